@@ -0,0 +1,472 @@
+/* ==============================================================================================
+ * Load Generator
+ * ==============================================================================================
+ *
+ * Drives a running server with N concurrent sessions and reports what a client sees: latency
+ * per command (p50/p99/max), commands per second and output throughput. Every session is a
+ * closed loop - send one command, read the response up to its END frame, send the next - so
+ * the numbers measure the server's command path (session loop, plan cache, spawning,
+ * forwarding) rather than queueing in the load generator.
+ *
+ * The commands are drawn from a weighted mix of three classes:
+ *
+ *   trivial    `true`                                  spawn and round-trip cost
+ *   output     `cat <file>`                            forwarding throughput
+ *   pipeline   `cat <file> | grep -c 0 | wc -l`        multi-stage spawn and pipe wiring
+ *
+ * The file for the output classes is given with -f, or created once with -s MB of text (the
+ * server must be able to read the same path, so run both on one host or use a shared path).
+ *
+ * All sessions run from one poller (epoll/kqueue) loop with non-blocking sockets. They
+ * connect and negotiate the framed protocol up front, without compression or raw streaming,
+ * so every response arrives as DATA frames followed by END.
+ *
+ * Usage: bench/loadgen [-u path | -p port [-i host]] [-c sessions] [-d seconds | -n commands]
+ *                      [-m trivial,output,pipeline] [-f file | -s megabytes]
+ *        (default: /tmp/myshell.sock, 16 sessions, 10 seconds, mix 8,1,1, 1 MB file)
+ *
+ * Comparing server models, e.g.:
+ *        ./shell -s -u /tmp/a.sock            &   bench/loadgen -u /tmp/a.sock
+ *        ./shell -s -u /tmp/b.sock -E         &   bench/loadgen -u /tmp/b.sock
+ *        ./shell -s -u /tmp/c.sock -F         &   bench/loadgen -u /tmp/c.sock
+ *
+ * Build: make bench
+ *
+ * ==============================================================================================
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../poller.h"
+#include "../protocol.h"
+
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_READ_SIZE 65536
+#define LOADGEN_DEFAULT_FILE "/tmp/myshell_loadgen.dat"
+
+enum {
+    CLASS_TRIVIAL = 0,
+    CLASS_OUTPUT = 1,
+    CLASS_PIPELINE = 2,
+    CLASS_COUNT = 3
+};
+
+static const char *class_names[CLASS_COUNT] = { "trivial", "output", "pipeline" };
+
+typedef struct {
+    double *samples;                // latency of every completed command, in microseconds
+    size_t count;
+    size_t cap;
+    unsigned long long bytes;       // output bytes received
+    unsigned long errors;           // non-zero exit status
+} class_stats_t;
+
+typedef struct {
+    int fd;
+    int class;                      // CLASS_* of the command in flight
+    double sent_at;
+    unsigned long remaining;        // commands left with -n, 0 = run until the deadline
+    char *in;                       // received bytes not parsed yet
+    size_t in_len;
+    size_t in_cap;
+} session_t;
+
+static char commands[CLASS_COUNT][PATH_MAX + 64];
+static int weights[CLASS_COUNT] = { 8, 1, 1 };
+static class_stats_t stats[CLASS_COUNT];
+
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *grow(void *memory, size_t size) {
+    void *grown = realloc(memory, size);
+    if (!grown) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    return grown;
+}
+
+
+/* ==============================================================================================
+ * Workload
+ * ==============================================================================================
+ */
+
+
+// Creates a text file of the given size for the output classes, unless it exists already
+static void prepare_file(const char *path, long megabytes) {
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size >= megabytes * 1024 * 1024) return;
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("[ERROR] Cannot create the load file");
+        exit(1);
+    }
+    // Numbered lines: compressible like real logs, and grep has something to match
+    long long written = 0, line = 0;
+    while (written < (long long)megabytes * 1024 * 1024)
+        written += fprintf(file, "%08lld the quick brown fox jumps over the lazy dog\n", line++);
+    fclose(file);
+}
+
+static int pick_class(void) {
+    int total = weights[0] + weights[1] + weights[2];
+    int roll = rand() % total;
+    for (int class = 0; class < CLASS_COUNT; class++) {
+        if (roll < weights[class]) return class;
+        roll -= weights[class];
+    }
+    return CLASS_TRIVIAL;
+}
+
+static void record(int class, double latency_us) {
+    class_stats_t *class_stats = &stats[class];
+    if (class_stats->count == class_stats->cap) {
+        class_stats->cap = class_stats->cap ? class_stats->cap * 2 : 1024;
+        class_stats->samples = grow(class_stats->samples, class_stats->cap * sizeof(double));
+    }
+    class_stats->samples[class_stats->count++] = latency_us;
+}
+
+
+/* ==============================================================================================
+ * Sessions
+ * ==============================================================================================
+ */
+
+
+static int connect_session(const char *socket_path, const char *host, int port) {
+    int fd;
+    if (port > 0) {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+            fprintf(stderr, "[ERROR] Invalid IP address: %s\n", host);
+            exit(1);
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+
+        // Commands are small writes waiting for an answer; do not let Nagle delay them
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    } else {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+    }
+
+    // No RAW streams and no compression: responses are DATA frames the loop can count
+    if (proto_client_hello(fd, 0) != PROTO_FRAMED) {
+        fprintf(stderr, "[ERROR] Server does not speak the framed protocol\n");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static int send_next(session_t *session) {
+    session->class = pick_class();
+    const char *command = commands[session->class];
+    session->sent_at = now_us();
+    // A command frame is far below the socket buffer, the non-blocking write completes at once
+    return proto_send_command(session->fd, PROTO_FRAMED, 1, command, strlen(command));
+}
+
+// Parses the received frames; returns 1 when the response is complete, -1 if the session ended
+static int consume_frames(session_t *session) {
+    size_t offset = 0;
+    int result = 0;
+
+    while (result == 0) {
+        frame_header_t header;
+        long frame = proto_parse_frame(session->in + offset, session->in_len - offset, &header);
+        if (frame < 0) {
+            fprintf(stderr, "[ERROR] Malformed frame from the server\n");
+            result = -1;
+            break;
+        }
+        if (frame == 0) break;
+        offset += frame;
+
+        switch (header.type) {
+            case FRAME_DATA:
+                stats[session->class].bytes += header.length;
+                break;
+            case FRAME_END:
+                record(session->class, now_us() - session->sent_at);
+                if (header.status != 0) stats[session->class].errors++;
+                result = 1;
+                break;
+            case FRAME_HALT:
+            case FRAME_QUIT:
+            case FRAME_ABORT:
+                result = -1;
+                break;
+            default:
+                break;
+        }
+    }
+
+    memmove(session->in, session->in + offset, session->in_len - offset);
+    session->in_len -= offset;
+    return result;
+}
+
+// Reads what is available; returns 1 when the response is complete, -1 if the session ended
+static int session_read(session_t *session) {
+    while (1) {
+        if (session->in_cap - session->in_len < LOADGEN_READ_SIZE) {
+            session->in_cap += LOADGEN_READ_SIZE;
+            session->in = grow(session->in, session->in_cap);
+        }
+        ssize_t bytes = read(session->fd, session->in + session->in_len, session->in_cap - session->in_len);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (bytes <= 0) return -1;
+        session->in_len += bytes;
+
+        int result = consume_frames(session);
+        if (result != 0) return result;
+    }
+}
+
+
+/* ==============================================================================================
+ * Report
+ * ==============================================================================================
+ */
+
+
+static int compare_samples(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const class_stats_t *class_stats, double quantile) {
+    if (class_stats->count == 0) return 0;
+    size_t index = (size_t)(quantile * (class_stats->count - 1) + 0.5);
+    return class_stats->samples[index];
+}
+
+static void print_line(const char *name, class_stats_t *class_stats, double elapsed_s) {
+    qsort(class_stats->samples, class_stats->count, sizeof(double), compare_samples);
+    double max = class_stats->count ? class_stats->samples[class_stats->count - 1] : 0;
+    printf("%-10s %9zu %10.0f %9.3f %9.3f %9.3f %9.2f %7lu\n", name, class_stats->count,
+           class_stats->count / elapsed_s, percentile(class_stats, 0.50) / 1e3,
+           percentile(class_stats, 0.99) / 1e3, max / 1e3,
+           class_stats->bytes / elapsed_s / (1024 * 1024), class_stats->errors);
+}
+
+static void report(double elapsed_s) {
+    class_stats_t all = {0};
+    for (int class = 0; class < CLASS_COUNT; class++) {
+        all.count += stats[class].count;
+        all.bytes += stats[class].bytes;
+        all.errors += stats[class].errors;
+    }
+    all.samples = grow(NULL, (all.count ? all.count : 1) * sizeof(double));
+    for (int class = 0; class < CLASS_COUNT; class++) {
+        memcpy(all.samples + all.cap, stats[class].samples, stats[class].count * sizeof(double));
+        all.cap += stats[class].count;
+    }
+
+    printf("%-10s %9s %10s %9s %9s %9s %9s %7s\n",
+           "class", "commands", "cmd/s", "p50 ms", "p99 ms", "max ms", "MB/s", "errors");
+    for (int class = 0; class < CLASS_COUNT; class++)
+        if (stats[class].count > 0) print_line(class_names[class], &stats[class], elapsed_s);
+    print_line("total", &all, elapsed_s);
+    free(all.samples);
+}
+
+
+/* ==============================================================================================
+ * Main Loop
+ * ==============================================================================================
+ */
+
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-u path | -p port [-i host]] [-c sessions] [-d seconds | -n commands]\n"
+                    "       [-m trivial,output,pipeline] [-f file | -s megabytes]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = "/tmp/myshell.sock";
+    const char *host = "127.0.0.1";
+    const char *file = NULL;
+    int port = 0, session_count = 16;
+    double duration_s = 10;
+    unsigned long per_session = 0;
+    long file_mb = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:p:i:c:d:n:m:f:s:")) != -1) {
+        switch (opt) {
+            case 'u':
+                socket_path = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'i':
+                host = optarg;
+                break;
+            case 'c':
+                session_count = atoi(optarg);
+                break;
+            case 'd':
+                duration_s = atof(optarg);
+                break;
+            case 'n':
+                per_session = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d", &weights[0], &weights[1], &weights[2]) != 3
+                    || weights[0] < 0 || weights[1] < 0 || weights[2] < 0
+                    || weights[0] + weights[1] + weights[2] == 0) {
+                    fprintf(stderr, "[ERROR] -m expects three weights, e.g. 8,1,1\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                file = optarg;
+                break;
+            case 's':
+                file_mb = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (session_count <= 0) session_count = 1;
+    if (file_mb <= 0) file_mb = 1;
+
+    if (!file) {
+        file = LOADGEN_DEFAULT_FILE;
+        if (weights[CLASS_OUTPUT] + weights[CLASS_PIPELINE] > 0) prepare_file(file, file_mb);
+    }
+    snprintf(commands[CLASS_TRIVIAL], sizeof(commands[0]), "true");
+    snprintf(commands[CLASS_OUTPUT], sizeof(commands[0]), "cat %s", file);
+    snprintf(commands[CLASS_PIPELINE], sizeof(commands[0]), "cat %s | grep -c 0 | wc -l", file);
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(getpid());
+
+    int poller_fd = poller_create();
+    if (poller_fd < 0) {
+        perror("[ERROR] Failed to create poller");
+        return 1;
+    }
+
+    session_t *sessions = grow(NULL, session_count * sizeof(session_t));
+    memset(sessions, 0, session_count * sizeof(session_t));
+
+    // fd -> session, like the fd tables of the server
+    int max_fd = 0;
+    session_t **by_fd = NULL;
+
+    for (int i = 0; i < session_count; i++) {
+        sessions[i].fd = connect_session(socket_path, port > 0 ? host : NULL, port);
+        if (sessions[i].fd < 0) {
+            fprintf(stderr, "[ERROR] Session %d could not connect: %s\n", i, strerror(errno));
+            return 1;
+        }
+        if (sessions[i].fd >= max_fd) {
+            int new_max = (sessions[i].fd + 1) * 2;
+            by_fd = grow(by_fd, new_max * sizeof(session_t *));
+            memset(by_fd + max_fd, 0, (new_max - max_fd) * sizeof(session_t *));
+            max_fd = new_max;
+        }
+        by_fd[sessions[i].fd] = &sessions[i];
+        sessions[i].remaining = per_session;
+        poller_add(poller_fd, sessions[i].fd, POLLER_READ);
+    }
+
+    if (per_session > 0)
+        printf("[INFO] %d sessions, %lu commands each, mix %d,%d,%d (trivial,output,pipeline)\n",
+               session_count, per_session, weights[0], weights[1], weights[2]);
+    else
+        printf("[INFO] %d sessions, %.1f s, mix %d,%d,%d (trivial,output,pipeline)\n",
+               session_count, duration_s, weights[0], weights[1], weights[2]);
+    fflush(stdout);
+
+    double start = now_us();
+    double deadline = start + duration_s * 1e6;
+    int active = session_count;
+
+    for (int i = 0; i < session_count; i++) {
+        if (send_next(&sessions[i]) < 0) {
+            perror("[ERROR] Failed to send command");
+            return 1;
+        }
+    }
+
+    poller_event_t events[LOADGEN_MAX_EVENTS];
+    while (active > 0) {
+        int ready = poller_wait(poller_fd, events, LOADGEN_MAX_EVENTS, 1000);
+        if (ready < 0) {
+            if (errno != EINTR) perror("[ERROR] poller_wait failed");
+            continue;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            session_t *session = by_fd[events[i].fd];
+            if (!session || session->fd < 0) continue;
+
+            int result = session_read(session);
+            if (result == 0) continue;
+
+            int finished = result < 0;
+            if (result < 0) fprintf(stderr, "[ERROR] Server closed a session\n");
+            else if (per_session > 0) finished = --session->remaining == 0;
+            else finished = now_us() >= deadline;
+
+            if (!finished && send_next(session) < 0) {
+                perror("[ERROR] Failed to send command");
+                finished = 1;
+            }
+            if (finished) {
+                poller_del(poller_fd, session->fd);
+                by_fd[session->fd] = NULL;
+                close(session->fd);
+                session->fd = -1;
+                active--;
+            }
+        }
+    }
+
+    report((now_us() - start) / 1e6);
+
+    for (int i = 0; i < session_count; i++) free(sessions[i].in);
+    free(sessions);
+    free(by_fd);
+    close(poller_fd);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/* ==============================================================================================
+ * Spawn Latency Benchmark
+ * ==============================================================================================
+ *
+ * Measures the cost of starting one pipeline stage the way execute_command() does it:
+ *
+ *   fork      fork() + dup2() + execv(), the server's -F path
+ *   spawn     posix_spawn() with the same stdout/stderr file actions, the default path
+ *
+ * Each iteration starts the command with its output going into a pipe, drains the pipe and
+ * waits for the process. The process can be made "large" first (-m MB of touched memory) to
+ * show how fork() latency grows with the resident size of a session process while
+ * posix_spawn() stays flat.
+ *
+ * Usage: bench/spawn_bench [-n iterations] [-m megabytes] [command [args...]]
+ *        (default: 2000 iterations, 0 MB, /bin/true)
+ *
+ * Build: make bench
+ *
+ * ==============================================================================================
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void drain_and_wait(int read_fd, pid_t pid) {
+    char buf[4096];
+    while (read(read_fd, buf, sizeof(buf)) > 0) {}
+    close(read_fd);
+    waitpid(pid, NULL, 0);
+}
+
+static void run_fork(char **argv) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("[ERROR] pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("[ERROR] fork");
+        exit(1);
+    }
+    close(fds[1]);
+    drain_and_wait(fds[0], pid);
+}
+
+static void run_spawn(char **argv) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("[ERROR] pipe");
+        exit(1);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "[ERROR] posix_spawn: %s\n", strerror(rc));
+        exit(1);
+    }
+    close(fds[1]);
+    drain_and_wait(fds[0], pid);
+}
+
+static double measure(void (*run)(char **), char **argv, int iterations) {
+    // Warm up the page cache and the dynamic loader
+    for (int i = 0; i < 10; i++) run(argv);
+
+    double start = now_us();
+    for (int i = 0; i < iterations; i++) run(argv);
+    return (now_us() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 2000;
+    long ballast_mb = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'm':
+                ballast_mb = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-m megabytes] [command [args...]]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations <= 0) iterations = 1;
+
+    char *default_argv[] = { "/bin/true", NULL };
+    char **command = (optind < argc) ? &argv[optind] : default_argv;
+
+    // Touch every page so the parent really has that much resident memory to copy
+    if (ballast_mb > 0) {
+        size_t size = (size_t)ballast_mb * 1024 * 1024;
+        char *ballast = malloc(size);
+        if (!ballast) {
+            perror("[ERROR] Memory allocation failed");
+            return 1;
+        }
+        memset(ballast, 1, size);
+    }
+
+    printf("[INFO] %s, %d iterations, %ld MB resident ballast\n", command[0], iterations, ballast_mb);
+    double fork_us = measure(run_fork, command, iterations);
+    double spawn_us = measure(run_spawn, command, iterations);
+    printf("fork + exec   %10.1f us per command\n", fork_us);
+    printf("posix_spawn   %10.1f us per command\n", spawn_us);
+    printf("speedup       %10.2fx\n", fork_us / spawn_us);
+    return 0;
+}
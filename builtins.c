@@ -0,0 +1,392 @@
+/* ==============================================================================================
+ * In-process Builtins
+ * ==============================================================================================
+ *
+ * Serves lightweight commands inside the server process instead of spawning a program, the
+ * same way `help`, `cd` and `hash` are handled in execute_command(). Health checks and
+ * scripts run `true`, `echo ok` or `cat /etc/hostname` constantly, and for those the fork
+ * or spawn and the exec of /bin/true cost far more than the command itself.
+ *
+ *   true, false         exit status only
+ *   echo [-neE] ...     bash semantics: -n no newline, -e backslash escapes, -E (default) none
+ *   printf fmt ...      %d %i %o %u %x %X %c %s %b %e %E %f %F %g %G %% with flags, width and
+ *                       precision; the format is reused until the arguments are consumed
+ *   pwd                 working directory of the session
+ *   cat file...         files are streamed to the client (no options, no stdin)
+ *
+ * A builtin is only chosen when it can reproduce the program exactly: builtin_find() returns
+ * NULL for anything it does not implement (`cat -n`, `pwd -P`, `printf '%*d'`, `cat` reading
+ * stdin ...) and the command runs as an external program as before.
+ *
+ * Builtins collect their output in a builtin_output_t; where it goes (client, redirection
+ * file, the next pipeline stage) is decided by the caller. `cat` has no run function: the
+ * caller streams the files with forward_output(), so large files are never held in memory.
+ * Builtins marked pure depend on nothing but their arguments, which lets the event loop
+ * (event_server.c) answer them without starting a job process.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include "builtins.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+
+/* ==============================================================================================
+ * Output Buffer
+ * ==============================================================================================
+ */
+
+
+static char *reserve(builtin_output_t *out, size_t extra) {
+    if (out->len + extra > out->cap) {
+        size_t new_cap = out->cap ? out->cap : 256;
+        while (new_cap < out->len + extra) new_cap *= 2;
+
+        char *grown = realloc(out->data, new_cap);
+        if (!grown) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        out->data = grown;
+        out->cap = new_cap;
+    }
+    return out->data + out->len;
+}
+
+static void append(builtin_output_t *out, const char *data, size_t len) {
+    memcpy(reserve(out, len), data, len);
+    out->len += len;
+}
+
+static void append_char(builtin_output_t *out, char c) {
+    append(out, &c, 1);
+}
+
+void builtin_output_free(builtin_output_t *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
+
+
+/* ==============================================================================================
+ * Backslash Escapes (echo -e, printf format, printf %b)
+ * ==============================================================================================
+ */
+
+
+// Appends the escape starting after a backslash at *cursor and advances past it. Octal
+// values are \0nnn for echo and %b, \nnn in a printf format. Returns 1 for \c (stop output).
+static int append_escape(builtin_output_t *out, const char **cursor, int octal_zero) {
+    const char *p = *cursor;
+    int value;
+
+    switch (*p) {
+        case 'a':  append_char(out, '\a'); break;
+        case 'b':  append_char(out, '\b'); break;
+        case 'e':  append_char(out, 033);  break;
+        case 'f':  append_char(out, '\f'); break;
+        case 'n':  append_char(out, '\n'); break;
+        case 'r':  append_char(out, '\r'); break;
+        case 't':  append_char(out, '\t'); break;
+        case 'v':  append_char(out, '\v'); break;
+        case '\\': append_char(out, '\\'); break;
+        case 'c':
+            *cursor = p + 1;
+            return 1;
+        case '\0':
+            append_char(out, '\\');
+            *cursor = p;
+            return 0;
+        default:
+            if ((octal_zero && *p == '0') || (!octal_zero && *p >= '0' && *p <= '7')) {
+                if (octal_zero) p++;
+                value = 0;
+                for (int digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++)
+                    value = value * 8 + (*p - '0');
+                append_char(out, (char)value);
+                *cursor = p;
+                return 0;
+            }
+            // Unknown escapes are kept as they are
+            append_char(out, '\\');
+            append_char(out, *p);
+            break;
+    }
+    *cursor = p + 1;
+    return 0;
+}
+
+// Appends s with escapes interpreted; returns 1 if it contained \c
+static int append_escaped(builtin_output_t *out, const char *s, int octal_zero) {
+    while (*s) {
+        const char *backslash = strchr(s, '\\');
+        if (!backslash) {
+            append(out, s, strlen(s));
+            break;
+        }
+        append(out, s, backslash - s);
+        s = backslash + 1;
+        if (append_escape(out, &s, octal_zero)) return 1;
+    }
+    return 0;
+}
+
+
+/* ==============================================================================================
+ * Commands
+ * ==============================================================================================
+ */
+
+
+static int run_true(char **argv, builtin_output_t *out) {
+    (void)argv;
+    (void)out;
+    return 0;
+}
+
+static int run_false(char **argv, builtin_output_t *out) {
+    (void)argv;
+    (void)out;
+    return 1;
+}
+
+// Options are only recognized as leading words made of n, e and E, like bash does
+static int echo_option(const char *arg) {
+    if (arg[0] != '-' || arg[1] == '\0') return 0;
+    return strspn(arg + 1, "neE") == strlen(arg + 1);
+}
+
+static int run_echo(char **argv, builtin_output_t *out) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+
+    for (; argv[i] && echo_option(argv[i]); i++) {
+        for (const char *flag = argv[i] + 1; *flag; flag++) {
+            if (*flag == 'n') newline = 0;
+            else if (*flag == 'e') escapes = 1;
+            else escapes = 0;
+        }
+    }
+
+    for (int first = i; argv[i]; i++) {
+        if (i > first) append_char(out, ' ');
+        if (!escapes) append(out, argv[i], strlen(argv[i]));
+        else if (append_escaped(out, argv[i], 1)) return 0;    // \c: nothing more, no newline
+    }
+    if (newline) append_char(out, '\n');
+    return 0;
+}
+
+static int run_pwd(char **argv, builtin_output_t *out) {
+    (void)argv;
+    char *cwd = reserve(out, PATH_MAX + 1);
+    if (!getcwd(cwd, PATH_MAX)) {
+        int length = snprintf(cwd, PATH_MAX, "pwd: %s\n", strerror(errno));
+        out->len += length;
+        return 1;
+    }
+    out->len += strlen(cwd);
+    append_char(out, '\n');
+    return 0;
+}
+
+
+/* ==============================================================================================
+ * printf
+ * ==============================================================================================
+ */
+
+
+#define PRINTF_FLAGS "-+ #0"
+#define PRINTF_CONVERSIONS "diouxXcsbeEfFgG"
+
+// Checks that every directive in the format is one run_printf() implements
+static int printf_supported(const char *format) {
+    for (const char *p = format; (p = strchr(p, '%')) != NULL; p++) {
+        p++;
+        if (*p == '%') continue;
+        p += strspn(p, PRINTF_FLAGS);
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        if (*p == '\0' || !strchr(PRINTF_CONVERSIONS, *p)) return 0;
+    }
+    return 1;
+}
+
+// Numeric argument as printf(1) reads it: C integer syntax, or 'c for a character code
+static int printf_number(const char *arg, long long *value, builtin_output_t *out) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoll(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno) {
+        char message[128];
+        snprintf(message, sizeof(message), "printf: %s: invalid number\n", arg);
+        append(out, message, strlen(message));
+        return 1;
+    }
+    return 0;
+}
+
+static void append_formatted(builtin_output_t *out, const char *spec, ...) {
+    va_list args, copy;
+    va_start(args, spec);
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, spec, copy);
+    va_end(copy);
+    if (length > 0) {
+        vsnprintf(reserve(out, length + 1), length + 1, spec, args);
+        out->len += length;
+    }
+    va_end(args);
+}
+
+static int run_printf(char **argv, builtin_output_t *out) {
+    const char *format = argv[1];
+    char **args = argv + 2;
+    int status = 0;
+
+    do {
+        char **pass_start = args;
+
+        for (const char *p = format; *p; ) {
+            if (*p == '\\') {
+                p++;
+                if (append_escape(out, &p, 0)) return status;
+                continue;
+            }
+            if (*p != '%') {
+                const char *next = p + strcspn(p, "\\%");
+                append(out, p, next - p);
+                p = next;
+                continue;
+            }
+            if (p[1] == '%') {
+                append_char(out, '%');
+                p += 2;
+                continue;
+            }
+
+            // Copy the directive without its conversion: "%-08.3", then add the length modifier
+            char spec[64];
+            size_t spec_len = 1 + strspn(p + 1, PRINTF_FLAGS);
+            spec_len += strspn(p + spec_len, "0123456789");
+            if (p[spec_len] == '.') spec_len += 1 + strspn(p + spec_len + 1, "0123456789");
+            char conversion = p[spec_len];
+            if (spec_len + 4 > sizeof(spec)) spec_len = sizeof(spec) - 4;
+            memcpy(spec, p, spec_len);
+            p += strcspn(p, PRINTF_CONVERSIONS) + 1;
+
+            // Missing arguments count as "" or 0
+            const char *arg = *args ? *args++ : "";
+            long long number = 0;
+
+            switch (conversion) {
+                case 's':
+                    strcpy(spec + spec_len, "s");
+                    append_formatted(out, spec, arg);
+                    break;
+                case 'b': {
+                    builtin_output_t expanded = {0};
+                    int stop = append_escaped(&expanded, arg, 1);
+                    append_char(&expanded, '\0');
+                    strcpy(spec + spec_len, "s");
+                    append_formatted(out, spec, expanded.data);
+                    builtin_output_free(&expanded);
+                    if (stop) return status;
+                    break;
+                }
+                case 'c':
+                    strcpy(spec + spec_len, "c");
+                    append_formatted(out, spec, arg[0]);
+                    break;
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                    char *end;
+                    double value = strtod(arg, &end);
+                    if (*arg && *end) {
+                        append_formatted(out, "printf: %s: invalid number\n", arg);
+                        status = 1;
+                    }
+                    spec[spec_len] = conversion;
+                    spec[spec_len + 1] = '\0';
+                    append_formatted(out, spec, value);
+                    break;
+                }
+                default:            // d i o u x X
+                    if (*arg && printf_number(arg, &number, out)) status = 1;
+                    spec[spec_len] = 'l';
+                    spec[spec_len + 1] = 'l';
+                    spec[spec_len + 2] = conversion;
+                    spec[spec_len + 3] = '\0';
+                    append_formatted(out, spec, number);
+                    break;
+            }
+        }
+
+        // The format is reused while arguments remain, as long as it consumes any
+        if (args == pass_start) break;
+    } while (*args);
+
+    return status;
+}
+
+
+/* ==============================================================================================
+ * Registry
+ * ==============================================================================================
+ */
+
+
+static const builtin_t builtins[] = {
+    { "true",   run_true,   1 },
+    { "false",  run_false,  1 },
+    { "echo",   run_echo,   1 },
+    { "printf", run_printf, 1 },
+    { "pwd",    run_pwd,    0 },
+    { "cat",    NULL,       0 },
+};
+
+// Returns the builtin serving argv, or NULL if the command has to run as a program
+const builtin_t *builtin_find(char **argv) {
+    const builtin_t *builtin = NULL;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(argv[0], builtins[i].name) == 0) {
+            builtin = &builtins[i];
+            break;
+        }
+    }
+    if (!builtin) return NULL;
+
+    if (strcmp(builtin->name, "pwd") == 0 && argv[1]) return NULL;
+    if (strcmp(builtin->name, "printf") == 0 && (!argv[1] || !printf_supported(argv[1]))) return NULL;
+    if (strcmp(builtin->name, "cat") == 0) {
+        // Only plain file operands; options and stdin ("-" or none) are left to cat(1)
+        if (!argv[1]) return NULL;
+        for (int i = 1; argv[i]; i++)
+            if (argv[i][0] == '-') return NULL;
+    }
+    return builtin;
+}
+
+int builtin_run(const builtin_t *builtin, char **argv, builtin_output_t *out) {
+    out->len = 0;
+    return builtin->run ? builtin->run(argv, out) : 0;
+}
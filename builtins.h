@@ -0,0 +1,23 @@
+#ifndef MYSHELL_BUILTINS_H
+#define MYSHELL_BUILTINS_H
+
+#include <stddef.h>
+
+// Output collected by a builtin; grows as needed, reused between commands
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} builtin_output_t;
+
+typedef struct {
+    const char *name;
+    int (*run)(char **argv, builtin_output_t *out);    // NULL: files are streamed (cat)
+    int pure;                       // depends on argv only, no working directory or files
+} builtin_t;
+
+const builtin_t *builtin_find(char **argv);
+int builtin_run(const builtin_t *builtin, char **argv, builtin_output_t *out);
+void builtin_output_free(builtin_output_t *out);
+
+#endif //MYSHELL_BUILTINS_H
@@ -0,0 +1,265 @@
+/* ==============================================================================================
+ * Resource Limits (cgroup v2)
+ * ==============================================================================================
+ *
+ * With -G every pipeline runs in a cgroup of its own below a delegated cgroup v2 directory,
+ * so a single command line cannot take more than its share of CPU, memory or processes:
+ *
+ *   -G cpu=50,mem=256M,pids=64,dir=/sys/fs/cgroup/myshell
+ *
+ *   cpu=<percent>   cpu.max quota in percent of one CPU (200 = two CPUs)
+ *   mem=<size>      memory.max, with an optional K, M or G suffix
+ *   pids=<n>        pids.max, the number of processes and threads of the pipeline
+ *   dir=<path>      parent cgroup (default CGROUP_DEFAULT_DIR); it is created if missing, and
+ *                   the cgroup above it must have the controllers enabled for us (delegation)
+ *
+ * The priority class of the session (scheduler.c) also sets cpu.weight, so a high priority
+ * pipeline gets more CPU than a low priority one when they compete.
+ *
+ * The pipeline's cgroup is created before its stages start ("p<session pid>-<n>"). The stages
+ * of a pipeline with a cgroup are started with fork(), as with -F, and move themselves in
+ * before exec(): moved from outside after posix_spawn(), a stage could fork or allocate
+ * beyond the limits before it got there. A cgroup can only be removed once it is empty,
+ * so finished ones are removed by the next pipeline of the session, and the accept loop
+ * sweeps those left behind when a session ends (background jobs still running then).
+ *
+ * Only Linux has cgroups; elsewhere -G is reported as unsupported and ignored.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "scheduler.h"
+#include "cgroup.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+static int requested = 0;                  // -G given
+static int enabled = 0;                    // and usable, see cgroup_init()
+static const char *base_dir = CGROUP_DEFAULT_DIR;
+static long cpu_percent = 0;                // 0 = no limit
+static long long memory_bytes = 0;
+static long pids_max = 0;
+
+static char **pending = NULL;               // cgroups of this session not removed yet
+static size_t pending_count = 0;
+static size_t pending_cap = 0;
+static unsigned long created = 0;
+
+static const char *cpu_weights[SCHED_CLASSES] = { "400", "100", "25" };
+
+int cgroup_parse(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        char *value = strchr(item, '=');
+        if (!value || value[1] == '\0') {
+            result = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        char *end;
+        if (strcmp(item, "cpu") == 0) {
+            cpu_percent = strtol(value, &end, 10);
+            if (*end != '\0' || cpu_percent < 1) result = -1;
+        } else if (strcmp(item, "mem") == 0) {
+            memory_bytes = strtoll(value, &end, 10);
+            if (*end == 'K' || *end == 'k') memory_bytes <<= 10, end++;
+            else if (*end == 'M' || *end == 'm') memory_bytes <<= 20, end++;
+            else if (*end == 'G' || *end == 'g') memory_bytes <<= 30, end++;
+            if (*end != '\0' || memory_bytes < 1) result = -1;
+        } else if (strcmp(item, "pids") == 0) {
+            pids_max = strtol(value, &end, 10);
+            if (*end != '\0' || pids_max < 1) result = -1;
+        } else if (strcmp(item, "dir") == 0) {
+            base_dir = strdup(value);
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    if (result == 0) requested = 1;
+    return result;
+}
+
+#ifdef __linux__
+
+static int write_file(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t written = write(fd, value, strlen(value));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return written < 0 ? -1 : 0;
+}
+
+// Called once by the server before it starts accepting
+void cgroup_init(void) {
+    if (!requested) return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", base_dir);
+    if (mkdir(base_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "[WARN] -G: cannot create %s: %s, running without resource limits\n", base_dir, strerror(errno));
+        return;
+    }
+    if (access(path, F_OK) < 0) {
+        fprintf(stderr, "[WARN] -G: %s is not a cgroup v2 directory, running without resource limits\n", base_dir);
+        return;
+    }
+
+    // Let the pipeline cgroups have the controllers of the limits that were asked for
+    const struct { const char *name; int wanted; } controllers[] = {
+        { "+cpu", 1 }, { "+memory", memory_bytes > 0 }, { "+pids", pids_max > 0 }
+    };
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (!controllers[i].wanted) continue;
+        if (write_file(base_dir, "cgroup.subtree_control", controllers[i].name) < 0)
+            fprintf(stderr, "[WARN] -G: cannot enable the %s controller in %s: %s (is it delegated?)\n",
+                    controllers[i].name + 1, base_dir, strerror(errno));
+    }
+    enabled = 1;
+    printf("[INFO] Pipelines run in cgroups below %s\n", base_dir);
+}
+
+// Removes the empty cgroups of earlier pipelines of this session
+static void remove_pending(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < pending_count; i++) {
+        if (rmdir(pending[i]) == 0 || errno == ENOENT) free(pending[i]);
+        else pending[kept++] = pending[i];
+    }
+    pending_count = kept;
+}
+
+// Creates the cgroup of the next pipeline; returns its cgroup.procs descriptor or -1
+int cgroup_open(int priority) {
+    if (!enabled) return -1;
+    remove_pending();
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/p%d-%lu", base_dir, (int)getpid(), created++);
+    if (mkdir(dir, 0755) < 0) {
+        fprintf(stderr, "[WARN] -G: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    char value[64];
+    if (cpu_percent > 0) {
+        snprintf(value, sizeof(value), "%ld 100000", cpu_percent * 1000);
+        write_file(dir, "cpu.max", value);
+    }
+    if (memory_bytes > 0) {
+        snprintf(value, sizeof(value), "%lld", memory_bytes);
+        write_file(dir, "memory.max", value);
+    }
+    if (pids_max > 0) {
+        snprintf(value, sizeof(value), "%ld", pids_max);
+        write_file(dir, "pids.max", value);
+    }
+    if (priority >= 0 && priority < SCHED_CLASSES) write_file(dir, "cpu.weight", cpu_weights[priority]);
+
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    int procs_fd = open(path, O_WRONLY | O_CLOEXEC);
+    int saved_errno = errno;
+
+    if (pending_count == pending_cap) {
+        size_t new_cap = pending_cap ? pending_cap * 2 : 8;
+        char **grown = realloc(pending, new_cap * sizeof(char *));
+        if (!grown) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        pending = grown;
+        pending_cap = new_cap;
+    }
+    pending[pending_count] = strdup(dir);
+    if (!pending[pending_count]) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    pending_count++;
+
+    if (procs_fd < 0) fprintf(stderr, "[WARN] -G: cannot open %s: %s\n", path, strerror(saved_errno));
+    return procs_fd;
+}
+
+// Moves a stage into the pipeline's cgroup (pid 0: the calling process)
+void cgroup_attach(int procs_fd, pid_t pid) {
+    if (procs_fd < 0) return;
+    char value[32];
+    int len = snprintf(value, sizeof(value), "%d", (int)pid);
+    if (write(procs_fd, value, len) < 0 && pid != 0)
+        fprintf(stderr, "[WARN] -G: cannot move PID %d into its cgroup: %s\n", (int)pid, strerror(errno));
+}
+
+// The pipeline has been started (and, unless it is a job, has ended)
+void cgroup_close(int procs_fd) {
+    if (procs_fd < 0) return;
+    close(procs_fd);
+    remove_pending();
+}
+
+// Accept loop: removes what an ended session left behind
+void cgroup_forget_session(pid_t session_pid) {
+    if (!enabled) return;
+    DIR *dir = opendir(base_dir);
+    if (!dir) return;
+
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "p%d-", (int)session_pid);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", base_dir, entry->d_name);
+        rmdir(path);
+    }
+    closedir(dir);
+}
+
+#else
+
+void cgroup_init(void) {
+    if (requested) fprintf(stderr, "[WARN] -G: resource limits need Linux cgroup v2, running without them\n");
+}
+
+int cgroup_open(int priority) {
+    (void)priority;
+    return -1;
+}
+
+void cgroup_attach(int procs_fd, pid_t pid) {
+    (void)procs_fd;
+    (void)pid;
+}
+
+void cgroup_close(int procs_fd) {
+    (void)procs_fd;
+}
+
+void cgroup_forget_session(pid_t session_pid) {
+    (void)session_pid;
+}
+
+#endif
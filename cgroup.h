@@ -0,0 +1,17 @@
+#ifndef MYSHELL_CGROUP_H
+#define MYSHELL_CGROUP_H
+
+#include <sys/types.h>
+
+#define CGROUP_DEFAULT_DIR "/sys/fs/cgroup/myshell"
+
+// Parses -G "cpu=<percent>,mem=<size>,pids=<n>,dir=<path>"; -1 if malformed
+int cgroup_parse(const char *spec);
+
+void cgroup_init(void);
+int cgroup_open(int priority);
+void cgroup_attach(int procs_fd, pid_t pid);
+void cgroup_close(int procs_fd);
+void cgroup_forget_session(pid_t session_pid);
+
+#endif //MYSHELL_CGROUP_H
@@ -7,13 +7,19 @@
  * with the server through bidirectional streams. The user enters commands which
  * are sent to the server; server responses are printed to stdout.
  *
- * The prompt includes time, username, and hostname. The client also supports heredoc (<<).
+ * The prompt includes time, username, and hostname. The client also supports heredoc (<<),
+ * whose body is sent to the server ahead of the command (FRAME_STDIN).
  * Built-in control signals like [HALT], [QUIT], and [ABORT] are processed internally.
+ * The framed protocol (protocol.c) is negotiated on connect, with legacy text mode as fallback.
  *
  * ==============================================================================================
  * ============================================================================================== */
 
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,9 +27,26 @@
 #include <time.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include "protocol.h"
+#include "compress.h"
+#include "client.h"
+#include "mux.h"
+#include "tls.h"
+#include "sockopt.h"
+
+#define CLIENT_READ_SIZE (128 * 1024)     // socket reads while receiving responses
+#define SINK_SIZE (256 * 1024)            // output collected before a write in streaming mode
+#define SPLICE_MIN_PAYLOAD 65536          // DATA payloads spliced from the socket to stdout
+
+client_options_t client_options = {0};
+static char receive_buf[CLIENT_READ_SIZE];
 
 
 /* ==============================================================================================
@@ -70,6 +93,671 @@ void get_prompt(char *prompt, size_t size) {
 }
 
 
+/* ==============================================================================================
+ * User Input
+ * ==============================================================================================
+ *
+ * Reads one command line from stdin into input_buf.
+ * - Heredoc (<< delimiter) input is collected into heredoc_body, sent ahead of the line in
+ *   FRAME_STDIN frames; the server feeds it to the stage as is, of any size and content.
+ *   Servers without PROTO_CAP_STDIN get the old rewrite into a printf-pipe instead.
+ * Returns 1 when a command is ready, 0 for an empty line, INPUT_PENDING when no complete
+ * line is available yet and INPUT_CLOSED when stdin was closed.
+ *
+ * Lines are taken from our own buffer instead of stdio: with pipelining the loop keeps
+ * reading as long as lines are available, and must know whether buffered lines are left
+ * without losing a partially read line to a non-blocking fgets().
+ *
+ * ==============================================================================================
+ * ============================================================================================== */
+
+
+#define INPUT_PENDING (-2)
+#define INPUT_CLOSED (-1)
+
+static char stdin_buf[8192];
+static size_t stdin_len = 0;
+static int stdin_eof = 0;
+
+static char *heredoc_body = NULL;   // Body of the line's heredoc
+static size_t heredoc_len = 0;
+static size_t heredoc_cap = 0;
+static int native_heredoc = 0;      // Server takes the body as FRAME_STDIN (PROTO_CAP_STDIN)
+
+// Takes the next line (with its newline) from stdin; waits for it when blocking is set
+static int next_input_line(char *line, size_t size, int blocking) {
+    while (1) {
+        char *newline = memchr(stdin_buf, '\n', stdin_len);
+        if (newline || (stdin_eof && stdin_len > 0) || stdin_len == sizeof(stdin_buf)) {
+            size_t line_len = newline ? (size_t)(newline - stdin_buf) + 1 : stdin_len;
+            size_t copy = line_len < size - 1 ? line_len : size - 2;   // overlong lines are cut
+            memcpy(line, stdin_buf, copy);
+            if (line[copy - 1] != '\n') line[copy++] = '\n';
+            line[copy] = '\0';
+            memmove(stdin_buf, stdin_buf + line_len, stdin_len - line_len);
+            stdin_len -= line_len;
+            return 1;
+        }
+        if (stdin_eof) return INPUT_CLOSED;
+
+        if (blocking) {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+        }
+
+        ssize_t bytes = read(STDIN_FILENO, stdin_buf + stdin_len, sizeof(stdin_buf) - stdin_len);
+        if (bytes > 0) {
+            stdin_len += bytes;
+        } else if (bytes == 0) {
+            stdin_eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!blocking) return INPUT_PENDING;
+        } else if (errno != EINTR) {
+            stdin_eof = 1;
+        }
+    }
+}
+
+static void append_heredoc(const char *data, size_t len) {
+    if (heredoc_len + len > heredoc_cap) {
+        size_t cap = heredoc_cap ? heredoc_cap : 4096;
+        while (cap < heredoc_len + len) cap *= 2;
+        char *grown = realloc(heredoc_body, cap);
+        if (!grown) {
+            perror("[CLIENT] Memory allocation failed");
+            exit(1);
+        }
+        heredoc_body = grown;
+        heredoc_cap = cap;
+    }
+    memcpy(heredoc_body + heredoc_len, data, len);
+    heredoc_len += len;
+}
+
+static int read_user_command(char *input_buf, size_t size) {
+    // Read line from stdin
+    int got = next_input_line(input_buf, size, 0);
+    if (got <= 0) return got;
+    heredoc_len = 0;
+
+    // Skip empty lines
+    if (strlen(input_buf) <= 1) return 0;
+
+    // HEREDOC PROCESSING (<< delimiter)
+    if (strstr(input_buf, "<<") && !strstr(input_buf, "<<<")) {
+        char delimiter[64] = {0};
+        char *heredoc_pos = strstr(input_buf, "<<");
+        sscanf(heredoc_pos + 2, "%63s", delimiter); // extract delimiter
+
+        if (native_heredoc) {
+            // The line goes out unchanged, the server knows the `<<` stage
+            char line[sizeof(stdin_buf)];
+            while (1) {
+                printf("heredoc> ");
+                fflush(stdout);
+                if (next_input_line(line, sizeof(line), 1) < 0) break;
+
+                size_t line_len = strlen(line);
+                if (line_len - 1 == strlen(delimiter) && strncmp(line, delimiter, line_len - 1) == 0)
+                    break;
+                append_heredoc(line, line_len);
+            }
+            return 1;
+        }
+
+        // Truncate heredoc marker from command
+        *heredoc_pos = '\0';
+        input_buf[strcspn(input_buf, "\n")] = '\0'; // remove newline
+
+        // Read heredoc content until the delimiter is typed (waiting for further lines)
+        char heredoc_data[4096] = "";
+        char line[1024];
+        while (1) {
+            printf("heredoc> ");
+            fflush(stdout);
+            if (next_input_line(line, sizeof(line), 1) < 0) break;
+
+            // Strip newline and compare with delimiter
+            char temp[1024];
+            strcpy(temp, line);
+            temp[strcspn(temp, "\n")] = '\0';
+            if (strcmp(temp, delimiter) == 0)
+                break;
+
+            // Append the input line to heredoc_data, add escaped newline
+            strncat(heredoc_data, temp, sizeof(heredoc_data) - strlen(heredoc_data) - 1);
+            strncat(heredoc_data, "\\n", sizeof(heredoc_data) - strlen(heredoc_data) - 1);
+        }
+
+        // Rewrite input command as: printf "heredoc..." | original_command
+        char result[1024];
+        snprintf(result, sizeof(result), "printf %.500s | %.500s\n", heredoc_data, input_buf);
+        strncpy(input_buf, result, size - 1);
+        input_buf[size - 1] = '\0';
+    }
+    return 1;
+}
+
+
+/* ==============================================================================================
+ * Output Sink
+ * ==============================================================================================
+ *
+ * All command output reaches stdout through here. On a terminal it is written with stdio and
+ * flushed after every read from the server, so output appears as soon as it arrives.
+ *
+ * When stdout is not a terminal (redirected to a file or a pipe) the client streams instead:
+ * output is collected in one large reusable buffer and written with writev() when the buffer
+ * is full or a response is complete, never per chunk. Partial writes are continued, and EAGAIN
+ * (stdout sharing the non-blocking file description of stdin) waits until stdout is writable.
+ * On Linux, large uncompressed DATA payloads are moved from the socket into a stdout pipe
+ * with splice() and never enter user space. While the client waits for stdout it does not
+ * read the socket, so a slow consumer throttles the server through flow control rather than
+ * growing the client's memory. Output is binary-safe in both modes.
+ *
+ * Everything else the client prints (prompts, [CLIENT] messages) goes through stdio after
+ * sink_flush(), so the order on stdout is kept.
+ *
+ * ==============================================================================================
+ * ============================================================================================== */
+
+
+typedef struct {
+    int streaming;              // stdout is not a terminal
+    int can_splice;             // stdout is a pipe (Linux)
+    char *buf;
+    size_t len;
+} output_sink_t;
+
+static output_sink_t sink = {0};
+
+static void sink_init(void) {
+    if (sink.buf || isatty(STDOUT_FILENO)) return;
+
+    sink.buf = malloc(SINK_SIZE);
+    if (!sink.buf) return;                  // stay with stdio
+    sink.streaming = 1;
+#if defined(__linux__)
+    struct stat st;
+    sink.can_splice = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+}
+
+// Blocks until stdout accepts more data (only needed when it is non-blocking)
+static void wait_stdout(void) {
+    struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+}
+
+static void write_stdout(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_stdout();
+                continue;
+            }
+            perror("[CLIENT] Failed to write output");
+            exit(1);
+        }
+        // Skip what was written, the rest of a partly written vector is retried
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static void sink_flush(void) {
+    fflush(stdout);
+    if (!sink.streaming || sink.len == 0) return;
+    struct iovec iov = { sink.buf, sink.len };
+    write_stdout(&iov, 1);
+    sink.len = 0;
+}
+
+static void sink_write(const void *data, size_t len) {
+    if (!sink.streaming) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    if (sink.len + len <= SINK_SIZE) {
+        memcpy(sink.buf + sink.len, data, len);
+        sink.len += len;
+        return;
+    }
+
+    // Does not fit: write what is buffered and the new data together, without copying it
+    fflush(stdout);
+    struct iovec iov[2] = { { sink.buf, sink.len }, { (void *)data, len } };
+    write_stdout(iov, 2);
+    sink.len = 0;
+}
+
+
+/* ==============================================================================================
+ * Outstanding Responses
+ * ==============================================================================================
+ *
+ * With pipelining (-P <n>) up to n commands are in flight at once, each tagged with its own
+ * stream ID. The queue keeps them in submission order. Output of the oldest request is
+ * printed as it arrives; output for later requests (e.g. a `stat` answered by the server's
+ * master process while the session already runs the next command) is buffered until all
+ * earlier responses are complete, so the terminal always shows responses in order.
+ *
+ * ==============================================================================================
+ * ============================================================================================== */
+
+
+typedef struct {
+    uint32_t stream_id;
+    int done;
+    char *output;               // output received while not at the head of the queue
+    size_t len;
+    size_t cap;
+} response_t;
+
+typedef struct {
+    response_t *slots;          // ring buffer of `window` entries
+    size_t window;
+    size_t head;
+    size_t count;
+    char *prompt;               // refreshed and printed after every completed response, NULL = none
+    size_t prompt_size;
+} response_queue_t;
+
+static response_t *find_response(response_queue_t *queue, uint32_t stream_id, size_t *position) {
+    for (size_t i = 0; i < queue->count; i++) {
+        response_t *response = &queue->slots[(queue->head + i) % queue->window];
+        if (response->stream_id == stream_id) {
+            *position = i;
+            return response;
+        }
+    }
+    return NULL;
+}
+
+static void push_response(response_queue_t *queue, uint32_t stream_id) {
+    response_t *response = &queue->slots[(queue->head + queue->count++) % queue->window];
+    response->stream_id = stream_id;
+    response->done = 0;
+    response->len = 0;
+}
+
+// Routes command output to stdout or to the buffer of a response that is not due yet
+static void emit_output(response_queue_t *queue, uint32_t stream_id, const void *data, size_t len) {
+    size_t position;
+    response_t *response = queue ? find_response(queue, stream_id, &position) : NULL;
+
+    if (!response || position == 0) {
+        sink_write(data, len);
+        return;
+    }
+
+    if (response->len + len > response->cap) {
+        size_t cap = response->cap ? response->cap : 4096;
+        while (cap < response->len + len) cap *= 2;
+        char *grown = realloc(response->output, cap);
+        if (!grown) {
+            perror("[CLIENT] Memory allocation failed");
+            exit(1);
+        }
+        response->output = grown;
+        response->cap = cap;
+    }
+    memcpy(response->output + response->len, data, len);
+    response->len += len;
+}
+
+// Marks a response complete; prints every response that is now due. Returns how many were.
+static int complete_response(response_queue_t *queue, uint32_t stream_id) {
+    size_t position;
+    int completed = 0;
+    response_t *response = queue ? find_response(queue, stream_id, &position) : NULL;
+    if (!response) return 0;
+    response->done = 1;
+    if (queue->prompt) sink_flush();
+
+    while (queue->count > 0 && queue->slots[queue->head].done) {
+        queue->head = (queue->head + 1) % queue->window;
+        queue->count--;
+        completed++;
+
+        // One-shot commands (no prompt) print the output exactly as received
+        if (queue->prompt) {
+            printf("\n");
+            get_prompt(queue->prompt, queue->prompt_size);
+            printf("%s", queue->prompt);
+        }
+
+        // The next response is at the head now: release what it has buffered so far
+        if (queue->count > 0) {
+            response_t *next = &queue->slots[queue->head];
+            sink_write(next->output, next->len);
+            next->len = 0;
+        }
+    }
+    return completed;
+}
+
+
+/* ==============================================================================================
+ * Framed Response Parsing
+ * ==============================================================================================
+ *
+ * Incremental parser for server data on framed connections. Frame headers may be split across
+ * reads; DATA payloads are handed to the response queue as they arrive, without being scanned.
+ * Control frames (HALT, QUIT, ABORT) are recognized wherever they appear in the stream.
+ * Returns the number of responses completed (and printed) by the END frames in the data.
+ *
+ * A FRAME_RAW header (server started with -D) is followed by unframed output that ends with
+ * the boundary token carried in its payload. The output is scanned for the token with a
+ * Knuth-Morris-Pratt matcher, so a token split across reads is still recognized; bytes that
+ * might start the token are held back until they are known to be output.
+ *
+ * A compressed DATA frame (codec in the header flags) is collected completely and then
+ * decompressed into its original status-field length before it is printed.
+ *
+ * ==============================================================================================
+ * ============================================================================================== */
+
+
+typedef struct {
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    size_t header_len;
+    frame_header_t header;
+    size_t payload_left;
+    int last_status;
+
+    int raw;                                        // inside a raw stream
+    unsigned char token[PROTO_RAW_TOKEN_SIZE];      // boundary of the raw stream
+    size_t token_fail[PROTO_RAW_TOKEN_SIZE];        // KMP failure function of the token
+    size_t matched;                                 // token bytes matched (and held back) so far
+
+    char *packed;                                   // compressed DATA payload being collected
+    size_t packed_cap;
+
+    response_queue_t *queue;                        // requests waiting for their responses
+} frame_stream_t;
+
+static void prepare_raw(frame_stream_t *fs) {
+    size_t k = 0;
+    fs->token_fail[0] = 0;
+    for (size_t i = 1; i < PROTO_RAW_TOKEN_SIZE; i++) {
+        while (k > 0 && fs->token[i] != fs->token[k]) k = fs->token_fail[k - 1];
+        if (fs->token[i] == fs->token[k]) k++;
+        fs->token_fail[i] = k;
+    }
+    fs->matched = 0;
+    fs->raw = 1;
+}
+
+// Outputs raw data up to the boundary token; returns the number of bytes consumed
+static size_t consume_raw(frame_stream_t *fs, const char *data, size_t len) {
+    const unsigned char *in = (const unsigned char *)data;
+    size_t i = 0, plain_start = 0;
+
+    while (i < len) {
+        if (fs->matched == 0) {
+            // Fast path: nothing held back, skip to the next possible token start
+            const unsigned char *next = memchr(in + i, fs->token[0], len - i);
+            if (!next) {
+                i = len;
+                break;
+            }
+            i = next - in;
+            emit_output(fs->queue, fs->header.stream_id, in + plain_start, i - plain_start);
+            fs->matched = 1;
+            plain_start = ++i;
+            continue;
+        }
+
+        if (in[i] == fs->token[fs->matched]) {
+            fs->matched++;
+            plain_start = ++i;
+            if (fs->matched == PROTO_RAW_TOKEN_SIZE) {
+                fs->raw = 0;
+                return i;
+            }
+            continue;
+        }
+
+        // Mismatch: the held bytes that can no longer start the token are output
+        size_t keep = fs->token_fail[fs->matched - 1];
+        emit_output(fs->queue, fs->header.stream_id, fs->token, fs->matched - keep);
+        fs->matched = keep;
+        if (keep == 0) plain_start = i;     // re-examine this byte as plain output
+    }
+
+    emit_output(fs->queue, fs->header.stream_id, in + plain_start, len - plain_start);
+    return len;
+}
+
+static int consume_frames(frame_stream_t *fs, const char *data, size_t len) {
+    int completed = 0;
+
+    while (len > 0) {
+        if (fs->raw) {
+            size_t used = consume_raw(fs, data, len);
+            data += used;
+            len -= used;
+            continue;
+        }
+
+        // Collect the header first
+        if (fs->header_len < PROTO_HEADER_SIZE) {
+            size_t take = PROTO_HEADER_SIZE - fs->header_len;
+            if (take > len) take = len;
+            memcpy(fs->header_buf + fs->header_len, data, take);
+            fs->header_len += take;
+            data += take;
+            len -= take;
+            if (fs->header_len < PROTO_HEADER_SIZE) break;
+
+            if (proto_decode_header(fs->header_buf, &fs->header) < 0) {
+                sink_flush();
+                printf("\n[CLIENT] Protocol error: invalid frame from server.\n");
+                exit(1);
+            }
+            fs->payload_left = fs->header.length;
+
+            if (fs->header.type == FRAME_DATA && fs->header.flags != 0 && fs->header.length > COMPRESS_MAX_FRAME) {
+                sink_flush();
+                printf("\n[CLIENT] Protocol error: oversized compressed frame from server.\n");
+                exit(1);
+            }
+            if (fs->header.type == FRAME_DATA && fs->header.flags != 0
+                && fs->header.length > fs->packed_cap) {
+                char *grown = realloc(fs->packed, fs->header.length);
+                if (!grown) {
+                    perror("[ERROR] Memory allocation failed");
+                    exit(1);
+                }
+                fs->packed = grown;
+                fs->packed_cap = fs->header.length;
+            }
+
+            switch (fs->header.type) {
+                case FRAME_HALT:
+                    sink_flush();
+                    printf("[CLIENT] Server halted. Exiting.\n");
+                    exit(0);
+                case FRAME_QUIT:
+                    sink_flush();
+                    printf("[CLIENT] Quit command received. Disconnecting.\n");
+                    exit(0);
+                case FRAME_ABORT:
+                    sink_flush();
+                    printf("\n[CLIENT] Abort!\n");
+                    exit(0);
+                case FRAME_END:
+                    fs->last_status = fs->header.status;
+                    completed += complete_response(fs->queue, fs->header.stream_id);
+                    break;
+            }
+        }
+
+        // Forward the payload (only DATA payloads are printed, RAW payloads hold the token)
+        size_t take = fs->payload_left < len ? fs->payload_left : len;
+        if (take > 0 && fs->header.type == FRAME_DATA && fs->header.flags != 0)
+            memcpy(fs->packed + fs->header.length - fs->payload_left, data, take);
+        else if (take > 0 && fs->header.type == FRAME_DATA)
+            emit_output(fs->queue, fs->header.stream_id, data, take);
+        if (take > 0 && fs->header.type == FRAME_RAW) {
+            size_t offset = fs->header.length - fs->payload_left;
+            if (offset < PROTO_RAW_TOKEN_SIZE) {
+                size_t copy = take < PROTO_RAW_TOKEN_SIZE - offset ? take : PROTO_RAW_TOKEN_SIZE - offset;
+                memcpy(fs->token + offset, data, copy);
+            }
+        }
+        data += take;
+        len -= take;
+        fs->payload_left -= take;
+
+        if (fs->payload_left == 0) {
+            fs->header_len = 0;
+            if (fs->header.type == FRAME_DATA && fs->header.flags != 0) {
+                const char *output = compress_unpack(fs->header.flags, fs->packed, fs->header.length,
+                                                     (uint32_t)fs->header.status);
+                if (!output) {
+                    sink_flush();
+                    printf("\n[CLIENT] Protocol error: cannot decompress output from server.\n");
+                    exit(1);
+                }
+                emit_output(fs->queue, fs->header.stream_id, output, (uint32_t)fs->header.status);
+            }
+            if (fs->header.type == FRAME_RAW && fs->header.length == PROTO_RAW_TOKEN_SIZE)
+                prepare_raw(fs);
+        }
+    }
+
+    if (!sink.streaming) fflush(stdout);
+    return completed;
+}
+
+#if defined(__linux__)
+// Moves the rest of a large DATA payload from the socket straight into the stdout pipe.
+// Returns the bytes moved, 0 if splicing does not apply, -1 if the socket has no data now.
+static ssize_t splice_payload(int sock, frame_stream_t *fs) {
+    size_t position = 0;
+    if (!sink.can_splice || fs->raw || fs->header_len < PROTO_HEADER_SIZE || fs->header.type != FRAME_DATA
+        || fs->header.flags != 0 || fs->payload_left < SPLICE_MIN_PAYLOAD) return 0;
+    if (fs->queue && find_response(fs->queue, fs->header.stream_id, &position) && position > 0) return 0;
+
+    sink_flush();
+    while (1) {
+        ssize_t moved = splice(sock, NULL, STDOUT_FILENO, NULL, fs->payload_left, SPLICE_F_MOVE);
+        if (moved > 0) {
+            fs->payload_left -= moved;
+            if (fs->payload_left == 0) fs->header_len = 0;
+            return moved;
+        }
+        if (moved == 0) return 0;           // EOF: let read() report it
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Either the socket is drained or a non-blocking stdout pipe is full
+            struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+            if (poll(&pfd, 1, 0) == 1) return -1;
+            wait_stdout();
+            continue;
+        }
+        sink.can_splice = 0;                // e.g. EINVAL: read and write instead
+        return 0;
+    }
+}
+#endif
+
+// One receive step on a framed connection: splices a large payload or reads and parses.
+// Returns > 0 after progress, 0 when the server closed the connection, -1 if nothing is
+// available on a non-blocking socket (or it failed).
+static ssize_t receive_frames(int sock, frame_stream_t *fs) {
+#if defined(__linux__)
+    ssize_t moved = splice_payload(sock, fs);
+    if (moved != 0) return moved;
+#endif
+    ssize_t bytes = read(sock, receive_buf, sizeof(receive_buf));
+    if (bytes < 0 && errno == EINTR) return 1;
+    if (bytes > 0) consume_frames(fs, receive_buf, bytes);
+    return bytes;
+}
+
+
+/* ==============================================================================================
+ * Command Submission
+ * ==============================================================================================
+ * Commands are queued and written as the socket accepts them, so a client with many requests
+ * in flight never blocks in write() while the server is blocked writing responses to it.
+ * ==============================================================================================
+ */
+
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} send_queue_t;
+
+static void queue_frame(send_queue_t *out, int mode, int type, uint32_t stream_id, const char *payload, size_t len) {
+    if (out->len + PROTO_HEADER_SIZE + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + PROTO_HEADER_SIZE + len) cap *= 2;
+        char *grown = realloc(out->data, cap);
+        if (!grown) {
+            perror("[CLIENT] Memory allocation failed");
+            exit(1);
+        }
+        out->data = grown;
+        out->cap = cap;
+    }
+
+    if (mode == PROTO_FRAMED) {
+        frame_header_t header = {0};
+        header.type = type;
+        header.stream_id = stream_id;
+        header.length = len;
+        proto_encode_header((unsigned char *)out->data + out->len, &header);
+        out->len += PROTO_HEADER_SIZE;
+    }
+    memcpy(out->data + out->len, payload, len);
+    out->len += len;
+}
+
+static void queue_command(send_queue_t *out, int mode, uint32_t stream_id, const char *command, size_t len) {
+    queue_frame(out, mode, FRAME_COMMAND, stream_id, command, len);
+}
+
+// Heredoc body of the next command, in frames the server's reader can take
+static void queue_stdin(send_queue_t *out, uint32_t stream_id, const char *data, size_t len) {
+    for (size_t sent = 0; sent < len; sent += PROTO_MAX_COMMAND) {
+        size_t chunk = len - sent < PROTO_MAX_COMMAND ? len - sent : PROTO_MAX_COMMAND;
+        queue_frame(out, PROTO_FRAMED, FRAME_STDIN, stream_id, data + sent, chunk);
+    }
+}
+
+// Writes as much of the queue as the non-blocking socket takes; -1 on a broken connection
+static int flush_commands(int sock, send_queue_t *out) {
+    size_t sent = 0;
+    while (sent < out->len) {
+        ssize_t written = write(sock, out->data + sent, out->len - sent);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += written;
+    }
+    memmove(out->data, out->data + sent, out->len - sent);
+    out->len -= sent;
+    return 0;
+}
+
+
 /* ==============================================================================================
  * Main Client Interaction Loop
  * ==============================================================================================
@@ -77,19 +765,49 @@ void get_prompt(char *prompt, size_t size) {
  * Handles bidirectional communication between client and server.
  * - Reads user input and sends it to the server.
  * - Receives and prints server response.
- * - Supports heredoc (<< delimiter), which is rewritten into a printf-pipe.
+ * - Supports heredoc (<< delimiter), whose body is sent ahead of the command.
  * - Non-blocking I/O is used for responsiveness.
  * - Recognizes control messages like [HALT], [QUIT], and [ABORT].
  *
+ * The protocol mode was negotiated by proto_client_hello() when connecting: framed servers
+ * answer with length-prefixed frames, legacy servers with text terminated by [END].
+ *
+ * Without -P the client sends one command and waits for its response. With -P <n> (framed
+ * servers only) up to n commands are sent ahead, each with its own stream ID; the server
+ * still executes them in order and the response queue prints the answers in order. When
+ * stdin is closed, the client waits for all outstanding responses before it exits.
+ *
  * ==============================================================================================
  * ============================================================================================== */
 
 
 void main_connection_loop(int sock) {
     char prompt[256];            // Prompt string (e.g., "12:30 user@host# ")
-    char buffer[4096];            // Buffer for incoming server data
+    char *buffer = receive_buf;   // Buffer for incoming server data
     char input_buf[1024];        // Buffer for user input from stdin
-    int waiting_for_response = 0; // Flag: true if a command has been sent and waiting for output
+    int mode = proto_get_mode(sock);
+    uint32_t next_stream_id = 1;  // Request ID of the next framed command
+    int input_closed = 0;
+    frame_stream_t frames = {0};
+    response_queue_t queue = {0};
+    send_queue_t out = {0};
+
+    // Legacy servers cannot tag responses, so they always get one command at a time
+    queue.window = 1;
+    if (client_options.pipeline_window > 1) {
+        if (mode == PROTO_FRAMED) queue.window = client_options.pipeline_window;
+        else printf("[CLIENT] Legacy server, pipelining disabled.\n");
+    }
+    native_heredoc = (mode == PROTO_FRAMED && (proto_get_caps(sock) & PROTO_CAP_STDIN));
+    queue.slots = calloc(queue.window, sizeof(response_t));
+    if (!queue.slots) {
+        perror("[CLIENT] Memory allocation failed");
+        exit(1);
+    }
+    queue.prompt = prompt;
+    queue.prompt_size = sizeof(prompt);
+    frames.queue = &queue;
+    sink_init();
 
     // Set the socket and stdin to non-blocking mode
     fcntl(sock, F_SETFL, O_NONBLOCK);
@@ -101,123 +819,106 @@ void main_connection_loop(int sock) {
     fflush(stdout);
 
     while (1) {
-        fd_set read_fds;
+        // USER INPUT HANDLING: submit commands while the window has room. Lines that are
+        // already buffered are taken without waiting for stdin to become readable again.
+        while (!input_closed && queue.count < queue.window) {
+            int input = read_user_command(input_buf, sizeof(input_buf));
+            if (input == INPUT_PENDING) break;
+            if (input == INPUT_CLOSED) {
+                input_closed = 1;
+                break;
+            }
+            if (input == 0) {
+                // Empty line: show the prompt again unless responses are still due
+                if (queue.count == 0) {
+                    printf("%s", prompt);
+                    fflush(stdout);
+                }
+                continue;
+            }
+
+            if (heredoc_len > 0) queue_stdin(&out, next_stream_id, heredoc_body, heredoc_len);
+            queue_command(&out, mode, next_stream_id, input_buf, strlen(input_buf));
+            push_response(&queue, next_stream_id++);
+        }
+
+        // Send the queued commands to the server
+        if (flush_commands(sock, &out) < 0) {
+            perror("[CLIENT] Failed to send command");
+            break;
+        }
+
+        if (input_closed && queue.count == 0) {
+            sink_flush();
+            printf("[CLIENT] Input closed.\n");
+            break;
+        }
+
+        fd_set read_fds, write_fds;
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
 
-        // Wait for input from user (stdin) only if not already waiting for server response
-        if (!waiting_for_response)
+        // Wait for input from user (stdin) only while more commands may be sent
+        if (!input_closed && queue.count < queue.window)
             FD_SET(STDIN_FILENO, &read_fds);
 
-        // Always check for server messages
+        // Always check for server messages, and for room to send when commands are queued
         FD_SET(sock, &read_fds);
+        if (out.len > 0)
+            FD_SET(sock, &write_fds);
 
         int max_fd = sock > STDIN_FILENO ? sock : STDIN_FILENO;
 
         // Wait for activity on stdin or socket (blocking select)
-        int ready = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        int ready = select(max_fd + 1, &read_fds, &write_fds, NULL, NULL);
         if (ready < 0) {
+            if (errno == EINTR) continue;
             perror("[CLIENT] select failed");
             break;
         }
 
-        // USER INPUT HANDLING
-        if (!waiting_for_response && FD_ISSET(STDIN_FILENO, &read_fds)) {
-            // Read line from stdin
-            if (!fgets(input_buf, sizeof(input_buf), stdin)) {
-                printf("[CLIENT] Input closed.\n");
-                break;
-            }
-
-            // Skip empty lines
-            if (strlen(input_buf) <= 1) {
-                printf("%s", prompt);
-                fflush(stdout);
-                continue;
-            }
-
-            // HEREDOC PROCESSING (<< delimiter)
-            if (strstr(input_buf, "<<") && !strstr(input_buf, "<<<")) {
-                char delimiter[64] = {0};
-                char *heredoc_pos = strstr(input_buf, "<<");
-                sscanf(heredoc_pos + 2, "%s", delimiter); // extract delimiter
-
-                // Truncate heredoc marker from command
-                *heredoc_pos = '\0';
-                input_buf[strcspn(input_buf, "\n")] = '\0'; // remove newline
-
-                // Temporarily switch back to blocking mode for heredoc input
-                int old_flags = fcntl(STDIN_FILENO, F_GETFL);
-                fcntl(STDIN_FILENO, F_SETFL, old_flags & ~O_NONBLOCK);
-
-                // Read heredoc content until the delimiter is typed
-                char heredoc_data[4096] = "";
-                char line[1024];
-                while (1) {
-                    printf("heredoc> ");
-                    fflush(stdout);
-                    if (!fgets(line, sizeof(line), stdin)) break;
-
-                    // Strip newline and compare with delimiter
-                    char temp[1024];
-                    strcpy(temp, line);
-                    temp[strcspn(temp, "\n")] = '\0';
-                    if (strcmp(temp, delimiter) == 0)
-                        break;
-
-                    // Append the input line to heredoc_data, add escaped newline
-                    strncat(heredoc_data, temp, sizeof(heredoc_data) - strlen(heredoc_data) - 1);
-                    strncat(heredoc_data, "\\n", sizeof(heredoc_data) - strlen(heredoc_data) - 1);
-                }
-
-                // Rewrite input command as: printf "heredoc..." | original_command
-                char result[1024];
-                snprintf(result, sizeof(result), "printf %s | %s\n", heredoc_data, input_buf);
-                strncpy(input_buf, result, sizeof(result) - 1);
-                input_buf[sizeof(result) - 1] = '\0';
-
-                // Restore original non-blocking mode
-                fcntl(STDIN_FILENO, F_SETFL, old_flags);
-            }
-
-            // Send the command to the server
-            if (write(sock, input_buf, strlen(input_buf)) < 0) {
-                perror("[CLIENT] Failed to send command");
-                break;
-            }
-
-            waiting_for_response = 1;
-        }
-
         // SERVER RESPONSE HANDLING
         if (FD_ISSET(sock, &read_fds)) {
             int bytes;
 
-            // Read all available data from the server
-            while ((bytes = read(sock, buffer, sizeof(buffer) - 1)) > 0) {
-                buffer[bytes] = '\0';
+            if (mode == PROTO_FRAMED) {
+                // Framed responses: forward payloads, no marker scanning
+                while ((bytes = receive_frames(sock, &frames)) > 0) {}
+                if (bytes == 0) {
+                    sink_flush();
+                    printf("\n[CLIENT] Server closed the connection.\n");
+                    break;
+                }
+                continue;
+            }
 
+            // Read all available data from the server (output may contain NUL bytes)
+            while ((bytes = read(sock, buffer, CLIENT_READ_SIZE)) > 0) {
                 // Handle special control messages from server
-                if (strncmp(buffer, "[HALT]", 6) == 0) {
+                if (bytes >= 6 && memcmp(buffer, "[HALT]", 6) == 0) {
+                    sink_flush();
                     printf("[CLIENT] Server halted. Exiting.\n");
                     exit(0);
                 }
-                if (strncmp(buffer, "[QUIT]", 6) == 0) {
+                if (bytes >= 6 && memcmp(buffer, "[QUIT]", 6) == 0) {
+                    sink_flush();
                     printf("[CLIENT] Quit command received. Disconnecting.\n");
                     exit(0);
                 }
-                if (strncmp(buffer, "[ABORT]", 7) == 0) {
+                if (bytes >= 7 && memcmp(buffer, "[ABORT]", 7) == 0) {
+                    sink_flush();
                     printf("\n[CLIENT] Abort!\n");
                     exit(0);
                 }
 
                 // Handle output from the command, until [END] marker
-                if (waiting_for_response) {
-                    char *end_marker = strstr(buffer, "[END]");
+                if (queue.count > 0) {
+                    char *end_marker = memmem(buffer, bytes, "[END]", 5);
                     if (end_marker) {
-                        *end_marker = '\0'; // Cut off at [END] marker
-                        printf("%s\n", buffer);
-                        fflush(stdout);
-                        waiting_for_response = 0;
+                        sink_write(buffer, end_marker - buffer); // Cut off at [END] marker
+                        sink_write("\n", 1);
+                        sink_flush();
+                        queue.count = 0;
 
                         // Show new prompt
                         get_prompt(prompt, sizeof(prompt));
@@ -227,15 +928,101 @@ void main_connection_loop(int sock) {
                     }
 
                     // If no [END], just print ongoing data
-                    printf("%s", buffer);
-                    fflush(stdout);
+                    sink_write(buffer, bytes);
+                    if (!sink.streaming) fflush(stdout);
                 }
             }
-
+            if (bytes == 0) {
+                sink_flush();
+                printf("\n[CLIENT] Server closed the connection.\n");
+                break;
+            }
         }
     }
+
+    sink_flush();
+    for (size_t i = 0; i < queue.window; i++) free(queue.slots[i].output);
+    free(queue.slots);
+    free(out.data);
+    free(frames.packed);
+}
+
+
+
+/* ==============================================================================================
+ * Connecting
+ * ==============================================================================================
+ * Both connect helpers return a connected blocking socket, or -1 with errno set.
+ * ==============================================================================================
+ */
+
+
+int client_connect_unix(const char *socket_path) {
+    struct sockaddr_un server_addr;  // UNIX socket address structure
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    // Initialize server address structure, copy socket path (with length validation)
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, socket_path, sizeof(server_addr.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
+}
+
+int client_connect_tcp(const char *host, int port) {
+    struct sockaddr_in server_addr;  // Internet socket address structure
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;  // IPv4 address family
+    server_addr.sin_port = htons(port);  // Convert port to network byte order
+
+    // Convert IP address from text to binary form
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    sockopt_connection(sock);   // TCP_NODELAY and -o; buffer sizes must be set before connect()
+
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
 }
 
+// Negotiates the protocol on a connected socket, through TLS (-T) for TCP connections (host
+// set): the hello then travels as 0-RTT data when a saved session allows it. Returns the
+// descriptor to talk to the server on from now on, or -1; sock is taken over either way.
+int client_handshake(int sock, const char *host, int port, uint32_t caps) {
+    if (host && tls_configured()) {
+        unsigned char hello[PROTO_HEADER_SIZE];
+        frame_header_t header = {0};
+        header.type = FRAME_HELLO;
+        header.flags = caps;
+        proto_encode_header(hello, &header);
+
+        sock = tls_connect(sock, host, port, hello, sizeof(hello));
+        if (sock < 0) return -1;
+        if (proto_await_hello(sock) >= 0) return sock;
+    } else if (proto_client_hello(sock, caps) >= 0) {
+        return sock;
+    }
+    close(sock);
+    return -1;
+}
 
 
 /* ==============================================================================================
@@ -250,31 +1037,21 @@ void main_connection_loop(int sock) {
 
 
 void run_unix_client(char *socket_path) {
-    int sock;  // Socket file descriptor
-    struct sockaddr_un server_addr;  // UNIX socket address structure
-
-    // Create a UNIX domain stream socket
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int sock = client_connect_unix(socket_path);
     if (sock < 0) {
-        perror("[CLIENT] UNIX socket creation failed");
+        perror("[CLIENT] UNIX connection failed");
         exit(1);
     }
 
-    // Initialize server address structure
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    // Copy socket path (with length validation)
-    strncpy(server_addr.sun_path, socket_path, sizeof(server_addr.sun_path) - 1);
+    printf("[CLIENT] Connected to UNIX socket: %s\n", socket_path);
 
-    // Connect to the server
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("[CLIENT] UNIX connection failed");
+    // Negotiate the framed protocol, falling back to legacy text mode
+    if (proto_client_hello(sock, PROTO_CAP_RAW | compress_supported()) < 0) {
+        fprintf(stderr, "[CLIENT] Handshake with server failed\n");
         close(sock);
         exit(1);
     }
 
-    printf("[CLIENT] Connected to UNIX socket: %s\n", socket_path);
-
     // Run the main client interaction loop
     main_connection_loop(sock);
 
@@ -295,40 +1072,107 @@ void run_unix_client(char *socket_path) {
 
 
 void run_tcp_client(const char *host, int port) {
-    int sock;  // Socket file descriptor
-    struct sockaddr_in server_addr;  // Internet socket address structure
-
-    // Create an IPv4 TCP socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = client_connect_tcp(host, port);
     if (sock < 0) {
-        perror("[CLIENT] TCP socket creation failed");
+        perror("[CLIENT] TCP connection failed");
         exit(1);
     }
 
-    // Initialize server address structure
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;  // IPv4 address family
-    server_addr.sin_port = htons(port);  // Convert port to network byte order
-
-    // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
-        perror("[CLIENT] Invalid host IP address");
-        close(sock);
-        exit(1);
-    }
+    printf("[CLIENT] Connected to TCP %s:%d\n", host, port);
 
-    // Connect to the server
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("[CLIENT] TCP connection failed");
-        close(sock);
+    // Negotiate the framed protocol (over TLS with -T), falling back to legacy text mode
+    sock = client_handshake(sock, host, port, PROTO_CAP_RAW | compress_supported());
+    if (sock < 0) {
+        fprintf(stderr, "[CLIENT] Handshake with server failed\n");
         exit(1);
     }
 
-    printf("[CLIENT] Connected to TCP %s:%d\n", host, port);
-
     // Run the main client interaction loop
     main_connection_loop(sock);
 
     // Cleanup: close the socket
     close(sock);
 }
+
+
+/* ==============================================================================================
+ * One-shot Command (-c "command")
+ * ==============================================================================================
+ *
+ * Sends a single command, prints its output and returns its exit status. When a connection
+ * multiplexer (-M, mux.c) runs for the server, the command goes through its control socket
+ * and reuses one of its warm server sessions; otherwise the server is connected directly.
+ *
+ * ==============================================================================================
+ * ============================================================================================== */
+
+
+int run_client_command(const char *socket_path, const char *host, int port, const char *command) {
+    char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char *buffer = receive_buf;
+    int status = 1;
+
+    // The multiplexer is local; a direct TCP connection uses TLS with -T
+    const char *tls_host = NULL;
+    mux_control_path(control_path, sizeof(control_path), socket_path, host, port);
+    int sock = client_connect_unix(control_path);
+    if (sock < 0) {
+        sock = port > 0 ? client_connect_tcp(host, port) : client_connect_unix(socket_path);
+        if (sock < 0) {
+            perror("[CLIENT] Connection failed");
+            return 1;
+        }
+        if (port > 0) tls_host = host;
+    }
+
+    sock = client_handshake(sock, tls_host, port, PROTO_CAP_RAW | compress_supported());
+    if (sock < 0) {
+        fprintf(stderr, "[CLIENT] Handshake with server failed\n");
+        return 1;
+    }
+    int mode = proto_get_mode(sock);
+    if (proto_send_command(sock, mode, 1, command, strlen(command)) < 0) {
+        perror("[CLIENT] Failed to send command");
+        close(sock);
+        return 1;
+    }
+
+    if (mode == PROTO_FRAMED) {
+        response_t slot = {0};
+        response_queue_t queue = {0};
+        frame_stream_t frames = {0};
+        queue.slots = &slot;
+        queue.window = 1;
+        frames.queue = &queue;
+        push_response(&queue, 1);
+        sink_init();
+
+        while (queue.count > 0 && receive_frames(sock, &frames) > 0) {}
+        if (queue.count == 0) status = frames.last_status;
+        free(slot.output);
+        free(frames.packed);
+    } else {
+        // Legacy server: print everything up to the [END] marker
+        size_t len = 0;
+        int bytes;
+        sink_init();
+        while ((bytes = read(sock, buffer + len, CLIENT_READ_SIZE - len)) > 0) {
+            len += bytes;
+            char *end = memmem(buffer, len, "[END]", 5);
+            if (end) {
+                sink_write(buffer, end - buffer);
+                status = 0;
+                break;
+            }
+            // Keep a short tail so a marker split across two reads is still found
+            size_t keep = len < 4 ? len : 4;
+            sink_write(buffer, len - keep);
+            memmove(buffer, buffer + len - keep, keep);
+            len = keep;
+        }
+    }
+
+    sink_flush();
+    close(sock);
+    return status;
+}
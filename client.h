@@ -2,8 +2,20 @@
 #define MYSHELL_CLIENT_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+typedef struct {
+    int pipeline_window;    // -P: commands sent ahead without waiting, 0/1 = one at a time
+    const char *mux_path;   // -m: control socket of the connection multiplexer, NULL = default
+} client_options_t;
+
+extern client_options_t client_options;
 
 void get_prompt(char *prompt, size_t size);
 void run_unix_client(char *socket_path);
 void run_tcp_client(const char *host, int port);
+int client_connect_unix(const char *socket_path);
+int client_connect_tcp(const char *host, int port);
+int client_handshake(int sock, const char *host, int port, uint32_t caps);
+int run_client_command(const char *socket_path, const char *host, int port, const char *command);
 #endif //MYSHELL_CLIENT_H
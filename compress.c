@@ -0,0 +1,242 @@
+/* ==============================================================================================
+ * Output Compression Module
+ * ==============================================================================================
+ *
+ * Compresses command output on framed connections, for large text output (logs, `cat`,
+ * `tail -f`) over slow links. Three codecs can be built in:
+ *
+ *   lz4    lowest latency, moderate ratio        (HAVE_LZ4, liblz4)
+ *   zstd   much better ratio at similar speed    (HAVE_ZSTD, libzstd)
+ *   zlib   deflate, slower but always present    (HAVE_ZLIB, libz)
+ *
+ * The Makefile enables every codec whose headers are installed. The server picks one with
+ * -Z <codec>; it is used for a connection only if the client's hello offered it as well
+ * (PROTO_CAP_LZ4 / PROTO_CAP_ZSTD / PROTO_CAP_ZLIB, see protocol.h), everyone else keeps
+ * getting plain output.
+ *
+ * Compression is applied per DATA frame, and only to payloads of at least COMPRESS_MIN_SIZE
+ * bytes: small replies and interactive output would gain nothing but latency. A frame is
+ * sent compressed only when that makes it smaller. Every compressed frame is a self-contained
+ * block rather than part of one stream per connection: output of a connection is written by
+ * several processes (session, event-loop jobs, the master answering `stat`), which cannot
+ * share a compressor state. With output forwarded in blocks of up to 256 KB the ratio is
+ * close to that of a stream.
+ *
+ * The counters (frames, bytes before and after) are per process and shown by `stat`.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#define COMPRESS_ZSTD_LEVEL 3
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#define COMPRESS_ZLIB_LEVEL Z_BEST_SPEED
+#endif
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD) || defined(HAVE_ZLIB)
+#define COMPRESS_CODECS                 // at least one codec built in
+#endif
+
+static char *pack_buf = NULL;
+static compress_stats_t totals = {0};
+
+#ifdef COMPRESS_CODECS
+static size_t pack_cap = 0;
+static char *unpack_buf = NULL;
+static size_t unpack_cap = 0;
+
+static char *reserve(char **buf, size_t *cap, size_t size) {
+    if (size > *cap) {
+        char *grown = realloc(*buf, size);
+        if (!grown) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        *buf = grown;
+        *cap = size;
+    }
+    return *buf;
+}
+#endif
+
+
+/* ==============================================================================================
+ * Codec Table
+ * ==============================================================================================
+ */
+
+
+// Hello capabilities of the codecs built into this binary
+uint32_t compress_supported(void) {
+    uint32_t caps = 0;
+#ifdef HAVE_LZ4
+    caps |= compress_cap(COMPRESS_LZ4);
+#endif
+#ifdef HAVE_ZSTD
+    caps |= compress_cap(COMPRESS_ZSTD);
+#endif
+#ifdef HAVE_ZLIB
+    caps |= compress_cap(COMPRESS_ZLIB);
+#endif
+    return caps;
+}
+
+uint32_t compress_cap(int codec) {
+    return codec > COMPRESS_NONE ? 1u << codec : 0;
+}
+
+// Returns the codec for a -Z argument, COMPRESS_NONE for "none", -1 if unknown or not built in
+int compress_parse(const char *name) {
+    static const char *names[] = { "none", "lz4", "zstd", "zlib" };
+    for (int codec = COMPRESS_NONE; codec <= COMPRESS_ZLIB; codec++) {
+        if (strcmp(name, names[codec]) != 0) continue;
+        if (codec == COMPRESS_NONE || (compress_supported() & compress_cap(codec))) return codec;
+        return -1;
+    }
+    return -1;
+}
+
+const char *compress_name(int codec) {
+    switch (codec) {
+        case COMPRESS_LZ4:  return "lz4";
+        case COMPRESS_ZSTD: return "zstd";
+        case COMPRESS_ZLIB: return "zlib";
+        default:            return "off";
+    }
+}
+
+
+/* ==============================================================================================
+ * Packing and Unpacking
+ * ==============================================================================================
+ * Both return pointers into a buffer owned by this module, valid until the next call.
+ * ==============================================================================================
+ */
+
+
+// Compresses one payload. Returns NULL when it is too small, did not shrink or the codec
+// failed; the caller sends the original bytes then.
+const void *compress_pack(int codec, const void *src, size_t len, size_t *packed_len) {
+    if (codec == COMPRESS_NONE || len < COMPRESS_MIN_SIZE || len > COMPRESS_MAX_FRAME) return NULL;
+
+    long packed = -1;
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4: {
+            int bound = LZ4_compressBound((int)len);
+            char *dst = reserve(&pack_buf, &pack_cap, bound);
+            packed = LZ4_compress_default(src, dst, (int)len, bound);
+            if (packed <= 0) packed = -1;
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            static ZSTD_CCtx *cctx = NULL;
+            if (!cctx && !(cctx = ZSTD_createCCtx())) break;
+            size_t bound = ZSTD_compressBound(len);
+            char *dst = reserve(&pack_buf, &pack_cap, bound);
+            size_t result = ZSTD_compressCCtx(cctx, dst, bound, src, len, COMPRESS_ZSTD_LEVEL);
+            if (!ZSTD_isError(result)) packed = (long)result;
+            break;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case COMPRESS_ZLIB: {
+            uLongf bound = compressBound(len);
+            char *dst = reserve(&pack_buf, &pack_cap, bound);
+            if (compress2((Bytef *)dst, &bound, src, len, COMPRESS_ZLIB_LEVEL) == Z_OK) packed = (long)bound;
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+
+    totals.bytes_in += len;
+    if (packed < 0 || (size_t)packed >= len) {
+        totals.bytes_out += len;
+        return NULL;
+    }
+    totals.frames++;
+    totals.bytes_out += packed;
+    *packed_len = packed;
+    return pack_buf;
+}
+
+// Decompresses a payload that must expand to exactly original_len bytes; NULL if it is corrupt
+const char *compress_unpack(int codec, const void *src, size_t len, size_t original_len) {
+    if (original_len == 0 || original_len > COMPRESS_MAX_FRAME) return NULL;
+#ifdef COMPRESS_CODECS
+    char *dst = reserve(&unpack_buf, &unpack_cap, original_len);
+#endif
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            return LZ4_decompress_safe(src, dst, (int)len, (int)original_len) == (int)original_len ? dst : NULL;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            static ZSTD_DCtx *dctx = NULL;
+            if (!dctx && !(dctx = ZSTD_createDCtx())) return NULL;
+            size_t result = ZSTD_decompressDCtx(dctx, dst, original_len, src, len);
+            return !ZSTD_isError(result) && result == original_len ? dst : NULL;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case COMPRESS_ZLIB: {
+            uLongf out_len = original_len;
+            if (uncompress((Bytef *)dst, &out_len, src, len) != Z_OK) return NULL;
+            return out_len == original_len ? dst : NULL;
+        }
+#endif
+        default:
+            return NULL;
+    }
+}
+
+
+/* ==============================================================================================
+ * Statistics
+ * ==============================================================================================
+ */
+
+
+void compress_stats(compress_stats_t *stats) {
+    *stats = totals;
+}
+
+// Adds counters collected by another process (event-loop jobs report theirs when they finish)
+void compress_stats_add(const compress_stats_t *stats) {
+    totals.frames += stats->frames;
+    totals.bytes_in += stats->bytes_in;
+    totals.bytes_out += stats->bytes_out;
+}
+
+void compress_stats_reset(void) {
+    memset(&totals, 0, sizeof(totals));
+}
+
+void format_compress_stats(char *buf, size_t size, int codec) {
+    if (codec == COMPRESS_NONE) {
+        snprintf(buf, size, "Compression: off\n");
+        return;
+    }
+
+    double ratio = totals.bytes_out > 0 ? (double)totals.bytes_in / totals.bytes_out : 1.0;
+    snprintf(buf, size, "Compression: %s, %lu frames, %llu -> %llu bytes (ratio %.2fx, %llu bytes saved)\n",
+             compress_name(codec), totals.frames, totals.bytes_in, totals.bytes_out, ratio,
+             totals.bytes_in - totals.bytes_out);
+}
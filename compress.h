@@ -0,0 +1,37 @@
+#ifndef MYSHELL_COMPRESS_H
+#define MYSHELL_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPRESS_MIN_SIZE 512               // DATA payloads below this are sent as they are
+#define COMPRESS_MAX_FRAME (16 * 1024 * 1024) // Largest uncompressed payload a peer accepts
+
+// Codec IDs; a codec's hello capability is PROTO_CAP_* = 1 << id (see protocol.h)
+enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_LZ4 = 1,                       // lowest latency
+    COMPRESS_ZSTD = 2,                      // best ratio per CPU second
+    COMPRESS_ZLIB = 3                       // deflate, available everywhere
+};
+
+typedef struct {
+    unsigned long frames;                   // DATA frames sent compressed
+    unsigned long long bytes_in;            // payload bytes considered for compression
+    unsigned long long bytes_out;           // bytes actually sent for them
+} compress_stats_t;
+
+uint32_t compress_supported(void);
+uint32_t compress_cap(int codec);
+int compress_parse(const char *name);
+const char *compress_name(int codec);
+
+const void *compress_pack(int codec, const void *src, size_t len, size_t *packed_len);
+const char *compress_unpack(int codec, const void *src, size_t len, size_t original_len);
+
+void compress_stats(compress_stats_t *stats);
+void compress_stats_add(const compress_stats_t *stats);
+void compress_stats_reset(void);
+void format_compress_stats(char *buf, size_t size, int codec);
+
+#endif //MYSHELL_COMPRESS_H
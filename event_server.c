@@ -0,0 +1,1023 @@
+/* ==============================================================================================
+ * Event-Driven Server Module
+ * ==============================================================================================
+ *
+ * Alternative to the fork-per-client model of main_server_loop(), enabled with the -E switch.
+ * A single process multiplexes the listening socket and every client socket through the
+ * poller module (epoll on Linux, kqueue on FreeBSD). Each session is represented by a small
+ * event_conn_t structure holding its line buffer, pending output and working directory,
+ * instead of a whole resident process.
+ *
+ * Only the actual command pipelines fork: when a complete line arrives, a short-lived job
+ * process runs it exactly like a session child would, then reports its final working
+ * directory back through a completion pipe and exits. The line is compiled through the plan
+ * cache before forking, so the cache lives in the event loop and survives the jobs. While a job runs,
+ * its session stops reading input, so commands of one client are still executed in order.
+ *
+ * Internal commands that need the connection list (`stat`, `abort`, `quit`) are answered by
+ * the event loop itself without forking, and so are lines the result cache (-R) holds.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "server.h"
+#include "protocol.h"
+#include "compress.h"
+#include "builtins.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "jobs.h"
+#include "result_cache.h"
+#include "heredoc.h"
+#include "tls.h"
+#include "sockopt.h"
+#include "recorder.h"
+#include "poller.h"
+#include "event_server.h"
+
+#define EVENT_MAX_EVENTS 64
+#define EVENT_LINE_MAX 4096
+#define EVENT_INPUT_MAX (PROTO_HEADER_SIZE + PROTO_MAX_COMMAND)
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+
+/* ==============================================================================================
+ * Session State
+ * ==============================================================================================
+ * One event_conn_t exists per connected client. Sessions are kept in a linked list for `stat`
+ * (newest first, like the connection list of the forking server) and in an fd-indexed table
+ * so that poller events for both the client socket and the job completion pipe can be mapped
+ * back to their session in constant time.
+ * ==============================================================================================
+ */
+
+
+typedef struct event_conn {
+    int id;
+    int fd;
+    pid_t job_pid;             // PID of the running command, 0 when idle
+    int job_fd;                // Read end of the job completion pipe, -1 when idle
+    int negotiated;            // First message seen, protocol mode decided
+    char peer[INET_ADDRSTRLEN + 8];        // Client address shown by `stat` (format_peer())
+    char in_buf[EVENT_INPUT_MAX];
+    size_t in_len;
+    char *out_buf;             // Output produced by the event loop itself, not yet sent
+    size_t out_len;
+    size_t out_cap;
+    int close_after_flush;     // Disconnect once out_buf has been drained (quit/abort)
+    int closing_frame;         // FRAME_QUIT/FRAME_ABORT held back until the job is reaped, 0 = none
+    char *cwd;                 // Session working directory, NULL = server directory
+    int metrics_slot;          // Counters of the session (metrics.c), -1 = none
+    sched_entry_t sched;       // Pipeline slot of the session (scheduler.c)
+    char *queued_line;         // Command waiting for a slot (-L) or a cached result (-R), NULL = none
+    cache_entry_t *cache_entry;    // Result cache entry the session fills or waits for, NULL = none
+    int cache_filling;         // The session's job runs the command of cache_entry
+    int capture_fd;            // Capture file of that job, -1 = none
+    int input_fd;              // Heredoc body (FRAME_STDIN) for the next line, -1 = none
+    time_t last_input;         // When the client last sent something (-o idle=)
+    struct event_conn *next;
+} event_conn_t;
+
+static int poller_fd = -1;
+static event_conn_t *conn_list = NULL;
+static event_conn_t **fd_table = NULL;
+static int fd_table_size = 0;
+
+
+static void fd_table_set(int fd, event_conn_t *conn) {
+    if (fd >= fd_table_size) {
+        int new_size = fd_table_size ? fd_table_size : 64;
+        while (new_size <= fd) new_size *= 2;
+
+        event_conn_t **table = realloc(fd_table, new_size * sizeof(event_conn_t *));
+        if (!table) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        memset(table + fd_table_size, 0, (new_size - fd_table_size) * sizeof(event_conn_t *));
+        fd_table = table;
+        fd_table_size = new_size;
+    }
+    fd_table[fd] = conn;
+}
+
+static event_conn_t *fd_table_get(int fd) {
+    return (fd >= 0 && fd < fd_table_size) ? fd_table[fd] : NULL;
+}
+
+static void set_cloexec(int fd) {
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+/* ==============================================================================================
+ * Non-blocking Output
+ * ==============================================================================================
+ * Replies generated by the event loop are sent with MSG_DONTWAIT. Whatever the socket does
+ * not accept right away is queued in the session's output buffer and flushed when the poller
+ * reports the socket writable. The client socket itself stays in blocking mode, because it is
+ * shared with the job processes which write command output to it directly.
+ * ==============================================================================================
+ */
+
+
+// Input is read only while nothing is queued: the next command waits for the earlier answers
+// and for a parked line, and a full input buffer waits until process_input() consumes it
+static void conn_update_interest(event_conn_t *conn) {
+    int events = 0;
+    if (conn->job_pid == 0 && !conn->queued_line && !conn->close_after_flush && conn->out_len == 0
+        && conn->in_len < sizeof(conn->in_buf))
+        events |= POLLER_READ;
+    if (conn->out_len > 0) events |= POLLER_WRITE;
+    poller_mod(poller_fd, conn->fd, events);
+}
+
+static void conn_send(event_conn_t *conn, const char *data, size_t len) {
+    // Try to send directly when nothing is queued yet
+    if (conn->out_len == 0) {
+        ssize_t sent = send(conn->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0) {
+            data += sent;
+            len -= sent;
+        }
+        if (len == 0) return;
+    }
+
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : 1024;
+        while (new_cap < conn->out_len + len) new_cap *= 2;
+
+        char *buf = realloc(conn->out_buf, new_cap);
+        if (!buf) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        conn->out_buf = buf;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, data, len);
+    conn->out_len += len;
+    conn_update_interest(conn);
+}
+
+// Queues one message in the session's protocol: a frame, or text plus legacy marker
+static void conn_send_message(event_conn_t *conn, int type, const char *payload, size_t len, int status) {
+    if (proto_get_mode(conn->fd) == PROTO_LEGACY) {
+        const char *marker = proto_legacy_marker(type);
+        if (len > 0) conn_send(conn, payload, len);
+        if (marker) conn_send(conn, marker, strlen(marker));
+        return;
+    }
+
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    frame_header_t header = {0};
+    header.type = type;
+    header.stream_id = proto_get_stream(conn->fd);
+    header.length = len;
+    header.status = status;
+    proto_encode_header(header_buf, &header);
+
+    conn_send(conn, (const char *)header_buf, PROTO_HEADER_SIZE);
+    if (len > 0) conn_send(conn, payload, len);
+}
+
+static void conn_send_frame(event_conn_t *conn, int type, const char *payload, size_t len) {
+    conn_send_message(conn, type, payload, len, 0);
+}
+
+static void conn_send_reply(event_conn_t *conn, const char *text) {
+    conn_send_frame(conn, FRAME_DATA, text, strlen(text));
+    conn_send_frame(conn, FRAME_END, NULL, 0);
+}
+
+
+/* ==============================================================================================
+ * Session Lifecycle
+ * ==============================================================================================
+ */
+
+
+static void grant_waiting(void);
+static void cache_forget(event_conn_t *conn);
+static void finish_capture(event_conn_t *conn);
+
+static void drop_input(event_conn_t *conn) {
+    if (conn->input_fd >= 0) close(conn->input_fd);
+    conn->input_fd = -1;
+}
+
+static void conn_close(event_conn_t *conn) {
+    event_conn_t **link = &conn_list;
+    while (*link && *link != conn) link = &(*link)->next;
+    if (*link) *link = conn->next;
+
+    if (conn->job_pid > 0) {
+        kill(conn->job_pid, SIGTERM);
+        waitpid(conn->job_pid, NULL, 0);
+    }
+    if (conn->job_fd >= 0) {
+        // A client often leaves right after the output, the job may have filled the entry
+        finish_capture(conn);
+        poller_del(poller_fd, conn->job_fd);
+        fd_table_set(conn->job_fd, NULL);
+        close(conn->job_fd);
+    }
+
+    poller_del(poller_fd, conn->fd);
+    fd_table_set(conn->fd, NULL);
+    proto_forget(conn->fd);
+    close(conn->fd);
+
+    metrics_session_close(conn->metrics_slot);
+    scheduler_forget(&conn->sched);
+    cache_forget(conn);
+    drop_input(conn);
+    free(conn->queued_line);
+    free(conn->out_buf);
+    free(conn->cwd);
+    free(conn);
+
+    // The slot of its job, if it had one, can go to the next session
+    grant_waiting();
+}
+
+static void conn_accept(int server_fd) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("[ERROR] Accept failed");
+            return;
+        }
+
+        // Job processes must not leak other sessions' sockets into executed commands
+        set_cloexec(client_fd);
+
+        // TLS (-T): a relay process makes the handshake, the loop never waits for one
+        sockopt_accepted(client_fd);
+        if (tls_enabled() && (client_fd = tls_accept_detached(client_fd)) < 0) {
+            perror("[ERROR] TLS relay failed");
+            continue;
+        }
+
+        event_conn_t *conn = calloc(1, sizeof(event_conn_t));
+        if (!conn) {
+            perror("[ERROR] Memory allocation failed");
+            close(client_fd);
+            return;
+        }
+        conn->id = allocate_connection_id();
+        conn->fd = client_fd;
+        format_peer((struct sockaddr *)&client_addr, conn->peer, sizeof(conn->peer));
+        conn->job_fd = -1;
+        conn->capture_fd = -1;
+        conn->input_fd = -1;
+        conn->last_input = time(NULL);
+        conn->metrics_slot = metrics_session_open();
+        scheduler_entry_init(&conn->sched, conn);
+        metrics_session_label(conn->metrics_slot, conn->id, getpid());
+        conn->next = conn_list;
+        conn_list = conn;
+
+        fd_table_set(client_fd, conn);
+        poller_add(poller_fd, client_fd, POLLER_READ);
+
+        printf("[INFO] Client connected.\n");
+        printf("[INFO] Added connection ID %d (FD %d)\n", conn->id, client_fd);
+    }
+}
+
+
+/* ==============================================================================================
+ * Internal Commands Answered by the Event Loop
+ * ==============================================================================================
+ */
+
+
+static void handle_stat(event_conn_t *sender, int verbose) {
+    size_t len = 0, cap = 1024;
+    char *text = malloc(cap);
+    if (!text) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    text[0] = '\0';
+
+    for (event_conn_t *curr = conn_list; curr; curr = curr->next) {
+        char line[128];
+        int line_len = snprintf(line, sizeof(line), "ID: %d | PID: %d | Peer: %s\n",
+                                curr->id, curr->job_pid ? curr->job_pid : getpid(), curr->peer);
+        if (len + line_len + 1 > cap) {
+            cap *= 2;
+            char *grown = realloc(text, cap);
+            if (!grown) {
+                perror("[ERROR] Memory allocation failed");
+                exit(1);
+            }
+            text = grown;
+        }
+        memcpy(text + len, line, line_len + 1);
+        len += line_len;
+    }
+
+    char plan_line[256];
+    format_plan_stats(plan_line, sizeof(plan_line));
+    conn_send_frame(sender, FRAME_DATA, plan_line, strlen(plan_line));
+    format_compress_stats(plan_line, sizeof(plan_line), server_options.compression);
+    conn_send_frame(sender, FRAME_DATA, plan_line, strlen(plan_line));
+    scheduler_format_stats(plan_line, sizeof(plan_line));
+    conn_send_frame(sender, FRAME_DATA, plan_line, strlen(plan_line));
+    result_cache_format_stats(plan_line, sizeof(plan_line));
+    conn_send_frame(sender, FRAME_DATA, plan_line, strlen(plan_line));
+    if (verbose) {
+        size_t metrics_len;
+        char *metrics = metrics_format_verbose(&metrics_len);
+        conn_send_frame(sender, FRAME_DATA, metrics, metrics_len);
+        free(metrics);
+    }
+
+    conn_send_reply(sender, text);
+    free(text);
+}
+
+static void send_closing_frames(event_conn_t *conn, int type) {
+    conn->closing_frame = 0;
+    conn_send_frame(conn, type, NULL, 0);
+    conn_send_frame(conn, FRAME_END, NULL, 0);
+    if (conn->out_len == 0) {
+        conn_close(conn);
+        return;
+    }
+    conn_update_interest(conn);
+}
+
+// Sends a closing control message ([QUIT] / [ABORT]) and drops the session once it is flushed.
+// A running job may be in the middle of a frame: the message follows once it has been reaped.
+static void conn_shutdown(event_conn_t *conn, int type) {
+    printf("[INFO] Aborted connection ID %d\n", conn->id);
+    conn->close_after_flush = 1;
+    if (conn->job_pid > 0) {
+        kill(conn->job_pid, SIGTERM);
+        conn->closing_frame = type;
+        conn_update_interest(conn);
+        return;
+    }
+    send_closing_frames(conn, type);
+}
+
+// A line answered by the event loop itself is recorded (-r) here, since no job runs it
+static void record_line(event_conn_t *conn, const char *line, const char *output, size_t len, int status) {
+    recorder_set_session(conn->id);
+    recorder_begin(line, strlen(line));
+    recorder_output(output, len);
+    recorder_end(status);
+}
+
+// Answers a line that is a single pure builtin (`true`, `echo ok`, builtins.c) without a job;
+// returns 0 if the line needs one
+static int answer_builtin(event_conn_t *conn, const char *line, const plan_t *plan) {
+    if (plan->count != 1 || plan->steps[0].result == PARSE_ERROR || plan->steps[0].pipeline.count != 1)
+        return 0;
+
+    const command_t *stage = &plan->steps[0].pipeline.stages[0];
+    const builtin_t *builtin = builtin_find(stage->argv);
+    if (!builtin || !builtin->pure || stage->input_file || stage->output_file) return 0;
+
+    static builtin_output_t output = {0};
+    metrics_attach(conn->metrics_slot);
+    metrics_command_begin(stage->argv[0]);
+    metrics_command_spawned();
+    int status = builtin_run(builtin, stage->argv, &output);
+    metrics_output(output.len);
+    metrics_command_end();
+    record_line(conn, line, output.data, output.len, status);
+
+    if (output.len > 0) {
+        if (!server_options.quiet) fwrite(output.data, 1, output.len, stdout);
+        conn_send_frame(conn, FRAME_DATA, output.data, output.len);
+    }
+    conn_send_message(conn, FRAME_END, NULL, 0, status);
+    return 1;
+}
+
+static void handle_abort(event_conn_t *sender, int arg_id) {
+    event_conn_t *target = conn_list;
+    while (target && target->id != arg_id) target = target->next;
+
+    if (target != sender) {
+        char info_message[256];
+        snprintf(info_message, sizeof(info_message), "[INFO] Aborted connection for ID %d\n", arg_id);
+        conn_send_reply(sender, info_message);
+    }
+
+    if (!target) {
+        printf("[WARN] No connection found with ID %d\n", arg_id);
+        return;
+    }
+    conn_shutdown(target, FRAME_ABORT);
+}
+
+
+/* ==============================================================================================
+ * Job Execution
+ * ==============================================================================================
+ * Forks a job process for one command line. The job inherits the session's working directory,
+ * runs the regular command handler against the client socket and finally writes its working
+ * directory into the completion pipe, so that `cd` keeps working across commands. With -L a
+ * job first needs a slot of the scheduler; until it gets one the line is parked in the
+ * session (queued_line) and the session reads no further input. The event
+ * loop learns about completion from EOF on that pipe and only then reaps the job.
+ *
+ * A job whose output goes to the result cache (-R) also copies it into an unlinked capture
+ * file, headed by the exit status of the pipeline (written before the client gets its END);
+ * once the job has ended, the event loop reads the file into the cache entry and answers the
+ * sessions that waited for it.
+ * ==============================================================================================
+ */
+
+
+static void run_job(event_conn_t *conn, const plan_t *plan) {
+    int done_pipe[2];
+    if (pipe(done_pipe) < 0) {
+        perror("[ERROR] Failed to create job pipe");
+        conn_send_reply(conn, "[ERROR] Server could not start command\n");
+        scheduler_release(&conn->sched);
+        return;
+    }
+    set_cloexec(done_pipe[0]);
+    set_cloexec(done_pipe[1]);
+
+    // Avoid duplicating buffered log output in the job process
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid != 0) drop_input(conn);     // the job has its own copy of the heredoc body
+    if (pid < 0) {
+        perror("[ERROR] Fork failed");
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        conn_send_reply(conn, "[ERROR] Server could not start command\n");
+        scheduler_release(&conn->sched);
+        return;
+    }
+
+    if (pid == 0) {
+        // Job process code
+        close(done_pipe[0]);
+        if (conn->cwd && chdir(conn->cwd) != 0)
+            perror("[ERROR] Cannot restore session directory");
+
+        compress_stats_reset();
+        metrics_attach(conn->metrics_slot);
+        set_session_priority(conn->sched.priority);
+        set_cache_capture(conn->capture_fd);
+        heredoc_set_pending(conn->input_fd);
+        recorder_set_session(conn->id);
+        run_plan(conn->fd, plan);
+
+        // Report the compression counters and the working directory in one atomic write
+        char report[sizeof(compress_stats_t) + PATH_MAX];
+        compress_stats_t stats;
+        compress_stats(&stats);
+        memcpy(report, &stats, sizeof(stats));
+        size_t report_len = sizeof(compress_stats_t);
+        if (getcwd(report + report_len, PIPE_BUF - report_len))
+            report_len += strlen(report + report_len);
+        write(done_pipe[1], report, report_len);
+        exit(0);
+    }
+
+    close(done_pipe[1]);
+    conn->job_pid = pid;
+    conn->job_fd = done_pipe[0];
+    fd_table_set(conn->job_fd, conn);
+    poller_add(poller_fd, conn->job_fd, POLLER_READ);
+    conn_update_interest(conn);
+}
+
+// The plan is compiled (or fetched) by the event loop, so the cache survives the job process
+static void start_job(event_conn_t *conn, const char *line, const plan_t *plan) {
+    if (scheduler_acquire(&conn->sched, -1)) {
+        run_job(conn, plan);
+        return;
+    }
+    conn->queued_line = strdup(line);
+    if (!conn->queued_line) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    conn_update_interest(conn);
+}
+
+// Starts the parked lines of the sessions that get a freed slot. Their plans are looked up
+// again: other lines may have pushed them out of the plan cache while they waited.
+static void grant_waiting(void) {
+    sched_entry_t *entry;
+    while ((entry = scheduler_next()) != NULL) {
+        event_conn_t *conn = entry->owner;
+        char *line = conn->queued_line;
+        conn->queued_line = NULL;
+        conn_update_interest(conn);
+        run_job(conn, plan_lookup(line));
+        free(line);
+    }
+}
+
+static void process_input(event_conn_t *conn);
+
+
+/* ==============================================================================================
+ * Result Cache (-R)
+ * ==============================================================================================
+ * The cache lives in the event loop (result_cache.c). A line that may be cached is answered
+ * from its entry, or parks the session on the entry while another session's job runs the same
+ * command; otherwise the job started for the line fills a new entry.
+ * ==============================================================================================
+ */
+
+
+// Runs the parked line of a session that waited for the cache
+static void resume_line(event_conn_t *conn) {
+    char *line = conn->queued_line;
+    conn->queued_line = NULL;
+    conn_update_interest(conn);
+    start_job(conn, line, plan_lookup(line));
+    free(line);
+}
+
+static void send_cached(event_conn_t *conn, uint32_t stream_id, const cache_entry_t *entry, int status, const char *line) {
+    record_line(conn, line, entry->data, entry->len, status);
+    proto_set_stream(conn->fd, stream_id);
+    metrics_output(entry->len);
+    if (entry->len > 0) {
+        if (!server_options.quiet) fwrite(entry->data, 1, entry->len, stdout);
+        conn_send_frame(conn, FRAME_DATA, entry->data, entry->len);
+    }
+    conn_send_message(conn, FRAME_END, NULL, 0, status);
+}
+
+// Returns 0 if the line needs a job; that job fills a new entry if the line may be cached
+static int answer_cached(event_conn_t *conn, const char *line, const plan_t *plan) {
+    if (plan->count != 1 || plan->steps[0].result == PARSE_ERROR) return 0;
+
+    const pipeline_t *pipeline = &plan->steps[0].pipeline;
+    unsigned ttl_ms = result_cache_ttl(pipeline);
+    char cwd[PATH_MAX];
+    char key[PATH_MAX + EVENT_LINE_MAX];
+    if (ttl_ms == 0 || (!conn->cwd && !getcwd(cwd, sizeof(cwd)))) return 0;
+
+    size_t key_len = result_cache_key(pipeline, conn->cwd ? conn->cwd : cwd, key, sizeof(key));
+    if (key_len == 0) return 0;
+
+    cache_entry_t *entry = result_cache_lookup(key, key_len);
+    if (entry && entry->ready) {
+        metrics_attach(conn->metrics_slot);
+        metrics_command_begin(pipeline->stages[0].argv[0]);
+        send_cached(conn, proto_get_stream(conn->fd), entry, 0, line);
+        metrics_command_end();
+        return 1;
+    }
+    if (entry) {
+        // Another session's job runs the same command: the line waits for its output
+        conn->queued_line = strdup(line);
+        if (!conn->queued_line) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        result_cache_wait(entry, conn, proto_get_stream(conn->fd));
+        conn->cache_entry = entry;
+        conn_update_interest(conn);
+        return 1;
+    }
+
+    conn->capture_fd = jobs_spool();
+    if (conn->capture_fd < 0) return 0;
+    conn->cache_entry = result_cache_begin(key, key_len, ttl_ms);
+    conn->cache_filling = 1;
+    return 0;
+}
+
+// Reads the capture file of the ended job into the entry. Returns the exit status the job
+// wrote in front of the output, -1 if it is not to be kept, -2 if the output was too large.
+static int read_capture(event_conn_t *conn) {
+    char buf[65536];
+    ssize_t bytes;
+    int status = -1;
+
+    if (pread(conn->capture_fd, &status, sizeof(status), 0) != sizeof(status)) return -1;
+    if (status < 0) return status;
+    if (lseek(conn->capture_fd, sizeof(status), SEEK_SET) < 0) return -1;
+    while ((bytes = read(conn->capture_fd, buf, sizeof(buf))) != 0) {
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) return -1;
+        if (result_cache_append(conn->cache_entry, buf, bytes) < 0) return -2;
+    }
+    return status;
+}
+
+// The job filling an entry has ended: its waiters get the output, or run the line themselves
+// if it could not be captured
+static void finish_capture(event_conn_t *conn) {
+    cache_entry_t *entry = conn->cache_entry;
+    if (!entry || !conn->cache_filling) return;
+
+    int status = read_capture(conn);
+    int kept = (status >= 0);
+    close(conn->capture_fd);
+    conn->capture_fd = -1;
+    conn->cache_entry = NULL;
+    conn->cache_filling = 0;
+
+    cache_waiter_t *waiters = kept ? result_cache_finish(entry, status)
+                                   : result_cache_abandon(entry, status == -2);
+    for (cache_waiter_t *waiter = waiters; waiter; waiter = waiter->next) {
+        event_conn_t *waiting = waiter->owner;
+        waiting->cache_entry = NULL;
+        if (!kept) {
+            resume_line(waiting);
+            continue;
+        }
+        metrics_attach(waiting->metrics_slot);
+        send_cached(waiting, waiter->stream_id, entry, status, waiting->queued_line);
+        free(waiting->queued_line);
+        waiting->queued_line = NULL;
+        conn_update_interest(waiting);
+    }
+    if (kept) result_cache_settle(entry);
+
+    // Serving a waiter can close its session, so their input is processed afterwards
+    for (cache_waiter_t *waiter = waiters; waiter; waiter = waiter->next) {
+        event_conn_t *waiting = waiter->owner;
+        if (kept) process_input(waiting);
+    }
+    result_cache_free_waiters(waiters);
+}
+
+// A session that goes away leaves the entry it waits for; the one its job fills goes to the
+// first waiter, which then runs the command itself
+static void cache_forget(event_conn_t *conn) {
+    cache_entry_t *entry = conn->cache_entry;
+    if (!entry) return;
+    conn->cache_entry = NULL;
+    if (conn->capture_fd >= 0) close(conn->capture_fd);
+    conn->capture_fd = -1;
+    if (!conn->cache_filling) {
+        result_cache_unwait(entry, conn);
+        return;
+    }
+
+    conn->cache_filling = 0;
+    cache_waiter_t *next_filler = result_cache_handover(entry);
+    if (!next_filler) return;
+    event_conn_t *successor = next_filler->owner;
+    free(next_filler);
+
+    successor->capture_fd = jobs_spool();
+    successor->cache_filling = 1;
+    resume_line(successor);
+}
+
+static void finish_job(event_conn_t *conn) {
+    char report[sizeof(compress_stats_t) + PATH_MAX];
+    ssize_t bytes = read(conn->job_fd, report, sizeof(report) - 1);
+
+    if (bytes > 0) {
+        // The job reported its counters and working directory; EOF follows when it exits
+        compress_stats_t stats;
+        if ((size_t)bytes < sizeof(stats)) return;
+        memcpy(&stats, report, sizeof(stats));
+        compress_stats_add(&stats);
+        if ((size_t)bytes > sizeof(compress_stats_t)) {
+            report[bytes] = '\0';
+            free(conn->cwd);
+            conn->cwd = strdup(report + sizeof(compress_stats_t));
+        }
+        return;
+    }
+    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    poller_del(poller_fd, conn->job_fd);
+    fd_table_set(conn->job_fd, NULL);
+    close(conn->job_fd);
+    waitpid(conn->job_pid, NULL, 0);
+
+    conn->job_fd = -1;
+    conn->job_pid = 0;
+    conn_update_interest(conn);
+    scheduler_release(&conn->sched);
+    grant_waiting();
+    finish_capture(conn);
+    if (conn->closing_frame) {
+        send_closing_frames(conn, conn->closing_frame);
+        return;
+    }
+
+    // Commands that arrived while the job was running are now processed in order
+    process_input(conn);
+}
+
+
+/* ==============================================================================================
+ * Input Processing
+ * ==============================================================================================
+ * Splits the session's input buffer into commands - text lines for legacy clients, COMMAND
+ * frames for framed ones - and dispatches them one at a time. Dispatching stops as soon as a
+ * job is started; the remaining commands wait for its completion. The very first bytes of a
+ * connection decide the protocol, exactly like read_session_command() in the forking server.
+ * ==============================================================================================
+ */
+
+
+// Returns 0 when the session was closed while handling the line
+static int dispatch_line(event_conn_t *conn, char *line) {
+    printf("[INFO] (ID %d) Command from client: %s\n", conn->id, line);
+
+    if (strncmp(line, "stat", 4) == 0) {
+        handle_stat(conn, stat_verbose(line));
+    } else if (strncmp(line, "abort ", 6) == 0) {
+        int arg_id = atoi(line + 6);
+        int aborted_self = (arg_id == conn->id);
+        handle_abort(conn, arg_id);
+        if (aborted_self) return 0;
+    } else if (strncmp(line, "quit", 4) == 0) {
+        conn_shutdown(conn, FRAME_QUIT);
+        return 0;
+    } else if (strncmp(line, "priority", 8) == 0 && (line[8] == '\0' || line[8] == ' ')) {
+        // The class belongs to the session, which outlives the jobs
+        const plan_t *plan = plan_lookup(line);
+        char reply[256];
+        if (plan->count == 1 && plan->steps[0].pipeline.count == 1) {
+            int status = scheduler_priority_command(plan->steps[0].pipeline.stages[0].argv, &conn->sched.priority,
+                                                    reply, sizeof(reply));
+            conn_send_message(conn, FRAME_DATA, reply, strlen(reply), 0);
+            conn_send_message(conn, FRAME_END, NULL, 0, status);
+        } else {
+            strcat(line, "\n");
+            start_job(conn, line, plan);
+        }
+    } else if (strncmp(line, "hash", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+        // The path cache lives in this process; a job would only reset its own copy
+        const plan_t *plan = plan_lookup(line);
+        char reply[4096];
+        if (plan->count == 1 && plan->steps[0].pipeline.count == 1) {
+            hash_builtin(plan->steps[0].pipeline.stages[0].argv, reply, sizeof(reply));
+            conn_send_reply(conn, reply);
+        } else {
+            strcat(line, "\n");
+            start_job(conn, line, plan);
+        }
+    } else {
+        // One lookup per line: the answers below share the plan
+        strcat(line, "\n");
+        const plan_t *plan = plan_lookup(line);
+        if (!answer_builtin(conn, line, plan) && !answer_cached(conn, line, plan)) start_job(conn, line, plan);
+    }
+    return 1;
+}
+
+// Extracts the next legacy text line; returns 0 if no complete line is buffered yet
+static int next_text_line(event_conn_t *conn, char *line) {
+    char *newline = memchr(conn->in_buf, '\n', conn->in_len);
+    size_t line_len;
+
+    if (newline) {
+        line_len = newline - conn->in_buf;
+    } else if (conn->in_len >= EVENT_LINE_MAX) {
+        // Overlong line: run what fits, like a single read() of the forking server
+        line_len = EVENT_LINE_MAX;
+    } else {
+        return 0;
+    }
+
+    memcpy(line, conn->in_buf, line_len);
+    line[line_len] = '\0';
+
+    size_t consumed = newline ? line_len + 1 : line_len;
+    memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    return 1;
+}
+
+// Extracts the next COMMAND frame, collecting the heredoc body sent ahead of it; returns 0 if
+// incomplete, -1 on a protocol violation
+static int next_command_frame(event_conn_t *conn, char *line) {
+    frame_header_t header;
+    long frame_len = proto_parse_frame(conn->in_buf, conn->in_len, &header);
+    if (frame_len < 0) return -1;
+    if (frame_len == 0) {
+        if (conn->in_len >= PROTO_HEADER_SIZE && header.length > PROTO_MAX_COMMAND) return -1;
+        return 0;
+    }
+
+    int is_command = (header.type == FRAME_COMMAND);
+    if (is_command) {
+        memcpy(line, conn->in_buf + PROTO_HEADER_SIZE, header.length);
+        line[header.length] = '\0';
+        line[strcspn(line, "\n")] = '\0';
+        proto_set_stream(conn->fd, header.stream_id);
+    } else if (header.type == FRAME_STDIN
+               && heredoc_append(&conn->input_fd, conn->in_buf + PROTO_HEADER_SIZE, header.length) < 0) {
+        perror("[ERROR] Cannot store command input");
+    }
+
+    memmove(conn->in_buf, conn->in_buf + frame_len, conn->in_len - frame_len);
+    conn->in_len -= frame_len;
+
+    // Frames other than commands are skipped
+    if (!is_command) line[0] = '\0';
+    return is_command ? 1 : 2;
+}
+
+// A job writes to the client socket directly, so nothing may start while answers of the loop
+// itself are still queued in out_buf; conn_flush() continues once they are sent
+static void process_input(event_conn_t *conn) {
+    while (conn->job_pid == 0 && !conn->queued_line && !conn->close_after_flush && conn->out_len == 0
+           && conn->in_len > 0) {
+        char line[PROTO_MAX_COMMAND + 2];
+
+        if (!conn->negotiated) {
+            // Wait until it is clear whether the first message is a hello frame
+            if (conn->in_len < PROTO_HEADER_SIZE && conn->in_buf[0] == ((PROTO_MAGIC >> 8) & 0xFF)) break;
+
+            // Hello frames carry no payload, capabilities travel in the header flags
+
+            conn->negotiated = 1;
+            if (proto_is_hello(conn->in_buf, conn->in_len)) {
+                // Nothing has been queued for the session yet, so the reply can go out directly
+                accept_session_hello(conn->fd, conn->in_buf);
+                memmove(conn->in_buf, conn->in_buf + PROTO_HEADER_SIZE, conn->in_len - PROTO_HEADER_SIZE);
+                conn->in_len -= PROTO_HEADER_SIZE;
+                continue;
+            }
+        }
+
+        if (proto_get_mode(conn->fd) == PROTO_FRAMED) {
+            int result = next_command_frame(conn, line);
+            if (result < 0) {
+                printf("[WARN] Protocol error on connection ID %d, closing\n", conn->id);
+                conn_close(conn);
+                return;
+            }
+            if (result == 0) break;
+            if (result == 2) continue;
+
+            // A framed client waits for an answer even for an empty command
+            if (line[0] == '\0') {
+                drop_input(conn);
+                conn_send_frame(conn, FRAME_END, NULL, 0);
+                continue;
+            }
+        } else {
+            if (!next_text_line(conn, line)) break;
+            if (line[0] == '\0') continue;
+        }
+
+        if (!dispatch_line(conn, line)) return;
+
+        // Answered by the event loop itself: the line's heredoc body is not needed
+        if (conn->job_pid == 0 && !conn->queued_line) drop_input(conn);
+    }
+    conn_update_interest(conn);     // reading resumes once a full buffer has room again
+}
+
+static void conn_read(event_conn_t *conn) {
+    // Nothing fits until a line is consumed (a receive of 0 bytes would look like EOF)
+    if (conn->in_len == sizeof(conn->in_buf)) {
+        conn_update_interest(conn);
+        return;
+    }
+    ssize_t bytes = recv(conn->fd, conn->in_buf + conn->in_len,
+                         sizeof(conn->in_buf) - conn->in_len, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (bytes <= 0) {
+        printf("[INFO] Client disconnected (ID %d).\n", conn->id);
+        conn_close(conn);
+        return;
+    }
+    conn->in_len += bytes;
+    conn->last_input = time(NULL);
+    metrics_input(conn->metrics_slot, bytes);
+    process_input(conn);
+}
+
+static void conn_flush(event_conn_t *conn) {
+    while (conn->out_len > 0) {
+        ssize_t sent = send(conn->fd, conn->out_buf, conn->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            conn->out_len = 0;
+            break;
+        }
+        memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+        conn->out_len -= sent;
+    }
+
+    if (conn->close_after_flush && !conn->closing_frame) {
+        conn_close(conn);
+        return;
+    }
+    conn_update_interest(conn);
+    if (conn->out_len == 0) process_input(conn);
+}
+
+
+// -o idle=: closes sessions that neither sent anything nor had a command running for that long
+static void close_idle_sessions(int timeout) {
+    time_t now = time(NULL);
+    event_conn_t *conn = conn_list;
+    while (conn) {
+        event_conn_t *next = conn->next;
+        if (conn->job_pid == 0 && !conn->queued_line && now - conn->last_input >= timeout) {
+            printf("[INFO] Client idle for %d seconds, closing (ID %d).\n", timeout, conn->id);
+            conn_close(conn);
+        }
+        conn = next;
+    }
+}
+
+
+/* ==============================================================================================
+ * Main Event Loop
+ * ==============================================================================================
+ */
+
+
+void event_server_loop(int server_fd) {
+    poller_fd = poller_create();
+    if (poller_fd < 0) {
+        perror("[ERROR] Failed to create poller");
+        exit(1);
+    }
+
+    // Accept in a loop until EAGAIN, so a burst of clients is drained in one wakeup
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    set_cloexec(server_fd);
+    poller_add(poller_fd, server_fd, POLLER_READ);
+    if (metrics_admin_fd() >= 0) poller_add(poller_fd, metrics_admin_fd(), POLLER_READ);
+
+    printf("[INFO] Event mode: serving all clients from PID %d\n", getpid());
+
+    // With an idle timeout the loop wakes up every second to look for idle sessions
+    int idle_timeout = sockopt_idle_timeout();
+    time_t last_sweep = time(NULL);
+
+    poller_event_t events[EVENT_MAX_EVENTS];
+    while (1) {
+        fflush(stdout);
+        if (idle_timeout && time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            close_idle_sessions(idle_timeout);
+        }
+        int ready = poller_wait(poller_fd, events, EVENT_MAX_EVENTS, idle_timeout ? 1000 : -1);
+        if (ready < 0) {
+            if (errno != EINTR) perror("[ERROR] poller_wait failed");
+            continue;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].fd;
+
+            if (fd == server_fd) {
+                conn_accept(server_fd);
+                continue;
+            }
+            if (fd == metrics_admin_fd()) {
+                metrics_admin_serve();
+                continue;
+            }
+
+            // The session may have been closed by an earlier event of this batch
+            event_conn_t *conn = fd_table_get(fd);
+            if (!conn) continue;
+
+            if (fd == conn->job_fd) {
+                finish_job(conn);
+                continue;
+            }
+            if (events[i].events & POLLER_WRITE) {
+                conn_flush(conn);
+                if (fd_table_get(fd) != conn) continue;
+            }
+            if (events[i].events & POLLER_READ)
+                conn_read(conn);
+        }
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef MYSHELL_EVENT_SERVER_H
+#define MYSHELL_EVENT_SERVER_H
+
+void event_server_loop(int server_fd);
+
+#endif //MYSHELL_EVENT_SERVER_H
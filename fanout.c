@@ -0,0 +1,531 @@
+/* ==============================================================================================
+ * Fan-out Client
+ * ==============================================================================================
+ *
+ * Runs one command on many servers at once: `./shell -c -H hosts.txt "uptime; df -h"`.
+ *
+ * The hosts file lists one server per line, as `host`, `host:port`, `[ipv6]:port` or the path
+ * of a UNIX socket (starting with '/'); blank lines and lines starting with '#' are ignored.
+ * Hosts without a port use the one given with -p.
+ *
+ * All connections are driven from one poller (epoll/kqueue) loop, at most -N of them at a
+ * time (default FANOUT_DEFAULT_CONNECTIONS): a non-blocking connect(), the protocol hello,
+ * the command and then the response. Every output line is printed with the host it came from
+ * as prefix, as soon as the line is complete. Hosts that cannot be reached within
+ * FANOUT_CONNECT_TIMEOUT seconds, or that close the connection early, are reported with an
+ * [ERROR] line. The exit code is 0 only if every host ran the command with exit status 0.
+ *
+ * Framed servers get the command as a COMMAND frame; legacy servers are detected the same way
+ * as by proto_client_hello() and get it as a plain text line. With -T, TCP hosts are reached
+ * over TLS; a relay process makes the handshake (tls.c), so the loop never waits for one.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "poller.h"
+#include "protocol.h"
+#include "compress.h"
+#include "fanout.h"
+#include "tls.h"
+#include "sockopt.h"
+
+#define FANOUT_CONNECT_TIMEOUT 10   // seconds for connect() and the protocol hello
+#define FANOUT_MAX_EVENTS 256
+
+enum {
+    HOST_PENDING = 0,               // not started yet
+    HOST_CONNECTING = 1,            // non-blocking connect() in progress
+    HOST_HELLO = 2,                 // hello sent, waiting for the server's answer
+    HOST_LEGACY_HELLO = 3,          // legacy server: discarding its response to the hello
+    HOST_RUNNING = 4,               // command sent, reading the response
+    HOST_DONE = 5
+};
+
+typedef struct {
+    char *name;                     // as listed in the hosts file
+    char *tls_name;                 // server name for TLS (-T), NULL for UNIX sockets
+    int tls_port;
+    int fd;
+    int state;                      // HOST_*
+    int mode;                       // PROTO_LEGACY / PROTO_FRAMED
+    int status;                     // exit status reported by the server, -1 = failed
+    time_t deadline;                // end of the connect/hello phase
+
+    char *in;                       // received bytes not processed yet
+    size_t in_len;
+    size_t in_cap;
+    char *line;                     // output line not complete yet
+    size_t line_len;
+    size_t line_cap;
+} fanout_host_t;
+
+static int name_width = 0;          // longest host name, for aligned prefixes
+static fanout_host_t **fd_hosts;    // host owning each open descriptor
+static int fd_hosts_cap = 0;
+
+
+static void *grow(void *ptr, size_t size) {
+    void *grown = realloc(ptr, size);
+    if (!grown) {
+        perror("[CLIENT] Memory allocation failed");
+        exit(1);
+    }
+    return grown;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const char *data, size_t size) {
+    if (*len + size > *cap) {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (new_cap < *len + size) new_cap *= 2;
+        *buf = grow(*buf, new_cap);
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+}
+
+static const char *find_marker(const char *buf, size_t len, const char *marker) {
+    size_t marker_len = strlen(marker);
+    for (size_t i = 0; i + marker_len <= len; i++) {
+        if (buf[i] == marker[0] && memcmp(buf + i, marker, marker_len) == 0)
+            return buf + i;
+    }
+    return NULL;
+}
+
+
+/* ==============================================================================================
+ * Output
+ * ==============================================================================================
+ */
+
+
+static void print_line(const fanout_host_t *host, const char *text, size_t len) {
+    printf("%-*s | %.*s\n", name_width, host->name, (int)len, text);
+}
+
+// Prints every complete line of the host's output, keeping the last partial one
+static void host_output(fanout_host_t *host, const char *data, size_t len) {
+    append(&host->line, &host->line_len, &host->line_cap, data, len);
+
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(host->line + start, '\n', host->line_len - start))) {
+        print_line(host, host->line + start, newline - (host->line + start));
+        start = newline - host->line + 1;
+    }
+    memmove(host->line, host->line + start, host->line_len - start);
+    host->line_len -= start;
+}
+
+static void host_finish(int poller_fd, fanout_host_t *host, const char *error) {
+    if (host->line_len > 0) print_line(host, host->line, host->line_len);
+    host->line_len = 0;
+
+    if (error) {
+        char message[512];
+        snprintf(message, sizeof(message), "[ERROR] %s", error);
+        print_line(host, message, strlen(message));
+        host->status = -1;
+    }
+    fflush(stdout);
+
+    if (host->fd >= 0) {
+        fd_hosts[host->fd] = NULL;
+        poller_del(poller_fd, host->fd);
+        proto_forget(host->fd);
+        close(host->fd);
+        host->fd = -1;
+    }
+    free(host->in);
+    free(host->line);
+    host->in = host->line = NULL;
+    host->in_len = host->in_cap = host->line_cap = 0;
+    host->state = HOST_DONE;
+}
+
+
+/* ==============================================================================================
+ * Connecting
+ * ==============================================================================================
+ */
+
+
+static void track_fd(fanout_host_t *host) {
+    if (host->fd >= fd_hosts_cap) {
+        int cap = fd_hosts_cap ? fd_hosts_cap : 256;
+        while (cap <= host->fd) cap *= 2;
+        fd_hosts = grow(fd_hosts, cap * sizeof(fanout_host_t *));
+        memset(fd_hosts + fd_hosts_cap, 0, (cap - fd_hosts_cap) * sizeof(fanout_host_t *));
+        fd_hosts_cap = cap;
+    }
+    fd_hosts[host->fd] = host;
+}
+
+// Starts a non-blocking connect; returns an error message or NULL
+static const char *host_connect(fanout_host_t *host, int default_port) {
+    struct sockaddr_un unix_addr;
+    struct addrinfo hints, *result = NULL;
+    const struct sockaddr *addr;
+    socklen_t addr_len;
+    int family;
+
+    if (host->name[0] == '/') {
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, host->name, sizeof(unix_addr.sun_path) - 1);
+        addr = (struct sockaddr *)&unix_addr;
+        addr_len = sizeof(unix_addr);
+        family = AF_UNIX;
+    } else {
+        char name[256], port[16];
+        const char *colon;
+
+        // [ipv6]:port, host:port or host
+        if (host->name[0] == '[' && strchr(host->name, ']')) {
+            const char *end = strchr(host->name, ']');
+            snprintf(name, sizeof(name), "%.*s", (int)(end - host->name - 1), host->name + 1);
+            colon = (end[1] == ':') ? end + 1 : NULL;
+        } else {
+            colon = strrchr(host->name, ':');
+            snprintf(name, sizeof(name), "%.*s", colon ? (int)(colon - host->name) : (int)strlen(host->name),
+                     host->name);
+        }
+        if (colon) snprintf(port, sizeof(port), "%s", colon + 1);
+        else if (default_port > 0) snprintf(port, sizeof(port), "%d", default_port);
+        else return "no port (use host:port or -p)";
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(name, port, &hints, &result);
+        if (rc != 0) return gai_strerror(rc);
+        host->tls_name = grow(NULL, strlen(name) + 1);
+        strcpy(host->tls_name, name);
+        host->tls_port = atoi(port);
+        addr = result->ai_addr;
+        addr_len = result->ai_addrlen;
+        family = result->ai_family;
+    }
+
+    host->fd = socket(family, SOCK_STREAM, 0);
+    if (host->fd < 0) {
+        if (result) freeaddrinfo(result);
+        return strerror(errno);
+    }
+    fcntl(host->fd, F_SETFL, O_NONBLOCK);
+    fcntl(host->fd, F_SETFD, FD_CLOEXEC);
+    track_fd(host);
+    if (family != AF_UNIX) sockopt_connection(host->fd);
+
+    int rc = connect(host->fd, addr, addr_len);
+    int error = errno;
+    if (result) freeaddrinfo(result);
+    if (rc < 0 && error != EINPROGRESS) return strerror(error);
+
+    host->state = HOST_CONNECTING;
+    host->deadline = time(NULL) + FANOUT_CONNECT_TIMEOUT;
+    return NULL;
+}
+
+static const char *host_send_hello(int poller_fd, fanout_host_t *host) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(host->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+    if (error) return strerror(error);
+
+    // TLS (-T): a relay process makes the handshake, everything goes through its socketpair
+    if (host->tls_name && tls_configured()) {
+        fd_hosts[host->fd] = NULL;
+        poller_del(poller_fd, host->fd);
+        host->fd = tls_connect_detached(host->fd, host->tls_name, host->tls_port);
+        if (host->fd < 0) return "TLS relay failed";
+        fcntl(host->fd, F_SETFL, O_NONBLOCK);
+        track_fd(host);
+        if (poller_add(poller_fd, host->fd, POLLER_WRITE) < 0) return strerror(errno);
+    }
+
+    // Raw streams are not requested: every byte of output has to pass through the prefixer
+    if (proto_send_hello(host->fd, compress_supported()) < 0) return strerror(errno);
+    host->state = HOST_HELLO;
+    return NULL;
+}
+
+static const char *host_send_command(fanout_host_t *host, const char *command) {
+    proto_set_mode(host->fd, host->mode);
+    if (proto_send_command(host->fd, host->mode, 1, command, strlen(command)) < 0) return strerror(errno);
+    host->state = HOST_RUNNING;
+    return NULL;
+}
+
+
+/* ==============================================================================================
+ * Responses
+ * ==============================================================================================
+ * Processes the received bytes of a host according to its state. Returns an error message,
+ * or NULL; the host is finished when its state has become HOST_DONE.
+ * ==============================================================================================
+ */
+
+
+static const char *host_process(int poller_fd, fanout_host_t *host, const char *command) {
+    frame_header_t header;
+    size_t done = 0;
+    const char *error = NULL;
+
+    if (host->state == HOST_HELLO) {
+        if (host->in_len < PROTO_HEADER_SIZE && host->in[0] == ((PROTO_MAGIC >> 8) & 0xFF)
+            && !find_marker(host->in, host->in_len, "[END]"))
+            return NULL;
+
+        if (proto_is_hello(host->in, host->in_len)) {
+            host->mode = PROTO_FRAMED;
+            done = PROTO_HEADER_SIZE;
+            error = host_send_command(host, command);
+        } else {
+            host->mode = PROTO_LEGACY;
+            host->state = HOST_LEGACY_HELLO;
+        }
+    }
+
+    if (!error && host->state == HOST_LEGACY_HELLO) {
+        // The legacy server ran the hello as a command: drop its response, including what
+        // follows the marker in the same read (as proto_client_hello() does)
+        const char *end = find_marker(host->in + done, host->in_len - done, "[END]");
+        if (end) {
+            done = host->in_len;
+            error = host_send_command(host, command);
+        } else {
+            done = host->in_len > 4 ? host->in_len - 4 : 0;
+        }
+    }
+
+    while (!error && host->state == HOST_RUNNING && done < host->in_len) {
+        const char *data = host->in + done;
+        size_t len = host->in_len - done;
+
+        if (host->mode == PROTO_LEGACY) {
+            const char *end = find_marker(data, len, "[END]");
+            size_t keep = (!end && len > 4) ? 4 : (end ? 0 : len);
+            size_t take = end ? (size_t)(end - data) : len - keep;
+            host_output(host, data, take);
+            done += take;
+            if (end) {
+                host->status = 0;
+                host_finish(poller_fd, host, NULL);
+                return NULL;
+            }
+            break;
+        }
+
+        long frame = proto_parse_frame(data, len, &header);
+        if (frame == 0) break;
+        if (frame < 0) {
+            error = "protocol error";
+            break;
+        }
+        done += frame;
+
+        switch (header.type) {
+            case FRAME_DATA:
+                if (header.flags != 0) {
+                    const char *output = compress_unpack(header.flags, data + PROTO_HEADER_SIZE,
+                                                         header.length, (uint32_t)header.status);
+                    if (!output) {
+                        error = "corrupt compressed output";
+                        break;
+                    }
+                    host_output(host, output, (uint32_t)header.status);
+                } else {
+                    host_output(host, data + PROTO_HEADER_SIZE, header.length);
+                }
+                break;
+            case FRAME_END:
+                host->status = header.status;
+                host_finish(poller_fd, host, NULL);
+                return NULL;
+            case FRAME_HALT:
+                host_output(host, "[INFO] Server halted.\n", 22);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (host->state != HOST_DONE) {
+        memmove(host->in, host->in + done, host->in_len - done);
+        host->in_len -= done;
+    }
+    return error;
+}
+
+static void host_read(int poller_fd, fanout_host_t *host, const char *command) {
+    char buf[16384];
+
+    while (host->state != HOST_DONE) {
+        ssize_t bytes = read(host->fd, buf, sizeof(buf));
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            host_finish(poller_fd, host, strerror(errno));
+            return;
+        }
+        if (bytes == 0) {
+            host_finish(poller_fd, host, "connection closed before the command completed");
+            return;
+        }
+
+        append(&host->in, &host->in_len, &host->in_cap, buf, bytes);
+        const char *error = host_process(poller_fd, host, command);
+        if (error) host_finish(poller_fd, host, error);
+    }
+}
+
+
+/* ==============================================================================================
+ * Hosts File
+ * ==============================================================================================
+ */
+
+
+static fanout_host_t *load_hosts(const char *filename, size_t *count) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("[CLIENT] Cannot open hosts file");
+        return NULL;
+    }
+
+    fanout_host_t *hosts = NULL;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+
+    *count = 0;
+    while ((len = getline(&line, &line_cap, file)) >= 0) {
+        char *name = line + strspn(line, " \t");
+        len = strcspn(name, " \t\r\n#");
+        if (len == 0) continue;
+        name[len] = '\0';
+
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            hosts = grow(hosts, cap * sizeof(fanout_host_t));
+        }
+        fanout_host_t *host = &hosts[(*count)++];
+        memset(host, 0, sizeof(fanout_host_t));
+        host->name = grow(NULL, len + 1);
+        memcpy(host->name, name, len + 1);
+        host->fd = -1;
+        if ((int)len > name_width) name_width = len;
+    }
+
+    free(line);
+    fclose(file);
+    return hosts;
+}
+
+
+/* ==============================================================================================
+ * Event Loop
+ * ==============================================================================================
+ */
+
+
+int run_fanout_client(const char *hosts_file, int default_port, int max_connections, const char *command) {
+    size_t count;
+    fanout_host_t *hosts = load_hosts(hosts_file, &count);
+    if (!hosts) return 1;
+    if (max_connections <= 0) max_connections = FANOUT_DEFAULT_CONNECTIONS;
+
+    // A host that went away is reported as failed, it must not kill the client
+    signal(SIGPIPE, SIG_IGN);
+
+    int poller_fd = poller_create();
+    if (poller_fd < 0) {
+        perror("[CLIENT] Poller creation failed");
+        return 1;
+    }
+
+    poller_event_t events[FANOUT_MAX_EVENTS];
+    size_t next = 0, finished = 0;
+    int active = 0;
+
+    while (finished < count) {
+        // Start more hosts while below the concurrency cap
+        while (next < count && active < max_connections) {
+            fanout_host_t *host = &hosts[next++];
+            const char *error = host_connect(host, default_port);
+            if (!error && poller_add(poller_fd, host->fd, POLLER_WRITE) < 0) error = strerror(errno);
+            if (error) {
+                host_finish(poller_fd, host, error);
+                finished++;
+                continue;
+            }
+            active++;
+        }
+
+        int ready = poller_wait(poller_fd, events, FANOUT_MAX_EVENTS, 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("[CLIENT] Poller wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            fanout_host_t *host = events[i].fd < fd_hosts_cap ? fd_hosts[events[i].fd] : NULL;
+            if (!host) continue;   // finished earlier in this round
+
+            if (host->state == HOST_CONNECTING) {
+                const char *error = host_send_hello(poller_fd, host);
+                if (!error && poller_mod(poller_fd, host->fd, POLLER_READ) < 0) error = strerror(errno);
+                if (error) host_finish(poller_fd, host, error);
+            } else {
+                host_read(poller_fd, host, command);
+            }
+
+            if (host->state == HOST_DONE) {
+                active--;
+                finished++;
+            }
+        }
+
+        // Hosts that did not connect or answer the hello in time
+        time_t now = time(NULL);
+        for (size_t k = 0; k < next; k++) {
+            fanout_host_t *host = &hosts[k];
+            if ((host->state == HOST_CONNECTING || host->state == HOST_HELLO) && now >= host->deadline) {
+                host_finish(poller_fd, host, "connection timed out");
+                active--;
+                finished++;
+            }
+        }
+    }
+
+    size_t failed = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (hosts[k].status != 0) failed++;
+        free(hosts[k].name);
+        free(hosts[k].tls_name);
+    }
+    fprintf(stderr, "[CLIENT] %zu hosts, %zu succeeded, %zu failed\n", count, count - failed, failed);
+
+    free(hosts);
+    free(fd_hosts);
+    fd_hosts = NULL;
+    fd_hosts_cap = 0;
+    close(poller_fd);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+#ifndef MYSHELL_FANOUT_H
+#define MYSHELL_FANOUT_H
+
+#define FANOUT_DEFAULT_CONNECTIONS 64   // -N default: hosts served at the same time
+
+int run_fanout_client(const char *hosts_file, int default_port, int max_connections, const char *command);
+
+#endif //MYSHELL_FANOUT_H
@@ -0,0 +1,191 @@
+/* ==============================================================================================
+ * Output Forwarding Module
+ * ==============================================================================================
+ *
+ * Moves the output of a pipeline from its result pipe to the client socket and, optionally,
+ * mirrors it to the server's stdout.
+ *
+ * On Linux the data never enters user space: splice(2) moves pipe pages straight into the
+ * socket, and when mirroring is enabled tee(2) first duplicates them into a second pipe that is
+ * spliced to stdout. For framed sessions the amount of data waiting in the pipe (FIONREAD) is
+ * announced in a DATA header before the corresponding bytes are spliced behind it.
+ *
+ * On other systems (FreeBSD) and whenever the kernel refuses to splice a descriptor, output is
+ * copied through a large reusable buffer instead of the former 4 KB chunks. Connections with
+ * negotiated compression always take the copy path, the data has to pass the compressor.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "compress.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "forward.h"
+
+#define FORWARD_BUF_SIZE (256 * 1024)
+#define FORWARD_PIPE_SIZE (1024 * 1024)
+
+static char forward_buf[FORWARD_BUF_SIZE];
+
+
+/* ==============================================================================================
+ * Buffered Copy (portable fallback)
+ * ==============================================================================================
+ */
+
+
+static ssize_t copy_forward(int src_fd, int client_fd, int mirror_stdout, forward_tap_t tap) {
+    ssize_t total = 0, bytes_read;
+
+    while ((bytes_read = read(src_fd, forward_buf, sizeof(forward_buf))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return total > 0 ? total : -1;
+        }
+        if (mirror_stdout)
+            fwrite(forward_buf, 1, bytes_read, stdout);
+        if (client_fd > 0) {
+            metrics_output(bytes_read);
+            proto_send_data(client_fd, forward_buf, bytes_read);
+        }
+        if (tap) tap(forward_buf, bytes_read);
+        total += bytes_read;
+    }
+    return total;
+}
+
+
+#if defined(__linux__)
+
+/* ==============================================================================================
+ * Zero-copy Path (Linux splice / tee)
+ * ==============================================================================================
+ */
+
+
+// Moves exactly len bytes out of the pipe src_fd; falls back to copying if splice is refused
+static int move_bytes(int src_fd, int dst_fd, size_t len, int *can_splice) {
+    while (len > 0) {
+        ssize_t moved;
+
+        if (*can_splice) {
+            moved = splice(src_fd, NULL, dst_fd, NULL, len, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // e.g. stdout is a terminal - copy from now on
+                *can_splice = 0;
+                continue;
+            }
+            if (moved <= 0) return -1;
+        } else {
+            size_t want = len < sizeof(forward_buf) ? len : sizeof(forward_buf);
+            moved = read(src_fd, forward_buf, want);
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved <= 0) return -1;
+            if (proto_write_all(dst_fd, forward_buf, moved) < 0) return -1;
+        }
+        len -= moved;
+    }
+    return 0;
+}
+
+static ssize_t splice_forward(int src_fd, int client_fd, int mirror_stdout) {
+    int mirror_pipe[2] = { -1, -1 };
+    int client_splice = 1, stdout_splice = 1;
+    int framed = (proto_get_mode(client_fd) == PROTO_FRAMED);
+    ssize_t total = 0;
+
+    if (mirror_stdout) {
+        if (pipe(mirror_pipe) < 0) return copy_forward(src_fd, client_fd, mirror_stdout, NULL);
+        // Buffered log lines must reach stdout before the spliced output
+        fflush(stdout);
+    }
+
+    // Larger pipe buffers mean fewer wakeups per megabyte (best effort, may exceed the limit)
+    fcntl(src_fd, F_SETPIPE_SZ, FORWARD_PIPE_SIZE);
+
+    while (1) {
+        struct pollfd pfd = { src_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int available = 0;
+        if (ioctl(src_fd, FIONREAD, &available) < 0) break;
+        if (available == 0) {
+            if (pfd.revents & (POLLHUP | POLLERR)) break;   // writers closed and pipe drained
+            continue;
+        }
+
+        size_t chunk = available;
+        if (mirror_stdout) {
+            // Duplicate the pages for stdout without consuming them from the result pipe
+            ssize_t copied = tee(src_fd, mirror_pipe[1], chunk, 0);
+            if (copied <= 0) break;
+            chunk = copied;
+        }
+
+        metrics_output(chunk);
+        if (framed) {
+            unsigned char header_buf[PROTO_HEADER_SIZE];
+            frame_header_t header = {0};
+            header.type = FRAME_DATA;
+            header.stream_id = proto_get_stream(client_fd);
+            header.length = chunk;
+            proto_encode_header(header_buf, &header);
+            if (proto_write_all(client_fd, header_buf, PROTO_HEADER_SIZE) < 0) break;
+        }
+
+        if (move_bytes(src_fd, client_fd, chunk, &client_splice) < 0) break;
+        if (mirror_stdout && move_bytes(mirror_pipe[0], STDOUT_FILENO, chunk, &stdout_splice) < 0) break;
+        total += chunk;
+    }
+
+    if (mirror_stdout) {
+        close(mirror_pipe[0]);
+        close(mirror_pipe[1]);
+    }
+    return total;
+}
+
+#endif
+
+
+/* ==============================================================================================
+ * Entry Point
+ * ==============================================================================================
+ * Forwards everything the pipe (or file) src_fd delivers until EOF. Returns the number of bytes
+ * forwarded, or -1 if nothing could be read.
+ * ==============================================================================================
+ */
+
+
+ssize_t forward_output(int src_fd, int client_fd, int mirror_stdout) {
+#if defined(__linux__)
+    // splice() needs a pipe on one side; files streamed by the `cat` builtin are copied
+    struct stat st;
+    if (client_fd > 0 && proto_get_codec(client_fd) == COMPRESS_NONE
+        && fstat(src_fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        return splice_forward(src_fd, client_fd, mirror_stdout);
+#endif
+    return copy_forward(src_fd, client_fd, mirror_stdout, NULL);
+}
+
+// Same, but every chunk is also handed to tap (the result cache, -R); always copies
+ssize_t forward_output_tapped(int src_fd, int client_fd, int mirror_stdout, forward_tap_t tap) {
+    return copy_forward(src_fd, client_fd, mirror_stdout, tap);
+}
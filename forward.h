@@ -0,0 +1,12 @@
+#ifndef MYSHELL_FORWARD_H
+#define MYSHELL_FORWARD_H
+
+#include <sys/types.h>
+
+// Receives a copy of the forwarded bytes
+typedef void (*forward_tap_t)(const char *data, size_t len);
+
+ssize_t forward_output(int src_fd, int client_fd, int mirror_stdout);
+ssize_t forward_output_tapped(int src_fd, int client_fd, int mirror_stdout, forward_tap_t tap);
+
+#endif //MYSHELL_FORWARD_H
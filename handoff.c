@@ -0,0 +1,195 @@
+/* ==============================================================================================
+ * Hot Restart (Listener and Session Handoff)
+ * ==============================================================================================
+ *
+ * Restarting the server used to unlink and rebind its socket: connections arriving meanwhile
+ * were refused, and the sessions of the old process lost the accept loop that answers their
+ * `stat`, `abort` and scheduler requests. With -U a new binary takes over from the running
+ * one instead:
+ *
+ *   ./shell -s -u /tmp/myshell.sock -U        (same switches as the running server, plus -U)
+ *
+ * The forking server keeps a handoff socket next to its listener (<socket>.handoff, or
+ * /tmp/myshell_handoff_<ip>_<port> for TCP; mode 0600). The new process loads everything that
+ * does not depend on the old one first (TLS certificates, cgroups, limits), then connects:
+ *
+ *   new -> old   HANDOFF_HELLO      version and PID
+ *   old -> new   HANDOFF_STATE      listener, admin socket (-A), metrics region and recorder
+ *                                   ring (-r) by SCM_RIGHTS; connection IDs handed out so far
+ *   old -> new   HANDOFF_SESSION    one per registry entry (session_t) with the parent's end
+ *                                   of its control channel, pipeline slots and queue state
+ *   new -> old   HANDOFF_READY
+ *   old -> new   HANDOFF_GO         the old recorder writer has drained the ring and exited
+ *
+ * and the old process exits. The listening socket is never closed, so clients that connect
+ * during the exchange wait in its backlog and are accepted by the new process; nothing is
+ * bound, mapped or initialized again before its first accept(). The session children keep
+ * running the code they were started with and talk to the new process over their channels;
+ * requests sent while the handoff was in progress wait there. Sessions are not children of
+ * the new process: they are reaped by init, and a session ends when its channel is closed.
+ * The shared regions are memfds where the system has them, so the sessions taken over keep
+ * counting into the same metrics and recording into the same ring; elsewhere the new server
+ * starts with fresh metrics. The result cache (-R) is not handed over: fills in progress are
+ * given up and their waiters run the command themselves.
+ *
+ * If the new process fails before HANDOFF_READY the old one keeps serving. Workers (-w) and
+ * the event engine (-E) cannot hand over: their sessions live inside the workers or the
+ * event loop itself.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+// Default handoff socket of a server, derived like the multiplexer's control socket (mux.c)
+void handoff_path(char *buf, size_t size, const char *socket_path, const char *host, int port) {
+    if (port > 0) snprintf(buf, size, "/tmp/myshell_handoff_%s_%d", host ? host : "0.0.0.0", port);
+    else snprintf(buf, size, "%s.handoff", socket_path);
+}
+
+static int handoff_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// SOCK_SEQPACKET keeps the messages apart, with their descriptors
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd = -1;
+    if (handoff_address(path, &addr) == 0) fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        fprintf(stderr, "[WARN] No handoff socket %s, hot restart disabled: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        fprintf(stderr, "[WARN] No handoff socket %s, hot restart disabled: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0600);                  // whoever connects gets the sessions: no other users
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) < 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+
+/* ==============================================================================================
+ * Messages
+ * ==============================================================================================
+ * One handoff_msg_t per packet; the descriptors of the slots that are not -1 travel in one
+ * SCM_RIGHTS control message, in slot order, and msg->fds tells the receiver which they are.
+ * ==============================================================================================
+ */
+
+
+int handoff_send(int fd, handoff_msg_t *msg, const int fds[HANDOFF_FDS]) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+    } control;
+    int passed[HANDOFF_FDS];
+    int count = 0;
+
+    msg->fds = 0;
+    for (int slot = 0; fds && slot < HANDOFF_FDS; slot++) {
+        if (fds[slot] < 0) continue;
+        msg->fds |= 1u << slot;
+        passed[count++] = fds[slot];
+    }
+
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr header = {0};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if (count > 0) {
+        memset(&control, 0, sizeof(control));
+        header.msg_control = control.space;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), passed, sizeof(int) * count);
+    }
+
+    ssize_t sent;
+    do sent = sendmsg(fd, &header, 0);
+    while (sent < 0 && errno == EINTR);
+    return sent == (ssize_t)sizeof(*msg) ? 0 : -1;
+}
+
+// Fills fds by slot (-1 for the ones not sent); -1 on EOF, error or a malformed message
+int handoff_recv(int fd, handoff_msg_t *msg, int fds[HANDOFF_FDS]) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+    } control;
+    int received[HANDOFF_FDS];
+    int count = 0;
+
+    for (int slot = 0; slot < HANDOFF_FDS; slot++) fds[slot] = -1;
+
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr header = {0};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.space;
+    header.msg_controllen = sizeof(control.space);
+
+    int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t bytes;
+    do bytes = recvmsg(fd, &header, flags);
+    while (bytes < 0 && errno == EINTR);
+    if (bytes <= 0) return -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > HANDOFF_FDS - count) n = HANDOFF_FDS - count;
+        memcpy(received + count, CMSG_DATA(cmsg), sizeof(int) * n);
+        count += n;
+    }
+    for (int i = 0; i < count; i++) fcntl(received[i], F_SETFD, FD_CLOEXEC);
+
+    int malformed = bytes != (ssize_t)sizeof(*msg) || (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+    int next = 0;
+    for (int slot = 0; slot < HANDOFF_FDS && !malformed; slot++) {
+        if ((msg->fds & (1u << slot)) && next < count) fds[slot] = received[next++];
+    }
+    while (next < count) close(received[next++]);     // not announced in msg->fds
+    return malformed ? -1 : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef MYSHELL_HANDOFF_H
+#define MYSHELL_HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDOFF_VERSION 2           // bump when control_msg_t or a shared region changes layout
+#define HANDOFF_TIMEOUT 5           // seconds the running server waits for its successor
+
+enum {
+    HANDOFF_HELLO = 1,              // new -> old: version, pid
+    HANDOFF_STATE = 2,              // old -> new: listener and shared regions, session count
+    HANDOFF_SESSION = 3,            // old -> new: one registry entry with its control channel
+    HANDOFF_READY = 4,              // new -> old: everything adopted
+    HANDOFF_GO = 5                  // old -> new: the recorder writer has stopped, old exits
+};
+
+// Descriptor slots of a message; absent ones are -1
+enum {
+    HANDOFF_FD_LISTENER = 0,        // HANDOFF_STATE
+    HANDOFF_FD_CHANNEL = 0,         // HANDOFF_SESSION
+    HANDOFF_FD_ADMIN = 1,
+    HANDOFF_FD_METRICS = 2,
+    HANDOFF_FD_RING = 3,
+    HANDOFF_FDS = 4
+};
+
+typedef struct {
+    uint32_t type;                  // HANDOFF_*
+    uint32_t version;               // HANDOFF_HELLO
+    uint32_t fds;                   // slots sent along (set by handoff_send)
+    int32_t pid;                    // HELLO: new server, STATE: old server, SESSION: session child
+    int32_t pgid;                   // STATE: process group of the old server and its sessions
+    int32_t count;                  // STATE: HANDOFF_SESSION messages that follow
+    int32_t next_id;                // STATE: connection IDs handed out so far
+    int32_t id;                     // SESSION: the fields of session_t (registry.h)
+    int32_t metrics_slot;
+    int32_t priority;
+    int32_t running;
+    int32_t queued;
+    char peer[48];
+} handoff_msg_t;
+
+void handoff_path(char *buf, size_t size, const char *socket_path, const char *host, int port);
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+
+int handoff_send(int fd, handoff_msg_t *msg, const int fds[HANDOFF_FDS]);
+int handoff_recv(int fd, handoff_msg_t *msg, int fds[HANDOFF_FDS]);
+
+#endif //MYSHELL_HANDOFF_H
@@ -0,0 +1,101 @@
+/* ==============================================================================================
+ * Command Input (Heredocs and Here-strings)
+ * ==============================================================================================
+ *
+ * A stage may read its stdin from text that travels with the command instead of a file:
+ *
+ *   cat << EOF | wc -l      the heredoc body, collected by the client and sent ahead of the
+ *   ...                     command in FRAME_STDIN frames (protocol.c)
+ *   EOF
+ *   grep x <<< word         the here-string, taken from the line itself, plus a newline
+ *
+ * The body is kept in a memfd (an unlinked temporary file where memfd_create() is missing)
+ * that becomes the stage's stdin, rewound: no helper process and no pipe that would have to
+ * be fed while the pipeline runs, and no size limit besides memory. The data is binary-safe.
+ *
+ * A session collects the FRAME_STDIN payloads of its next command with heredoc_receive(); with
+ * -E the event loop collects them and hands the descriptor to the job (heredoc_set_pending).
+ * The body belongs to the first `<<` stage of the line; whatever is left when the line is
+ * done is dropped.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "protocol.h"
+#include "heredoc.h"
+
+#define HEREDOC_TEMPLATE "/tmp/myshell_input_XXXXXX"
+
+static int pending_fd = -1;         // body for the next `<<` stage, -1 = none
+
+
+// Returns an empty, anonymous read/write file (close-on-exec, sealable if it is a memfd), or -1
+int heredoc_open(void) {
+#if defined(__linux__) && defined(MFD_CLOEXEC) && defined(MFD_ALLOW_SEALING)
+    int fd = memfd_create("myshell_input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0) return fd;
+#endif
+    char path[] = HEREDOC_TEMPLATE;
+    int tmp_fd = mkstemp(path);
+    if (tmp_fd < 0) return -1;
+    unlink(path);
+    fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
+    return tmp_fd;
+}
+
+// Appends data to the body in *fd, creating it first if needed; -1 if it cannot be stored
+int heredoc_append(int *fd, const char *data, size_t len) {
+    if (*fd < 0 && (*fd = heredoc_open()) < 0) return -1;
+    return proto_write_all(*fd, data, len);
+}
+
+// Session: one FRAME_STDIN payload for the next command
+void heredoc_receive(const char *data, size_t len) {
+    if (heredoc_append(&pending_fd, data, len) < 0)
+        perror("[ERROR] Cannot store command input");
+}
+
+// -E job: the body the event loop collected for its line
+void heredoc_set_pending(int fd) {
+    heredoc_discard();
+    pending_fd = fd;
+}
+
+void heredoc_discard(void) {
+    if (pending_fd >= 0) close(pending_fd);
+    pending_fd = -1;
+}
+
+// The stdin of a stage with a here-string or heredoc, rewound; -1 if the stage has neither.
+// Without a body (nothing was sent, or a second `<<` in the line) the stage reads empty input.
+int heredoc_stage_input(const command_t *stage) {
+    int fd = -1;
+
+    if (stage->input_text) {
+        if (heredoc_append(&fd, stage->input_text, strlen(stage->input_text)) < 0
+            || proto_write_all(fd, "\n", 1) < 0) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+    } else if (stage->heredoc) {
+        fd = pending_fd >= 0 ? pending_fd : heredoc_open();
+        pending_fd = -1;
+    } else {
+        return -1;
+    }
+
+    if (fd < 0) return open("/dev/null", O_RDONLY | O_CLOEXEC);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
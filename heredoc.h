@@ -0,0 +1,14 @@
+#ifndef MYSHELL_HEREDOC_H
+#define MYSHELL_HEREDOC_H
+
+#include <stddef.h>
+#include "parser.h"
+
+int heredoc_open(void);
+int heredoc_append(int *fd, const char *data, size_t len);
+void heredoc_receive(const char *data, size_t len);
+void heredoc_set_pending(int fd);
+void heredoc_discard(void);
+int heredoc_stage_input(const command_t *stage);
+
+#endif //MYSHELL_HEREDOC_H
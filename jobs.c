@@ -0,0 +1,379 @@
+/* ==============================================================================================
+ * Background Jobs
+ * ==============================================================================================
+ *
+ * A pipeline ended by '&' (`rsync -a src dst &`) is started like any other pipeline, but the
+ * session does not wait for it: the client gets "[<id>] <pid>" at once and can send the next
+ * command while the job runs. Every session process keeps its own job table.
+ *
+ * The output of a job (stdout and stderr of the last stage) goes into a spool file, an
+ * unlinked temporary file that belongs to the job alone. Writing to it never blocks, however
+ * much a job prints and however long nobody asks for it, and it keeps the output complete
+ * until the client collects it.
+ *
+ * Jobs are reaped from a SIGCHLD handler (SA_RESTART, so the blocking session loop does not
+ * notice it). The handler waits only for the PIDs in the job table, never for any child, so
+ * the waitpid() calls of foreground pipelines in execute_command() keep seeing their own
+ * children. The job table is only changed with SIGCHLD blocked.
+ *
+ * Builtins, dispatched by execute_command() next to help, cd and hash:
+ *
+ *   jobs                 list jobs with their state and the size of their spooled output
+ *   fg [id]              wait for a job (default: the newest), send its output and remove it;
+ *                        the response carries the job's exit status
+ *   wait [id]            wait for one job, or for all; the output stays spooled
+ *   kill [-SIG] id       signal every stage of a job (default SIGTERM)
+ *
+ * Job IDs can be written as `3` or `%3`. `kill <n>` with a number that is no job of the
+ * session is left to kill(1), so it still signals a process ID.
+ *
+ * When the session ends, its running jobs get SIGHUP, as from a shell that exits.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "protocol.h"
+#include "forward.h"
+#include "server.h"
+#include "jobs.h"
+
+#define JOBS_SPOOL_TEMPLATE "/tmp/myshell_job_XXXXXX"
+
+typedef struct job {
+    int id;
+    pid_t *pids;                        // stages, 0 once reaped or if never started
+    size_t count;
+    volatile sig_atomic_t remaining;    // stages still running
+    volatile sig_atomic_t status;       // exit status of the last stage
+    int spool_fd;                       // output of the last stage
+    int holds_slot;                     // scheduler slot to give back when it ends (-L)
+    char *command;                      // shown by `jobs`
+    struct job *next;
+} job_t;
+
+static job_t *volatile job_list = NULL;        // newest first
+static int next_job_id = 1;
+static int handler_installed = 0;
+
+
+/* ==============================================================================================
+ * Reaping
+ * ==============================================================================================
+ */
+
+
+static void reap_jobs(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+
+    for (job_t *job = job_list; job; job = job->next) {
+        for (size_t i = 0; i < job->count; i++) {
+            int child_status;
+            if (job->pids[i] <= 0 || waitpid(job->pids[i], &child_status, WNOHANG) != job->pids[i]) continue;
+
+            job->pids[i] = 0;
+            job->remaining--;
+            if (job->remaining == 0 && job->holds_slot) {
+                release_pipeline_slot();
+                job->holds_slot = 0;
+            }
+            if (i == job->count - 1) {
+                if (WIFEXITED(child_status)) job->status = WEXITSTATUS(child_status);
+                else if (WIFSIGNALED(child_status)) job->status = 128 + WTERMSIG(child_status);
+                else job->status = 1;
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+static void block_reaping(sigset_t *old_mask) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+static void unblock_reaping(const sigset_t *old_mask) {
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
+}
+
+static void wait_job(job_t *job) {
+    sigset_t old_mask;
+    block_reaping(&old_mask);
+    while (job->remaining > 0) sigsuspend(&old_mask);
+    unblock_reaping(&old_mask);
+}
+
+
+/* ==============================================================================================
+ * Job Table
+ * ==============================================================================================
+ */
+
+
+// Creates the spool file for a job's output; -1 with errno set on failure
+int jobs_spool(void) {
+    char path[] = JOBS_SPOOL_TEMPLATE;
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);    // the last stage gets it dup2'ed onto its stdout
+    return fd;
+}
+
+static char *describe(const pipeline_t *pipeline) {
+    size_t len = 1;
+    for (size_t i = 0; i < pipeline->count; i++) {
+        const command_t *stage = &pipeline->stages[i];
+        for (size_t j = 0; j < stage->argc; j++) len += strlen(stage->argv[j]) + 1;
+        if (stage->input_file) len += strlen(stage->input_file) + 3;
+        if (stage->input_text) len += strlen(stage->input_text) + 5;
+        if (stage->output_file) len += strlen(stage->output_file) + 4;
+        len += 3;
+    }
+
+    char *text = malloc(len);
+    if (!text) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    text[0] = '\0';
+    for (size_t i = 0; i < pipeline->count; i++) {
+        const command_t *stage = &pipeline->stages[i];
+        if (i > 0) strcat(text, " | ");
+        for (size_t j = 0; j < stage->argc; j++) {
+            if (j > 0) strcat(text, " ");
+            strcat(text, stage->argv[j]);
+        }
+        if (stage->input_file) {
+            strcat(text, " < ");
+            strcat(text, stage->input_file);
+        }
+        if (stage->input_text) {
+            strcat(text, " <<< ");
+            strcat(text, stage->input_text);
+        }
+        if (stage->output_file) {
+            strcat(text, stage->output_mode == REDIRECT_APPEND ? " >> " : " > ");
+            strcat(text, stage->output_file);
+        }
+    }
+    return text;
+}
+
+// Takes over the started stages (pids < 0: could not be started), the spool file and the
+// scheduler slot, which is given back when the last stage has been reaped; returns the job ID
+int jobs_add(const pipeline_t *pipeline, const pid_t *pids, size_t count, int spool_fd, int holds_slot) {
+    job_t *job = calloc(1, sizeof(job_t));
+    pid_t *job_pids = malloc(count * sizeof(pid_t));
+    if (!job || !job_pids) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    job->pids = job_pids;
+    job->count = count;
+    job->spool_fd = spool_fd;
+    job->holds_slot = holds_slot;
+    job->command = describe(pipeline);
+    for (size_t i = 0; i < count; i++) {
+        job->pids[i] = pids[i] > 0 ? pids[i] : 0;
+        if (pids[i] > 0) job->remaining++;
+    }
+    if (pids[count - 1] <= 0) job->status = 1;
+    if (job->remaining == 0 && holds_slot) {
+        release_pipeline_slot();
+        job->holds_slot = 0;
+    }
+
+    sigset_t old_mask;
+    block_reaping(&old_mask);
+    if (!handler_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = reap_jobs;
+        action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGCHLD, &action, NULL);
+        handler_installed = 1;
+    }
+    job->id = next_job_id++;
+    job->next = job_list;
+    job_list = job;
+    reap_jobs(0);                       // stages that ended before the handler could see them
+    unblock_reaping(&old_mask);
+    return job->id;
+}
+
+static void remove_job(job_t *job) {
+    sigset_t old_mask;
+    block_reaping(&old_mask);
+    job_t *volatile *link = &job_list;
+    while (*link && *link != job) link = &(*link)->next;
+    if (*link) *link = job->next;
+    unblock_reaping(&old_mask);
+
+    close(job->spool_fd);
+    free(job->command);
+    free(job->pids);
+    free(job);
+}
+
+// Looks up "3" or "%3"; NULL if the session has no such job
+static job_t *find_job(const char *arg) {
+    if (arg[0] == '%') arg++;
+    char *end;
+    long id = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0') return NULL;
+    for (job_t *job = job_list; job; job = job->next)
+        if (job->id == id) return job;
+    return NULL;
+}
+
+static void signal_job(job_t *job, int sig) {
+    sigset_t old_mask;
+    block_reaping(&old_mask);           // a PID is not reused while it is still in the table
+    for (size_t i = 0; i < job->count; i++)
+        if (job->pids[i] > 0) kill(job->pids[i], sig);
+    unblock_reaping(&old_mask);
+}
+
+// Called when the session ends
+void jobs_hangup(void) {
+    for (job_t *job = job_list; job; job = job->next) {
+        signal_job(job, SIGHUP);
+        signal_job(job, SIGCONT);       // stopped jobs must run to see the SIGHUP
+    }
+}
+
+
+/* ==============================================================================================
+ * Builtins
+ * ==============================================================================================
+ */
+
+
+static void reply(int client_fd, const char *text) {
+    if (client_fd > 0) proto_send_data(client_fd, text, strlen(text));
+    else printf("%s", text);
+}
+
+static void list_jobs(int client_fd) {
+    char line[512];
+    if (!job_list) reply(client_fd, "No jobs\n");
+
+    // Oldest first, like a shell lists them
+    size_t count = 0;
+    for (job_t *job = job_list; job; job = job->next) count++;
+    for (size_t n = count; n > 0; n--) {
+        job_t *job = job_list;
+        for (size_t i = 1; i < n; i++) job = job->next;
+
+        char state[32];
+        if (job->remaining > 0) snprintf(state, sizeof(state), "Running");
+        else if (job->status == 0) snprintf(state, sizeof(state), "Done");
+        else snprintf(state, sizeof(state), "Exit %d", (int)job->status);
+
+        struct stat st;
+        long long spooled = fstat(job->spool_fd, &st) == 0 ? (long long)st.st_size : 0;
+        snprintf(line, sizeof(line), "[%d]  %-8s %10lld bytes  %.400s\n", job->id, state, spooled, job->command);
+        reply(client_fd, line);
+    }
+}
+
+static int parse_signal(const char *arg) {
+    static const struct { const char *name; int sig; } names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "TERM", SIGTERM }, { "STOP", SIGSTOP }, { "CONT", SIGCONT },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }
+    };
+    if (strncmp(arg, "SIG", 3) == 0) arg += 3;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (strcmp(arg, names[i].name) == 0) return names[i].sig;
+
+    char *end;
+    long sig = strtol(arg, &end, 10);
+    return (end != arg && *end == '\0' && sig > 0 && sig < NSIG) ? (int)sig : -1;
+}
+
+// Runs jobs / fg / wait / kill. Returns the exit status, or -1 if argv is not a job builtin.
+int jobs_command(int client_fd, char **argv, int not_all_flag) {
+    char message[256];
+    int status = 0;
+    const char *name = argv[0];
+
+    if (strcmp(name, "jobs") == 0) {
+        list_jobs(client_fd);
+
+    } else if (strcmp(name, "fg") == 0 || strcmp(name, "wait") == 0) {
+        int is_fg = (name[0] == 'f');
+        job_t *job = argv[1] ? find_job(argv[1]) : job_list;
+
+        if (argv[1] && !job) {
+            snprintf(message, sizeof(message), "[ERROR] %s: no such job: %.100s\n", name, argv[1]);
+            reply(client_fd, message);
+            status = 1;
+        } else if (!job) {
+            if (is_fg) {
+                reply(client_fd, "[ERROR] fg: no current job\n");
+                status = 1;
+            }
+        } else if (is_fg) {
+            wait_job(job);
+            status = job->status;
+            lseek(job->spool_fd, 0, SEEK_SET);
+            forward_output(job->spool_fd, client_fd, client_fd <= 0 || !server_options.quiet);
+            remove_job(job);
+        } else if (argv[1]) {
+            wait_job(job);
+            status = job->status;
+        } else {
+            // `wait` without an ID: every job, the status is that of the newest one
+            for (job_t *each = job_list; each; each = each->next) wait_job(each);
+            status = job_list->status;
+        }
+
+    } else if (strcmp(name, "kill") == 0) {
+        int sig = SIGTERM;
+        char **args = argv + 1;
+        if (args[0] && args[0][0] == '-' && args[1]) {
+            sig = parse_signal(args[0] + 1);
+            args++;
+        }
+        if (!args[0]) return -1;
+
+        job_t *job = find_job(args[0]);
+        if (!job && args[0][0] != '%') return -1;      // a process ID: kill(1)
+        if (sig < 0) {
+            reply(client_fd, "[ERROR] kill: unknown signal\n");
+            status = 1;
+        } else if (!job) {
+            snprintf(message, sizeof(message), "[ERROR] kill: no such job: %.100s\n", args[0]);
+            reply(client_fd, message);
+            status = 1;
+        } else if (args[1]) {
+            reply(client_fd, "[ERROR] kill: one job at a time\n");
+            status = 1;
+        } else {
+            signal_job(job, sig);
+            if (sig != SIGCONT) signal_job(job, SIGCONT);      // let stopped stages receive it
+        }
+
+    } else {
+        return -1;
+    }
+
+    if (!not_all_flag) proto_send_end(client_fd, status);
+    return status;
+}
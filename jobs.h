@@ -0,0 +1,12 @@
+#ifndef MYSHELL_JOBS_H
+#define MYSHELL_JOBS_H
+
+#include <sys/types.h>
+#include "parser.h"
+
+int jobs_spool(void);
+int jobs_add(const pipeline_t *pipeline, const pid_t *pids, size_t count, int spool_fd, int holds_slot);
+int jobs_command(int client_fd, char **argv, int not_all_flag);
+void jobs_hangup(void);
+
+#endif //MYSHELL_JOBS_H
@@ -31,11 +31,34 @@
  *          -u <path>   → use UNIX socket at specified path,
  *          -p <port>   → use TCP port to listen or connect,
  *          -i <ip>     → specify IP address for client/server TCP connections,
+ *          -E          → serve all clients from one event-driven process (epoll/kqueue),
+ *          -w <n>      → start n pre-forked server workers (SO_REUSEPORT listeners for TCP),
+ *          -b <n>      → listen() backlog of the server socket(s),
+ *          -q          → do not copy command output to the server's stdout,
+ *          -D          → last pipeline stage writes directly into the client socket,
+ *          -F          → start pipeline stages with fork() instead of posix_spawn(),
+ *          -Z <codec>  → compress large command output for clients (lz4, zstd, zlib),
+ *          -A <spec>   → serve metrics on a UNIX socket path or local TCP port (Prometheus),
+ *          -L <n>[,m]  → at most n pipelines run at once, m of them per session (queued fairly),
+ *          -G <limits> → run each pipeline in a cgroup v2 with cpu=, mem=, pids= limits,
+ *          -R <spec>   → share the output of allowed read-only commands for a few seconds,
+ *          -O <spec>   → server writes `>`/`>>` files itself in large batches (io_uring),
+ *          -T <spec>   → TLS for TCP connections (server: cert=,key=; client: ca= or insecure),
+ *          -o <spec>   → TCP tuning (nagle, cork, sndbuf=, rcvbuf=, keepalive=, idle=),
+ *          -r <spec>   → record every command line with its output to an indexed log directory,
+ *          -Q <query>  → list or replay recorded commands by time and session (with -r <dir>),
+ *          -U          → hot restart: take over listener and sessions of the running server,
+ *          -P <n>      → client sends up to n commands ahead without waiting (framed servers),
+ *          -j <n>      → run independent script lines on n parallel workers,
+ *          -H <file>   → client runs the command on every server listed in the file,
+ *          -N <n>      → at most n concurrent connections for -H, warm sessions for -M,
+ *          -M          → run the connection multiplexer for the server given by -u/-p/-i,
+ *          -m <path>   → control socket of the multiplexer (default derived from -u/-p/-i),
  *          -h          → show help message and usage info.
  *
  *      Optional:
  *          -c "command..." → run the command and exit (client mode only),
- *          [filename]      → process command script (server mode only).
+ *          [filename]      → process command script, "-" for stdin (server mode only).
  *
  *  Optional tasks – Completed extensions:
  *  --------------------------------------
@@ -73,6 +96,17 @@
 #include <string.h>
 #include "server.h"
 #include "client.h"
+#include "script.h"
+#include "fanout.h"
+#include "compress.h"
+#include "mux.h"
+#include "scheduler.h"
+#include "cgroup.h"
+#include "result_cache.h"
+#include "sink.h"
+#include "tls.h"
+#include "sockopt.h"
+#include "recorder.h"
 
 #define SOCKET_PATH "/tmp/myshell_socket"
 
@@ -85,24 +119,35 @@
  * the script file and reads commands line by line. Each command is sent to the same handler
  * as if it was received from the socket or typed interactively.
  *
+ * The script reader (script.c) maps regular files and streams pipes in large blocks, so lines
+ * have no length limit and are not copied before parsing. "-" reads the script from stdin.
+ *
+ * With -j <n> the script is handed to run_script_parallel() (script.c), which runs
+ * independent lines concurrently and prints their output in script order.
+ *
  * ==============================================================================================
  * ============================================================================================== */
 
 
 void run_script(const char *filename){
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("[ERROR] Cannot open script file");
+    if (server_options.script_jobs > 1) {
+        run_script_parallel(filename, server_options.script_jobs);
         return;
     }
-    char command[1024];
-    while (fgets(command, sizeof(command), file)) {
-        if (strlen(command) > 0) {
-            handle_command(-1, command);
+
+    script_reader_t reader;
+    if (script_open(&reader, filename, 0) < 0) return;
+
+    // Lines are views into the script; the plan cache copies what it needs
+    const char *line;
+    size_t len;
+    while (script_next_line(&reader, &line, &len) > 0) {
+        if (len > 0 && !script_wait_line(line, len)) {
+            run_plan(-1, plan_lookup_view(line, len));
         }
     }
 
-    fclose(file);
+    script_close(&reader);
 }
 
 
@@ -130,21 +175,103 @@ void print_help() {
             "  -u <path>         Use UNIX domain socket at specified path\n"
             "  -p <port>         Use TCP socket on specified port\n"
             "  -i <ip>           Specify IP address for TCP connection\n\n"
+            "Server Options:\n"
+            "  -E                Event mode: one epoll/kqueue process serves all clients,\n"
+            "                    only command pipelines are forked\n"
+            "  -w <n>            Start n pre-forked workers, each with its own listener\n"
+            "                    (SO_REUSEPORT) and event loop\n"
+            "  -b <n>            Listen backlog (default SOMAXCONN)\n"
+            "  -q                Quiet: do not mirror client command output on stdout\n"
+            "  -D                Direct output: the last pipeline stage writes straight\n"
+            "                    into the client socket (output is not mirrored)\n"
+            "  -F                Start pipeline stages with fork() instead of posix_spawn()\n"
+            "  -Z <codec>        Compress command output of 512 bytes or more for clients\n"
+            "                    that support the codec: lz4 (fastest), zstd (best ratio)\n"
+            "                    or zlib, as far as built in\n"
+            "  -A <path|port>    Admin socket: serve the session metrics in Prometheus\n"
+            "                    text format on a UNIX socket or 127.0.0.1:<port>\n"
+            "  -L <n>[,<m>]      Run at most n pipelines at once (m per session); the\n"
+            "                    others wait in a fair queue ordered by `priority`\n"
+            "  -G <limits>       Run every pipeline in its own cgroup v2 (Linux), e.g.\n"
+            "                    cpu=50,mem=256M,pids=64[,dir=" CGROUP_DEFAULT_DIR "]\n"
+            "  -R <spec>         Result cache: identical read-only commands of all clients\n"
+            "                    share one run, e.g. ttl=2,mem=16M,allow=df/10:ls:wc\n"
+            "  -O <spec>         Redirection sink: the server writes > and >> files in\n"
+            "                    large batches (io_uring on Linux), e.g. batch=1M,depth=4,\n"
+            "                    prealloc=64M,readahead=8M,nocache\n"
+            "  -r <spec>         Record every command line, its output and exit status\n"
+            "                    to a compressed, indexed log: <dir>[,segment=64M,\n"
+            "                    ring=4M,codec=zstd]\n"
+            "  -U                Hot restart: take over the listener and the live\n"
+            "                    sessions of the server running on the same socket,\n"
+            "                    which then exits (not with -E or -w)\n\n"
+            "Recorded Sessions:\n"
+            "  -Q <query>        With -r <dir>: list the recorded commands, or replay\n"
+            "                    them with their output: from=<time>,to=<time>,\n"
+            "                    session=<id>,replay (or all). Times: 2026-10-14T09:30,\n"
+            "                    @<epoch> or -<n>[smhd] ago\n\n"
+            "TLS and TCP Tuning (TCP only):\n"
+            "  -T <spec>         Encrypt TCP connections (TLS 1.3, kTLS where available).\n"
+            "                    Server: cert=<pem>,key=<pem>. Client: ca=<pem>, or on\n"
+            "                    for the system CAs, or insecure; session=<file> keeps\n"
+            "                    the ticket for resumption with a 0-RTT hello (default\n"
+            "                    ~/.myshell_tls_<ip>_<port>), noearly turns 0-RTT off\n"
+            "  -o <spec>         Tune TCP connections (TCP_NODELAY is on by default):\n"
+            "                    nagle keeps Nagle's algorithm, cork sends each response\n"
+            "                    in full segments (server), sndbuf=<size>, rcvbuf=<size>,\n"
+            "                    keepalive=<idle>[/<interval>[/<count>]] in seconds,\n"
+            "                    idle=<seconds> closes silent sessions (server)\n\n"
+            "Client Options:\n"
+            "  -P <n>            Pipelining: keep up to n commands in flight; responses\n"
+            "                    are still printed in order (default 1)\n"
+            "  -H <file>         Fan-out: run the command on every server listed in\n"
+            "                    the file (host, host:port or socket path per line),\n"
+            "                    output lines are prefixed with the host\n"
+            "  -N <n>            Concurrent connections for -H (default 64), warm server\n"
+            "                    sessions for -M (default 8)\n"
+            "  -M                Run a connection multiplexer: keeps warm sessions to the\n"
+            "                    server given by -u/-p/-i; -c commands then use them\n"
+            "  -m <path>         Control socket of the multiplexer (default <socket>.mux\n"
+            "                    or /tmp/myshell_mux_<ip>_<port>)\n\n"
             "Internal Commands:\n"
             "  help              Show this help message\n"
             "  quit              Disconnect current client\n"
             "  halt              Terminate the entire server and all clients\n"
-            "  stat              Show active client connections (server only)\n"
-            "  abort <id>        Force-close a specific connection by ID\n\n"
+            "  hash [-r]         List the command path cache, -r resets it\n"
+            "  stat [-v]         Show active client connections, plan cache and\n"
+            "                    compression statistics (server only); -v adds\n"
+            "                    throughput and per-command latency metrics\n"
+            "  abort <id>        Force-close a specific connection by ID\n"
+            "  priority [class]  Show or set the scheduling class of the session for\n"
+            "                    -L and -G: high, normal (default) or low\n"
+            "  cmd &             Run a pipeline as a background job of the session;\n"
+            "                    its output is kept until `fg` collects it\n"
+            "  jobs              List the jobs of the session\n"
+            "  fg [id]           Wait for a job (default: the newest) and show its output\n"
+            "  wait [id]         Wait for a job, or for all jobs\n"
+            "  kill [-SIG] id    Send a signal to a job (default SIGTERM)\n\n"
             "One-Time Commands (Client Mode Only):\n"
             "  -c \"command\"      Send a single command to the server and exit\n\n"
             "Script Support (Server Mode Only):\n"
-            "  <script_file>     Execute commands from a given script file line-by-line\n\n"
+            "  <script_file>     Execute commands from a given script file line-by-line\n"
+            "                    (\"-\" reads the script from stdin)\n"
+            "  -j <n>            Run independent script lines on n parallel workers;\n"
+            "                    output is still printed in script order. Lines ending\n"
+            "                    in ';' stay chained to the next, `wait` waits for all\n"
+            "                    earlier lines\n\n"
             "Examples:\n"
             "  ./shell -s -u /tmp/shell.sock\n"
             "  ./shell -c -p 1234 -i 127.0.0.1\n"
             "  ./shell -c \"ls -l | grep txt\"\n"
-            "  ./shell script.txt\n\n"
+            "  ./shell -c -H hosts.txt -p 1234 \"uptime; df -h\"\n"
+            "  ./shell -s -p 1234 -T cert=server.pem,key=server.key\n"
+            "  ./shell -c -p 1234 -T ca=ca.pem \"uptime\"\n"
+            "  ./shell -s -p 1234 -o cork,keepalive=60/10/5,idle=600\n"
+            "  ./shell -s -r /var/log/myshell\n"
+            "  ./shell -r /var/log/myshell -Q from=-1h,session=3,replay\n"
+            "  ./shell -s -u /tmp/shell.sock -U\n"
+            "  ./shell script.txt\n"
+            "  ./shell -j 8 script.txt\n\n"
     );
 }
 
@@ -168,6 +295,10 @@ int main(int argc, char *argv[]) {
     char *socket_path = SOCKET_PATH;
     char *host = "127.0.0.1";
     int tcp_port = -1;
+    char *hosts_file = NULL;
+    char *query = NULL;
+    int connection_limit = 0;
+    int mux_mode = 0;
     int opt;
 
 
@@ -181,13 +312,36 @@ int main(int argc, char *argv[]) {
      *   -u path  → use UNIX socket at given path
      *   -p port  → use TCP port
      *   -i host  → use specific host address
+     *   -E       → event-driven server engine
+     *   -w n     → number of pre-forked workers
+     *   -b n     → listen backlog
+     *   -q       → quiet, no output mirroring on the server
+     *   -D       → direct output of the last pipeline stage to the client
+     *   -F       → fork launcher instead of posix_spawn
+     *   -Z codec → output compression codec
+     *   -A spec  → metrics admin socket
+     *   -L n,m   → pipeline limit (scheduler)
+     *   -G spec  → cgroup resource limits
+     *   -R spec  → result cache
+     *   -O spec  → redirection sink
+     *   -T spec  → TLS transport
+     *   -o spec  → TCP socket tuning
+     *   -r spec  → session recorder
+     *   -Q query → recorder query / replay mode
+     *   -U       → take over from the running server (hot restart)
+     *   -P n     → client pipelining window
+     *   -j n     → parallel script workers
+     *   -H file  → fan-out client hosts file
+     *   -N n     → fan-out concurrency cap / multiplexer sessions
+     *   -M       → connection multiplexer daemon
+     *   -m path  → multiplexer control socket
      *   -h       → show help and exit
      *
      * ==============================================================================================
      * ============================================================================================== */
 
 
-    while ((opt = getopt(argc, argv, "scu:p:hi:")) != -1) {
+    while ((opt = getopt(argc, argv, "scu:p:hi:Ew:b:qDFZ:A:L:G:R:O:T:o:r:Q:UP:j:H:N:Mm:")) != -1) {
         switch (opt) {
             case 's':
                 is_server = 1;
@@ -206,6 +360,100 @@ int main(int argc, char *argv[]) {
             case 'i':
                 host = optarg;
                 break;
+            case 'E':
+                server_options.event_mode = 1;
+                break;
+            case 'w':
+                server_options.workers = atoi(optarg);
+                break;
+            case 'b':
+                server_options.backlog = atoi(optarg);
+                break;
+            case 'q':
+                server_options.quiet = 1;
+                break;
+            case 'D':
+                server_options.direct_output = 1;
+                break;
+            case 'F':
+                server_options.fork_launcher = 1;
+                break;
+            case 'Z':
+                server_options.compression = compress_parse(optarg);
+                if (server_options.compression < 0) {
+                    fprintf(stderr, "[ERROR] Compression codec '%s' is not available in this build\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'A':
+                server_options.admin_socket = optarg;
+                break;
+            case 'L':
+                if (scheduler_parse(optarg, &server_options.max_running, &server_options.max_per_session) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid pipeline limit '%s' (expected <n> or <n>,<per session>)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G':
+                if (cgroup_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid resource limits '%s' (expected cpu=<%%>,mem=<size>,pids=<n>,dir=<path>)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'R':
+                if (result_cache_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid result cache '%s' (expected ttl=<s>,mem=<size>,allow=<cmd>[/<s>]:...)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                if (sink_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid redirection sink '%s' (expected batch=<size>,depth=<n>,prealloc=<size>,readahead=<size>,nocache)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (tls_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid TLS options '%s' (expected cert=<file>,key=<file>,ca=<file>,session=<file>,insecure,noearly or on; needs OpenSSL)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                if (sockopt_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid TCP options '%s' (expected nagle,cork,sndbuf=<size>,rcvbuf=<size>,keepalive=<idle>[/<interval>[/<count>]],idle=<seconds>)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (recorder_parse(optarg) < 0) {
+                    fprintf(stderr, "[ERROR] Invalid recorder '%s' (expected <dir>,segment=<size>,ring=<size>,codec=<name>)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Q':
+                query = optarg;
+                break;
+            case 'U':
+                server_options.takeover = 1;
+                break;
+            case 'P':
+                client_options.pipeline_window = atoi(optarg);
+                break;
+            case 'j':
+                server_options.script_jobs = atoi(optarg);
+                break;
+            case 'M':
+                mux_mode = 1;
+                break;
+            case 'm':
+                client_options.mux_path = optarg;
+                break;
+            case 'H':
+                hosts_file = optarg;
+                break;
+            case 'N':
+                connection_limit = atoi(optarg);
+                break;
             case 'h':
                 print_help();
                 return 0;
@@ -257,6 +505,9 @@ int main(int argc, char *argv[]) {
      * ============================================================================================== */
 
 
+    // -Q only reads the log of the session recorder (-r)
+    if (query) return recorder_query(query);
+
     if (is_server && optind < argc) {
         const char *script_file = argv[optind];
         run_script(script_file);
@@ -268,21 +519,36 @@ int main(int argc, char *argv[]) {
      * Command Execution via -c
      * ==============================================================================================
      *
-     * If a command was collected via -c, format it properly and send it for processing.
+     * If a command was collected via -c, it is sent to the server (through the connection
+     * multiplexer when one runs), its output is printed and its exit status becomes ours.
+     * With a hosts file (-H) the command is sent to every listed server at once (fanout.c);
+     * the exit code then tells whether it succeeded everywhere.
      *
      * ==============================================================================================
      * ============================================================================================== */
 
 
+    if (hosts_file && !command_to_run) {
+        fprintf(stderr, "[ERROR] -H needs a command to run\n");
+        return 1;
+    }
+
     if (command_to_run) {
         size_t len = strlen(command_to_run);
-        char command_buf[512];
-        snprintf(command_buf, sizeof(command_buf), "%s%s", command_to_run,
+        char *command_buf = malloc(len + 2);
+        if (!command_buf) {
+            perror("malloc");
+            exit(1);
+        }
+        snprintf(command_buf, len + 2, "%s%s", command_to_run,
                  (command_to_run[len - 1] == '\n') ? "" : "\n");
 
-        handle_command(-1, command_buf);
+        int rc;
+        if (hosts_file) rc = run_fanout_client(hosts_file, tcp_port, connection_limit, command_buf);
+        else rc = run_client_command(socket_path, host, tcp_port, command_buf);
+        free(command_buf);
         free(command_to_run);
-        return 0;
+        return rc;
     }
 
 
@@ -297,7 +563,9 @@ int main(int argc, char *argv[]) {
      * ============================================================================================== */
 
 
-    if (is_server) {
+    if (mux_mode) {
+        run_mux(socket_path, host, tcp_port, connection_limit);
+    } else if (is_server) {
         if (tcp_port > 0) {
             run_tcp_server(host, tcp_port);
         } else {
@@ -322,7 +590,7 @@ int main(int argc, char *argv[]) {
 To build and run this shell application in a Linux or UNIX-like environment:
 
 1) Compile all modules using gcc:
-        gcc -Wall -g -o shell main.c server.c client.c redirections.c
+        gcc -Wall -g -DHAVE_ZLIB -DHAVE_OPENSSL -o shell main.c server.c client.c redirections.c parser.c path_cache.c plan_cache.c spawn.c builtins.c jobs.c script.c poller.c event_server.c protocol.c forward.c fanout.c mux.c compress.c registry.c metrics.c scheduler.c cgroup.c result_cache.c sink.c heredoc.c tls.c sockopt.c recorder.c handoff.c -lz -lssl -lcrypto
     OR
         make
 
@@ -369,8 +637,9 @@ Internal control commands allow terminating sessions and querying connections.
 - Interactive command execution with support for redirection and pipes
 - Accepts shell-like syntax and supports command chaining
 - Supports script execution from files (non-interactive mode)
-- Built-in internal commands: `help`, `quit`, `halt`, `stat`, `abort`
-- Client-server architecture using forked processes per connection
+- Built-in internal commands: `help`, `cd`, `hash`, `quit`, `halt`, `stat`, `abort`
+- Client-server architecture using forked processes per connection, or a single
+  epoll/kqueue event loop serving all connections (-E)
 - Cross-platform compatibility (POSIX-compliant: Linux, FreeBSD)
 - External library usage for modular I/O redirection handling
 - Full English documentation and clean modular structure
@@ -393,6 +662,8 @@ Internal control commands allow terminating sessions and querying connections.
 - Commands are parsed and split based on separators (`;`, `|`, `<`, `>`)
 - Select-based server loop handles multiple sockets and a control pipe
 - Inter-process communication is used to notify the parent of client-side events
+- Client and server negotiate a length-prefixed framed protocol (protocol.c), with the
+  original "[END]"-terminated text protocol kept as a fallback
 - Pipes (`pipe()`) are used to form command pipelines
 - I/O redirection is implemented via `dup2()` and file descriptor manipulation
 - Robust memory management ensures dynamic command handling
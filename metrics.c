@@ -0,0 +1,569 @@
+/* ==============================================================================================
+ * Metrics Module (Latency / Throughput Instrumentation)
+ * ==============================================================================================
+ *
+ * Records where the time of a command goes, per session and per command name:
+ *
+ *   commands      pipelines executed
+ *   bytes in      command bytes received from the client
+ *   bytes out     output bytes forwarded to the client (direct -D output bypasses the server)
+ *   spawn         start of the pipeline until every stage is started
+ *   first byte    start of the pipeline until its first output byte is forwarded
+ *   exec          start of the pipeline until the last stage has exited
+ *
+ * Execution times also go into one latency histogram per command name (the first stage's
+ * program, e.g. "grep"). Built-in commands run in the server itself and are not counted.
+ *
+ * Storage: everything lives in one anonymous MAP_SHARED region, mapped before the server
+ * forks sessions, jobs or workers, so every process writes its counters where the others can
+ * read them and nothing has to be collected over pipes (a memfd where available, so a hot
+ * restart with -U can hand it to the new server). Each session owns a slot; the slot
+ * and histogram fields are updated with relaxed atomic adds, the totals as well. Recording a
+ * command costs four clock_gettime() calls (vDSO, no system call) and a few additions, so
+ * collection stays on in production. Command names are entered into a fixed open-addressing
+ * table; once it is full, further names are counted under "(other)".
+ *
+ * Output:
+ *   - `stat -v` prints the totals, one line per session and the per-command latencies,
+ *   - -A <path|port> opens an admin socket (UNIX path, or a TCP port on 127.0.0.1) that
+ *     answers every connection with the totals and histograms in the Prometheus text format,
+ *     as an HTTP response when the client sent an HTTP request. Per-session counters are left
+ *     out there: session IDs would make an unbounded set of time series.
+ *
+ * Without a mapping (script mode, or mmap failed) all recording functions do nothing.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "metrics.h"
+
+typedef struct {
+    uint64_t commands;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t spawn_ns;
+    uint64_t first_byte_ns;
+    uint64_t first_byte_count;      // commands that produced forwarded output
+    uint64_t exec_ns;
+} metrics_counters_t;
+
+typedef struct {
+    int32_t in_use;
+    int32_t id;
+    int32_t pid;
+    int64_t started;                // time() the session was opened
+    metrics_counters_t counters;
+} metrics_session_t;
+
+enum {
+    NAME_EMPTY = 0,
+    NAME_CLAIMED = 1,               // a process is writing the name
+    NAME_READY = 2
+};
+
+typedef struct {
+    int32_t state;
+    char name[METRICS_NAME_SIZE];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_command_t;
+
+typedef struct {
+    metrics_counters_t totals;
+    uint64_t sessions_opened;
+    metrics_command_t commands[METRICS_COMMAND_SLOTS];     // [0] is "(other)"
+    metrics_session_t sessions[METRICS_SESSION_SLOTS];
+} metrics_region_t;
+
+// Upper bounds of the latency buckets in nanoseconds (100 us ... 10 s, then +Inf)
+static const uint64_t bucket_bounds[METRICS_BUCKETS - 1] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+static metrics_region_t *region = NULL;
+static int current_slot = -1;      // session this process records for
+static int admin_fd = -1;
+static int region_fd = -1;
+
+// The command being executed by this process
+static struct {
+    int active;
+    metrics_command_t *command;
+    uint64_t start, spawned, first_byte, bytes_out;
+} current;
+
+#define ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* ==============================================================================================
+ * Region and Session Slots
+ * ==============================================================================================
+ */
+
+
+void metrics_init(void) {
+    if (region) return;
+#if defined(MFD_CLOEXEC)
+    region_fd = memfd_create("myshell-metrics", MFD_CLOEXEC);
+    if (region_fd >= 0 && ftruncate(region_fd, sizeof(metrics_region_t)) < 0) {
+        close(region_fd);
+        region_fd = -1;
+    }
+#endif
+    void *memory = mmap(NULL, sizeof(metrics_region_t), PROT_READ | PROT_WRITE,
+                        region_fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, region_fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("[WARN] Metrics disabled, mmap failed");
+        return;
+    }
+    region = memory;
+    strcpy(region->commands[0].name, "(other)");
+    region->commands[0].state = NAME_READY;
+}
+
+// The memfd behind the region, passed on by a hot restart (-U); -1 for an anonymous mapping
+int metrics_region_fd(void) {
+    return region_fd;
+}
+
+// Hot restart: maps the region of the previous server, which its sessions go on writing to.
+// -1 (and the descriptor closed) if it does not have the layout of this build.
+int metrics_adopt(int fd) {
+    struct stat st;
+    void *memory = MAP_FAILED;
+    if (!region && fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(metrics_region_t))
+        memory = mmap(NULL, sizeof(metrics_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    region = memory;
+    region_fd = fd;
+    return 0;
+}
+
+// Claims a free session slot; -1 when all are taken (the session then only adds to the totals)
+int metrics_session_open(void) {
+    if (!region) return -1;
+    for (int slot = 0; slot < METRICS_SESSION_SLOTS; slot++) {
+        int32_t expected = 0;
+        if (__atomic_compare_exchange_n(&region->sessions[slot].in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            metrics_session_t *session = &region->sessions[slot];
+            memset(&session->counters, 0, sizeof(session->counters));
+            session->id = 0;
+            session->pid = 0;
+            session->started = time(NULL);
+            ADD(region->sessions_opened, 1);
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void metrics_session_label(int slot, int id, pid_t pid) {
+    if (!region || slot < 0) return;
+    region->sessions[slot].id = id;
+    region->sessions[slot].pid = pid;
+}
+
+void metrics_session_close(int slot) {
+    if (!region || slot < 0) return;
+    __atomic_store_n(&region->sessions[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Makes the calling process record its commands for the session in slot
+void metrics_attach(int slot) {
+    current_slot = slot;
+}
+
+
+/* ==============================================================================================
+ * Recording
+ * ==============================================================================================
+ */
+
+
+static metrics_counters_t *session_counters(void) {
+    return current_slot >= 0 ? &region->sessions[current_slot].counters : NULL;
+}
+
+void metrics_input(int slot, size_t bytes) {
+    if (!region) return;
+    ADD(region->totals.bytes_in, bytes);
+    if (slot >= 0) ADD(region->sessions[slot].counters.bytes_in, bytes);
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;       // FNV-1a
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static metrics_command_t *find_command(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char name[METRICS_NAME_SIZE];
+    snprintf(name, sizeof(name), "%s", slash ? slash + 1 : path);
+
+    uint32_t start = name_hash(name) % (METRICS_COMMAND_SLOTS - 1);
+    for (int probe = 0; probe < METRICS_COMMAND_SLOTS - 1; probe++) {
+        metrics_command_t *command = &region->commands[1 + (start + probe) % (METRICS_COMMAND_SLOTS - 1)];
+        int32_t state = __atomic_load_n(&command->state, __ATOMIC_ACQUIRE);
+
+        if (state == NAME_EMPTY) {
+            int32_t expected = NAME_EMPTY;
+            if (__atomic_compare_exchange_n(&command->state, &expected, NAME_CLAIMED, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                memcpy(command->name, name, sizeof(name));
+                __atomic_store_n(&command->state, NAME_READY, __ATOMIC_RELEASE);
+                return command;
+            }
+            state = expected;
+        }
+        // Another process is entering a name here right now; it is done within nanoseconds
+        while (state == NAME_CLAIMED) state = __atomic_load_n(&command->state, __ATOMIC_ACQUIRE);
+        if (strcmp(command->name, name) == 0) return command;
+    }
+    return &region->commands[0];
+}
+
+void metrics_command_begin(const char *name) {
+    if (!region) return;
+    current.active = 1;
+    current.command = find_command(name);
+    current.start = now_ns();
+    current.spawned = current.first_byte = current.bytes_out = 0;
+}
+
+void metrics_command_spawned(void) {
+    if (current.active) current.spawned = now_ns();
+}
+
+// Called by the forwarder for every chunk of output sent to the client
+void metrics_output(size_t bytes) {
+    if (!current.active) return;
+    if (current.first_byte == 0) current.first_byte = now_ns();
+    current.bytes_out += bytes;
+}
+
+void metrics_command_end(void) {
+    if (!current.active) return;
+    current.active = 0;
+
+    uint64_t exec = now_ns() - current.start;
+    uint64_t spawn = current.spawned ? current.spawned - current.start : 0;
+    uint64_t first_byte = current.first_byte ? current.first_byte - current.start : 0;
+
+    metrics_counters_t *targets[2] = { &region->totals, session_counters() };
+    for (int i = 0; i < 2 && targets[i]; i++) {
+        ADD(targets[i]->commands, 1);
+        ADD(targets[i]->bytes_out, current.bytes_out);
+        ADD(targets[i]->spawn_ns, spawn);
+        ADD(targets[i]->exec_ns, exec);
+        if (current.first_byte) {
+            ADD(targets[i]->first_byte_ns, first_byte);
+            ADD(targets[i]->first_byte_count, 1);
+        }
+    }
+
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && exec > bucket_bounds[bucket]) bucket++;
+    ADD(current.command->count, 1);
+    ADD(current.command->sum_ns, exec);
+    ADD(current.command->buckets[bucket], 1);
+}
+
+
+/* ==============================================================================================
+ * Formatting
+ * ==============================================================================================
+ * Both formats return a malloc'ed text the caller frees.
+ * ==============================================================================================
+ */
+
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text_t;
+
+static void appendf(text_t *text, const char *format, ...) {
+    while (1) {
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(text->data + text->len, text->cap - text->len, format, args);
+        va_end(args);
+        if (needed < 0) return;
+        if ((size_t)needed < text->cap - text->len) {
+            text->len += needed;
+            return;
+        }
+
+        size_t cap = text->cap ? text->cap * 2 : 4096;
+        while (cap - text->len <= (size_t)needed) cap *= 2;
+        char *grown = realloc(text->data, cap);
+        if (!grown) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        text->data = grown;
+        text->cap = cap;
+    }
+}
+
+static double average_ms(uint64_t total_ns, uint64_t count) {
+    return count ? total_ns / 1e6 / count : 0.0;
+}
+
+// Upper bound of the bucket holding the given quantile, in milliseconds (-1 = above 10 s)
+static double quantile_ms(const metrics_command_t *command, double quantile) {
+    uint64_t rank = command->count * quantile, seen = 0;
+    for (int bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++) {
+        seen += command->buckets[bucket];
+        if (seen > rank) return bucket_bounds[bucket] / 1e6;
+    }
+    return -1;
+}
+
+static void append_counters(text_t *text, const metrics_counters_t *counters) {
+    appendf(text, "%lu commands | in %lu B | out %lu B | spawn %.3f ms | first byte %.3f ms | exec %.3f ms\n",
+            (unsigned long)counters->commands, (unsigned long)counters->bytes_in,
+            (unsigned long)counters->bytes_out, average_ms(counters->spawn_ns, counters->commands),
+            average_ms(counters->first_byte_ns, counters->first_byte_count),
+            average_ms(counters->exec_ns, counters->commands));
+}
+
+char *metrics_format_verbose(size_t *len) {
+    text_t text = {0};
+    if (!region) {
+        appendf(&text, "Metrics: not available\n");
+        *len = text.len;
+        return text.data;
+    }
+
+    appendf(&text, "Totals (%lu sessions opened): ", (unsigned long)region->sessions_opened);
+    append_counters(&text, &region->totals);
+
+    appendf(&text, "Sessions (times are averages per command):\n");
+    for (int slot = 0; slot < METRICS_SESSION_SLOTS; slot++) {
+        const metrics_session_t *session = &region->sessions[slot];
+        if (!__atomic_load_n(&session->in_use, __ATOMIC_ACQUIRE) || session->pid == 0) continue;
+        appendf(&text, "  ID: %d | PID: %d | %lds | ", session->id, session->pid,
+                (long)(time(NULL) - session->started));
+        append_counters(&text, &session->counters);
+    }
+
+    appendf(&text, "Commands (execution time):\n");
+    for (int i = 0; i < METRICS_COMMAND_SLOTS; i++) {
+        const metrics_command_t *command = &region->commands[i];
+        if (command->state != NAME_READY || command->count == 0) continue;
+        appendf(&text, "  %-16s %8lu runs | avg %.3f ms | p50 <= %.1f ms | p99 <= %.1f ms\n",
+                command->name, (unsigned long)command->count, average_ms(command->sum_ns, command->count),
+                quantile_ms(command, 0.5), quantile_ms(command, 0.99));
+    }
+
+    *len = text.len;
+    return text.data;
+}
+
+static void append_metric(text_t *text, const char *name, const char *type, const char *help, double value) {
+    appendf(text, "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, value);
+}
+
+// Label values may contain any byte of a program name: escape as the exposition format wants
+static void append_label(text_t *text, const char *value) {
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') appendf(text, "\\%c", *value);
+        else if (*value == '\n') appendf(text, "\\n");
+        else appendf(text, "%c", *value);
+    }
+}
+
+char *metrics_format_prometheus(size_t *len) {
+    text_t text = {0};
+    if (!region) appendf(&text, "# metrics not available\n");
+    if (region) {
+        const metrics_counters_t *totals = &region->totals;
+        int active = 0;
+        for (int slot = 0; slot < METRICS_SESSION_SLOTS; slot++) active += region->sessions[slot].in_use != 0;
+
+        append_metric(&text, "myshell_sessions_opened_total", "counter", "Client sessions opened.",
+                      region->sessions_opened);
+        append_metric(&text, "myshell_sessions_active", "gauge", "Client sessions currently open.", active);
+        append_metric(&text, "myshell_commands_total", "counter", "Command pipelines executed.", totals->commands);
+        append_metric(&text, "myshell_input_bytes_total", "counter", "Command bytes received from clients.",
+                      totals->bytes_in);
+        append_metric(&text, "myshell_output_bytes_total", "counter", "Output bytes forwarded to clients.",
+                      totals->bytes_out);
+        append_metric(&text, "myshell_spawn_seconds_total", "counter", "Time spent starting pipeline stages.",
+                      totals->spawn_ns / 1e9);
+        append_metric(&text, "myshell_first_byte_seconds_total", "counter",
+                      "Time from pipeline start to the first forwarded output byte.", totals->first_byte_ns / 1e9);
+        append_metric(&text, "myshell_first_byte_commands_total", "counter",
+                      "Pipelines that forwarded output.", totals->first_byte_count);
+        append_metric(&text, "myshell_exec_seconds_total", "counter", "Time spent executing pipelines.",
+                      totals->exec_ns / 1e9);
+
+        appendf(&text, "# HELP myshell_command_duration_seconds Pipeline execution time by command.\n"
+                       "# TYPE myshell_command_duration_seconds histogram\n");
+        for (int i = 0; i < METRICS_COMMAND_SLOTS; i++) {
+            const metrics_command_t *command = &region->commands[i];
+            if (command->state != NAME_READY || command->count == 0) continue;
+
+            uint64_t cumulative = 0;
+            for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+                cumulative += command->buckets[bucket];
+                appendf(&text, "myshell_command_duration_seconds_bucket{command=\"");
+                append_label(&text, command->name);
+                if (bucket < METRICS_BUCKETS - 1)
+                    appendf(&text, "\",le=\"%g\"} %lu\n", bucket_bounds[bucket] / 1e9, (unsigned long)cumulative);
+                else
+                    appendf(&text, "\",le=\"+Inf\"} %lu\n", (unsigned long)cumulative);
+            }
+            appendf(&text, "myshell_command_duration_seconds_sum{command=\"");
+            append_label(&text, command->name);
+            appendf(&text, "\"} %.9g\n", command->sum_ns / 1e9);
+            appendf(&text, "myshell_command_duration_seconds_count{command=\"");
+            append_label(&text, command->name);
+            appendf(&text, "\"} %lu\n", (unsigned long)command->count);
+        }
+    }
+    *len = text.len;
+    return text.data;
+}
+
+
+/* ==============================================================================================
+ * Admin Socket
+ * ==============================================================================================
+ * The listener is opened before sessions and workers are forked, and every accept loop
+ * (forking server, event loop, each worker) watches it. A scrape is answered by a short-lived
+ * grandchild, so a slow or silent scraper never stalls the loop: it waits up to a second for
+ * an HTTP request (plain `nc`/`socat` clients send none), writes the dump and exits.
+ * ==============================================================================================
+ */
+
+
+#define ADMIN_REQUEST_TIMEOUT 1000      // ms to wait for a request line
+
+// Opens the -A admin socket: a number is a TCP port on 127.0.0.1, anything else a UNIX path
+int metrics_admin_open(const char *spec) {
+    char *end;
+    long port = strtol(spec, &end, 10);
+    int fd;
+
+    if (*spec && *end == '\0') {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int opt = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("[ERROR] Admin socket bind failed");
+            exit(1);
+        }
+    } else {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec, sizeof(addr.sun_path) - 1);
+        unlink(spec);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("[ERROR] Admin socket bind failed");
+            exit(1);
+        }
+    }
+
+    if (listen(fd, 16) < 0) {
+        perror("[ERROR] Admin socket listen failed");
+        exit(1);
+    }
+    // Shared by all workers: the ones that lose the race for a connection get EAGAIN
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    printf("[INFO] Metrics admin socket: %s\n", spec);
+    admin_fd = fd;
+    return fd;
+}
+
+// Hot restart: the admin socket stays bound, the new server serves it from now on
+void metrics_admin_adopt(int fd) {
+    admin_fd = fd;
+}
+
+int metrics_admin_fd(void) {
+    return admin_fd;
+}
+
+static void answer_scrape(int fd) {
+    char request[4096];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ssize_t bytes = 0;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (poll(&pfd, 1, ADMIN_REQUEST_TIMEOUT) > 0) bytes = read(fd, request, sizeof(request));
+
+    size_t len;
+    char *body = metrics_format_prometheus(&len);
+    if (bytes > 4 && memcmp(request, "GET ", 4) == 0) {
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+        proto_write_all(fd, header, header_len);
+    }
+    proto_write_all(fd, body, len);
+    free(body);
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+// Accepts all pending admin connections
+void metrics_admin_serve(void) {
+    int fd;
+    while ((fd = accept(admin_fd, NULL, NULL)) >= 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Detach through a second fork, so the loops never have to collect the responder
+            if (fork() == 0) {
+                answer_scrape(fd);
+                _exit(0);
+            }
+            _exit(0);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+        close(fd);
+    }
+}
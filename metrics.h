@@ -0,0 +1,35 @@
+#ifndef MYSHELL_METRICS_H
+#define MYSHELL_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define METRICS_SESSION_SLOTS 4096  // sessions with their own counters (more share the totals)
+#define METRICS_COMMAND_SLOTS 128   // command names with a latency histogram, incl. "(other)"
+#define METRICS_NAME_SIZE 32
+#define METRICS_BUCKETS 17          // latency buckets, the last one is +Inf
+
+void metrics_init(void);
+int metrics_region_fd(void);
+int metrics_adopt(int fd);
+int metrics_session_open(void);
+void metrics_session_label(int slot, int id, pid_t pid);
+void metrics_session_close(int slot);
+void metrics_attach(int slot);
+
+void metrics_input(int slot, size_t bytes);
+void metrics_command_begin(const char *name);
+void metrics_command_spawned(void);
+void metrics_output(size_t bytes);
+void metrics_command_end(void);
+
+char *metrics_format_verbose(size_t *len);
+char *metrics_format_prometheus(size_t *len);
+
+int metrics_admin_open(const char *spec);
+void metrics_admin_adopt(int fd);
+int metrics_admin_fd(void);
+void metrics_admin_serve(void);
+
+#endif //MYSHELL_METRICS_H
@@ -0,0 +1,536 @@
+/* ==============================================================================================
+ * Connection Multiplexer (-M)
+ * ==============================================================================================
+ *
+ * A local daemon in the spirit of ssh's ControlMaster: it keeps warm sessions to one server
+ * and lets one-shot clients (`./shell -c "cmd"`) use them through a UNIX control socket, so
+ * a command costs one local round trip instead of a connect, a handshake and a session fork.
+ *
+ *   ./shell -M -p 1234 -i 10.0.0.5      # daemon for a TCP server
+ *   ./shell -c -p 1234 -i 10.0.0.5 "uptime"
+ *
+ * The control socket is found from the same -u/-p/-i options the client uses (see
+ * mux_control_path(), or set it with -m <path>). A client that cannot reach it connects to
+ * the server directly, so the daemon is purely an accelerator.
+ *
+ * Local clients speak the normal framed protocol to the daemon. Each command is relayed to an
+ * idle upstream session; replies are passed back frame by frame with the stream ID rewritten
+ * to the client's, without buffering whole responses. Up to -N sessions
+ * (MUX_DEFAULT_UPSTREAMS) are opened on demand and kept; when all are busy, commands queue.
+ * `quit` is answered by the daemon itself, because the session belongs to the pool.
+ *
+ * Sessions are reused by unrelated clients, so session state such as the working directory
+ * after a `cd` carries over to whichever client gets that session next.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "client.h"
+#include "poller.h"
+#include "protocol.h"
+#include "compress.h"
+#include "mux.h"
+
+#define MUX_MAX_EVENTS 64
+#define MUX_INPUT_MAX (PROTO_HEADER_SIZE + PROTO_MAX_COMMAND)
+#define MUX_RELAY_BUF (64 * 1024)
+
+typedef struct mux_client mux_client_t;
+
+// One warm session to the server
+typedef struct mux_upstream {
+    int fd;
+    int busy;                           // a command is in flight (its client may be gone)
+    mux_client_t *client;               // client the reply goes to, NULL = discard
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    size_t header_len;
+    frame_header_t header;              // frame being relayed
+    size_t payload_left;
+    struct mux_upstream *next;
+} mux_upstream_t;
+
+// One local client on the control socket
+struct mux_client {
+    int fd;
+    int negotiated;
+    char in_buf[MUX_INPUT_MAX];
+    size_t in_len;
+    uint32_t stream_id;                 // request in flight
+    mux_upstream_t *upstream;           // session serving it
+    int queued;                         // waiting for a free session
+    mux_client_t *next_queued;
+};
+
+typedef struct {
+    mux_client_t *client;
+    mux_upstream_t *upstream;
+} mux_slot_t;
+
+static int poller_fd = -1;
+static mux_slot_t *fd_table = NULL;
+static int fd_table_size = 0;
+
+static mux_upstream_t *upstreams = NULL;
+static int upstream_count = 0;
+static int upstream_limit = MUX_DEFAULT_UPSTREAMS;
+static mux_client_t *queue_head = NULL;
+static mux_client_t *queue_tail = NULL;
+
+static const char *target_socket;
+static const char *target_host;
+static int target_port;
+static char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+
+// Control socket used by the daemon and by one-shot clients for the given server
+void mux_control_path(char *buf, size_t size, const char *socket_path, const char *host, int port) {
+    if (client_options.mux_path) snprintf(buf, size, "%s", client_options.mux_path);
+    else if (port > 0) snprintf(buf, size, "/tmp/myshell_mux_%s_%d", host, port);
+    else snprintf(buf, size, "%s.mux", socket_path);
+}
+
+static void fd_table_set(int fd, mux_client_t *client, mux_upstream_t *upstream) {
+    if (fd >= fd_table_size) {
+        int new_size = fd_table_size ? fd_table_size : 64;
+        while (new_size <= fd) new_size *= 2;
+
+        mux_slot_t *table = realloc(fd_table, new_size * sizeof(mux_slot_t));
+        if (!table) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        memset(table + fd_table_size, 0, (new_size - fd_table_size) * sizeof(mux_slot_t));
+        fd_table = table;
+        fd_table_size = new_size;
+    }
+    fd_table[fd].client = client;
+    fd_table[fd].upstream = upstream;
+}
+
+
+/* ==============================================================================================
+ * Local Clients
+ * ==============================================================================================
+ */
+
+
+// Sends a frame tagged with the client's current request; write errors surface as EOF later
+static void client_send(mux_client_t *client, int type, const void *payload, size_t len, int status) {
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    frame_header_t header = {0};
+    header.type = type;
+    header.stream_id = client->stream_id;
+    header.length = len;
+    header.status = status;
+    proto_encode_header(header_buf, &header);
+    if (proto_write_all(client->fd, header_buf, PROTO_HEADER_SIZE) == 0 && len > 0)
+        proto_write_all(client->fd, payload, len);
+}
+
+static void client_fail(mux_client_t *client, const char *message) {
+    client_send(client, FRAME_DATA, message, strlen(message), 0);
+    client_send(client, FRAME_END, NULL, 0, 1);
+}
+
+// Clients are only read while they have no request in flight, which keeps their commands in order
+static void client_update_interest(mux_client_t *client) {
+    int idle = !client->upstream && !client->queued;
+    poller_mod(poller_fd, client->fd, idle ? POLLER_READ : 0);
+}
+
+static void client_close(mux_client_t *client) {
+    if (client->upstream) client->upstream->client = NULL;
+
+    if (client->queued) {
+        mux_client_t **link = &queue_head;
+        queue_tail = NULL;
+        while (*link) {
+            if (*link == client) *link = client->next_queued;
+            else {
+                queue_tail = *link;
+                link = &(*link)->next_queued;
+            }
+        }
+    }
+
+    poller_del(poller_fd, client->fd);
+    fd_table_set(client->fd, NULL, NULL);
+    close(client->fd);
+    free(client);
+}
+
+
+/* ==============================================================================================
+ * Upstream Sessions
+ * ==============================================================================================
+ */
+
+
+static void drain_queue(void);
+
+static mux_upstream_t *upstream_open(void) {
+    int fd = target_port > 0 ? client_connect_tcp(target_host, target_port) : client_connect_unix(target_socket);
+    if (fd < 0) return NULL;
+
+    // Raw streams are not requested: the daemon relays frames only. Compressed DATA frames
+    // are relayed as they are and decompressed by the -c client, built from the same binary.
+    fd = client_handshake(fd, target_port > 0 ? target_host : NULL, target_port, compress_supported());
+    if (fd < 0 || proto_get_mode(fd) != PROTO_FRAMED) {
+        fprintf(stderr, "[WARN] Multiplexer: server did not negotiate the framed protocol\n");
+        if (fd >= 0) close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    mux_upstream_t *upstream = calloc(1, sizeof(mux_upstream_t));
+    if (!upstream) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    upstream->fd = fd;
+    upstream->next = upstreams;
+    upstreams = upstream;
+    upstream_count++;
+
+    fd_table_set(fd, NULL, upstream);
+    poller_add(poller_fd, fd, POLLER_READ);
+    return upstream;
+}
+
+static void upstream_close(mux_upstream_t *upstream) {
+    if (upstream->client) {
+        mux_client_t *client = upstream->client;
+        client->upstream = NULL;
+        client_fail(client, "[ERROR] Connection to server lost\n");
+        client_update_interest(client);
+    }
+
+    mux_upstream_t **link = &upstreams;
+    while (*link && *link != upstream) link = &(*link)->next;
+    if (*link) *link = upstream->next;
+    upstream_count--;
+
+    poller_del(poller_fd, upstream->fd);
+    fd_table_set(upstream->fd, NULL, NULL);
+    proto_forget(upstream->fd);
+    close(upstream->fd);
+    free(upstream);
+
+    // Queued commands must not wait for a session that is gone
+    drain_queue();
+}
+
+// Sends the client's command on the session. If the session turns out to be broken it is
+// closed, which also sends the client its error reply; -1 is returned then.
+static int upstream_start(mux_upstream_t *upstream, mux_client_t *client, const char *command, size_t len) {
+    upstream->busy = 1;
+    upstream->client = client;
+    client->upstream = upstream;
+    if (proto_send_command(upstream->fd, PROTO_FRAMED, 1, command, len) < 0) {
+        upstream_close(upstream);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ==============================================================================================
+ * Dispatching
+ * ==============================================================================================
+ * The command of a queued client stays at the start of its input buffer until a session
+ * becomes free.
+ * ==============================================================================================
+ */
+
+
+static void client_process(mux_client_t *client);
+
+static void dispatch(mux_client_t *client, const char *command, size_t len) {
+    mux_upstream_t *upstream = upstreams;
+    while (upstream && upstream->busy) upstream = upstream->next;
+
+    if (!upstream && upstream_count < upstream_limit) {
+        upstream = upstream_open();
+        if (!upstream && upstream_count == 0) {
+            char message[256];
+            snprintf(message, sizeof(message), "[ERROR] Multiplexer cannot reach the server: %s\n", strerror(errno));
+            client_fail(client, message);
+            return;
+        }
+    }
+
+    if (!upstream) {
+        client->queued = 1;
+        client->next_queued = NULL;
+        if (queue_tail) queue_tail->next_queued = client;
+        else queue_head = client;
+        queue_tail = client;
+        return;
+    }
+
+    upstream_start(upstream, client, command, len);
+}
+
+// Hands queued commands to free sessions, opening new ones while below the limit
+static void drain_queue(void) {
+    while (queue_head) {
+        mux_upstream_t *upstream = upstreams;
+        while (upstream && upstream->busy) upstream = upstream->next;
+        if (!upstream && upstream_count < upstream_limit) upstream = upstream_open();
+        if (!upstream && upstream_count > 0) return;    // wait for a busy session
+
+        mux_client_t *client = queue_head;
+        queue_head = client->next_queued;
+        if (!queue_head) queue_tail = NULL;
+        client->queued = 0;
+
+        frame_header_t header;
+        long frame = proto_parse_frame(client->in_buf, client->in_len, &header);
+        if (upstream) {
+            upstream_start(upstream, client, client->in_buf + PROTO_HEADER_SIZE, header.length);
+        } else {
+            client_fail(client, "[ERROR] Multiplexer cannot reach the server\n");
+        }
+        memmove(client->in_buf, client->in_buf + frame, client->in_len - frame);
+        client->in_len -= frame;
+        if (!client->upstream) client_process(client);
+    }
+}
+
+static void client_process(mux_client_t *client) {
+    frame_header_t header;
+    long frame;
+
+    while (!client->upstream && !client->queued &&
+           (frame = proto_parse_frame(client->in_buf, client->in_len, &header)) != 0) {
+        if (frame < 0 || (!client->negotiated && header.type != FRAME_HELLO)) {
+            client_close(client);
+            return;
+        }
+
+        const char *payload = client->in_buf + PROTO_HEADER_SIZE;
+        if (header.type == FRAME_HELLO) {
+            client->negotiated = 1;
+            proto_send_hello(client->fd, 0);
+        } else if (header.type == FRAME_COMMAND) {
+            client->stream_id = header.stream_id;
+            if (header.length >= 4 && strncmp(payload, "quit", 4) == 0) {
+                // The session stays in the pool; only the client goes
+                client_send(client, FRAME_QUIT, NULL, 0, 0);
+                client_send(client, FRAME_END, NULL, 0, 0);
+            } else {
+                dispatch(client, payload, header.length);
+                if (client->queued) break;    // the command stays buffered until dispatched
+            }
+        }
+
+        memmove(client->in_buf, client->in_buf + frame, client->in_len - frame);
+        client->in_len -= frame;
+    }
+    client_update_interest(client);
+}
+
+static void client_readable(mux_client_t *client) {
+    if (client->in_len == sizeof(client->in_buf)) {
+        client_close(client);           // no valid frame fits: not one of our clients
+        return;
+    }
+
+    ssize_t bytes = read(client->fd, client->in_buf + client->in_len, sizeof(client->in_buf) - client->in_len);
+    if (bytes <= 0) {
+        if (bytes < 0 && errno == EINTR) return;
+        client_close(client);
+        return;
+    }
+    client->in_len += bytes;
+    client_process(client);
+}
+
+
+/* ==============================================================================================
+ * Relaying Replies
+ * ==============================================================================================
+ */
+
+
+static void upstream_readable(mux_upstream_t *upstream) {
+    static char buf[MUX_RELAY_BUF];
+
+    ssize_t bytes = read(upstream->fd, buf, sizeof(buf));
+    if (bytes <= 0) {
+        if (bytes < 0 && errno == EINTR) return;
+        upstream_close(upstream);
+        return;
+    }
+
+    char *data = buf;
+    size_t len = bytes;
+    while (len > 0) {
+        if (upstream->header_len < PROTO_HEADER_SIZE) {
+            size_t take = PROTO_HEADER_SIZE - upstream->header_len;
+            if (take > len) take = len;
+            memcpy(upstream->header_buf + upstream->header_len, data, take);
+            upstream->header_len += take;
+            data += take;
+            len -= take;
+            if (upstream->header_len < PROTO_HEADER_SIZE) break;
+
+            if (proto_decode_header(upstream->header_buf, &upstream->header) < 0) {
+                fprintf(stderr, "[WARN] Multiplexer: invalid frame from server\n");
+                upstream_close(upstream);
+                return;
+            }
+            upstream->payload_left = upstream->header.length;
+
+            // Pass the header on under the client's stream ID
+            if (upstream->client) {
+                unsigned char header_buf[PROTO_HEADER_SIZE];
+                frame_header_t header = upstream->header;
+                header.stream_id = upstream->client->stream_id;
+                proto_encode_header(header_buf, &header);
+                proto_write_all(upstream->client->fd, header_buf, PROTO_HEADER_SIZE);
+            }
+        }
+
+        size_t take = upstream->payload_left < len ? upstream->payload_left : len;
+        if (take > 0 && upstream->client) proto_write_all(upstream->client->fd, data, take);
+        data += take;
+        len -= take;
+        upstream->payload_left -= take;
+
+        if (upstream->payload_left > 0) break;
+        upstream->header_len = 0;
+
+        // END completes the request: free the session and continue with the client's next one
+        if (upstream->header.type == FRAME_END && upstream->busy) {
+            mux_client_t *client = upstream->client;
+            upstream->busy = 0;
+            upstream->client = NULL;
+            if (client) {
+                client->upstream = NULL;
+                client_process(client);
+            }
+            drain_queue();
+        }
+    }
+}
+
+
+/* ==============================================================================================
+ * Daemon
+ * ==============================================================================================
+ */
+
+
+static void remove_control_socket(int sig) {
+    unlink(control_path);
+    _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+void run_mux(const char *socket_path, const char *host, int port, int max_upstreams) {
+    target_socket = socket_path;
+    target_host = host;
+    target_port = port;
+    if (max_upstreams > 0) upstream_limit = max_upstreams;
+    mux_control_path(control_path, sizeof(control_path), socket_path, host, port);
+
+    // Replies to clients that went away must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    int probe = client_connect_unix(control_path);
+    if (probe >= 0) {
+        fprintf(stderr, "[ERROR] A multiplexer is already running on %s\n", control_path);
+        close(probe);
+        exit(1);
+    }
+
+    poller_fd = poller_create();
+    if (poller_fd < 0) {
+        perror("[ERROR] Poller creation failed");
+        exit(1);
+    }
+
+    // Warm the first session right away, which also checks that the server is there
+    if (!upstream_open()) {
+        perror("[ERROR] Multiplexer cannot reach the server");
+        exit(1);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("[ERROR] Socket creation failed");
+        exit(1);
+    }
+    unlink(control_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[ERROR] Bind failed");
+        exit(1);
+    }
+    chmod(control_path, 0600);          // the sessions are ours: no other users
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("[ERROR] Listen failed");
+        exit(1);
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    poller_add(poller_fd, listen_fd, POLLER_READ);
+
+    signal(SIGTERM, remove_control_socket);
+    signal(SIGINT, remove_control_socket);
+
+    if (port > 0) printf("[MUX] Control socket %s for TCP %s:%d, up to %d sessions\n", control_path, host, port, upstream_limit);
+    else printf("[MUX] Control socket %s for %s, up to %d sessions\n", control_path, socket_path, upstream_limit);
+    fflush(stdout);
+
+    poller_event_t events[MUX_MAX_EVENTS];
+    while (1) {
+        int ready = poller_wait(poller_fd, events, MUX_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERROR] Poller wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].fd;
+
+            if (fd == listen_fd) {
+                int client_fd = accept(listen_fd, NULL, NULL);
+                if (client_fd < 0) continue;
+                fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+                mux_client_t *client = calloc(1, sizeof(mux_client_t));
+                if (!client) {
+                    perror("[ERROR] Memory allocation failed");
+                    exit(1);
+                }
+                client->fd = client_fd;
+                fd_table_set(client_fd, client, NULL);
+                poller_add(poller_fd, client_fd, POLLER_READ);
+                continue;
+            }
+
+            if (fd >= fd_table_size) continue;
+            if (fd_table[fd].client) client_readable(fd_table[fd].client);
+            else if (fd_table[fd].upstream) upstream_readable(fd_table[fd].upstream);
+        }
+    }
+
+    unlink(control_path);
+}
@@ -0,0 +1,11 @@
+#ifndef MYSHELL_MUX_H
+#define MYSHELL_MUX_H
+
+#include <stddef.h>
+
+#define MUX_DEFAULT_UPSTREAMS 8     // -N default: warm server sessions kept by the multiplexer
+
+void mux_control_path(char *buf, size_t size, const char *socket_path, const char *host, int port);
+void run_mux(const char *socket_path, const char *host, int port, int max_upstreams);
+
+#endif //MYSHELL_MUX_H
@@ -0,0 +1,280 @@
+/* ==============================================================================================
+ * Command Parser (Arena-backed)
+ * ==============================================================================================
+ *
+ * Turns one command line into pipelines of argument vectors without per-token allocations.
+ *
+ * parser_begin() copies the line into a per-request arena once. The tokenizer then works in
+ * place on that copy: every token is a slice of it, terminated by overwriting the whitespace
+ * or operator character that follows it with '\0'. argv and stage vectors are growable arrays
+ * that also live in the arena, so there are no fixed limits on the number of stages,
+ * arguments or argument length.
+ *
+ * Everything is released at once with arena_reset(); its memory is kept for the next line,
+ * so a steady stream of commands costs no malloc() calls at all.
+ *
+ * Grammar (as before):
+ *   line      := pipeline { ( ';' | '&' ) pipeline }
+ *   pipeline  := command { '|' command }
+ *   command   := { word | '<' file | '>' file | '>>' file | '<<' delimiter | '<<<' word }
+ * "<< delimiter" marks the stage to read the heredoc body the client sent ahead of the line
+ * (the client already ended the body at the delimiter); "<<< word" feeds it word plus a
+ * newline (heredoc.c). A pipeline ended by '&' is marked to run in the background (jobs.c).
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+#define INITIAL_ARGV 8
+#define INITIAL_STAGES 4
+
+
+/* ==============================================================================================
+ * Arena
+ * ==============================================================================================
+ */
+
+
+static arena_block_t *new_block(size_t size) {
+    arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+    if (!block) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (!arena->head || arena->head->size - arena->head->used < size) {
+        size_t block_size = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+        arena_block_t *block = new_block(size > block_size ? size : block_size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *ptr = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    return ptr;
+}
+
+// Frees everything allocated since the last reset. If the last request needed several blocks,
+// they are merged into a single one large enough for it to fit next time.
+void arena_reset(arena_t *arena) {
+    if (!arena->head) return;
+
+    if (arena->head->next) {
+        size_t total = 0;
+        while (arena->head) {
+            arena_block_t *next = arena->head->next;
+            total += arena->head->size;
+            free(arena->head);
+            arena->head = next;
+        }
+        arena->head = new_block(total);
+    }
+    arena->head->used = 0;
+}
+
+void arena_release(arena_t *arena) {
+    while (arena->head) {
+        arena_block_t *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+
+/* ==============================================================================================
+ * Growable Vectors
+ * ==============================================================================================
+ * Growing allocates a twice as large array from the arena; the old one is simply abandoned
+ * until the next reset.
+ * ==============================================================================================
+ */
+
+
+static void push_arg(arena_t *arena, command_t *command, char *arg) {
+    // Keep one slot free for the terminating NULL
+    if (command->argc + 1 >= command->argv_cap) {
+        size_t cap = command->argv_cap ? command->argv_cap * 2 : INITIAL_ARGV;
+        char **argv = arena_alloc(arena, cap * sizeof(char *));
+        if (command->argc) memcpy(argv, command->argv, command->argc * sizeof(char *));
+        command->argv = argv;
+        command->argv_cap = cap;
+    }
+    command->argv[command->argc++] = arg;
+    command->argv[command->argc] = NULL;
+}
+
+static command_t *push_stage(arena_t *arena, pipeline_t *pipeline) {
+    if (pipeline->count == pipeline->cap) {
+        size_t cap = pipeline->cap ? pipeline->cap * 2 : INITIAL_STAGES;
+        command_t *stages = arena_alloc(arena, cap * sizeof(command_t));
+        if (pipeline->count) memcpy(stages, pipeline->stages, pipeline->count * sizeof(command_t));
+        pipeline->stages = stages;
+        pipeline->cap = cap;
+    }
+    command_t *command = &pipeline->stages[pipeline->count++];
+    memset(command, 0, sizeof(command_t));
+    return command;
+}
+
+
+/* ==============================================================================================
+ * Tokenizer
+ * ==============================================================================================
+ */
+
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int is_delimiter(char c) {
+    return c == '\0' || c == '\n' || c == ';' || c == '|' || c == '&' || c == '<' || c == '>' || is_space(c);
+}
+
+// Returns the word at the cursor (after leading blanks), or NULL if there is none. The
+// character ending the word is left for the caller, which terminates the word when it has
+// examined that character.
+static char *read_word(char **cursor) {
+    char *p = *cursor;
+    while (is_space(*p)) *p++ = '\0';
+    if (is_delimiter(*p)) {
+        *cursor = p;
+        return NULL;
+    }
+
+    char *word = p;
+    while (!is_delimiter(*p)) p++;
+    *cursor = p;
+    return word;
+}
+
+// Copies the line into the arena; the returned cursor is passed to parse_pipeline()
+char *parser_begin(arena_t *arena, const char *line) {
+    size_t len = strlen(line);
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, line, len + 1);
+    return copy;
+}
+
+// Parses the next pipeline of the line. A pipeline without any stage (blank line, trailing or
+// doubled ';') is returned with count == 0.
+int parse_pipeline(arena_t *arena, char **cursor, pipeline_t *pipeline, const char **error) {
+    char *p = *cursor;
+    command_t *command = NULL;
+    int result = PARSE_LAST;
+
+    memset(pipeline, 0, sizeof(pipeline_t));
+    *error = NULL;
+
+    while (1) {
+        while (is_space(*p)) *p++ = '\0';
+        char c = *p;
+
+        if (c == '\0' || c == '\n') {
+            *p = '\0';
+            break;
+        }
+
+        if (c == ';') {
+            *p++ = '\0';
+            result = PARSE_SEQUENCE;
+            break;
+        }
+
+        if (c == '&') {
+            if (p[1] == '&') {
+                *error = "'&&' is not supported";
+                return PARSE_ERROR;
+            }
+            if (!command) {
+                *error = "missing command before '&'";
+                return PARSE_ERROR;
+            }
+            *p++ = '\0';
+            pipeline->background = 1;
+            result = PARSE_SEQUENCE;
+            break;
+        }
+
+        if (c == '|') {
+            if (!command || command->argc == 0) {
+                *error = "missing command before '|'";
+                return PARSE_ERROR;
+            }
+            *p++ = '\0';
+            command = push_stage(arena, pipeline);
+            continue;
+        }
+
+        if (!command) command = push_stage(arena, pipeline);
+
+        if (c == '<' && p[1] == '<') {
+            int here_string = (p[2] == '<');
+            *p = '\0';
+            p += here_string ? 3 : 2;
+
+            char *word = read_word(&p);
+            if (!word) {
+                *error = here_string ? "missing word after '<<<'" : "missing delimiter after '<<'";
+                return PARSE_ERROR;
+            }
+            if (here_string) {
+                command->input_text = word;
+                command->heredoc = 0;
+            } else {
+                command->heredoc = 1;
+                command->input_text = NULL;
+            }
+            command->input_file = NULL;
+            continue;
+        }
+
+        if (c == '<' || c == '>') {
+            int mode = REDIRECT_NONE;
+            if (c == '>') mode = (p[1] == '>') ? REDIRECT_APPEND : REDIRECT_TRUNCATE;
+            *p = '\0';
+            p += (mode == REDIRECT_APPEND) ? 2 : 1;
+
+            char *file = read_word(&p);
+            if (!file) {
+                *error = (c == '<') ? "missing file name after '<'" : "missing file name after '>'";
+                return PARSE_ERROR;
+            }
+            if (c == '<') {
+                command->input_file = file;
+                command->input_text = NULL;
+                command->heredoc = 0;
+            } else {
+                command->output_file = file;
+                command->output_mode = mode;
+            }
+            continue;
+        }
+
+        push_arg(arena, command, read_word(&p));
+    }
+
+    if (command && command->argc == 0) {
+        *error = pipeline->count > 1 ? "missing command after '|'" : "missing command";
+        return PARSE_ERROR;
+    }
+
+    *cursor = p;
+    return result;
+}
@@ -0,0 +1,58 @@
+#ifndef MYSHELL_PARSER_H
+#define MYSHELL_PARSER_H
+
+#include <stddef.h>
+
+// Bump allocator for everything one command line needs; reset as a whole per request
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *head;
+    size_t block_size;              // minimum block size, 0 = ARENA_BLOCK_SIZE
+} arena_t;
+
+enum {
+    REDIRECT_NONE = 0,
+    REDIRECT_TRUNCATE = 1,          // >
+    REDIRECT_APPEND = 2             // >>
+};
+
+// One stage of a pipeline
+typedef struct {
+    char **argv;                    // NULL-terminated, strings point into the arena copy of the line
+    char *path;                     // pre-resolved executable (copy from the path cache), NULL = search PATH
+    size_t argc;
+    size_t argv_cap;
+    char *input_file;               // < file, or NULL
+    char *input_text;               // <<< word, or NULL
+    int heredoc;                    // << delimiter: stdin is the body sent with the line
+    char *output_file;              // > / >> file, or NULL
+    int output_mode;                // REDIRECT_*
+} command_t;
+
+typedef struct {
+    command_t *stages;
+    size_t count;
+    size_t cap;
+    int background;                 // ended by '&': runs as a job (jobs.c)
+} pipeline_t;
+
+enum {
+    PARSE_ERROR = -1,               // syntax error, message in *error
+    PARSE_LAST = 0,                 // pipeline ends the line
+    PARSE_SEQUENCE = 1              // pipeline is followed by ';' and more input
+};
+
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_release(arena_t *arena);
+
+char *parser_begin(arena_t *arena, const char *line);
+int parse_pipeline(arena_t *arena, char **cursor, pipeline_t *pipeline, const char **error);
+
+#endif //MYSHELL_PARSER_H
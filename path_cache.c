@@ -0,0 +1,234 @@
+/* ==============================================================================================
+ * Command Path Cache (`hash`)
+ * ==============================================================================================
+ *
+ * Remembers where commands were found in $PATH, like the `hash` builtin of other shells, so
+ * stages are started with execv() / posix_spawn() on an absolute path instead of letting
+ * execvp() walk every PATH directory again in every child.
+ *
+ * Entries are kept in a hash table keyed by command name. Only regular, executable files in
+ * absolute PATH directories are cached; anything else is left to the PATH search at run time.
+ *
+ * Invalidation: installing or removing a program changes the mtime of its directory. The
+ * mtimes of all PATH directories are recorded when the cache is filled and compared again
+ * by path_cache_validate(), at most once per PATH_CHECK_INTERVAL; any change (or a changed
+ * $PATH) drops the whole cache. `hash -r` drops it explicitly.
+ *
+ * Every drop increments a generation number. Resolved paths handed out stay valid until the
+ * next drop, so holders (the plan cache) re-resolve when the generation has changed.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "path_cache.h"
+
+#define PATH_HASH_BUCKETS 256       // power of two
+#define PATH_CHECK_INTERVAL 1       // seconds between PATH directory mtime checks
+
+typedef struct path_entry {
+    struct path_entry *next;
+    unsigned long hits;
+    char *path;                     // points behind the name in the same allocation
+    char name[];
+} path_entry_t;
+
+typedef struct {
+    char *dir;
+    int exists;
+    struct timespec mtime;
+} dir_stamp_t;
+
+static path_entry_t *buckets[PATH_HASH_BUCKETS];
+static size_t entry_count = 0;
+static unsigned long generation = 1;
+
+static char *path_copy = NULL;      // $PATH the directory stamps were taken from
+static dir_stamp_t *stamps = NULL;
+static size_t stamp_count = 0;
+static time_t last_check = 0;
+
+
+/* ==============================================================================================
+ * PATH Directory Stamps
+ * ==============================================================================================
+ */
+
+
+static const char *current_path(void) {
+    const char *path_env = getenv("PATH");
+    return path_env ? path_env : "/usr/local/bin:/usr/bin:/bin";
+}
+
+static int stamp_dir(dir_stamp_t *stamp) {
+    struct stat st;
+    int exists = stat(stamp->dir, &st) == 0;
+    int changed = exists != stamp->exists
+                  || (exists && (st.st_mtim.tv_sec != stamp->mtime.tv_sec
+                                 || st.st_mtim.tv_nsec != stamp->mtime.tv_nsec));
+    stamp->exists = exists;
+    if (exists) stamp->mtime = st.st_mtim;
+    return changed;
+}
+
+// Splits $PATH into directory stamps (called whenever the cache is empty)
+static void take_stamps(void) {
+    const char *path_env = current_path();
+
+    for (size_t i = 0; i < stamp_count; i++) free(stamps[i].dir);
+    free(stamps);
+    free(path_copy);
+    stamps = NULL;
+    stamp_count = 0;
+
+    path_copy = strdup(path_env);
+    size_t max_dirs = 1;
+    for (const char *p = path_env; *p; p++) if (*p == ':') max_dirs++;
+    stamps = calloc(max_dirs, sizeof(dir_stamp_t));
+    if (!path_copy || !stamps) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t len = end ? (size_t)(end - dir) : strlen(dir);
+        dir_stamp_t *stamp = &stamps[stamp_count++];
+        stamp->dir = strndup(dir, len);
+        if (!stamp->dir) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        stamp_dir(stamp);
+        if (!end) break;
+        dir = end + 1;
+    }
+    last_check = time(NULL);
+}
+
+
+/* ==============================================================================================
+ * Hash Table
+ * ==============================================================================================
+ */
+
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;    // FNV-1a
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void path_cache_reset(void) {
+    for (int i = 0; i < PATH_HASH_BUCKETS; i++) {
+        while (buckets[i]) {
+            path_entry_t *next = buckets[i]->next;
+            free(buckets[i]);
+            buckets[i] = next;
+        }
+    }
+    entry_count = 0;
+    generation++;
+}
+
+unsigned long path_cache_generation(void) {
+    return generation;
+}
+
+// Drops the cache if $PATH or one of its directories has changed since the entries were found
+void path_cache_validate(void) {
+    if (entry_count == 0) return;
+
+    time_t now = time(NULL);
+    if (now - last_check < PATH_CHECK_INTERVAL && now >= last_check) return;
+    last_check = now;
+
+    int changed = (path_copy == NULL || strcmp(path_copy, current_path()) != 0);
+    for (size_t i = 0; !changed && i < stamp_count; i++)
+        changed = stamp_dir(&stamps[i]);
+
+    if (changed) path_cache_reset();
+}
+
+
+/* ==============================================================================================
+ * Lookup
+ * ==============================================================================================
+ */
+
+
+static int search_path(const char *name, char *found, size_t size) {
+    for (size_t i = 0; i < stamp_count; i++) {
+        struct stat st;
+
+        // Empty and relative PATH entries depend on the current directory - don't cache them
+        if (stamps[i].dir[0] != '/') continue;
+        if (snprintf(found, size, "%s/%s", stamps[i].dir, name) >= (int)size) continue;
+        if (stat(found, &st) == 0 && S_ISREG(st.st_mode) && access(found, X_OK) == 0) return 1;
+    }
+    return 0;
+}
+
+// Returns the absolute path of a command, or NULL to leave it to the PATH search of execvp()
+const char *path_cache_lookup(const char *name) {
+    if (strchr(name, '/')) return NULL;
+
+    uint32_t hash = hash_name(name);
+    path_entry_t **bucket = &buckets[hash & (PATH_HASH_BUCKETS - 1)];
+    for (path_entry_t *entry = *bucket; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    // The stamps must describe the directories the new entry was found in
+    if (entry_count == 0) take_stamps();
+
+    char found[PATH_MAX];
+    if (!search_path(name, found, sizeof(found))) return NULL;
+
+    size_t name_len = strlen(name), path_len = strlen(found);
+    path_entry_t *entry = malloc(sizeof(path_entry_t) + name_len + 1 + path_len + 1);
+    if (!entry) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    memcpy(entry->name, name, name_len + 1);
+    entry->path = entry->name + name_len + 1;
+    memcpy(entry->path, found, path_len + 1);
+    entry->hits = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+    entry_count++;
+    return entry->path;
+}
+
+// Lists the cache like `hash` does: hits and path of every remembered command
+void path_cache_format(char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    if (entry_count == 0) {
+        snprintf(buf, size, "hash: hash table empty\n");
+        return;
+    }
+
+    len += snprintf(buf, size, "hits\tcommand\n");
+    for (int i = 0; i < PATH_HASH_BUCKETS && len < size; i++) {
+        for (path_entry_t *entry = buckets[i]; entry && len < size; entry = entry->next)
+            len += snprintf(buf + len, size - len, "%4lu\t%s\n", entry->hits, entry->path);
+    }
+}
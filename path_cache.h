@@ -0,0 +1,12 @@
+#ifndef MYSHELL_PATH_CACHE_H
+#define MYSHELL_PATH_CACHE_H
+
+#include <stddef.h>
+
+const char *path_cache_lookup(const char *name);
+void path_cache_validate(void);
+unsigned long path_cache_generation(void);
+void path_cache_reset(void);
+void path_cache_format(char *buf, size_t size);
+
+#endif //MYSHELL_PATH_CACHE_H
@@ -0,0 +1,200 @@
+/* ==============================================================================================
+ * Command Plan Cache
+ * ==============================================================================================
+ *
+ * Compiles command lines into plans and keeps the most recently used ones, so that a client
+ * sending the same line again (monitoring agents, scripts in a loop) skips tokenization and
+ * the PATH search of every stage.
+ *
+ * A plan is the parsed line: one step per ';'-separated part, each holding a pipeline whose
+ * redirections are already split out and whose executables are resolved to absolute paths
+ * through the path cache (path_cache.c). When that cache has been dropped since, the plan
+ * is re-resolved on its next use.
+ * Plans live in their own arena; when the cache is full the least recently used plan is
+ * evicted and its arena is reused for the new one.
+ *
+ * Lookup goes through a hash table keyed by the command line (without its newline); an LRU
+ * list orders the entries. The cache is per process: session children each have their own,
+ * the event-driven server keeps one in the master and compiles before forking a job.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "path_cache.h"
+#include "plan_cache.h"
+
+#define PLAN_HASH_BUCKETS 256       // power of two, at least 2 * PLAN_CACHE_SIZE
+#define PLAN_ARENA_BLOCK 1024
+#define INITIAL_STEPS 2
+
+static plan_t *buckets[PLAN_HASH_BUCKETS];
+static plan_t *lru_head = NULL;     // most recently used
+static plan_t *lru_tail = NULL;     // next to be evicted
+static size_t entry_count = 0;
+static unsigned long hit_count = 0;
+static unsigned long miss_count = 0;
+
+
+/* ==============================================================================================
+ * Compilation
+ * ==============================================================================================
+ */
+
+
+static void compile_plan(plan_t *plan, const char *line, size_t key_len) {
+    size_t cap = 0;
+
+    plan->key = arena_alloc(&plan->arena, key_len + 1);
+    memcpy(plan->key, line, key_len);
+    plan->key[key_len] = '\0';
+    plan->steps = NULL;
+    plan->count = 0;
+
+    char *cursor = parser_begin(&plan->arena, plan->key);
+    int result;
+    do {
+        if (plan->count == cap) {
+            cap = cap ? cap * 2 : INITIAL_STEPS;
+            plan_step_t *steps = arena_alloc(&plan->arena, cap * sizeof(plan_step_t));
+            if (plan->count) memcpy(steps, plan->steps, plan->count * sizeof(plan_step_t));
+            plan->steps = steps;
+        }
+
+        plan_step_t *step = &plan->steps[plan->count++];
+        result = parse_pipeline(&plan->arena, &cursor, &step->pipeline, &step->error);
+        step->result = result;
+
+    } while (result == PARSE_SEQUENCE);
+}
+
+// (Re)binds every stage to the executable the path cache currently knows for it. The paths
+// are copied into the arena: `hash -r` or a $PATH change frees the path cache entries while
+// later steps of the same line still run.
+static void resolve_plan(plan_t *plan) {
+    for (size_t s = 0; s < plan->count; s++) {
+        pipeline_t *pipeline = &plan->steps[s].pipeline;
+        if (plan->steps[s].result == PARSE_ERROR) continue;
+        for (size_t i = 0; i < pipeline->count; i++) {
+            const char *path = path_cache_lookup(pipeline->stages[i].argv[0]);
+            pipeline->stages[i].path = NULL;
+            if (!path) continue;
+            size_t len = strlen(path) + 1;
+            pipeline->stages[i].path = memcpy(arena_alloc(&plan->arena, len), path, len);
+        }
+    }
+    plan->path_generation = path_cache_generation();
+}
+
+
+/* ==============================================================================================
+ * Hash Table and LRU List
+ * ==============================================================================================
+ */
+
+
+static uint32_t hash_key(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void lru_unlink(plan_t *plan) {
+    if (plan->lru_prev) plan->lru_prev->lru_next = plan->lru_next;
+    else lru_head = plan->lru_next;
+    if (plan->lru_next) plan->lru_next->lru_prev = plan->lru_prev;
+    else lru_tail = plan->lru_prev;
+    plan->lru_prev = plan->lru_next = NULL;
+}
+
+static void lru_push_front(plan_t *plan) {
+    plan->lru_prev = NULL;
+    plan->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = plan;
+    lru_head = plan;
+    if (!lru_tail) lru_tail = plan;
+}
+
+static void hash_remove(plan_t *plan) {
+    plan_t **link = &buckets[plan->hash & (PLAN_HASH_BUCKETS - 1)];
+    while (*link && *link != plan) link = &(*link)->hash_next;
+    if (*link) *link = plan->hash_next;
+    plan->hash_next = NULL;
+}
+
+// Takes a fresh plan, or recycles the least recently used one once the cache is full
+static plan_t *take_plan(void) {
+    if (entry_count < PLAN_CACHE_SIZE) {
+        plan_t *plan = calloc(1, sizeof(plan_t));
+        if (!plan) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        plan->arena.block_size = PLAN_ARENA_BLOCK;
+        entry_count++;
+        return plan;
+    }
+
+    plan_t *plan = lru_tail;
+    lru_unlink(plan);
+    hash_remove(plan);
+    arena_reset(&plan->arena);
+    return plan;
+}
+
+
+/* ==============================================================================================
+ * Public Interface
+ * ==============================================================================================
+ * The returned plan stays valid until the next lookup in the same process.
+ * ==============================================================================================
+ */
+
+
+const plan_t *plan_lookup(const char *line) {
+    return plan_lookup_view(line, strcspn(line, "\r\n"));
+}
+
+// Same for a line that is not NUL-terminated (e.g. a view into a mapped script)
+const plan_t *plan_lookup_view(const char *line, size_t len) {
+    size_t key_len = 0;
+    while (key_len < len && line[key_len] != '\r' && line[key_len] != '\n') key_len++;
+    uint32_t hash = hash_key(line, key_len);
+
+    // Resolved paths of cached plans are only trusted while the path cache still holds them
+    path_cache_validate();
+
+    for (plan_t *plan = buckets[hash & (PLAN_HASH_BUCKETS - 1)]; plan; plan = plan->hash_next) {
+        if (plan->hash == hash && strncmp(plan->key, line, key_len) == 0 && plan->key[key_len] == '\0') {
+            hit_count++;
+            lru_unlink(plan);
+            lru_push_front(plan);
+            if (plan->path_generation != path_cache_generation()) resolve_plan(plan);
+            return plan;
+        }
+    }
+
+    miss_count++;
+    plan_t *plan = take_plan();
+    compile_plan(plan, line, key_len);
+    resolve_plan(plan);
+    plan->hash = hash;
+
+    plan_t **bucket = &buckets[hash & (PLAN_HASH_BUCKETS - 1)];
+    plan->hash_next = *bucket;
+    *bucket = plan;
+    lru_push_front(plan);
+    return plan;
+}
+
+void plan_cache_stats(plan_cache_stats_t *stats) {
+    stats->hits = hit_count;
+    stats->misses = miss_count;
+    stats->entries = entry_count;
+}
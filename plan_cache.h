@@ -0,0 +1,40 @@
+#ifndef MYSHELL_PLAN_CACHE_H
+#define MYSHELL_PLAN_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "parser.h"
+
+#define PLAN_CACHE_SIZE 128         // Compiled command lines kept per process
+
+// One ';'-separated part of a command line
+typedef struct {
+    pipeline_t pipeline;            // count == 0 for an empty part
+    int result;                     // PARSE_* returned for this part
+    const char *error;              // syntax error message (PARSE_ERROR, always the last step)
+} plan_step_t;
+
+// A compiled command line
+typedef struct plan {
+    char *key;                      // command line without the trailing newline
+    uint32_t hash;
+    arena_t arena;                  // owns the key, the parsed line and all vectors
+    plan_step_t *steps;
+    size_t count;
+    unsigned long path_generation;  // path cache generation the stage paths belong to
+    struct plan *lru_prev;
+    struct plan *lru_next;
+    struct plan *hash_next;
+} plan_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    size_t entries;
+} plan_cache_stats_t;
+
+const plan_t *plan_lookup(const char *line);
+const plan_t *plan_lookup_view(const char *line, size_t len);
+void plan_cache_stats(plan_cache_stats_t *stats);
+
+#endif //MYSHELL_PLAN_CACHE_H
@@ -0,0 +1,151 @@
+/* ==============================================================================================
+ * Poller Module (epoll / kqueue Abstraction)
+ * ==============================================================================================
+ *
+ * Thin wrapper around the kernel event notification interface of the host system:
+ *   - epoll(7) on Linux
+ *   - kqueue(2) on FreeBSD (and other BSD-derived systems)
+ *
+ * The poller is represented by a plain file descriptor so it can be stored and closed like
+ * any other descriptor. Interest is expressed with POLLER_READ / POLLER_WRITE flags and
+ * readiness is reported back as an array of poller_event_t entries. All registrations are
+ * level-triggered, which keeps the callers as simple as a select() loop.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "poller.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__FreeBSD__) || defined(__APPLE__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define POLLER_KQUEUE 1
+#else
+#error "poller: no epoll or kqueue support on this platform"
+#endif
+
+
+#ifndef POLLER_KQUEUE
+
+/* ==============================================================================================
+ * epoll Backend (Linux)
+ * ==============================================================================================
+ */
+
+
+static unsigned int to_epoll_events(int events) {
+    unsigned int ev = 0;
+    if (events & POLLER_READ) ev |= EPOLLIN;
+    if (events & POLLER_WRITE) ev |= EPOLLOUT;
+    return ev;
+}
+
+int poller_create(void) {
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+int poller_add(int poller_fd, int fd, int events) {
+    struct epoll_event ev = {0};
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+    return epoll_ctl(poller_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int poller_mod(int poller_fd, int fd, int events) {
+    struct epoll_event ev = {0};
+    ev.events = to_epoll_events(events);
+    ev.data.fd = fd;
+    return epoll_ctl(poller_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int poller_del(int poller_fd, int fd) {
+    struct epoll_event ev = {0};
+    return epoll_ctl(poller_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int poller_wait(int poller_fd, poller_event_t *events, int max_events, int timeout_ms) {
+    struct epoll_event ready[max_events];
+
+    int n = epoll_wait(poller_fd, ready, max_events, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        events[i].fd = ready[i].data.fd;
+        events[i].events = 0;
+        if (ready[i].events & EPOLLIN) events[i].events |= POLLER_READ;
+        if (ready[i].events & EPOLLOUT) events[i].events |= POLLER_WRITE;
+        // Hang-ups are also reported as readable so the caller sees EOF on its next read
+        if (ready[i].events & (EPOLLHUP | EPOLLERR)) events[i].events |= POLLER_HUP | POLLER_READ;
+    }
+    return n;
+}
+
+#else
+
+/* ==============================================================================================
+ * kqueue Backend (FreeBSD)
+ * ==============================================================================================
+ * kqueue tracks read and write readiness as two separate filters. Both are registered up front
+ * and then switched on or off with EV_ENABLE / EV_DISABLE, so modifying the interest set never
+ * has to know what was registered before.
+ * ==============================================================================================
+ */
+
+
+static int kqueue_apply(int poller_fd, int fd, int events, unsigned short base_flags) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ,
+           base_flags | ((events & POLLER_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE,
+           base_flags | ((events & POLLER_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+    return kevent(poller_fd, changes, 2, NULL, 0, NULL);
+}
+
+int poller_create(void) {
+    return kqueue();
+}
+
+int poller_add(int poller_fd, int fd, int events) {
+    return kqueue_apply(poller_fd, fd, events, EV_ADD);
+}
+
+int poller_mod(int poller_fd, int fd, int events) {
+    return kqueue_apply(poller_fd, fd, events, 0);
+}
+
+int poller_del(int poller_fd, int fd) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    // One of the filters may have never been enabled - ENOENT is not an error here
+    if (kevent(poller_fd, changes, 2, NULL, 0, NULL) < 0 && errno != ENOENT)
+        return -1;
+    return 0;
+}
+
+int poller_wait(int poller_fd, poller_event_t *events, int max_events, int timeout_ms) {
+    struct kevent ready[max_events];
+    struct timespec ts, *tsp = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+
+    int n = kevent(poller_fd, NULL, 0, ready, max_events, tsp);
+    for (int i = 0; i < n; i++) {
+        events[i].fd = (int)ready[i].ident;
+        events[i].events = (ready[i].filter == EVFILT_WRITE) ? POLLER_WRITE : POLLER_READ;
+        if (ready[i].flags & (EV_EOF | EV_ERROR)) events[i].events |= POLLER_HUP;
+    }
+    return n;
+}
+
+#endif
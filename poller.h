@@ -0,0 +1,19 @@
+#ifndef MYSHELL_POLLER_H
+#define MYSHELL_POLLER_H
+
+#define POLLER_READ  0x1
+#define POLLER_WRITE 0x2
+#define POLLER_HUP   0x4
+
+typedef struct {
+    int fd;
+    int events;
+} poller_event_t;
+
+int poller_create(void);
+int poller_add(int poller_fd, int fd, int events);
+int poller_mod(int poller_fd, int fd, int events);
+int poller_del(int poller_fd, int fd);
+int poller_wait(int poller_fd, poller_event_t *events, int max_events, int timeout_ms);
+
+#endif //MYSHELL_POLLER_H
@@ -0,0 +1,491 @@
+/* ==============================================================================================
+ * Protocol Module (Framed Wire Protocol)
+ * ==============================================================================================
+ *
+ * Implements the versioned, length-prefixed protocol spoken between client and server, next to
+ * the original text protocol which stays available as a fallback.
+ *
+ * Legacy text mode:
+ *   - the client sends one command per line,
+ *   - the server answers with raw output followed by the in-band marker "[END]",
+ *   - control markers "[HALT]", "[QUIT]" and "[ABORT]" are sent as plain text.
+ *
+ * Framed mode: every message starts with a fixed 20-byte header in network byte order
+ *
+ *     offset  size  field
+ *        0     2    magic      "SN"
+ *        2     1    version    protocol version (PROTO_VERSION)
+ *        3     1    type       FRAME_* message type
+ *        4     4    flags      capability / per-frame flags
+ *        8     4    stream_id  request the frame belongs to
+ *       12     4    length     payload bytes following the header
+ *       16     4    status     exit status (FRAME_END)
+ *
+ * so payloads can be forwarded without being scanned and may contain any byte sequence.
+ *
+ * Negotiation: right after connecting, the client sends a FRAME_HELLO. A framed server answers
+ * with its own FRAME_HELLO and the connection switches to framed mode. A legacy server treats
+ * the hello as an unknown command and answers with an error message and "[END]"; the client
+ * discards that response and continues in text mode. Servers keep speaking text to clients
+ * that never send a hello. The hello flags announce optional capabilities (PROTO_CAP_*).
+ *
+ * Raw streams: a server running with direct output (-D) lets the last stage of a pipeline
+ * write straight into the socket. On framed connections whose client announced
+ * PROTO_CAP_RAW this is wrapped as a FRAME_RAW header carrying a random boundary token,
+ * the unframed output, the same token again and finally the usual FRAME_END. Legacy
+ * connections need no wrapping, their output is unframed anyway.
+ *
+ * Compression: when the server negotiated a codec with the client (compress.c), DATA frames
+ * of COMPRESS_MIN_SIZE bytes or more are sent compressed if that makes them smaller. Such a
+ * frame carries the codec ID in its flags and the uncompressed length in its status field.
+ * Raw streams bypass the framing and are therefore not used on compressed connections.
+ *
+ * Command input: a server announcing PROTO_CAP_STDIN takes the body of a heredoc (`<<`) in
+ * FRAME_STDIN frames sent right before the COMMAND frame of the line, each payload up to
+ * PROTO_MAX_COMMAND bytes; they are appended in order and become the stdin of the line's
+ * heredoc stage (heredoc.c). Clients of older servers fall back to rewriting the heredoc into
+ * the command line itself.
+ *
+ * The per-connection mode and current stream ID are kept in a small table indexed by file
+ * descriptor, so the rest of the server can keep passing plain client_fd values around.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "compress.h"
+#include "protocol.h"
+
+
+/* ==============================================================================================
+ * Header Encoding
+ * ==============================================================================================
+ */
+
+
+static void put_u32(unsigned char *out, uint32_t value) {
+    uint32_t be = htonl(value);
+    memcpy(out, &be, sizeof(be));
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    uint32_t be;
+    memcpy(&be, in, sizeof(be));
+    return ntohl(be);
+}
+
+void proto_encode_header(unsigned char *out, const frame_header_t *header) {
+    out[0] = (PROTO_MAGIC >> 8) & 0xFF;
+    out[1] = PROTO_MAGIC & 0xFF;
+    out[2] = header->version ? header->version : PROTO_VERSION;
+    out[3] = header->type;
+    put_u32(out + 4, header->flags);
+    put_u32(out + 8, header->stream_id);
+    put_u32(out + 12, header->length);
+    put_u32(out + 16, (uint32_t)header->status);
+}
+
+// Returns 0 on success, -1 when the bytes do not start with the protocol magic
+int proto_decode_header(const unsigned char *in, frame_header_t *header) {
+    if (in[0] != ((PROTO_MAGIC >> 8) & 0xFF) || in[1] != (PROTO_MAGIC & 0xFF))
+        return -1;
+    header->version = in[2];
+    header->type = in[3];
+    header->flags = get_u32(in + 4);
+    header->stream_id = get_u32(in + 8);
+    header->length = get_u32(in + 12);
+    header->status = (int32_t)get_u32(in + 16);
+    return 0;
+}
+
+// Returns the size of the complete frame at buf, 0 if more bytes are needed, -1 if invalid
+long proto_parse_frame(const char *buf, size_t len, frame_header_t *header) {
+    if (len < PROTO_HEADER_SIZE) return 0;
+    if (proto_decode_header((const unsigned char *)buf, header) < 0) return -1;
+    if (len < PROTO_HEADER_SIZE + (size_t)header->length) return 0;
+    return PROTO_HEADER_SIZE + (long)header->length;
+}
+
+int proto_is_hello(const char *buf, size_t len) {
+    frame_header_t header;
+    if (len < PROTO_HEADER_SIZE) return 0;
+    return proto_decode_header((const unsigned char *)buf, &header) == 0 && header.type == FRAME_HELLO;
+}
+
+// Text used for a frame type on legacy connections (NULL for payload-only frames)
+const char *proto_legacy_marker(int type) {
+    switch (type) {
+        case FRAME_END:   return "[END]";
+        case FRAME_HALT:  return "[HALT]";
+        case FRAME_QUIT:  return "[QUIT]";
+        case FRAME_ABORT: return "[ABORT]";
+        default:          return NULL;
+    }
+}
+
+
+/* ==============================================================================================
+ * Per-connection State
+ * ==============================================================================================
+ */
+
+
+typedef struct {
+    int mode;
+    uint32_t caps;
+    uint32_t stream_id;
+    int codec;                      // COMPRESS_* used for DATA frames
+} proto_state_t;
+
+static proto_state_t *states = NULL;
+static int states_size = 0;
+
+static proto_state_t *state_for(int fd) {
+    if (fd < 0) return NULL;
+    if (fd >= states_size) {
+        int new_size = states_size ? states_size : 64;
+        while (new_size <= fd) new_size *= 2;
+
+        proto_state_t *table = realloc(states, new_size * sizeof(proto_state_t));
+        if (!table) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        memset(table + states_size, 0, (new_size - states_size) * sizeof(proto_state_t));
+        states = table;
+        states_size = new_size;
+    }
+    return &states[fd];
+}
+
+// Switches a connection to framed mode after its hello and records the announced capabilities
+void proto_accept_hello(int fd, const char *hello) {
+    frame_header_t header;
+    proto_state_t *state = state_for(fd);
+    if (!state) return;
+
+    state->mode = PROTO_FRAMED;
+    state->caps = proto_decode_header((const unsigned char *)hello, &header) == 0 ? header.flags : 0;
+}
+
+// Whether raw output may be written to the connection (see "Raw streams" above)
+int proto_raw_capable(int fd) {
+    if (proto_get_mode(fd) == PROTO_LEGACY) return 1;
+    return (states[fd].caps & PROTO_CAP_RAW) != 0 && states[fd].codec == COMPRESS_NONE;
+}
+
+void proto_set_mode(int fd, int mode) {
+    proto_state_t *state = state_for(fd);
+    if (state) state->mode = mode;
+}
+
+int proto_get_mode(int fd) {
+    return (fd >= 0 && fd < states_size) ? states[fd].mode : PROTO_LEGACY;
+}
+
+void proto_set_stream(int fd, uint32_t stream_id) {
+    proto_state_t *state = state_for(fd);
+    if (state) state->stream_id = stream_id;
+}
+
+uint32_t proto_get_stream(int fd) {
+    return (fd >= 0 && fd < states_size) ? states[fd].stream_id : 0;
+}
+
+// Capabilities the peer announced in its hello
+uint32_t proto_get_caps(int fd) {
+    return (fd >= 0 && fd < states_size) ? states[fd].caps : 0;
+}
+
+void proto_set_codec(int fd, int codec) {
+    proto_state_t *state = state_for(fd);
+    if (state) state->codec = codec;
+}
+
+int proto_get_codec(int fd) {
+    return (fd >= 0 && fd < states_size) ? states[fd].codec : COMPRESS_NONE;
+}
+
+// Resets the state of a closed descriptor so a reused fd starts in legacy mode again
+void proto_forget(int fd) {
+    if (fd >= 0 && fd < states_size) memset(&states[fd], 0, sizeof(proto_state_t));
+}
+
+
+/* ==============================================================================================
+ * Sending
+ * ==============================================================================================
+ * Framed messages are written with a single writev() of header and payload, the last output
+ * of a reply together with its END frame (proto_send_reply). All send helpers silently ignore
+ * negative descriptors, which the server uses for local (script / -c) runs.
+ * ==============================================================================================
+ */
+
+
+int proto_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip the fully written vectors and advance into the partially written one
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Adds one message to iov (at most 2 entries): the payload and the marker of a legacy client,
+// or the frame header (encoded into header_buf) and the payload. Returns the entries used.
+static int frame_iov(int fd, struct iovec *iov, unsigned char *header_buf,
+                     int type, const void *payload, size_t len, int status) {
+    int count = 0;
+
+    if (proto_get_mode(fd) == PROTO_LEGACY) {
+        const char *marker = proto_legacy_marker(type);
+        if (len > 0) iov[count++] = (struct iovec){ (void *)payload, len };
+        if (marker) iov[count++] = (struct iovec){ (void *)marker, strlen(marker) };
+        return count;
+    }
+
+    frame_header_t header = {0};
+    header.type = type;
+    header.stream_id = proto_get_stream(fd);
+    header.status = status;
+
+    size_t packed_len;
+    const void *packed;
+    int codec = proto_get_codec(fd);
+    if (type == FRAME_DATA && codec != COMPRESS_NONE
+        && (packed = compress_pack(codec, payload, len, &packed_len)) != NULL) {
+        header.flags = codec;
+        header.status = (int32_t)len;
+        payload = packed;
+        len = packed_len;
+    }
+    header.length = len;
+    proto_encode_header(header_buf, &header);
+
+    iov[count++] = (struct iovec){ header_buf, PROTO_HEADER_SIZE };
+    if (len > 0) iov[count++] = (struct iovec){ (void *)payload, len };
+    return count;
+}
+
+int proto_send_frame(int fd, int type, const void *payload, size_t len, int status) {
+    if (fd < 0) return 0;
+
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    struct iovec iov[2];
+    int count = frame_iov(fd, iov, header_buf, type, payload, len, status);
+    return count > 0 ? writev_all(fd, iov, count) : 0;
+}
+
+int proto_send_data(int fd, const void *buf, size_t len) {
+    if (len == 0) return 0;
+    return proto_send_frame(fd, FRAME_DATA, buf, len, 0);
+}
+
+// The last output of a response and, if end is set, its END frame in a single writev(), so a
+// short reply leaves in one segment even with TCP_NODELAY (sockopt.c)
+int proto_send_reply(int fd, const void *buf, size_t len, int end, int status) {
+    if (fd < 0) return 0;
+
+    unsigned char header_buf[2][PROTO_HEADER_SIZE];
+    struct iovec iov[4];
+    int count = 0;
+    if (len > 0) count += frame_iov(fd, iov, header_buf[0], FRAME_DATA, buf, len, 0);
+    if (end) count += frame_iov(fd, iov + count, header_buf[1], FRAME_END, NULL, 0, status);
+    return count > 0 ? writev_all(fd, iov, count) : 0;
+}
+
+int proto_send_end(int fd, int status) {
+    return proto_send_frame(fd, FRAME_END, NULL, 0, status);
+}
+
+int proto_send_control(int fd, int type) {
+    return proto_send_frame(fd, type, NULL, 0, 0);
+}
+
+// Hello frames are always framed, whatever mode the descriptor is currently in
+int proto_send_hello(int fd, uint32_t flags) {
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    frame_header_t header = {0};
+    header.type = FRAME_HELLO;
+    header.flags = flags;
+    proto_encode_header(header_buf, &header);
+    return proto_write_all(fd, header_buf, PROTO_HEADER_SIZE);
+}
+
+// Announces a raw stream; token receives the boundary that proto_end_raw() must send
+int proto_begin_raw(int fd, unsigned char *token) {
+    if (fd < 0 || proto_get_mode(fd) == PROTO_LEGACY) return 0;
+
+    if (getentropy(token, PROTO_RAW_TOKEN_SIZE) < 0) {
+        // Not expected to fail, but a weak token is still better than none
+        unsigned int seed = (unsigned int)getpid() ^ (unsigned int)time(NULL);
+        for (int i = 0; i < PROTO_RAW_TOKEN_SIZE; i++) token[i] = rand_r(&seed) & 0xFF;
+    }
+    return proto_send_frame(fd, FRAME_RAW, token, PROTO_RAW_TOKEN_SIZE, 0);
+}
+
+int proto_end_raw(int fd, const unsigned char *token) {
+    if (fd < 0 || proto_get_mode(fd) == PROTO_LEGACY) return 0;
+    return proto_write_all(fd, token, PROTO_RAW_TOKEN_SIZE);
+}
+
+
+/* ==============================================================================================
+ * Buffered Frame Reader
+ * ==============================================================================================
+ * Used by the blocking session children. Several frames may arrive in one read() (pipelined
+ * clients) and a frame may be split across reads; the reader handles both. The returned
+ * payload points into the reader's buffer and stays valid until the next call.
+ * ==============================================================================================
+ */
+
+
+void proto_reader_feed(proto_reader_t *reader, const char *data, size_t len) {
+    if (len > sizeof(reader->buf) - reader->len) len = sizeof(reader->buf) - reader->len;
+    memcpy(reader->buf + reader->len, data, len);
+    reader->len += len;
+}
+
+// Returns 1 when a frame was read, 0 on EOF, -1 on error or protocol violation
+int proto_read_frame(proto_reader_t *reader, int fd, frame_header_t *header, char **payload) {
+    // Drop the frame returned by the previous call
+    if (reader->consumed > 0) {
+        memmove(reader->buf, reader->buf + reader->consumed, reader->len - reader->consumed);
+        reader->len -= reader->consumed;
+        reader->consumed = 0;
+    }
+
+    while (1) {
+        long frame_len = proto_parse_frame(reader->buf, reader->len, header);
+        if (frame_len < 0) return -1;
+        if (frame_len > 0) {
+            *payload = reader->buf + PROTO_HEADER_SIZE;
+            reader->consumed = frame_len;
+            return 1;
+        }
+        if (reader->len >= PROTO_HEADER_SIZE && header->length > PROTO_MAX_COMMAND) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        ssize_t bytes = read(fd, reader->buf + reader->len, sizeof(reader->buf) - reader->len);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return bytes;
+        reader->len += bytes;
+    }
+}
+
+
+/* ==============================================================================================
+ * Client Side
+ * ==============================================================================================
+ */
+
+
+static const char *find_marker(const char *buf, size_t len, const char *marker) {
+    size_t marker_len = strlen(marker);
+    for (size_t i = 0; i + marker_len <= len; i++) {
+        if (buf[i] == marker[0] && memcmp(buf + i, marker, marker_len) == 0)
+            return buf + i;
+    }
+    return NULL;
+}
+
+// Negotiates the protocol on a freshly connected blocking socket, offering the PROTO_CAP_*
+// flags in caps. Returns the mode or -1.
+int proto_client_hello(int sock, uint32_t caps) {
+    if (proto_send_hello(sock, caps) < 0) return -1;
+    return proto_await_hello(sock);
+}
+
+// Reads the answer to a hello the client has sent (here, or as TLS early data in tls.c) and
+// switches the connection to the server's mode. Returns the mode or -1.
+int proto_await_hello(int sock) {
+    char buf[4096];
+    size_t len = 0;
+
+    while (len < PROTO_HEADER_SIZE) {
+        ssize_t bytes = read(sock, buf + len, sizeof(buf) - len);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+        len += bytes;
+
+        // A legacy server answers with text: stop waiting for a full header
+        if (buf[0] != ((PROTO_MAGIC >> 8) & 0xFF) || find_marker(buf, len, "[END]")) break;
+    }
+
+    frame_header_t header;
+    if (len >= PROTO_HEADER_SIZE && proto_decode_header((unsigned char *)buf, &header) == 0
+        && header.type == FRAME_HELLO) {
+        proto_accept_hello(sock, buf);      // framed mode, and remember what the server offers
+        return PROTO_FRAMED;
+    }
+
+    // Legacy server: it executed the hello as a command - discard that response up to [END]
+    while (!find_marker(buf, len, "[END]")) {
+        // Keep a short tail so a marker split across two reads is still found
+        size_t keep = len < 4 ? len : 4;
+        memmove(buf, buf + len - keep, keep);
+        len = keep;
+
+        ssize_t bytes = read(sock, buf + len, sizeof(buf) - len);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+        len += bytes;
+    }
+
+    proto_set_mode(sock, PROTO_LEGACY);
+    return PROTO_LEGACY;
+}
+
+// Sends one command line in the connection's protocol
+int proto_send_command(int sock, int mode, uint32_t stream_id, const char *command, size_t len) {
+    if (mode == PROTO_LEGACY) return proto_write_all(sock, command, len);
+
+    unsigned char header_buf[PROTO_HEADER_SIZE];
+    frame_header_t header = {0};
+    header.type = FRAME_COMMAND;
+    header.stream_id = stream_id;
+    header.length = len;
+    proto_encode_header(header_buf, &header);
+
+    struct iovec iov[2] = {
+        { header_buf, PROTO_HEADER_SIZE },
+        { (void *)command, len }
+    };
+    return writev_all(sock, iov, 2);
+}
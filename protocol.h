@@ -0,0 +1,86 @@
+#ifndef MYSHELL_PROTOCOL_H
+#define MYSHELL_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0x534E          // "SN"
+#define PROTO_VERSION 1
+#define PROTO_HEADER_SIZE 20
+#define PROTO_MAX_COMMAND 4096      // Largest COMMAND payload a server accepts
+#define PROTO_RAW_TOKEN_SIZE 16     // Boundary token closing a FRAME_RAW stream
+
+#define PROTO_CAP_RAW 0x1           // Hello flag: peer understands FRAME_RAW streams
+#define PROTO_CAP_LZ4 0x2           // Hello flags: peer decompresses DATA frames with the codec
+#define PROTO_CAP_ZSTD 0x4          //   (1 << COMPRESS_* ID, see compress.h)
+#define PROTO_CAP_ZLIB 0x8
+#define PROTO_CAP_STDIN 0x10        // Hello flag: server takes FRAME_STDIN input for commands
+
+enum {
+    PROTO_LEGACY = 0,               // Plain text lines, responses terminated by "[END]"
+    PROTO_FRAMED = 1                // Length-prefixed frames
+};
+
+enum {
+    FRAME_HELLO = 1,                // Version negotiation, sent once in both directions
+    FRAME_COMMAND = 2,              // Client -> server: one command line
+    FRAME_DATA = 3,                 // Server -> client: command output, flags = codec if compressed
+    FRAME_END = 4,                  // Server -> client: response finished, status = exit code
+    FRAME_HALT = 5,                 // Server is shutting down
+    FRAME_QUIT = 6,                 // Client session closed on request
+    FRAME_ABORT = 7,                // Client session closed by `abort`
+    FRAME_RAW = 8,                  // Server -> client: unframed output until the token in the payload
+    FRAME_STDIN = 9                 // Client -> server: heredoc body for the next COMMAND of the stream
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint32_t flags;
+    uint32_t stream_id;
+    uint32_t length;
+    int32_t status;
+} frame_header_t;
+
+// Buffered frame reader for blocking sockets
+typedef struct {
+    char buf[PROTO_HEADER_SIZE + PROTO_MAX_COMMAND];
+    size_t len;
+    size_t consumed;
+} proto_reader_t;
+
+void proto_encode_header(unsigned char *out, const frame_header_t *header);
+int proto_decode_header(const unsigned char *in, frame_header_t *header);
+long proto_parse_frame(const char *buf, size_t len, frame_header_t *header);
+int proto_is_hello(const char *buf, size_t len);
+const char *proto_legacy_marker(int type);
+
+void proto_accept_hello(int fd, const char *hello);
+int proto_raw_capable(int fd);
+void proto_set_mode(int fd, int mode);
+int proto_get_mode(int fd);
+void proto_set_stream(int fd, uint32_t stream_id);
+uint32_t proto_get_stream(int fd);
+uint32_t proto_get_caps(int fd);
+void proto_set_codec(int fd, int codec);
+int proto_get_codec(int fd);
+void proto_forget(int fd);
+
+int proto_write_all(int fd, const void *buf, size_t len);
+int proto_send_frame(int fd, int type, const void *payload, size_t len, int status);
+int proto_send_data(int fd, const void *buf, size_t len);
+int proto_send_reply(int fd, const void *buf, size_t len, int end, int status);
+int proto_send_end(int fd, int status);
+int proto_send_control(int fd, int type);
+int proto_send_hello(int fd, uint32_t flags);
+int proto_begin_raw(int fd, unsigned char *token);
+int proto_end_raw(int fd, const unsigned char *token);
+
+void proto_reader_feed(proto_reader_t *reader, const char *data, size_t len);
+int proto_read_frame(proto_reader_t *reader, int fd, frame_header_t *header, char **payload);
+
+int proto_client_hello(int sock, uint32_t caps);
+int proto_await_hello(int sock);
+int proto_send_command(int sock, int mode, uint32_t stream_id, const char *command, size_t len);
+
+#endif //MYSHELL_PROTOCOL_H
@@ -0,0 +1,902 @@
+/* ==============================================================================================
+ * Session Recorder
+ * ==============================================================================================
+ *
+ * For audits the server can keep every command line its sessions run, with the output the
+ * client received and the exit status:
+ *
+ *   -r /var/log/myshell,segment=64M,ring=4M,codec=zstd
+ *
+ *   <dir>             directory of the log, created if needed
+ *   segment=<size>    start a new segment file once one reaches this size (default
+ *                     RECORDER_SEGMENT)
+ *   ring=<size>       shared buffer between the sessions and the writer (default RECORDER_RING)
+ *   codec=<name>      block compression (lz4, zstd, zlib, none; default the best built in)
+ *
+ * Sessions never touch the disk. A line produces a BEGIN record (time, session ID, PID,
+ * command line), OUTPUT records in pieces of up to RECORDER_CHUNK bytes, and an END record
+ * with the exit status. In the forking server and in -E jobs each session is its own
+ * process, so the records go into a lock-free ring in a MAP_SHARED region mapped before
+ * anything is forked: a producer claims space with a compare-and-swap on the reserve counter
+ * and publishes the record by storing its length last. If the ring is full the record is
+ * dropped, never waited for; the END record of that line then carries RECORD_TRUNCATED.
+ *
+ * One writer process, forked together with the ring, drains it in order. It collects records
+ * into blocks of RECORDER_BLOCK bytes (or whatever arrived within RECORDER_FLUSH_MS),
+ * compresses each block with the codecs of -Z (compress.c) and appends it to the current
+ * segment, <dir>/<n>.log; while it falls behind, blocks are stored uncompressed. For every
+ * block a fixed-size entry is appended to <n>.idx: time range, session ID range, offset and
+ * sizes. Files are only ever appended to, a restarted server starts a new segment, and an
+ * index entry is written after its block, so a crash loses at most the blocks that were not
+ * complete yet. Both files use native byte order. A hot restart (-U) passes the ring on: the
+ * old writer drains it and exits, the new server forks the next one, which starts a new
+ * segment, while the sessions taken over go on recording into the same ring.
+ *
+ * The query mode (-Q, recorder_query) reads the small index files and decompresses only the
+ * blocks whose time and session ranges match:
+ *
+ *   ./shell -r /var/log/myshell -Q from=2026-10-14T09:00,to=-10m,session=3,replay
+ *
+ * lists the commands of session 3 from 9:00 until ten minutes ago with their output (without
+ * replay: one line per command). Times are local, @<epoch> or -<n>[smhd] ago; -Q all lists
+ * the whole log.
+ *
+ * Internal commands the server answers itself (stat, abort, quit) are not recorded, and -D
+ * is turned off for recorded sessions: their output has to pass through the server.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "compress.h"
+#include "recorder.h"
+
+#define RECORD_BUSY 0x80000000u         // length flag: space claimed, record not finished yet
+#define RECORD_TRUNCATED 1              // END flag: some records of the line were dropped
+
+#define RECORDER_LOG_MAGIC "MYSHLOG1"
+#define RECORDER_INDEX_MAGIC "MYSHIDX1"
+#define RECORDER_BLOCK_MAGIC 0x4d53524bu
+#define RECORDER_MAGIC_SIZE 8
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+enum {
+    RECORD_PAD = 0,                     // ring only: rest of the ring before it wraps
+    RECORD_BEGIN = 1,                   // payload: the command line
+    RECORD_OUTPUT = 2,                  // payload: output as the client received it
+    RECORD_END = 3                      // status: exit status of the line
+};
+
+typedef struct {
+    uint32_t length;                    // of header and payload
+    uint16_t type;
+    uint16_t flags;
+    int32_t session;
+    int32_t pid;
+    int32_t status;
+    uint32_t reserved;
+    int64_t time_us;                    // CLOCK_REALTIME
+} record_t;
+
+typedef struct {
+    uint64_t reserved __attribute__((aligned(64)));     // bytes claimed by producers
+    uint64_t consumed __attribute__((aligned(64)));     // bytes released by the writer
+    uint64_t dropped;                   // records that did not fit
+    uint64_t size;
+    char data[] __attribute__((aligned(64)));
+} ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t codec;
+    uint32_t raw_len;
+    uint32_t stored_len;
+} block_header_t;
+
+// One entry of a segment's .idx file per block of its .log file
+typedef struct {
+    int64_t first_time;
+    int64_t last_time;
+    uint64_t offset;                    // of the block header in the .log file
+    uint32_t stored_len;
+    uint32_t raw_len;
+    int32_t min_session;
+    int32_t max_session;
+    uint32_t codec;
+    uint32_t records;
+} index_entry_t;
+
+static char *log_dir = NULL;
+static size_t segment_limit = RECORDER_SEGMENT;
+static size_t ring_size = RECORDER_RING;
+static int codec = -1;                  // -1 = best built in
+
+static ring_t *ring = NULL;
+static int ring_fd = -1;                // memfd of the ring, -1 for an anonymous mapping
+static pid_t writer_pid = -1;
+
+static int session_id = 0;              // connection ID of this process's session
+static int recording = 0;               // between recorder_begin() and recorder_end()
+static int lost = 0;                    // a record of the current line was dropped
+
+
+/* ==============================================================================================
+ * Configuration
+ * ==============================================================================================
+ */
+
+
+static int parse_size(const char *text, long long *bytes) {
+    char *end;
+    *bytes = strtoll(text, &end, 10);
+    if (*end == 'K' || *end == 'k') *bytes <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') *bytes <<= 20, end++;
+    else if (*end == 'G' || *end == 'g') *bytes <<= 30, end++;
+    return (*end != '\0' || *bytes < 1) ? -1 : 0;
+}
+
+int recorder_parse(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        long long value = 0;
+        char *equals = strchr(item, '=');
+        if (equals) *equals++ = '\0';
+
+        if (!equals && !log_dir) {
+            log_dir = strdup(item);
+        } else if (!equals) {
+            result = -1;
+        } else if (strcmp(item, "codec") == 0) {
+            if ((codec = compress_parse(equals)) < 0) result = -1;
+        } else if (parse_size(equals, &value) < 0) {
+            result = -1;
+        } else if (strcmp(item, "segment") == 0 && value >= (1 << 20)) {
+            segment_limit = value;
+        } else if (strcmp(item, "ring") == 0 && value >= (1 << 20) && value <= (1LL << 30)) {
+            ring_size = ALIGN8(value);
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    if (result == 0 && !log_dir) result = -1;
+    return result;
+}
+
+int recorder_enabled(void) {
+    return log_dir != NULL;
+}
+
+static int best_codec(void) {
+    static const int preferred[] = { COMPRESS_ZSTD, COMPRESS_ZLIB, COMPRESS_LZ4 };
+    for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+        if (compress_supported() & compress_cap(preferred[i])) return preferred[i];
+    }
+    return COMPRESS_NONE;
+}
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* ==============================================================================================
+ * Recording (session processes)
+ * ==============================================================================================
+ */
+
+
+// Claims space for one record and publishes it; -1 (and nothing waits) if the ring is full
+static int ring_put(int type, int flags, int status, const void *payload, size_t len) {
+    uint64_t size = ring->size;
+    uint32_t length = sizeof(record_t) + len;
+    uint64_t need = ALIGN8(length);
+    uint64_t head = __atomic_load_n(&ring->reserved, __ATOMIC_RELAXED);
+    uint64_t pad;
+
+    // A signal that ends the session (abort, halt) must not fall between the claim and the
+    // length: the writer could never tell how much to skip
+    sigset_t all, previous;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &previous);
+
+    do {
+        // A record never wraps: the rest of the ring is filled with a pad record instead
+        uint64_t pos = head % size;
+        pad = (pos + need > size) ? size - pos : 0;
+        if (head + pad + need - __atomic_load_n(&ring->consumed, __ATOMIC_ACQUIRE) > size) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            sigprocmask(SIG_SETMASK, &previous, NULL);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->reserved, &head, head + pad + need, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    record_t *record = (record_t *)(ring->data + head % size);
+    if (pad) {
+        record->type = RECORD_PAD;
+        __atomic_store_n(&record->length, (uint32_t)pad, __ATOMIC_RELEASE);
+        record = (record_t *)ring->data;
+    }
+
+    // The length goes first, so the writer can skip the record if this process dies now
+    __atomic_store_n(&record->length, length | RECORD_BUSY, __ATOMIC_RELAXED);
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    record->type = type;
+    record->flags = flags;
+    record->session = session_id;
+    record->pid = getpid();
+    record->status = status;
+    record->time_us = now_us();
+    if (len > 0) memcpy(record + 1, payload, len);
+    __atomic_store_n(&record->length, length, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void recorder_set_session(int id) {
+    session_id = id;
+}
+
+int recorder_active(void) {
+    return recording;
+}
+
+void recorder_begin(const char *line, size_t len) {
+    if (!ring) return;
+    recording = 1;
+    lost = 0;
+    if (len > RECORDER_CHUNK) len = RECORDER_CHUNK;
+    if (ring_put(RECORD_BEGIN, 0, 0, line, len) < 0) lost = 1;
+}
+
+void recorder_output(const char *data, size_t len) {
+    if (!recording) return;
+    for (size_t offset = 0; offset < len; offset += RECORDER_CHUNK) {
+        size_t chunk = len - offset < RECORDER_CHUNK ? len - offset : RECORDER_CHUNK;
+        if (ring_put(RECORD_OUTPUT, 0, 0, data + offset, chunk) < 0) lost = 1;
+    }
+}
+
+void recorder_end(int status) {
+    if (!recording) return;
+    recording = 0;
+    ring_put(RECORD_END, lost ? RECORD_TRUNCATED : 0, status, NULL, 0);
+}
+
+
+/* ==============================================================================================
+ * Writer Process
+ * ==============================================================================================
+ */
+
+
+static volatile sig_atomic_t stopping = 0;
+
+static unsigned segment_number = 0;
+static int segment_fd = -1;
+static int index_fd = -1;
+static uint64_t segment_size = 0;
+
+static char *block = NULL;
+static size_t block_len = 0;
+static index_entry_t block_entry;
+static int64_t block_started = 0;       // now_us() when its first record arrived
+static uint64_t reported_drops = 0;
+
+static void writer_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// Segments are numbered; a new writer continues after the highest number in the directory
+static unsigned last_segment(void) {
+    unsigned highest = 0;
+    DIR *dir = opendir(log_dir);
+    if (!dir) return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned number;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%u.%7s", &number, suffix) == 2 && strcmp(suffix, "idx") == 0
+            && number > highest)
+            highest = number;
+    }
+    closedir(dir);
+    return highest;
+}
+
+static int open_file(const char *suffix, const char *magic) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%08u.%s", log_dir, segment_number, suffix);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (fd >= 0 && write(fd, magic, RECORDER_MAGIC_SIZE) != RECORDER_MAGIC_SIZE) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) fprintf(stderr, "[ERROR] Recorder cannot create %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static int segment_open(void) {
+    if (segment_fd >= 0) {
+        fdatasync(segment_fd);
+        close(segment_fd);
+        close(index_fd);
+    }
+    segment_number++;
+    segment_fd = open_file("log", RECORDER_LOG_MAGIC);
+    index_fd = segment_fd >= 0 ? open_file("idx", RECORDER_INDEX_MAGIC) : -1;
+    if (index_fd < 0) {
+        if (segment_fd >= 0) close(segment_fd);
+        segment_fd = -1;
+        return -1;
+    }
+    segment_size = RECORDER_MAGIC_SIZE;
+    printf("[INFO] Recorder: writing segment %s/%08u.log\n", log_dir, segment_number);
+    fflush(stdout);
+    return 0;
+}
+
+static void block_flush(void) {
+    if (block_len == 0) return;
+
+    // Behind the sessions (the ring more than half full), blocks are stored as they are:
+    // compressing costs more than writing, and a full ring drops records
+    uint64_t backlog = __atomic_load_n(&ring->reserved, __ATOMIC_ACQUIRE) - ring->consumed;
+    size_t stored = block_len;
+    const void *data = backlog < ring->size / 2 ? compress_pack(codec, block, block_len, &stored) : NULL;
+    block_entry.codec = data ? (uint32_t)codec : COMPRESS_NONE;
+    if (!data) {
+        data = block;
+        stored = block_len;
+    }
+
+    block_header_t header = { RECORDER_BLOCK_MAGIC, block_entry.codec, block_len, stored };
+    if (segment_fd < 0 || segment_size + sizeof(header) + stored > segment_limit) segment_open();
+
+    block_entry.offset = segment_size;
+    block_entry.raw_len = block_len;
+    block_entry.stored_len = stored;
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)data, stored } };
+    if (segment_fd < 0 || writev(segment_fd, iov, 2) != (ssize_t)(sizeof(header) + stored)
+        || write(index_fd, &block_entry, sizeof(block_entry)) != sizeof(block_entry)) {
+        fprintf(stderr, "[ERROR] Recorder lost a block of %u records: %s\n", block_entry.records,
+                segment_fd < 0 ? "no segment" : strerror(errno));
+    } else {
+        segment_size += sizeof(header) + stored;
+    }
+    block_len = 0;
+}
+
+// At most once per RECORDER_FLUSH_MS, the ring overflows in bursts
+static void report_drops(int force) {
+    static int64_t reported_at = 0;
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped == reported_drops || (!force && now_us() - reported_at < RECORDER_FLUSH_MS * 1000LL)) return;
+
+    fprintf(stderr, "[WARN] Recorder: %llu records dropped, the ring was full\n",
+            (unsigned long long)(dropped - reported_drops));
+    reported_drops = dropped;
+    reported_at = now_us();
+}
+
+static void block_add(const record_t *record, uint32_t length) {
+    if (block_len == 0) {
+        memset(&block_entry, 0, sizeof(block_entry));
+        block_entry.first_time = INT64_MAX;
+        block_entry.last_time = INT64_MIN;
+        block_entry.min_session = INT32_MAX;
+        block_entry.max_session = INT32_MIN;
+        block_started = now_us();
+    }
+    memcpy(block + block_len, record, length);
+    block_len += length;
+
+    block_entry.records++;
+    if (record->time_us < block_entry.first_time) block_entry.first_time = record->time_us;
+    if (record->time_us > block_entry.last_time) block_entry.last_time = record->time_us;
+    if (record->session < block_entry.min_session) block_entry.min_session = record->session;
+    if (record->session > block_entry.max_session) block_entry.max_session = record->session;
+
+    if (block_len >= RECORDER_BLOCK) block_flush();
+}
+
+// Moves the published records from the ring into the block; returns how many were taken
+static int ring_drain(void) {
+    static int64_t stall_since = 0;
+    uint64_t tail = ring->consumed;
+    int taken = 0;
+
+    while (tail != __atomic_load_n(&ring->reserved, __ATOMIC_ACQUIRE)) {
+        record_t *record = (record_t *)(ring->data + tail % ring->size);
+        uint32_t length = __atomic_load_n(&record->length, __ATOMIC_ACQUIRE);
+        int skip = 0;
+
+        if (length == 0 || (length & RECORD_BUSY)) {
+            // Still being written. A session killed in the middle never finishes its record.
+            if (!stall_since) stall_since = now_us();
+            if (length == 0 || now_us() - stall_since < RECORDER_STALL_MS * 1000LL) break;
+            length &= ~RECORD_BUSY;
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            skip = 1;
+        }
+        stall_since = 0;
+
+        uint64_t span = (record->type == RECORD_PAD) ? length : ALIGN8(length);
+        if (!skip && record->type != RECORD_PAD) block_add(record, length);
+        memset(record, 0, span);        // a later record starts with a zero length here
+        tail += span;
+        __atomic_store_n(&ring->consumed, tail, __ATOMIC_RELEASE);
+        taken++;
+    }
+    return taken;
+}
+
+static void close_other_fds(void) {
+#if defined(SYS_close_range)
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0) return;
+#endif
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+    for (int fd = 3; fd < max_fd; fd++) close(fd);
+}
+
+static void run_writer(pid_t server_pid) {
+    signal(SIGTERM, writer_stop);
+    signal(SIGINT, writer_stop);
+    signal(SIGHUP, writer_stop);
+    signal(SIGPIPE, SIG_IGN);
+    close_other_fds();
+
+    block = malloc(RECORDER_BLOCK + sizeof(record_t) + RECORDER_CHUNK);
+    if (!block) {
+        perror("[ERROR] Memory allocation failed");
+        _exit(1);
+    }
+    segment_number = last_segment();
+
+    // Until the server is gone: the sessions have ended then, what they wrote is drained
+    int idle_polls = 0;
+    while (1) {
+        int done = stopping || getppid() != server_pid;
+        if (ring_drain() > 0 && !done) {
+            idle_polls = 0;
+            continue;
+        }
+
+        if (block_len > 0 && (done || now_us() - block_started >= RECORDER_FLUSH_MS * 1000LL))
+            block_flush();
+        report_drops(done);
+        if (done) break;
+
+        // Output comes in bursts: right after one the ring is looked at every millisecond
+        usleep(++idle_polls < RECORDER_POLL_MS * 10 ? 1000 : RECORDER_POLL_MS * 1000);
+    }
+    if (segment_fd >= 0) fdatasync(segment_fd);
+    _exit(0);
+}
+
+static void start_writer(ring_t *shared) {
+    if (codec < 0) codec = best_codec();
+    if (mkdir(log_dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "[ERROR] Recorder directory %s: %s\n", log_dir, strerror(errno));
+        exit(1);
+    }
+
+    pid_t server_pid = getpid();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("[ERROR] Recorder fork failed");
+        exit(1);
+    }
+    ring = shared;
+    if (pid == 0) run_writer(server_pid);
+    writer_pid = pid;
+
+    printf("[INFO] Recording sessions to %s (%s blocks, writer PID %d)\n", log_dir,
+           codec == COMPRESS_NONE ? "uncompressed" : compress_name(codec), pid);
+}
+
+// Maps the ring and forks the writer; called by the server before anything else is forked.
+// The ring is a memfd where available, so a hot restart (-U) can hand it to the new server.
+void recorder_start(void) {
+    if (!log_dir) return;
+
+    size_t length = sizeof(ring_t) + ring_size;
+#if defined(MFD_CLOEXEC)
+    ring_fd = memfd_create("myshell-recorder", MFD_CLOEXEC);
+    if (ring_fd >= 0 && ftruncate(ring_fd, length) < 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+#endif
+    void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        ring_fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, ring_fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("[ERROR] Recorder ring mmap failed");
+        exit(1);
+    }
+    ring_t *shared = memory;
+    shared->size = ring_size;
+    start_writer(shared);
+}
+
+int recorder_ring_fd(void) {
+    return ring_fd;
+}
+
+// Hot restart, old server: stops the writer once it has drained the ring. The sessions go on
+// recording into the ring; the new server starts the next writer on it (recorder_adopt()).
+void recorder_stop(void) {
+    if (writer_pid <= 0) return;
+    kill(writer_pid, SIGTERM);
+    while (waitpid(writer_pid, NULL, 0) < 0 && errno == EINTR);
+    writer_pid = -1;
+}
+
+// Hot restart, new server: takes over the ring of the previous one, or starts a fresh one if
+// it has another layout. Without -r the descriptor is only closed.
+void recorder_adopt(int fd) {
+    struct stat st;
+    void *memory = MAP_FAILED;
+    if (log_dir && fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(ring_t))
+        memory = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory != MAP_FAILED && ((ring_t *)memory)->size + sizeof(ring_t) != (uint64_t)st.st_size) {
+        munmap(memory, st.st_size);
+        memory = MAP_FAILED;
+    }
+    if (memory == MAP_FAILED) {
+        close(fd);
+        recorder_start();
+        return;
+    }
+    ring_fd = fd;
+    start_writer(memory);
+}
+
+
+/* ==============================================================================================
+ * Query and Replay (-Q)
+ * ==============================================================================================
+ * Every segment's index is read in order; a block is decompressed only if its time range
+ * overlaps from..to and its session range contains the session asked for, or if a command
+ * that started in an earlier block is still waiting for its END record. Commands are
+ * selected by the time of their BEGIN record and printed when their END is found.
+ * ==============================================================================================
+ */
+
+
+typedef struct {
+    int session;
+    int pid;
+    int64_t started;
+    char *line;
+    char *output;                       // replay only
+    size_t output_len;
+    size_t output_cap;
+    size_t total;                       // output bytes
+} replay_t;
+
+static int64_t query_from = INT64_MIN;
+static int64_t query_to = INT64_MAX;
+static int query_session = 0;
+static int query_replay = 0;
+
+static replay_t *open_commands = NULL;
+static size_t open_count = 0;
+static size_t open_cap = 0;
+
+// "2026-10-14T09:30[:15]", "2026-10-14", "@<epoch seconds>" or "-<n>[s|m|h|d]" (ago)
+static int parse_time(const char *text, int64_t *time_us) {
+    char *end;
+    if (text[0] == '@' || text[0] == '-') {
+        long long value = strtoll(text + 1, &end, 10);
+        if (end == text + 1 || value < 0) return -1;
+        if (text[0] == '@') {
+            if (*end != '\0') return -1;
+            *time_us = value * 1000000;
+            return 0;
+        }
+        long long unit = 1;
+        if (*end == 'm') unit = 60, end++;
+        else if (*end == 'h') unit = 3600, end++;
+        else if (*end == 'd') unit = 86400, end++;
+        else if (*end == 's') end++;
+        if (*end != '\0') return -1;
+        *time_us = now_us() - value * unit * 1000000;
+        return 0;
+    }
+
+    static const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        end = strptime(text, formats[i], &tm);
+        if (!end || *end != '\0') continue;
+        tm.tm_isdst = -1;
+        *time_us = (int64_t)mktime(&tm) * 1000000;
+        return 0;
+    }
+    return -1;
+}
+
+static int parse_query(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        char *equals = strchr(item, '=');
+        if (equals) *equals++ = '\0';
+
+        if (strcmp(item, "replay") == 0 && !equals) {
+            query_replay = 1;
+        } else if (strcmp(item, "all") == 0 && !equals) {
+            continue;
+        } else if (!equals) {
+            result = -1;
+        } else if (strcmp(item, "from") == 0) {
+            result = parse_time(equals, &query_from);
+        } else if (strcmp(item, "to") == 0) {
+            result = parse_time(equals, &query_to);
+        } else if (strcmp(item, "session") == 0) {
+            query_session = atoi(equals);
+            if (query_session <= 0) result = -1;
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+static void format_time(int64_t time_us, char *buf, size_t size) {
+    time_t seconds = time_us / 1000000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03d", (int)(time_us % 1000000 / 1000));
+}
+
+static void append(replay_t *command, const char *data, size_t len) {
+    if (command->output_len + len > command->output_cap) {
+        size_t cap = command->output_cap ? command->output_cap : 4096;
+        while (cap < command->output_len + len) cap *= 2;
+        char *output = realloc(command->output, cap);
+        if (!output) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        command->output = output;
+        command->output_cap = cap;
+    }
+    memcpy(command->output + command->output_len, data, len);
+    command->output_len += len;
+}
+
+// end: the END record, NULL for a command the log has no end for (still running, or lost)
+static void print_command(const replay_t *command, const record_t *end) {
+    char started[32], status[48];
+    format_time(command->started, started, sizeof(started));
+    if (end) snprintf(status, sizeof(status), "status %d, %.3f s%s", end->status,
+                      (end->time_us - command->started) / 1e6,
+                      (end->flags & RECORD_TRUNCATED) ? ", incomplete" : "");
+    else snprintf(status, sizeof(status), "no end recorded");
+
+    if (!query_replay) {
+        printf("%s  ID %d  PID %d  %s  %zu bytes  %s\n", started, command->session, command->pid,
+               status, command->total, command->line);
+        return;
+    }
+    printf("=== %s | ID %d | PID %d | %s\n", started, command->session, command->pid, command->line);
+    fwrite(command->output, 1, command->output_len, stdout);
+    if (command->output_len > 0 && command->output[command->output_len - 1] != '\n') putchar('\n');
+    printf("=== %s\n", status);
+}
+
+static replay_t *find_open(int session) {
+    for (size_t i = 0; i < open_count; i++) {
+        if (open_commands[i].session == session) return &open_commands[i];
+    }
+    return NULL;
+}
+
+static void close_command(replay_t *command, const record_t *end) {
+    print_command(command, end);
+    free(command->line);
+    free(command->output);
+    *command = open_commands[--open_count];
+}
+
+static void replay_record(const record_t *record, const char *payload, size_t len) {
+    replay_t *command = find_open(record->session);
+
+    if (record->type == RECORD_BEGIN) {
+        if (command) close_command(command, NULL);
+        if (record->time_us < query_from || record->time_us > query_to) return;
+        if (query_session && record->session != query_session) return;
+
+        if (open_count == open_cap) {
+            open_cap = open_cap ? open_cap * 2 : 16;
+            open_commands = realloc(open_commands, open_cap * sizeof(replay_t));
+            if (!open_commands) {
+                perror("[ERROR] Memory allocation failed");
+                exit(1);
+            }
+        }
+        command = &open_commands[open_count++];
+        memset(command, 0, sizeof(*command));
+        command->session = record->session;
+        command->pid = record->pid;
+        command->started = record->time_us;
+        command->line = strndup(payload, len);
+        if (!command->line) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        command->line[strcspn(command->line, "\n")] = '\0';
+    } else if (!command) {
+        return;
+    } else if (record->type == RECORD_OUTPUT) {
+        command->total += len;
+        if (query_replay) append(command, payload, len);
+    } else if (record->type == RECORD_END) {
+        close_command(command, record);
+    }
+}
+
+static int replay_block(int log_fd, const index_entry_t *entry) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    size_t need = sizeof(block_header_t) + entry->stored_len;
+    if (need > cap) {
+        char *grown = realloc(buf, need);
+        if (!grown) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        buf = grown;
+        cap = need;
+    }
+
+    block_header_t header;
+    if (pread(log_fd, buf, need, entry->offset) != (ssize_t)need) return -1;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != RECORDER_BLOCK_MAGIC || header.stored_len != entry->stored_len
+        || header.raw_len != entry->raw_len)
+        return -1;
+
+    const char *data = buf + sizeof(header);
+    if (header.codec != COMPRESS_NONE
+        && !(data = compress_unpack(header.codec, data, header.stored_len, header.raw_len)))
+        return -1;
+
+    for (size_t offset = 0; offset + sizeof(record_t) <= header.raw_len;) {
+        record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (record.length < sizeof(record_t) || offset + record.length > header.raw_len) return -1;
+        replay_record(&record, data + offset + sizeof(record_t), record.length - sizeof(record_t));
+        offset += record.length;
+    }
+    return 0;
+}
+
+// Returns 1 once the blocks are past query_to, so later segments need not be read
+static int replay_segment(unsigned number) {
+    char path[4096];
+    char magic[RECORDER_MAGIC_SIZE];
+    int past_end = 0;
+
+    snprintf(path, sizeof(path), "%s/%08u.idx", log_dir, number);
+    FILE *index = fopen(path, "rb");
+    snprintf(path, sizeof(path), "%s/%08u.log", log_dir, number);
+    int log_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (!index || log_fd < 0 || fread(magic, 1, sizeof(magic), index) != sizeof(magic)
+        || memcmp(magic, RECORDER_INDEX_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "[WARN] Recorder segment %08u is unreadable, skipped\n", number);
+        if (index) fclose(index);
+        if (log_fd >= 0) close(log_fd);
+        return 0;
+    }
+
+    index_entry_t entry;
+    while (fread(&entry, sizeof(entry), 1, index) == 1) {
+        int sessions = !query_session || (entry.min_session <= query_session && query_session <= entry.max_session);
+        int in_time = entry.last_time >= query_from && entry.first_time <= query_to;
+        if (!in_time && open_count == 0) {
+            if (entry.first_time > query_to) {
+                past_end = 1;
+                break;
+            }
+            continue;
+        }
+        if (!sessions) continue;
+        if (replay_block(log_fd, &entry) < 0)
+            fprintf(stderr, "[WARN] Recorder segment %08u: damaged block at offset %llu, skipped\n",
+                    number, (unsigned long long)entry.offset);
+    }
+    fclose(index);
+    close(log_fd);
+    return past_end;
+}
+
+static int compare_numbers(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+int recorder_query(const char *spec) {
+    if (!log_dir) {
+        fprintf(stderr, "[ERROR] -Q needs the log directory of the recorder (-r <dir>)\n");
+        return 1;
+    }
+    if (parse_query(spec) < 0) {
+        fprintf(stderr, "[ERROR] Invalid query '%s' (expected from=<time>,to=<time>,session=<id>,replay)\n", spec);
+        return 1;
+    }
+
+    DIR *dir = opendir(log_dir);
+    if (!dir) {
+        fprintf(stderr, "[ERROR] Recorder directory %s: %s\n", log_dir, strerror(errno));
+        return 1;
+    }
+    unsigned *numbers = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned number;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%u.%7s", &number, suffix) != 2 || strcmp(suffix, "idx") != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            numbers = realloc(numbers, cap * sizeof(unsigned));
+            if (!numbers) {
+                perror("[ERROR] Memory allocation failed");
+                exit(1);
+            }
+        }
+        numbers[count++] = number;
+    }
+    closedir(dir);
+    qsort(numbers, count, sizeof(unsigned), compare_numbers);
+
+    for (size_t i = 0; i < count; i++) {
+        if (replay_segment(numbers[i])) break;
+    }
+    while (open_count > 0) close_command(&open_commands[0], NULL);
+
+    free(numbers);
+    free(open_commands);
+    return 0;
+}
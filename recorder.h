@@ -0,0 +1,32 @@
+#ifndef MYSHELL_RECORDER_H
+#define MYSHELL_RECORDER_H
+
+#include <stddef.h>
+
+#define RECORDER_RING (4 << 20)         // default shared ring between sessions and the writer
+#define RECORDER_SEGMENT (64 << 20)     // default size at which a new segment file is started
+#define RECORDER_BLOCK (256 * 1024)     // records are compressed and indexed in blocks of this size
+#define RECORDER_CHUNK (64 * 1024)      // output is recorded in pieces of at most this size
+#define RECORDER_FLUSH_MS 1000          // a block is written this long after its first record at the latest
+#define RECORDER_POLL_MS 20             // an idle writer looks at the ring this often (1 ms after output)
+#define RECORDER_STALL_MS 2000          // a record unfinished for this long is skipped (its session died)
+
+// Parses -r "<dir>,segment=<size>,ring=<size>,codec=<name>"; -1 if malformed
+int recorder_parse(const char *spec);
+
+int recorder_enabled(void);
+void recorder_start(void);
+int recorder_ring_fd(void);
+void recorder_stop(void);
+void recorder_adopt(int fd);
+
+void recorder_set_session(int id);
+int recorder_active(void);
+void recorder_begin(const char *line, size_t len);
+void recorder_output(const char *data, size_t len);
+void recorder_end(int status);
+
+// -Q "from=<time>,to=<time>,session=<id>,replay" (or "all"): lists or replays the recorded commands
+int recorder_query(const char *spec);
+
+#endif //MYSHELL_RECORDER_H
@@ -11,7 +11,15 @@
  *   - output_redirection_append(): Appends stdout content to a file
  *   - input_redirection(): Replaces stdin with content from a file
  *
- * These functions are called from child processes after forking and before exec().
+ * These functions are called from child processes after forking and before exec(), so they
+ * fail with _exit() and leave the parent's stdio buffers alone.
+ *
+ * The spawn_* variants describe the same redirections as posix_spawn() file actions for the
+ * default launcher (spawn.c); a failing open() then makes posix_spawn() itself fail.
+ *
+ * With -O the server opens the files of the last stage's `>`/`>>` and of `<` itself and does
+ * the file I/O in large batches instead (sink.c); these handlers then only see the files it
+ * could not open, so the stage reports the error as before.
  * ==============================================================================================
  */
 
@@ -20,6 +28,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include "redirections.h"
 
 void output_redirection(char *filename) {
     // Open (or create) a file for writing
@@ -30,7 +40,7 @@ void output_redirection(char *filename) {
     int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
         perror("Error opening file");
-        exit(1);
+        _exit(1);
     }
     // Redirect standard output (stdout) to the file
     // Now, everything written to stdout will be saved in the file
@@ -44,7 +54,7 @@ void output_redirection_append(char *filename) {
     int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
     if (fd == -1) {
         perror("Error opening file for append");
-        exit(1);
+        _exit(1);
     }
     // Redirect standard output to the file in append mode
     dup2(fd, STDOUT_FILENO);
@@ -57,11 +67,23 @@ void input_redirection(char *filename){
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
         perror("Error opening input file");
-        exit(1);
+        _exit(1);
     }
     // Redirect standard input (stdin) to read from the file
     // Now, everything that would be read from stdin will come from the file
     dup2(fd, STDIN_FILENO);
     // Close the file descriptor as it is no longer needed
     close(fd);
-}
\ No newline at end of file
+}
+
+int spawn_output_redirection(posix_spawn_file_actions_t *actions, const char *filename) {
+    return posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+int spawn_output_redirection_append(posix_spawn_file_actions_t *actions, const char *filename) {
+    return posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+int spawn_input_redirection(posix_spawn_file_actions_t *actions, const char *filename) {
+    return posix_spawn_file_actions_addopen(actions, STDIN_FILENO, filename, O_RDONLY, 0);
+}
@@ -1,8 +1,14 @@
 #ifndef MYSHELL_REDIRECTIONS_H
 #define MYSHELL_REDIRECTIONS_H
 
+#include <spawn.h>
+
 void output_redirection(char *filename);
 void input_redirection(char *filename);
 void output_redirection_append(char *filename);
 
+int spawn_output_redirection(posix_spawn_file_actions_t *actions, const char *filename);
+int spawn_input_redirection(posix_spawn_file_actions_t *actions, const char *filename);
+int spawn_output_redirection_append(posix_spawn_file_actions_t *actions, const char *filename);
+
 #endif //MYSHELL_REDIRECTIONS_H
@@ -0,0 +1,197 @@
+/* ==============================================================================================
+ * Session Registry
+ * ==============================================================================================
+ *
+ * Keeps the client sessions of the forking server (one child process per connection). Control
+ * messages from the children name a session by PID (`stat`, `quit`, protocol changes) or by
+ * connection ID (`abort <id>`), and the accept loop's poller reports a session by its
+ * control channel, so every lookup has its own index:
+ *
+ *   ID, PID   chained hash tables, grown to keep the load factor at most 1
+ *   channel   a table indexed by file descriptor, like the other fd tables in the server
+ *
+ * All lookups are O(1), so thousands of sessions cost no more per control message than a few.
+ * A doubly linked list in registration order (newest first) serves `stat`, and removal
+ * unlinks a node from all indexes without searching.
+ *
+ * Nodes come from a slab pool: they are allocated REGISTRY_SLAB_SIZE at a time and recycled
+ * through a free list, so connection churn does not turn into malloc/free traffic.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "registry.h"
+
+#define REGISTRY_INITIAL_BUCKETS 64     // power of two
+
+static session_t **id_buckets = NULL;
+static session_t **pid_buckets = NULL;
+static size_t bucket_count = 0;
+
+static session_t **fd_index = NULL;
+static int fd_index_size = 0;
+
+static session_t *newest = NULL;
+static session_t *free_nodes = NULL;
+static size_t session_count = 0;
+
+
+/* ==============================================================================================
+ * Node Pool and Indexes
+ * ==============================================================================================
+ */
+
+
+static void *allocate(size_t size) {
+    void *memory = calloc(1, size);
+    if (!memory) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    return memory;
+}
+
+static session_t *node_get(void) {
+    if (!free_nodes) {
+        session_t *slab = allocate(REGISTRY_SLAB_SIZE * sizeof(session_t));
+        for (int i = 0; i < REGISTRY_SLAB_SIZE; i++) {
+            slab[i].id_next = free_nodes;
+            free_nodes = &slab[i];
+        }
+    }
+    session_t *node = free_nodes;
+    free_nodes = node->id_next;
+    memset(node, 0, sizeof(session_t));
+    return node;
+}
+
+static void node_put(session_t *node) {
+    node->id_next = free_nodes;
+    free_nodes = node;
+}
+
+static size_t bucket_of(int key) {
+    // Fibonacci hashing: consecutive IDs and PIDs spread over the whole table
+    return (((uint32_t)key * 2654435769u) >> 8) & (bucket_count - 1);
+}
+
+static void grow_buckets(void) {
+    size_t new_count = bucket_count ? bucket_count * 2 : REGISTRY_INITIAL_BUCKETS;
+    session_t **new_ids = allocate(new_count * sizeof(session_t *));
+    session_t **new_pids = allocate(new_count * sizeof(session_t *));
+
+    free(id_buckets);
+    free(pid_buckets);
+    id_buckets = new_ids;
+    pid_buckets = new_pids;
+    bucket_count = new_count;
+
+    // Rehash by walking the registration list, which holds every node exactly once
+    for (session_t *node = newest; node; node = node->older) {
+        size_t id_bucket = bucket_of(node->id), pid_bucket = bucket_of(node->pid);
+        node->id_next = id_buckets[id_bucket];
+        id_buckets[id_bucket] = node;
+        node->pid_next = pid_buckets[pid_bucket];
+        pid_buckets[pid_bucket] = node;
+    }
+}
+
+static void fd_index_set(int fd, session_t *node) {
+    if (fd < 0) return;
+    if (fd >= fd_index_size) {
+        int new_size = fd_index_size ? fd_index_size : 64;
+        while (new_size <= fd) new_size *= 2;
+
+        session_t **table = realloc(fd_index, new_size * sizeof(session_t *));
+        if (!table) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+        memset(table + fd_index_size, 0, (new_size - fd_index_size) * sizeof(session_t *));
+        fd_index = table;
+        fd_index_size = new_size;
+    }
+    fd_index[fd] = node;
+}
+
+
+/* ==============================================================================================
+ * Registry Interface
+ * ==============================================================================================
+ */
+
+
+session_t *registry_add(int id, const char *peer, int channel_fd, pid_t pid) {
+    session_t *node = node_get();
+    node->id = id;
+    snprintf(node->peer, sizeof(node->peer), "%s", peer);
+    node->channel_fd = channel_fd;
+    node->pid = pid;
+
+    node->older = newest;
+    if (newest) newest->newer = node;
+    newest = node;
+    session_count++;
+
+    if (session_count > bucket_count) {
+        grow_buckets();         // also links the new node
+    } else {
+        size_t id_bucket = bucket_of(id), pid_bucket = bucket_of(pid);
+        node->id_next = id_buckets[id_bucket];
+        id_buckets[id_bucket] = node;
+        node->pid_next = pid_buckets[pid_bucket];
+        pid_buckets[pid_bucket] = node;
+    }
+    fd_index_set(channel_fd, node);
+    return node;
+}
+
+void registry_remove(session_t *session) {
+    session_t **link = &id_buckets[bucket_of(session->id)];
+    while (*link != session) link = &(*link)->id_next;
+    *link = session->id_next;
+
+    link = &pid_buckets[bucket_of(session->pid)];
+    while (*link != session) link = &(*link)->pid_next;
+    *link = session->pid_next;
+
+    if (session->newer) session->newer->older = session->older;
+    else newest = session->older;
+    if (session->older) session->older->newer = session->newer;
+
+    if (registry_by_channel(session->channel_fd) == session) fd_index[session->channel_fd] = NULL;
+    session_count--;
+    node_put(session);
+}
+
+session_t *registry_by_id(int id) {
+    if (bucket_count == 0) return NULL;
+    session_t *node = id_buckets[bucket_of(id)];
+    while (node && node->id != id) node = node->id_next;
+    return node;
+}
+
+session_t *registry_by_pid(pid_t pid) {
+    if (bucket_count == 0) return NULL;
+    session_t *node = pid_buckets[bucket_of(pid)];
+    while (node && node->pid != pid) node = node->pid_next;
+    return node;
+}
+
+session_t *registry_by_channel(int channel_fd) {
+    return (channel_fd >= 0 && channel_fd < fd_index_size) ? fd_index[channel_fd] : NULL;
+}
+
+// Most recently registered session; continue with ->older
+session_t *registry_newest(void) {
+    return newest;
+}
+
+size_t registry_count(void) {
+    return session_count;
+}
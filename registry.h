@@ -0,0 +1,35 @@
+#ifndef MYSHELL_REGISTRY_H
+#define MYSHELL_REGISTRY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "scheduler.h"
+
+#define REGISTRY_SLAB_SIZE 256      // Session nodes allocated at a time
+#define REGISTRY_PEER_SIZE 48       // "<ip>:<port>" of the client
+
+// One forked client session, as known to the accepting process
+typedef struct session {
+    int id;                         // connection ID shown by `stat`, used by `abort`
+    char peer[REGISTRY_PEER_SIZE];  // client address shown by `stat`, "local" for UNIX sockets
+    int channel_fd;                 // parent's end of the session's control channel
+    pid_t pid;                      // session child
+    int metrics_slot;               // counters of the session (metrics.c), -1 = none
+    sched_entry_t sched;            // pipeline slots of the session (scheduler.c)
+    struct cache_entry *cache_entry;        // result cache entry it fills or waits for (-R)
+    int cache_filling;
+    struct session *id_next;        // ID hash chain (free list link while unused)
+    struct session *pid_next;       // PID hash chain
+    struct session *newer;          // registration order, walked by `stat`
+    struct session *older;
+} session_t;
+
+session_t *registry_add(int id, const char *peer, int channel_fd, pid_t pid);
+void registry_remove(session_t *session);
+session_t *registry_by_id(int id);
+session_t *registry_by_pid(pid_t pid);
+session_t *registry_by_channel(int channel_fd);
+session_t *registry_newest(void);
+size_t registry_count(void);
+
+#endif //MYSHELL_REGISTRY_H
@@ -0,0 +1,465 @@
+/* ==============================================================================================
+ * Result Cache
+ * ==============================================================================================
+ *
+ * Dashboards poll the same read-only commands (`cat /proc/loadavg`, `df -h`, `ls /data | wc
+ * -l`) from many clients at once. With -R the output of such commands is kept for a short
+ * time and sent to the next client asking the same thing, instead of starting the pipeline
+ * again:
+ *
+ *   -R ttl=2,mem=16M,allow=df/10:ls:wc:cat
+ *
+ *   ttl=<s>      time to live of an entry (default RESULT_CACHE_TTL_MS, fractions allowed)
+ *   mem=<size>   memory cap of all entries, K/M/G suffix (default RESULT_CACHE_MEMORY)
+ *   allow=...    commands that may be cached, each with an optional TTL of its own; a
+ *                pipeline qualifies only if all its stages do, and writes no file (no > or
+ *                >>). Default: DEFAULT_ALLOW
+ *
+ * The key is the working directory plus the pipeline as parsed (arguments joined by single
+ * spaces), so spacing differences do not matter, and an entry lives for the shortest TTL of
+ * its stages. Only output of a pipeline that exited with status 0 is kept.
+ *
+ * Concurrent identical requests are coalesced: while one session runs the command, the
+ * others wait on the entry (its waiters) and all get the output of that single execution
+ * when it ends. If the session running it goes away, the first waiter takes over.
+ *
+ * Entries are kept in a hash table and an LRU list like the plan cache. When the memory cap
+ * is reached, the least recently used finished entries are evicted; an output larger than a
+ * quarter of the cap is never cached, its waiters run the command themselves instead.
+ *
+ * The cache lives with the sessions' owner: the accept loop of the forking server (sessions
+ * ask over their control channels, server.c) or the event loop with -E (event_server.c).
+ * The accept loop does not stream a hit to the session: it passes a sealed memfd with the
+ * output (result_cache_export()), which the session copies to its client.
+ *
+ * ==============================================================================================
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "builtins.h"
+#include "heredoc.h"
+#include "protocol.h"
+#include "result_cache.h"
+
+#define DEFAULT_ALLOW "cat:df:du:free:uptime:ls:wc:head:tail:grep:sort:uniq:cut:ps:who:uname:hostname:stat"
+
+typedef struct {
+    char *name;
+    unsigned ttl_ms;
+} allowed_t;
+
+static int enabled = 0;
+static unsigned default_ttl_ms = RESULT_CACHE_TTL_MS;
+static size_t memory_cap = RESULT_CACHE_MEMORY;
+static allowed_t *allowed = NULL;
+static size_t allowed_count = 0;
+
+static cache_entry_t *buckets[RESULT_CACHE_BUCKETS];
+static cache_entry_t *lru_head = NULL;      // most recently used
+static cache_entry_t *lru_tail = NULL;      // next to be evicted
+static size_t entry_count = 0;
+static size_t memory_used = 0;
+
+static unsigned long hit_count = 0;
+static unsigned long miss_count = 0;
+static unsigned long coalesced_count = 0;
+static unsigned long eviction_count = 0;
+static unsigned long oversize_count = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *checked(void *pointer) {
+    if (!pointer) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    return pointer;
+}
+
+
+/* ==============================================================================================
+ * Configuration
+ * ==============================================================================================
+ */
+
+
+static int parse_seconds(const char *text, unsigned *ms) {
+    char *end;
+    double seconds = strtod(text, &end);
+    if (end == text || *end != '\0' || seconds <= 0) return -1;
+    *ms = (unsigned)(seconds * 1000);
+    return *ms > 0 ? 0 : -1;
+}
+
+static int parse_allow(const char *list) {
+    char *copy = checked(strdup(list));
+    int result = 0;
+
+    for (char *name = strtok(copy, ":"); name; name = strtok(NULL, ":")) {
+        unsigned ttl_ms = 0;
+        char *slash = strchr(name, '/');
+        if (slash) {
+            *slash = '\0';
+            if (parse_seconds(slash + 1, &ttl_ms) < 0) result = -1;
+        }
+        if (name[0] == '\0') result = -1;
+
+        allowed = checked(realloc(allowed, (allowed_count + 1) * sizeof(allowed_t)));
+        allowed[allowed_count].name = checked(strdup(name));
+        allowed[allowed_count].ttl_ms = ttl_ms;
+        allowed_count++;
+    }
+    free(copy);
+    return result;
+}
+
+int result_cache_parse(const char *spec) {
+    char *copy = checked(strdup(spec));
+    const char *allow = DEFAULT_ALLOW;
+    int result = 0;
+
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        char *value = strchr(item, '=');
+        if (!value || value[1] == '\0') {
+            result = -1;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "ttl") == 0) {
+            result = parse_seconds(value, &default_ttl_ms);
+        } else if (strcmp(item, "mem") == 0) {
+            char *end;
+            long long bytes = strtoll(value, &end, 10);
+            if (*end == 'K' || *end == 'k') bytes <<= 10, end++;
+            else if (*end == 'M' || *end == 'm') bytes <<= 20, end++;
+            else if (*end == 'G' || *end == 'g') bytes <<= 30, end++;
+            if (*end != '\0' || bytes < 4096) result = -1;
+            memory_cap = (size_t)bytes;
+        } else if (strcmp(item, "allow") == 0) {
+            allow = value;
+        } else {
+            result = -1;
+        }
+    }
+
+    if (result == 0) result = parse_allow(allow);
+    free(copy);
+    if (result == 0) enabled = 1;
+    return result;
+}
+
+int result_cache_enabled(void) {
+    return enabled;
+}
+
+size_t result_cache_max_entry(void) {
+    return memory_cap / 4;
+}
+
+// Returns the TTL of the pipeline's entries, or 0 if the pipeline may not be cached
+unsigned result_cache_ttl(const pipeline_t *pipeline) {
+    if (!enabled || pipeline->background || pipeline->count == 0) return 0;
+
+    // Alone, a command of builtins.c runs in the session itself, cheaper than asking the cache
+    const command_t *first = &pipeline->stages[0];
+    if (pipeline->count == 1 && !first->input_file && !first->input_text && !first->heredoc && builtin_find(first->argv)) return 0;
+
+    unsigned ttl_ms = 0;
+    for (size_t i = 0; i < pipeline->count; i++) {
+        const command_t *stage = &pipeline->stages[i];
+        if (stage->output_file || stage->heredoc) return 0;    // the body is not part of the key
+
+        const char *name = strrchr(stage->argv[0], '/');
+        name = name ? name + 1 : stage->argv[0];
+
+        size_t j = 0;
+        while (j < allowed_count && strcmp(allowed[j].name, name) != 0) j++;
+        if (j == allowed_count) return 0;
+
+        unsigned stage_ttl = allowed[j].ttl_ms ? allowed[j].ttl_ms : default_ttl_ms;
+        if (ttl_ms == 0 || stage_ttl < ttl_ms) ttl_ms = stage_ttl;
+    }
+    return ttl_ms;
+}
+
+static int append_text(char *buf, size_t size, size_t *len, const char *text) {
+    size_t text_len = strlen(text);
+    if (*len + text_len >= size) return -1;
+    memcpy(buf + *len, text, text_len + 1);
+    *len += text_len;
+    return 0;
+}
+
+// Writes the key of the pipeline run in cwd into buf; returns its length, 0 if it does not fit
+size_t result_cache_key(const pipeline_t *pipeline, const char *cwd, char *buf, size_t size) {
+    size_t len = 0;
+    int failed = append_text(buf, size, &len, cwd) || append_text(buf, size, &len, "\n");
+
+    for (size_t i = 0; i < pipeline->count && !failed; i++) {
+        const command_t *stage = &pipeline->stages[i];
+        if (i > 0) failed |= append_text(buf, size, &len, " | ");
+        for (size_t j = 0; j < stage->argc && !failed; j++) {
+            if (j > 0) failed |= append_text(buf, size, &len, " ");
+            failed |= append_text(buf, size, &len, stage->argv[j]);
+        }
+        if (stage->input_file && !failed) {
+            failed |= append_text(buf, size, &len, " < ");
+            failed |= append_text(buf, size, &len, stage->input_file);
+        }
+        if (stage->input_text && !failed) {
+            failed |= append_text(buf, size, &len, " <<< ");
+            failed |= append_text(buf, size, &len, stage->input_text);
+        }
+    }
+    return failed ? 0 : len;
+}
+
+
+/* ==============================================================================================
+ * Hash Table and LRU List
+ * ==============================================================================================
+ */
+
+
+static uint32_t hash_key(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void lru_unlink(cache_entry_t *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (!lru_tail) lru_tail = entry;
+}
+
+static void hash_remove(cache_entry_t *entry) {
+    cache_entry_t **link = &buckets[entry->hash & (RESULT_CACHE_BUCKETS - 1)];
+    while (*link && *link != entry) link = &(*link)->hash_next;
+    if (*link) *link = entry->hash_next;
+    entry->hash_next = NULL;
+}
+
+static size_t entry_size(const cache_entry_t *entry) {
+    return sizeof(cache_entry_t) + entry->key_len + entry->cap;
+}
+
+// Takes the entry out of the table; it is freed by the caller
+static void detach(cache_entry_t *entry) {
+    lru_unlink(entry);
+    hash_remove(entry);
+    memory_used -= entry_size(entry);
+    entry_count--;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+// Evicts finished entries, least recently used first, until `needed` more bytes fit
+static int make_room(size_t needed) {
+    cache_entry_t *entry = lru_tail;
+    while (memory_used + needed > memory_cap && entry) {
+        cache_entry_t *older = entry->lru_prev;
+        if (entry->ready) {
+            detach(entry);
+            free_entry(entry);
+            eviction_count++;
+        }
+        entry = older;
+    }
+    return memory_used + needed <= memory_cap ? 0 : -1;
+}
+
+
+/* ==============================================================================================
+ * Public Interface
+ * ==============================================================================================
+ */
+
+
+// Returns a fresh finished entry (a hit), an entry still being filled by another session (wait
+// on it), or NULL: the caller runs the command and fills a new entry
+cache_entry_t *result_cache_lookup(const char *key, size_t len) {
+    uint32_t hash = hash_key(key, len);
+
+    for (cache_entry_t *entry = buckets[hash & (RESULT_CACHE_BUCKETS - 1)]; entry; entry = entry->hash_next) {
+        if (entry->hash != hash || entry->key_len != len || memcmp(entry->key, key, len) != 0) continue;
+
+        if (entry->ready && now_ns() >= entry->expires) {
+            detach(entry);
+            free_entry(entry);
+            break;
+        }
+        if (entry->ready) hit_count++;
+        else coalesced_count++;
+        lru_unlink(entry);
+        lru_push_front(entry);
+        return entry;
+    }
+    miss_count++;
+    return NULL;
+}
+
+cache_entry_t *result_cache_begin(const char *key, size_t len, unsigned ttl_ms) {
+    cache_entry_t *entry = checked(calloc(1, sizeof(cache_entry_t)));
+    entry->key = checked(malloc(len));
+    memcpy(entry->key, key, len);
+    entry->key_len = len;
+    entry->hash = hash_key(key, len);
+    entry->ttl_ms = ttl_ms;
+
+    make_room(entry_size(entry));
+    cache_entry_t **bucket = &buckets[entry->hash & (RESULT_CACHE_BUCKETS - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(entry);
+    memory_used += entry_size(entry);
+    entry_count++;
+    return entry;
+}
+
+// Adds output to an entry being filled; -1 if it grew too large to be cached
+int result_cache_append(cache_entry_t *entry, const char *data, size_t len) {
+    if (entry->len + len > result_cache_max_entry()) return -1;
+
+    if (entry->len + len > entry->cap) {
+        size_t new_cap = entry->cap ? entry->cap : 4096;
+        while (new_cap < entry->len + len) new_cap *= 2;
+        if (new_cap > result_cache_max_entry()) new_cap = result_cache_max_entry();
+        if (make_room(new_cap - entry->cap) < 0) return -1;
+
+        entry->data = checked(realloc(entry->data, new_cap));
+        memory_used += new_cap - entry->cap;
+        entry->cap = new_cap;
+    }
+    memcpy(entry->data + entry->len, data, len);
+    entry->len += len;
+    return 0;
+}
+
+void result_cache_wait(cache_entry_t *entry, void *owner, uint32_t stream_id) {
+    cache_waiter_t *waiter = checked(malloc(sizeof(cache_waiter_t)));
+    waiter->owner = owner;
+    waiter->stream_id = stream_id;
+
+    // Oldest first, so the first waiter is the one that takes over an abandoned entry
+    cache_waiter_t **link = &entry->waiters;
+    while (*link) link = &(*link)->next;
+    waiter->next = NULL;
+    *link = waiter;
+}
+
+void result_cache_unwait(cache_entry_t *entry, void *owner) {
+    cache_waiter_t **link = &entry->waiters;
+    while (*link && (*link)->owner != owner) link = &(*link)->next;
+    if (*link) {
+        cache_waiter_t *waiter = *link;
+        *link = waiter->next;
+        free(waiter);
+    }
+}
+
+// The command has ended: the entry is kept if it succeeded. Returns the waiters to serve from
+// entry->data; result_cache_settle() must follow once they are served.
+cache_waiter_t *result_cache_finish(cache_entry_t *entry, int status) {
+    cache_waiter_t *waiters = entry->waiters;
+    entry->waiters = NULL;
+
+    if (status == 0) {
+        entry->ready = 1;
+        entry->expires = now_ns() + (uint64_t)entry->ttl_ms * 1000000ULL;
+    } else {
+        detach(entry);
+        entry->ready = -1;
+    }
+    return waiters;
+}
+
+// Frees an entry that finish() did not keep
+void result_cache_settle(cache_entry_t *entry) {
+    if (entry->ready < 0) free_entry(entry);
+}
+
+// The session filling the entry is gone: the first waiter runs the command instead. Returns
+// that waiter (the caller frees it), or NULL if nobody waits and the entry was dropped.
+cache_waiter_t *result_cache_handover(cache_entry_t *entry) {
+    cache_waiter_t *next_filler = entry->waiters;
+    if (!next_filler) {
+        result_cache_free_waiters(result_cache_abandon(entry, 0));
+        return NULL;
+    }
+    entry->waiters = next_filler->next;
+    entry->len = 0;
+    return next_filler;
+}
+
+// The entry cannot be filled (output too large, or its session is gone); returns its waiters
+cache_waiter_t *result_cache_abandon(cache_entry_t *entry, int too_large) {
+    cache_waiter_t *waiters = entry->waiters;
+    if (too_large) oversize_count++;
+    detach(entry);
+    free_entry(entry);
+    return waiters;
+}
+
+// A rewound copy of the output of a finished entry, sealed where memfds exist; -1 on failure
+int result_cache_export(const cache_entry_t *entry) {
+    int fd = heredoc_open();
+    if (fd < 0) return -1;
+    if (entry->len > 0 && proto_write_all(fd, entry->data, entry->len) < 0) {
+        close(fd);
+        return -1;
+    }
+#if defined(F_ADD_SEALS)
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void result_cache_free_waiters(cache_waiter_t *waiters) {
+    while (waiters) {
+        cache_waiter_t *next = waiters->next;
+        free(waiters);
+        waiters = next;
+    }
+}
+
+void result_cache_format_stats(char *buf, size_t size) {
+    if (!enabled) {
+        snprintf(buf, size, "Result cache: off (no -R)\n");
+        return;
+    }
+    snprintf(buf, size, "Result cache: %lu hits, %lu coalesced, %lu misses, %zu entries, "
+             "%zu/%zu KB, %lu evicted, %lu too large\n",
+             hit_count, coalesced_count, miss_count, entry_count,
+             memory_used / 1024, memory_cap / 1024, eviction_count, oversize_count);
+}
@@ -0,0 +1,56 @@
+#ifndef MYSHELL_RESULT_CACHE_H
+#define MYSHELL_RESULT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "parser.h"
+
+#define RESULT_CACHE_TTL_MS 2000            // default time to live of an entry
+#define RESULT_CACHE_MEMORY (16 << 20)      // default memory cap of all entries
+#define RESULT_CACHE_BUCKETS 256            // power of two
+
+// Somebody waiting for the entry another session fills
+typedef struct cache_waiter {
+    void *owner;                    // session_t or event_conn_t
+    uint32_t stream_id;             // request the answer belongs to
+    struct cache_waiter *next;
+} cache_waiter_t;
+
+typedef struct cache_entry {
+    char *key;                      // cwd + '\n' + normalized pipeline
+    size_t key_len;
+    uint32_t hash;
+    int ready;                      // 0 while the command runs, 1 cached, -1 ended but not kept
+    char *data;                     // output of the command
+    size_t len;
+    size_t cap;
+    uint64_t expires;               // CLOCK_MONOTONIC ns, once ready
+    unsigned ttl_ms;
+    cache_waiter_t *waiters;        // coalesced requests, served when the command ends
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    struct cache_entry *hash_next;
+} cache_entry_t;
+
+// Parses -R "ttl=<s>,mem=<size>,allow=<cmd>[/<s>]:<cmd>..."; -1 if malformed
+int result_cache_parse(const char *spec);
+
+int result_cache_enabled(void);
+size_t result_cache_max_entry(void);
+unsigned result_cache_ttl(const pipeline_t *pipeline);
+size_t result_cache_key(const pipeline_t *pipeline, const char *cwd, char *buf, size_t size);
+
+cache_entry_t *result_cache_lookup(const char *key, size_t len);
+cache_entry_t *result_cache_begin(const char *key, size_t len, unsigned ttl_ms);
+int result_cache_append(cache_entry_t *entry, const char *data, size_t len);
+void result_cache_wait(cache_entry_t *entry, void *owner, uint32_t stream_id);
+void result_cache_unwait(cache_entry_t *entry, void *owner);
+cache_waiter_t *result_cache_finish(cache_entry_t *entry, int status);
+void result_cache_settle(cache_entry_t *entry);
+cache_waiter_t *result_cache_handover(cache_entry_t *entry);
+cache_waiter_t *result_cache_abandon(cache_entry_t *entry, int too_large);
+int result_cache_export(const cache_entry_t *entry);
+void result_cache_free_waiters(cache_waiter_t *waiters);
+void result_cache_format_stats(char *buf, size_t size);
+
+#endif //MYSHELL_RESULT_CACHE_H
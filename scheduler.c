@@ -0,0 +1,230 @@
+/* ==============================================================================================
+ * Execution Scheduler
+ * ==============================================================================================
+ *
+ * Limits how many pipelines run at the same time (-L <total>[,<per session>]), so one client
+ * starting `find /` pipelines in a loop cannot take the whole machine from everybody else.
+ * A pipeline needs a slot before its first stage is started and gives it back when its last
+ * stage has been reaped (for a background job: when the job ends). Builtins answered by the
+ * server itself need no slot.
+ *
+ * The scheduler lives in the process that owns the sessions: the accept loop of the forking
+ * server, where session children ask for slots over their control channels (server.c), or
+ * the event loop with -E (event_server.c). With -w every worker schedules its own sessions.
+ *
+ * Waiting pipelines are granted in this order:
+ *   - priority class of the session (`priority high|normal|low`, default normal); a request
+ *     that has waited SCHED_AGING_NS moves up one class, so low never starves completely
+ *   - arrival order within a class. A session waits for at most one slot at a time (its
+ *     commands run in order), so this is round-robin between the sessions of a class
+ *   - a session that already holds its per-session share is passed over until one of its
+ *     own pipelines ends
+ *
+ * Sessions are few compared to the cost of a fork, so the queue is a plain list scanned on
+ * every grant. `stat` shows running and queued pipelines and the time spent waiting.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scheduler.h"
+
+#define SCHED_AGING_NS 2000000000ULL    // waiting this long counts as one class higher
+
+static int limit_total = 0;             // 0 = no scheduling
+static int limit_session = 0;           // 0 = only the total applies
+static int running = 0;
+
+static sched_entry_t *queue_head = NULL;    // oldest first
+static sched_entry_t *queue_tail = NULL;
+static int queued_by_class[SCHED_CLASSES];
+
+static unsigned long grants = 0;
+static unsigned long waited = 0;        // grants that had to queue
+static uint64_t wait_total_ns = 0;
+static uint64_t wait_max_ns = 0;
+
+static const char *class_names[SCHED_CLASSES] = { "high", "normal", "low" };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int scheduler_parse(const char *spec, int *total, int *per_session) {
+    char *end;
+    long value = strtol(spec, &end, 10);
+    if (end == spec || value < 1) return -1;
+    *total = (int)value;
+    *per_session = 0;
+
+    if (*end == ',') {
+        const char *rest = end + 1;
+        value = strtol(rest, &end, 10);
+        if (end == rest || value < 1) return -1;
+        *per_session = (int)value;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+void scheduler_configure(int total, int per_session) {
+    limit_total = total;
+    limit_session = per_session;
+}
+
+int scheduler_enabled(void) {
+    return limit_total > 0;
+}
+
+void scheduler_entry_init(sched_entry_t *entry, void *owner) {
+    memset(entry, 0, sizeof(*entry));
+    entry->owner = owner;
+    entry->priority = SCHED_NORMAL;
+}
+
+static int may_run(const sched_entry_t *entry) {
+    return running < limit_total && (limit_session == 0 || entry->running < limit_session);
+}
+
+static void grant(sched_entry_t *entry) {
+    entry->running++;
+    running++;
+    grants++;
+}
+
+static void dequeue(sched_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else queue_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else queue_tail = entry->prev;
+    entry->next = entry->prev = NULL;
+    entry->queued = 0;
+    queued_by_class[entry->priority]--;
+}
+
+static void enqueue(sched_entry_t *entry) {
+    entry->queued = 1;
+    entry->queued_at = now_ns();
+    entry->prev = queue_tail;
+    entry->next = NULL;
+    if (queue_tail) queue_tail->next = entry;
+    else queue_head = entry;
+    queue_tail = entry;
+    queued_by_class[entry->priority]++;
+}
+
+// Returns 1 if the slot is granted at once, 0 if the entry waits for scheduler_next()
+int scheduler_acquire(sched_entry_t *entry, int priority) {
+    if (!scheduler_enabled()) return 1;
+    if (entry->queued) return 0;
+    if (priority >= 0 && priority < SCHED_CLASSES) entry->priority = priority;
+
+    // Jump the queue only if nobody is waiting who could run instead
+    int contended = 0;
+    for (sched_entry_t *waiting = queue_head; waiting && !contended; waiting = waiting->next)
+        contended = may_run(waiting);
+    if (may_run(entry) && !contended) {
+        grant(entry);
+        return 1;
+    }
+
+    enqueue(entry);
+    return 0;
+}
+
+void scheduler_release(sched_entry_t *entry) {
+    if (!scheduler_enabled() || entry->running == 0) return;
+    entry->running--;
+    running--;
+}
+
+// Picks the next waiting entry that may run and grants it a slot; NULL if there is none.
+// Called after every release until it returns NULL.
+sched_entry_t *scheduler_next(void) {
+    if (!scheduler_enabled() || running >= limit_total) return NULL;
+
+    uint64_t now = now_ns();
+    sched_entry_t *best = NULL;
+    long best_class = 0;
+    for (sched_entry_t *entry = queue_head; entry; entry = entry->next) {
+        if (!may_run(entry)) continue;
+        long effective = entry->priority - (long)((now - entry->queued_at) / SCHED_AGING_NS);
+        if (!best || effective < best_class) {
+            best = entry;
+            best_class = effective;
+        }
+    }
+    if (!best) return NULL;
+
+    uint64_t wait = now - best->queued_at;
+    waited++;
+    wait_total_ns += wait;
+    if (wait > wait_max_ns) wait_max_ns = wait;
+
+    dequeue(best);
+    grant(best);
+    return best;
+}
+
+// A session taken over from the previous server (hot restart, -U) keeps its class, the slots
+// its pipelines hold and, if it was waiting, a place in the queue (at its end)
+void scheduler_adopt(sched_entry_t *entry, int priority, int holding, int queued) {
+    if (priority >= 0 && priority < SCHED_CLASSES) entry->priority = priority;
+    if (!scheduler_enabled()) return;
+    if (holding > 0) {
+        entry->running = holding;
+        running += holding;
+    }
+    if (queued) enqueue(entry);
+}
+
+// A session that ends gives back its slots and leaves the queue
+void scheduler_forget(sched_entry_t *entry) {
+    if (!scheduler_enabled()) return;
+    if (entry->queued) dequeue(entry);
+    running -= entry->running;
+    entry->running = 0;
+}
+
+void scheduler_format_stats(char *buf, size_t size) {
+    if (!scheduler_enabled()) {
+        snprintf(buf, size, "Scheduler: off (no -L limit)\n");
+        return;
+    }
+
+    char per_session[32] = "";
+    if (limit_session > 0) snprintf(per_session, sizeof(per_session), ", %d per session", limit_session);
+    snprintf(buf, size,
+             "Scheduler: %d/%d running%s, %d queued (high %d, normal %d, low %d), "
+             "%lu granted, %lu waited (avg %.1f ms, max %.1f ms)\n",
+             running, limit_total, per_session,
+             queued_by_class[SCHED_HIGH] + queued_by_class[SCHED_NORMAL] + queued_by_class[SCHED_LOW],
+             queued_by_class[SCHED_HIGH], queued_by_class[SCHED_NORMAL], queued_by_class[SCHED_LOW],
+             grants, waited, waited ? wait_total_ns / 1e6 / waited : 0.0, wait_max_ns / 1e6);
+}
+
+const char *scheduler_priority_name(int priority) {
+    return (priority >= 0 && priority < SCHED_CLASSES) ? class_names[priority] : "normal";
+}
+
+// `priority` shows the class of the session, `priority <class>` changes it
+int scheduler_priority_command(char **argv, int *priority, char *buf, size_t size) {
+    if (!argv[1]) {
+        snprintf(buf, size, "Priority: %s\n", scheduler_priority_name(*priority));
+        return 0;
+    }
+    for (int i = 0; i < SCHED_CLASSES; i++) {
+        if (strcmp(argv[1], class_names[i]) == 0) {
+            *priority = i;
+            snprintf(buf, size, "[INFO] Priority set to: %s\n", class_names[i]);
+            return 0;
+        }
+    }
+    snprintf(buf, size, "[ERROR] priority: expected high, normal or low\n");
+    return 1;
+}
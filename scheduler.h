@@ -0,0 +1,42 @@
+#ifndef MYSHELL_SCHEDULER_H
+#define MYSHELL_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    SCHED_HIGH = 0,
+    SCHED_NORMAL = 1,
+    SCHED_LOW = 2,
+    SCHED_CLASSES = 3
+};
+
+// Scheduling state of one session, embedded in session_t / event_conn_t
+typedef struct sched_entry {
+    void *owner;                    // session_t or event_conn_t
+    int priority;                   // SCHED_*
+    int running;                    // slots held by the session's pipelines
+    int queued;                     // waiting in its class queue
+    uint64_t queued_at;             // CLOCK_MONOTONIC ns
+    struct sched_entry *next;       // class queue, FIFO
+    struct sched_entry *prev;
+} sched_entry_t;
+
+// Parses -L "<total>[,<per session>]"; -1 if malformed
+int scheduler_parse(const char *spec, int *total, int *per_session);
+
+void scheduler_configure(int total, int per_session);
+int scheduler_enabled(void);
+void scheduler_entry_init(sched_entry_t *entry, void *owner);
+int scheduler_acquire(sched_entry_t *entry, int priority);
+void scheduler_release(sched_entry_t *entry);
+sched_entry_t *scheduler_next(void);
+void scheduler_adopt(sched_entry_t *entry, int priority, int holding, int queued);
+void scheduler_forget(sched_entry_t *entry);
+void scheduler_format_stats(char *buf, size_t size);
+
+// `priority [high|normal|low]` of a session
+const char *scheduler_priority_name(int priority);
+int scheduler_priority_command(char **argv, int *priority, char *buf, size_t size);
+
+#endif //MYSHELL_SCHEDULER_H
@@ -0,0 +1,473 @@
+/* ==============================================================================================
+ * Parallel Script Execution
+ * ==============================================================================================
+ *
+ * With -j <N> a script is loaded completely before anything runs, and its lines are executed
+ * as jobs on up to N worker processes at once. Each worker runs its job through
+ * handle_command() exactly like the sequential run_script() would, but with stdout and stderr
+ * going into a pipe. The output of every job is collected in its own buffer and printed in
+ * script order: the oldest unfinished job streams its output directly, the buffers of later
+ * jobs are released as soon as everything before them is complete.
+ *
+ * Ordering rules:
+ *   - a line ending in ';' is chained to the next line; the chain is one job and runs in order
+ *   - `wait` on a line of its own waits until all earlier lines are complete
+ *   - cd, hash and halt change the state of the script process, so they run in the script
+ *     process itself, after all earlier lines and before any later line starts
+ *   - a line redirecting from or into a file waits for earlier lines that redirect into the
+ *     same file, and a line redirecting into a file also for earlier lines reading from it
+ * Dependencies that do not show in redirections (e.g. `cat out.txt` after `ls > out.txt`) are
+ * expressed with a trailing ';' or a `wait` line.
+ *
+ * The script reader below is shared with the sequential run_script() in main.c.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "plan_cache.h"
+#include "server.h"
+#include "spawn.h"
+#include "script.h"
+
+enum {
+    JOB_WAITING = 0,
+    JOB_RUNNING = 1,
+    JOB_DONE = 2
+};
+
+typedef struct {
+    char **names;
+    size_t count;
+    size_t cap;
+} name_list_t;
+
+typedef struct {
+    const char *line;           // command line of the job (not NUL-terminated)
+    size_t line_len;
+    char *owned;                // chained lines joined by ' ', NULL for a view into the script
+    int barrier;                // `wait` or a state-changing builtin
+    name_list_t reads;          // files redirected from (<)
+    name_list_t writes;         // files redirected into (>, >>)
+
+    int state;                  // JOB_*
+    pid_t pid;
+    int out_fd;                 // read end of the job's output pipe while it runs
+    char *output;               // output received while an earlier job is unfinished
+    size_t len;
+    size_t cap;
+} script_job_t;
+
+
+static void *grow(void *ptr, size_t size) {
+    void *grown = realloc(ptr, size);
+    if (!grown) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    return grown;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const char *data, size_t size) {
+    if (*len + size + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < *len + size + 1) new_cap *= 2;
+        *buf = grow(*buf, new_cap);
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    (*buf)[*len] = '\0';
+}
+
+// `wait` alone on a line; run_script() skips it, the parallel engine treats it as a barrier
+int script_wait_line(const char *line, size_t len) {
+    size_t i = 0;
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) i++;
+    if (len - i < 4 || memcmp(line + i, "wait", 4) != 0) return 0;
+    for (i += 4; i < len; i++)
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r' && line[i] != '\n') return 0;
+    return 1;
+}
+
+
+/* ==============================================================================================
+ * Dependency Analysis
+ * ==============================================================================================
+ */
+
+
+static void add_name(name_list_t *list, const char *name) {
+    for (size_t i = 0; i < list->count; i++)
+        if (strcmp(list->names[i], name) == 0) return;
+
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 4;
+        list->names = grow(list->names, list->cap * sizeof(char *));
+    }
+    size_t len = strlen(name);
+    list->names[list->count] = grow(NULL, len + 1);
+    memcpy(list->names[list->count++], name, len + 1);
+}
+
+static int shares_name(const name_list_t *a, const name_list_t *b) {
+    for (size_t i = 0; i < a->count; i++)
+        for (size_t k = 0; k < b->count; k++)
+            if (strcmp(a->names[i], b->names[k]) == 0) return 1;
+    return 0;
+}
+
+// True if `later` must not start before `earlier` has finished
+static int depends_on(const script_job_t *later, const script_job_t *earlier) {
+    if (later->barrier || earlier->barrier) return 1;
+    return shares_name(&earlier->writes, &later->reads) ||
+           shares_name(&earlier->writes, &later->writes) ||
+           shares_name(&earlier->reads, &later->writes);
+}
+
+static int changes_state(const char *name) {
+    return strcmp(name, "cd") == 0 || strcmp(name, "hash") == 0 || strcmp(name, "halt") == 0;
+}
+
+// Compiles the job once in the script process; the workers inherit the cached plan
+static void analyze_job(script_job_t *job) {
+    if (script_wait_line(job->line, job->line_len)) {
+        job->barrier = 1;
+        return;
+    }
+
+    const plan_t *plan = plan_lookup_view(job->line, job->line_len);
+    for (size_t s = 0; s < plan->count; s++) {
+        const pipeline_t *pipeline = &plan->steps[s].pipeline;
+        if (plan->steps[s].result == PARSE_ERROR) continue;
+        if (pipeline->count > 0 && changes_state(pipeline->stages[0].argv[0])) job->barrier = 1;
+
+        for (size_t i = 0; i < pipeline->count; i++) {
+            if (pipeline->stages[i].input_file) add_name(&job->reads, pipeline->stages[i].input_file);
+            if (pipeline->stages[i].output_file) add_name(&job->writes, pipeline->stages[i].output_file);
+        }
+    }
+}
+
+
+/* ==============================================================================================
+ * Script Reader
+ * ==============================================================================================
+ * Regular files are mapped and lines are handed out as views into the mapping, so neither
+ * the reader nor the caller copies them and lines have no length limit. Pipes, terminals and
+ * stdin ("-") are read in large blocks into a buffer that grows for lines longer than it;
+ * those views stay valid until the next call, unless the whole input was read up front.
+ * ==============================================================================================
+ */
+
+
+#define SCRIPT_BLOCK_SIZE (1024 * 1024)
+
+static void fill_buffer(script_reader_t *reader) {
+    // Keep the partial line at the start of the buffer, grow it if the line fills all of it
+    if (reader->pos > 0) {
+        memmove(reader->buf, reader->buf + reader->pos, reader->size - reader->pos);
+        reader->size -= reader->pos;
+        reader->pos = 0;
+    }
+    if (reader->size == reader->cap) {
+        reader->cap = reader->cap ? reader->cap * 2 : SCRIPT_BLOCK_SIZE;
+        reader->buf = grow(reader->buf, reader->cap);
+    }
+    reader->data = reader->buf;
+
+    ssize_t bytes = read(reader->fd, reader->buf + reader->size, reader->cap - reader->size);
+    if (bytes > 0) {
+        reader->size += bytes;
+    } else if (bytes == 0) {
+        reader->eof = 1;
+    } else if (errno != EINTR) {
+        perror("[ERROR] Script read failed");
+        reader->eof = 1;
+    }
+}
+
+// Opens a script ("-" = stdin); with whole set, streamed input is read completely right away
+// so that all views stay valid until script_close()
+int script_open(script_reader_t *reader, const char *filename, int whole) {
+    struct stat st;
+
+    memset(reader, 0, sizeof(script_reader_t));
+    reader->data = "";
+    reader->fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        perror("[ERROR] Cannot open script file");
+        return -1;
+    }
+
+    if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+            reader->data = map;
+            reader->size = st.st_size;
+            reader->mapped = 1;
+            reader->eof = 1;
+            return 0;
+        }
+    }
+
+    if (whole) {
+        while (!reader->eof) fill_buffer(reader);
+    }
+    return 0;
+}
+
+// Returns the next line without its newline; 0 at the end of the script
+int script_next_line(script_reader_t *reader, const char **line, size_t *len) {
+    while (1) {
+        const char *start = reader->data + reader->pos;
+        size_t available = reader->size - reader->pos;
+        const char *newline = memchr(start, '\n', available);
+
+        if (newline || (reader->eof && available > 0)) {
+            *line = start;
+            *len = newline ? (size_t)(newline - start) : available;
+            reader->pos += newline ? *len + 1 : available;
+            return 1;
+        }
+        if (reader->eof) return 0;
+        fill_buffer(reader);
+    }
+}
+
+void script_close(script_reader_t *reader) {
+    if (reader->mapped) munmap((void *)reader->data, reader->size);
+    if (reader->fd != STDIN_FILENO) close(reader->fd);
+    free(reader->buf);
+}
+
+
+/* ==============================================================================================
+ * Script Loading
+ * ==============================================================================================
+ */
+
+
+static void add_job(script_job_t **jobs, size_t *count, size_t *cap, const char *line, size_t len, char *owned) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *jobs = grow(*jobs, *cap * sizeof(script_job_t));
+    }
+    script_job_t *job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(script_job_t));
+    job->line = line;
+    job->line_len = len;
+    job->owned = owned;
+    job->out_fd = -1;
+    analyze_job(job);
+}
+
+// Splits the script into jobs. Single lines stay views into the reader's data, only chains
+// are joined into a copy.
+static void load_script(script_reader_t *reader, script_job_t **jobs, size_t *count) {
+    size_t cap = 0, len;
+    const char *line;
+    char *chain = NULL;
+    size_t chain_len = 0, chain_cap = 0;
+
+    *jobs = NULL;
+    *count = 0;
+    while (script_next_line(reader, &line, &len) > 0) {
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) len--;
+        if (len == 0) continue;
+
+        // A `wait` line is never part of a chain
+        int wait_line = script_wait_line(line, len);
+        if (wait_line && chain) {
+            add_job(jobs, count, &cap, chain, chain_len, chain);
+            chain = NULL;
+            chain_len = chain_cap = 0;
+        }
+
+        // Without a trailing ';' the line completes the job
+        if (!chain && (wait_line || line[len - 1] != ';')) {
+            add_job(jobs, count, &cap, line, len, NULL);
+            continue;
+        }
+
+        if (chain) append(&chain, &chain_len, &chain_cap, " ", 1);
+        append(&chain, &chain_len, &chain_cap, line, len);
+        if (line[len - 1] != ';') {
+            add_job(jobs, count, &cap, chain, chain_len, chain);
+            chain = NULL;
+            chain_len = chain_cap = 0;
+        }
+    }
+    if (chain) add_job(jobs, count, &cap, chain, chain_len, chain);
+}
+
+
+/* ==============================================================================================
+ * Workers
+ * ==============================================================================================
+ */
+
+
+static int start_job(script_job_t *job) {
+    int fds[2];
+    if (spawn_pipe(fds) < 0) {
+        perror("[ERROR] Pipe creation failed");
+        return -1;
+    }
+
+    // Anything still buffered belongs to the script process, not to the worker
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("[ERROR] Fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        run_plan(-1, plan_lookup_view(job->line, job->line_len));
+        fflush(stdout);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    job->pid = pid;
+    job->out_fd = fds[0];
+    job->state = JOB_RUNNING;
+    return 0;
+}
+
+static void finish_job(script_job_t *job) {
+    close(job->out_fd);
+    job->out_fd = -1;
+    waitpid(job->pid, NULL, 0);
+    job->state = JOB_DONE;
+}
+
+// Prints completed jobs in order; returns the index of the oldest job not printed yet
+static size_t release_output(script_job_t *jobs, size_t head, size_t count) {
+    while (head < count && jobs[head].state == JOB_DONE) {
+        free(jobs[head].output);
+        jobs[head].output = NULL;
+        head++;
+
+        // The next job streams directly from now on; first print what it has collected
+        if (head < count && jobs[head].len > 0) {
+            fwrite(jobs[head].output, 1, jobs[head].len, stdout);
+            jobs[head].len = 0;
+        }
+    }
+    fflush(stdout);
+    return head;
+}
+
+
+/* ==============================================================================================
+ * Scheduler
+ * ==============================================================================================
+ */
+
+
+void run_script_parallel(const char *filename, int jobs_max) {
+    script_reader_t reader;
+    script_job_t *jobs;
+    size_t count;
+
+    // All jobs are known before the first one starts, so they can keep pointing into the script
+    if (script_open(&reader, filename, 1) < 0) return;
+    load_script(&reader, &jobs, &count);
+
+    struct pollfd *fds = grow(NULL, jobs_max * sizeof(struct pollfd));
+    size_t *owner = grow(NULL, jobs_max * sizeof(size_t));
+    char buf[4096];
+    size_t head = 0;
+    int running = 0;
+
+    while ((head = release_output(jobs, head, count)) < count) {
+        // A barrier runs in this process once everything before it is printed
+        if (jobs[head].barrier && jobs[head].state == JOB_WAITING && running == 0) {
+            if (!script_wait_line(jobs[head].line, jobs[head].line_len))
+                run_plan(-1, plan_lookup_view(jobs[head].line, jobs[head].line_len));
+            jobs[head].state = JOB_DONE;
+            continue;
+        }
+
+        // Start ready jobs in script order; nothing may overtake an unfinished barrier
+        for (size_t j = head; j < count && running < jobs_max && !jobs[j].barrier; j++) {
+            if (jobs[j].state != JOB_WAITING) continue;
+
+            int ready = 1;
+            for (size_t i = head; i < j && ready; i++)
+                if (jobs[i].state != JOB_DONE && depends_on(&jobs[j], &jobs[i])) ready = 0;
+            if (!ready) continue;
+
+            if (start_job(&jobs[j]) < 0) {
+                if (running == 0) exit(1);
+                break;
+            }
+            running++;
+        }
+        if (running == 0) continue;
+
+        // Collect output of the running jobs
+        int nfds = 0;
+        for (size_t j = head; j < count && nfds < running; j++) {
+            if (jobs[j].state != JOB_RUNNING) continue;
+            fds[nfds].fd = jobs[j].out_fd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = j;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERROR] poll failed");
+            exit(1);
+        }
+
+        for (int k = 0; k < nfds; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            script_job_t *job = &jobs[owner[k]];
+
+            ssize_t bytes = read(job->out_fd, buf, sizeof(buf));
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) {
+                finish_job(job);
+                running--;
+            } else if (owner[k] == head) {
+                fwrite(buf, 1, bytes, stdout);
+            } else {
+                append(&job->output, &job->len, &job->cap, buf, bytes);
+            }
+        }
+    }
+
+    for (size_t j = 0; j < count; j++) {
+        free(jobs[j].owned);
+        for (size_t i = 0; i < jobs[j].reads.count; i++) free(jobs[j].reads.names[i]);
+        for (size_t i = 0; i < jobs[j].writes.count; i++) free(jobs[j].writes.names[i]);
+        free(jobs[j].reads.names);
+        free(jobs[j].writes.names);
+    }
+    free(jobs);
+    free(fds);
+    free(owner);
+    script_close(&reader);
+}
@@ -0,0 +1,24 @@
+#ifndef MYSHELL_SCRIPT_H
+#define MYSHELL_SCRIPT_H
+
+#include <stddef.h>
+
+typedef struct {
+    int fd;
+    const char *data;           // mapped file, or the read buffer
+    size_t size;                // bytes of script in data
+    size_t pos;                 // start of the next line
+    char *buf;                  // read buffer for pipes and stdin
+    size_t cap;
+    int mapped;
+    int eof;
+} script_reader_t;
+
+int script_open(script_reader_t *reader, const char *filename, int whole);
+int script_next_line(script_reader_t *reader, const char **line, size_t *len);
+void script_close(script_reader_t *reader);
+
+int script_wait_line(const char *line, size_t len);
+void run_script_parallel(const char *filename, int jobs);
+
+#endif //MYSHELL_SCRIPT_H
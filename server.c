@@ -7,7 +7,8 @@
  *   - UNIX domain sockets (local IPC via file path)
  *   - TCP/IP sockets (remote clients via host/port)
  *
- * The server listens for incoming connections and forks a child process for each client.
+ * The server listens for incoming connections and forks a child process for each client
+ * (or, with -E, multiplexes all clients from one process - see event_server.c).
  * Clients send shell-like commands which may include piping, redirection, or special
  * internal commands such as `halt`, `quit`, `stat`, and `abort`. The parent process
  * coordinates child sessions, processes control commands through a pipe, and maintains
@@ -17,7 +18,7 @@
  *   - Parsing of shell commands, separating arguments, pipes, redirection, etc.
  *   - Command execution with fork/exec and inter-process pipes
  *   - I/O redirection using custom handlers (redirections.h)
- *   - Linked list management for tracking connections
+ *   - Session registry (registry.h) for tracking connections
  *   - Bidirectional communication with clients using sockets
  *
  * ==============================================================================================
@@ -29,74 +30,66 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include "redirections.h"
+#include "parser.h"
+#include "plan_cache.h"
+#include "path_cache.h"
+#include "spawn.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "protocol.h"
+#include "compress.h"
+#include "forward.h"
+#include "registry.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "cgroup.h"
+#include "result_cache.h"
+#include "sink.h"
+#include "heredoc.h"
+#include "tls.h"
+#include "sockopt.h"
+#include "recorder.h"
+#include "handoff.h"
+#include "poller.h"
+#include "server.h"
+#include "event_server.h"
 
 #define CHUNK_SIZE 500
+#define CONTROL_MAX_PAYLOAD 4096
 
 
-/* ==============================================================================================
- * Filename Parser for Redirection
- * ==============================================================================================
- * Parses filenames from the input command stream after encountering redirection operators:
- *   - '>'   → output redirection
- *   - '>>'  → output append redirection
- *   - '<'   → input redirection
- * Skips whitespaces and reads characters until a special shell delimiter is reached
- * (such as pipe '|', semicolon ';', newline, or null terminator).
- * Returns a newly allocated string containing the parsed filename.
- * ==============================================================================================
- */
+// Server-wide settings filled in from the command line by main()
+server_options_t server_options = {0};
 
+// Scheduling class of the session this process serves (`priority`, scheduler.c)
+static int session_priority = SCHED_NORMAL;
 
-char* read_filename(char **cur_char){
-    char *filename = (char *)calloc(20, sizeof(char));
-
-    char *cur_char_filename = filename;
-
-    while (**cur_char != ';' && **cur_char != '|' && **cur_char != '\n' && **cur_char != '\0') {
-        if (**cur_char == ' ') {
-            (*cur_char)++;
-            continue;
-        }
-        *(cur_char_filename++) = **cur_char;
-        (*cur_char)++;
-    }
-    return filename;
-}
-
-
-/* ==============================================================================================
- * Free Command Argument Memory
- * ==============================================================================================
- * Frees dynamically allocated memory for command arguments
- * used during parsing and execution.
- * ==============================================================================================
- */
-
-
-void free_args(char ****args, int num_commands, int num_args_per_command) {
-    for (int row = 0; row < num_commands; row++) {
-        for (int call = 0; call < num_args_per_command; call++) {
-            free((*args)[row][call]);
-        }
-        free((*args)[row]);
-    }
-    free((*args));
-    *args = NULL;
-}
+// Session side of the result cache (-R), see the control channel section
+static int cache_request(int client_fd, const pipeline_t *pipeline, int not_all_flag, int *store);
+static void capture_begin(int store, const pipeline_t *pipeline);
+static void capture_chunk(const char *data, size_t len);
+static void capture_end(int status);
+static void output_tap(const char *data, size_t len);
+static int capturing = 0;           // output of the running pipeline goes to the cache
 
 
 /* ==============================================================================================
  * Execute Parsed Commands (Pipeline Execution)
  * ==============================================================================================
  * Executes a sequence of parsed commands that form a pipeline.
- * Each command is forked as a separate process. Pipes are created
- * between them to connect stdout of one to stdin of the next.
+ * Each command is started as a separate process with posix_spawn() (spawn.c), or forked
+ * when the server runs with -F. Pipes are created between them to connect stdout of one
+ * to stdin of the next.
  *
  * Handles redirection:
  *   - Input redirection if '<' is used before a command
@@ -104,58 +97,233 @@ void free_args(char ****args, int num_commands, int num_args_per_command) {
  *
  * If the last process produces output, it is captured via a dedicated result pipe
  * and sent back to the client over the socket, or printed locally if no socket is set.
- * Built-in commands such as 'cd' and 'halt' are also handled here without forking.
+ * Forwarding is done by forward.c (splice/tee on Linux); with -q the copy on the server's
+ * stdout is skipped.
+ * Built-in commands such as 'cd' and 'halt' are also handled here without forking, and so
+ * are the lightweight commands of builtins.c (echo, printf, pwd, true, false, cat file):
+ * alone they run entirely in the server process, as the first stage of a pipeline they feed
+ * the next stage without a process of their own.
+ * With -R the output of allowed read-only pipelines may come from the result cache the parent
+ * keeps (result_cache.c) instead; a pipeline that fills an entry copies its output there.
+ *
+ * All client output goes through the protocol module, which emits either raw text with an
+ * "[END]" marker (legacy clients) or DATA/END frames. Returns the exit status of the last
+ * pipeline stage, which framed clients receive in the END frame.
  * ==============================================================================================
  */
 
 
-void execute_command(int client_fd, char ***args, char **filenames, int row_number,
-                     const int *input_file_flags, const int *output_file_flags, int not_all_flag) {
+// `hash` lists the remembered command locations, `hash -r` forgets them
+int hash_builtin(char **argv, char *buf, size_t size) {
+    if (argv[1] == NULL) {
+        path_cache_format(buf, size);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0 && argv[2] == NULL) {
+        path_cache_reset();
+        snprintf(buf, size, "[INFO] Command path cache cleared\n");
+        return 0;
+    }
+    snprintf(buf, size, "[ERROR] hash: usage: hash [-r]\n");
+    return 2;
+}
+
+static int exit_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Runs a pipeline that consists of one builtin (builtins.c) without starting a process
+static int run_builtin(int client_fd, const command_t *stage, const builtin_t *builtin, int not_all_flag) {
+    static builtin_output_t output = {0};
+    int mirror_stdout = (client_fd <= 0 || !server_options.quiet);
+    char message[512];
+    const char *reply = NULL;   // sent together with the END frame
+    size_t reply_len = 0;
+    int status = 0;
+
+    metrics_command_begin(stage->argv[0]);
+    metrics_command_spawned();
+
+    if (builtin->run) {
+        status = builtin_run(builtin, stage->argv, &output);
+
+        if (stage->output_file) {
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->output_mode == REDIRECT_APPEND ? O_APPEND : O_TRUNC);
+            int file_fd = open(stage->output_file, flags, 0644);
+            if (file_fd < 0 || proto_write_all(file_fd, output.data, output.len) < 0) {
+                snprintf(message, sizeof(message), "[ERROR] %s: %s\n", stage->output_file, strerror(errno));
+                status = 1;
+            } else {
+                snprintf(message, sizeof(message), "[INFO] Output saved to file: %s\n", stage->output_file);
+            }
+            if (file_fd >= 0) close(file_fd);
+            reply = message;
+            reply_len = strlen(message);
+        } else {
+            if (mirror_stdout) fwrite(output.data, 1, output.len, stdout);
+            if (client_fd > 0) {
+                metrics_output(output.len);
+                reply = output.data;
+                reply_len = output.len;
+            }
+        }
+    } else {
+        // cat: stream every file, as the output of a pipeline is streamed
+        for (int i = 1; stage->argv[i]; i++) {
+            int file_fd = open(stage->argv[i], O_RDONLY | O_CLOEXEC);
+            ssize_t forwarded = -1;
+            if (file_fd >= 0) forwarded = recorder_active() ? forward_output_tapped(file_fd, client_fd, mirror_stdout, recorder_output)
+                                                            : forward_output(file_fd, client_fd, mirror_stdout);
+            if (forwarded < 0) {
+                snprintf(message, sizeof(message), "cat: %s: %s\n", stage->argv[i], strerror(errno));
+                if (mirror_stdout) fputs(message, stdout);
+                recorder_output(message, strlen(message));
+                proto_send_data(client_fd, message, strlen(message));
+                status = 1;
+            }
+            if (file_fd >= 0) close(file_fd);
+        }
+    }
+    metrics_command_end();
+
+    recorder_output(reply, reply_len);
+    proto_send_reply(client_fd, reply, reply_len, !not_all_flag, status);
+    return status;
+}
+
+// Lets a builtin first stage feed the pipe to the second one: `cat file` hands over the opened
+// file, other builtins put their whole output into the pipe up front, if it fits without
+// blocking. Returns 0 if the stage must run as a program after all.
+static int feed_builtin(const builtin_t *builtin, char **argv, int pipe_fds[2]) {
+    if (!builtin->run) {
+        if (argv[2]) return 0;
+        int file_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (file_fd < 0) return 0;              // cat reports the error itself
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        pipe_fds[0] = file_fd;
+        pipe_fds[1] = -1;
+        return 1;
+    }
+
+    static builtin_output_t output = {0};
+    builtin_run(builtin, argv, &output);
+
+    long capacity = PIPE_BUF;
+#ifdef F_GETPIPE_SZ
+    capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+#endif
+    if (output.len > (size_t)capacity) return 0;
+
+    if (proto_write_all(pipe_fds[1], output.data, output.len) < 0) return 0;
+    close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+    return 1;
+}
+
+// Heredocs and here-strings become stdin descriptors of their stages (heredoc.c). With -O the
+// server also takes over the redirections (sink.c): it writes the last stage's `>`/`>>` file
+// from the result pipe and opens `<` files with readahead hints. Returns the stages to start,
+// copies without the redirections taken over, with the descriptors in input_fds (-1 = none)
+// and *sink_fd.
+static const command_t *take_redirections(const pipeline_t *pipeline, command_t *copies, int *input_fds, int *sink_fd) {
+    int last = pipeline->count - 1;
+
+    *sink_fd = -1;
+    for (int i = 0; i <= last; i++) input_fds[i] = heredoc_stage_input(&pipeline->stages[i]);
+    if (!sink_enabled() || pipeline->background) return pipeline->stages;
+
+    for (int i = 0; i <= last; i++) {
+        copies[i] = pipeline->stages[i];
+        if (input_fds[i] < 0 && copies[i].input_file && (input_fds[i] = sink_open_input(copies[i].input_file)) >= 0)
+            copies[i].input_file = NULL;
+    }
+    if (copies[last].output_file && (*sink_fd = sink_open_output(&copies[last])) >= 0) {
+        copies[last].output_file = NULL;
+        copies[last].output_mode = REDIRECT_NONE;
+    }
+    return copies;
+}
+
+int execute_command(int client_fd, const pipeline_t *pipeline, int not_all_flag) {
+    const command_t *stages = pipeline->stages;
+    int row_number = pipeline->count - 1;   // index of the last stage
+    char **argv0 = stages[0].argv;
 
     char chunk_buf[4096];
     memset(chunk_buf, 0, sizeof(chunk_buf));
-    int total = 0, bytes_read;
-    char info_message[256] = "";
+    int total = 0;
+    int status = 0;
+    char info_message[1024] = "";
 
     // Handle built-in 'halt' command: terminates the entire shell server
-    if (strcmp(args[0][0], "halt") == 0) {
+    if (strcmp(argv0[0], "halt") == 0) {
         if (client_fd > 0) {
-            write(client_fd, "[HALT]", 6);
-            write(client_fd, "[END]", 5);
+            proto_send_control(client_fd, FRAME_HALT);
+            proto_send_end(client_fd, 0);
         }
         printf("Server closed.\n");
+        recorder_end(0);    // the writer drains the ring before it exits
         killpg(0, SIGTERM); // Send termination to all processes in group
     }
 
     // Handle built-in 'help' command: prints available internal commands
-    if (strcmp(args[0][0], "help") == 0) {
+    if (strcmp(argv0[0], "help") == 0) {
         snprintf(info_message, sizeof(info_message),
                  "[HELP] Available internal commands:\n"
                  "  help           Show this message\n"
                  "  cd <path>      Change working directory\n"
+                 "  hash [-r]      List the command path cache, -r resets it\n"
                  "  halt           Shut down the entire server\n"
                  "  quit           Disconnect current client\n"
-                 "  stat           Show active connections (server only)\n"
+                 "  stat [-v]      Show connections and plan cache stats, -v adds metrics\n"
+                 "  priority [cls] Show or set the scheduling class: high, normal, low\n"
+                 "  cmd &          Run a pipeline as a background job, its output is kept\n"
+                 "  jobs           List background jobs\n"
+                 "  fg [id]        Wait for a job and show its output\n"
+                 "  wait [id]      Wait for one job, or for all of them\n"
+                 "  kill [-SIG] id Signal a job (default SIGTERM)\n"
                  "  abort <id>     Force-close a specific connection by ID\n");
 
         // Send to client or print to stdout
         if (client_fd > 0) {
-            write(client_fd, info_message, strlen(info_message));
-            write(client_fd, "[END]", 5);
+            proto_send_reply(client_fd, info_message, strlen(info_message), !not_all_flag, 0);
         } else {
             printf("%s\n", info_message);
         }
-        return;
+        return 0;
+    }
+
+    // Handle built-in 'hash' command: lists or resets (-r) the command path cache
+    if (strcmp(argv0[0], "hash") == 0) {
+        status = hash_builtin(argv0, chunk_buf, sizeof(chunk_buf));
+        if (client_fd > 0) {
+            proto_send_reply(client_fd, chunk_buf, strlen(chunk_buf), !not_all_flag, status);
+        } else printf("%s\n", chunk_buf);
+        return status;
+    }
+
+    // Handle built-in 'priority' command: scheduling class of the session's pipelines
+    if (strcmp(argv0[0], "priority") == 0) {
+        status = scheduler_priority_command(argv0, &session_priority, chunk_buf, sizeof(chunk_buf));
+        if (client_fd > 0) {
+            proto_send_reply(client_fd, chunk_buf, strlen(chunk_buf), !not_all_flag, status);
+        } else printf("%s", chunk_buf);
+        return status;
     }
 
     // Handle built-in 'cd' command: changes working directory
-    if (strcmp(args[0][0], "cd") == 0) {
-        if (args[0][1] == NULL) {
+    if (strcmp(argv0[0], "cd") == 0) {
+        if (argv0[1] == NULL) {
             snprintf(info_message, sizeof(info_message), "[ERROR] cd: missing argument\n");
-        } else if (chdir(args[0][1]) != 0) {
+            status = 1;
+        } else if (chdir(argv0[1]) != 0) {
             snprintf(info_message, sizeof(info_message), "[ERROR] cd: directory doesn't exist\n");
+            status = 1;
         } else {
-            snprintf(info_message, sizeof(info_message), "[INFO] Changed directory to: %s\n", args[0][1]);
+            snprintf(info_message, sizeof(info_message), "[INFO] Changed directory to: %s\n", argv0[1]);
         }
         if (info_message[0] != '\0') {
             strncat(chunk_buf, info_message, sizeof(chunk_buf) - strlen(chunk_buf) - 1);
@@ -165,51 +333,146 @@ void execute_command(int client_fd, char ***args, char **filenames, int row_numb
 
         // Send feedback to client or print to local terminal
         if (client_fd > 0) {
-            write(client_fd, chunk_buf, total);
-            write(client_fd, "[END]", 5);
+            proto_send_reply(client_fd, chunk_buf, total, !not_all_flag, status);
         } else printf("%s\n", chunk_buf);
-        return;
+        return status;
+    }
+
+    // Handle job control builtins: jobs, fg, wait and kill (jobs.c)
+    status = jobs_command(client_fd, argv0, not_all_flag);
+    if (status >= 0) return status;
+    status = 0;
+
+    // Jobs belong to the session process; with -E every line runs in a process of its own
+    if (pipeline->background && server_options.event_mode) {
+        snprintf(info_message, sizeof(info_message), "[ERROR] Background jobs need a session process (not available with -E)\n");
+        if (client_fd > 0) {
+            proto_send_reply(client_fd, info_message, strlen(info_message), !not_all_flag, 1);
+        } else printf("%s", info_message);
+        return 1;
     }
 
+    // Lightweight commands served by the server process itself (builtins.c); a job always
+    // gets processes of its own, since it must not hold up the session
+    const builtin_t *builtin = builtin_find(argv0);
+    if (builtin && (stages[0].input_file || stages[0].input_text || stages[0].heredoc || (!builtin->run && stages[0].output_file) || pipeline->background)) builtin = NULL;
+    if (builtin && row_number == 0) return run_builtin(client_fd, &stages[0], builtin, not_all_flag);
+
+    // Everything from here on is timed for the session and the command's histogram
+    metrics_command_begin(argv0[0]);
+
+    // Output the result cache (-R) already has, or gets from a session running the same
+    int store = 0;
+    status = cache_request(client_fd, pipeline, not_all_flag, &store);
+    if (status >= 0) {
+        metrics_command_end();
+        return status;
+    }
+    status = 0;
+    capture_begin(store, pipeline);
+
     // Declare pipes between commands in pipeline
-    int pipes[row_number][2];
+    int pipes[row_number + 1][2];   // one spare, so the array is never zero-sized
     pid_t pids[row_number + 1];
-    int result_pipe[2]; // Pipe used by the last command to send output to parent
+    int result_pipe[2] = { -1, -1 }; // Pipe used by the last command to send output to parent
+    unsigned char raw_token[PROTO_RAW_TOKEN_SIZE];
+
+    // With -D the last command writes straight into the client socket instead of the result pipe
+    int direct = server_options.direct_output && client_fd > 0 && !stages[row_number].output_file
+                 && !pipeline->background && !capturing && !recorder_active() && proto_raw_capable(client_fd);
+
+    if (direct) {
+        if (proto_begin_raw(client_fd, raw_token) < 0) direct = 0;
+    }
+
+    // A job writes into its spool file instead of the result pipe, nobody reads it meanwhile
+    int spool_fd = -1;
+    if (pipeline->background) {
+        spool_fd = jobs_spool();
+        if (spool_fd < 0) {
+            snprintf(info_message, sizeof(info_message), "[ERROR] Cannot create job output file: %s\n", strerror(errno));
+            if (client_fd > 0) {
+                proto_send_reply(client_fd, info_message, strlen(info_message), !not_all_flag, 1);
+            } else printf("%s", info_message);
+            metrics_command_end();
+            return 1;
+        }
+        result_pipe[1] = spool_fd;
+    }
 
-    // Create result pipe
-    if (pipe(result_pipe) == -1) {
+    // Create result pipe (pipes are close-on-exec, stages only keep what is dup2'ed onto stdio)
+    if (!direct && spool_fd < 0 && spawn_pipe(result_pipe) == -1) {
         perror("[ERROR] result_pipe error");
         exit(1);
     }
 
     // Create all intermediate pipes for command chaining
     for (int i = 0; i < row_number; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (spawn_pipe(pipes[i]) == -1) {
             perror("[ERROR] Pipe error");
             exit(1);
         }
     }
 
-    // Fork each command in the pipeline
-    for (int i = 0; i <= row_number; i++) {
+    // Redirections the server handles itself (-O)
+    command_t copies[row_number + 1];
+    int input_fds[row_number + 1];
+    int sink_fd;
+    const command_t *run = take_redirections(pipeline, copies, input_fds, &sink_fd);
+
+    // Wait for a slot of the scheduler (-L) and create the pipeline's cgroup (-G)
+    int holds_slot = acquire_pipeline_slot();
+    int cgroup_fd = cgroup_open(session_priority);
+
+    // Stages started with fork() join the cgroup before exec(); posix_spawn() could only move
+    // them once they run, when they may already have forked or allocated outside the limits
+    int fork_launcher = server_options.fork_launcher || cgroup_fd >= 0;
+
+    // A builtin first stage writes into the first pipe right here (pids[0] = 0: no process)
+    int fed = builtin && !stages[0].output_file && feed_builtin(builtin, argv0, pipes[0]);
+    if (fed) pids[0] = 0;
+
+    // Spawn each command in the pipeline (posix_spawn, no copy of the server's address space)
+    for (int i = fed; !fork_launcher && i <= row_number; i++) {
+        int in_fd = (input_fds[i] >= 0) ? input_fds[i] : (i > 0) ? pipes[i - 1][0] : -1;
+        int out_fd = (i < row_number) ? pipes[i][1] : (direct ? client_fd : result_pipe[1]);
+        int error = 0;
+
+        pids[i] = spawn_stage(&run[i], in_fd, out_fd, &error);
+        if (pids[i] < 0) {
+            // Report it where the stage's own error output would have gone
+            snprintf(info_message, sizeof(info_message), "[ERROR] Execution error: %s\n", strerror(error));
+            if (!run[i].output_file) proto_write_all(out_fd, info_message, strlen(info_message));
+            else fprintf(stderr, "%s", info_message);
+            info_message[0] = '\0';
+        }
+    }
+
+    // With -F (or a cgroup to join), fork each command in the pipeline as before
+    for (int i = fed; fork_launcher && i <= row_number; i++) {
         pids[i] = fork();
         if (pids[i] == 0) {
             // CHILD PROCESS
+            cgroup_attach(cgroup_fd, 0);
 
             // Handle input redirection or pipe from previous command
-            if (input_file_flags[i]) {
-                input_redirection(filenames[i]);
+            if (run[i].input_file) {
+                input_redirection(run[i].input_file);
+            } else if (input_fds[i] >= 0) {
+                dup2(input_fds[i], STDIN_FILENO);
             } else if (i > 0) {
                 dup2(pipes[i - 1][0], STDIN_FILENO);
             }
 
             // Handle output redirection or pipe to next command or result pipe
-            if (output_file_flags[i] == 1) {
-                output_redirection(filenames[i]);
-            } else if (output_file_flags[i] == 2) {
-                output_redirection_append(filenames[i]);
+            if (run[i].output_mode == REDIRECT_TRUNCATE) {
+                output_redirection(run[i].output_file);
+            } else if (run[i].output_mode == REDIRECT_APPEND) {
+                output_redirection_append(run[i].output_file);
             } else if (i < row_number) {
                 dup2(pipes[i][1], STDOUT_FILENO);
+            } else if (direct) {
+                dup2(client_fd, STDOUT_FILENO); // last command writes to the client itself
             } else {
                 dup2(result_pipe[1], STDOUT_FILENO); // last command sends result here
             }
@@ -224,15 +487,18 @@ void execute_command(int client_fd, char ***args, char **filenames, int row_numb
             }
 
             // Close unused ends of result pipe
-            close(result_pipe[0]);
-            if (i != row_number || output_file_flags[i]) {
-                close(result_pipe[1]);
+            if (!direct) {
+                close(result_pipe[0]);
+                if (i != row_number || run[i].output_file) {
+                    close(result_pipe[1]);
+                }
             }
 
             // Execute the command using execvp
-            execvp(args[i][0], args[i]);
+            if (run[i].path) execv(run[i].path, run[i].argv);
+            execvp(run[i].argv[0], run[i].argv);  // not resolved, or it has moved since
             perror("[ERROR] Execution error");
-            exit(1);
+            _exit(1); // no exit(): flushing inherited stdio buffers would rewind a parent's script file
         } else if (pids[i] < 0) {
             perror("[ERROR] Fork error");
             exit(1);
@@ -240,49 +506,96 @@ void execute_command(int client_fd, char ***args, char **filenames, int row_numb
     }
 
     // PARENT PROCESS
+    metrics_command_spawned();
 
     // Close write-end of result pipe (only reading)
-    close(result_pipe[1]);
+    if (!direct && spool_fd < 0) close(result_pipe[1]);
 
     // Close all intermediate pipes in parent
     for (int i = 0; i < row_number; i++) {
         close(pipes[i][0]);
         close(pipes[i][1]);
     }
+    for (int i = 0; i <= row_number; i++) {
+        if (input_fds[i] >= 0) close(input_fds[i]);
+    }
+
+    // A job is left running: the client gets its ID and the PID of the last stage right away
+    if (spool_fd >= 0) {
+        int id = jobs_add(pipeline, pids, row_number + 1, spool_fd, holds_slot);
+        cgroup_close(cgroup_fd);
+        metrics_command_end();
+        snprintf(info_message, sizeof(info_message), "[%d] %d\n", id, (int)pids[row_number]);
+        if (client_fd > 0) {
+            proto_send_reply(client_fd, info_message, strlen(info_message), !not_all_flag, 0);
+        } else printf("%s", info_message);
+        return 0;
+    }
 
-    // Read the output from result pipe and forward to client or print
-    while ((bytes_read = read(result_pipe[0], chunk_buf, sizeof(chunk_buf))) > 0) {
-        fwrite(chunk_buf, 1, bytes_read, stdout);
-        if (client_fd > 0)
-            write(client_fd, chunk_buf, bytes_read);
+    // Forward the output from result pipe to client (zero-copy where possible) and/or print it.
+    // Direct output never passes through the server, so it is neither counted nor mirrored.
+    ssize_t forwarded = -1;
+    int sink_error = 0;
+    if (sink_fd >= 0) {
+        // -O: the output goes to the redirected file, written by the server
+        if (sink_drain(result_pipe[0], sink_fd) < 0) sink_error = errno;
+        else forwarded = 0;
+        close(sink_fd);
+    } else if (!direct) {
+        int mirror_stdout = (client_fd <= 0 || !server_options.quiet);
+        if (capturing || recorder_active()) forwarded = forward_output_tapped(result_pipe[0], client_fd, mirror_stdout, output_tap);
+        else forwarded = forward_output(result_pipe[0], client_fd, mirror_stdout);
     }
 
-    // Wait for all forked child processes to finish
+    // Wait for all forked child processes to finish, keeping the status of the last stage
     for (int i = 0; i <= row_number; i++) {
-        waitpid(pids[i], NULL, 0);
+        int child_status = 0;
+        if (pids[i] < 0) {
+            if (i == row_number) status = 1;    // stage could not be started
+            continue;
+        }
+        if (pids[i] == 0) continue;             // builtin, already done
+        waitpid(pids[i], &child_status, 0);
+        if (i == row_number) status = exit_status(child_status);
     }
+    if (sink_error) {
+        snprintf(info_message, sizeof(info_message), "[ERROR] %s: %s\n", stages[row_number].output_file, strerror(sink_error));
+        recorder_output(info_message, strlen(info_message));
+        if (client_fd > 0) proto_send_data(client_fd, info_message, strlen(info_message));
+        else fprintf(stderr, "%s", info_message);
+        status = 1;
+    }
+    if (holds_slot) release_pipeline_slot();
+    cgroup_close(cgroup_fd);
+    capture_end(status);
+    metrics_command_end();
+
+    // The last command has exited, so nothing else can be written in the raw stream
+    if (direct) proto_end_raw(client_fd, raw_token);
 
     // If no output was captured and output was redirected to a file, inform the client
-    if (!bytes_read) {
+    size_t info_len = 0;
+    if (forwarded == 0) {
         int filename_index = -1;
         for (int i = 0; i <= row_number; i++) {
-            if (output_file_flags[i]) {
+            if (stages[i].output_file) {
                 filename_index = i;
                 break;
             }
         }
         if (filename_index != -1) {
-            snprintf(info_message, sizeof(info_message), "[INFO] Output saved to file: %s\n", filenames[filename_index]);
-            write(client_fd, info_message, strlen(info_message));
+            snprintf(info_message, sizeof(info_message), "[INFO] Output saved to file: %s\n", stages[filename_index].output_file);
+            info_len = strlen(info_message);
         }
     }
 
     // Send [END] tag to indicate response finished (unless suppressed by not_all_flag)
-    if (!not_all_flag)
-        write(client_fd, "[END]", 7);
+    recorder_output(info_message, info_len);
+    proto_send_reply(client_fd, info_message, info_len, !not_all_flag, status);
 
     // Close result pipe's read-end
-    close(result_pipe[0]);
+    if (!direct) close(result_pipe[0]);
+    return status;
 }
 
 
@@ -295,443 +608,1157 @@ void execute_command(int client_fd, char ***args, char **filenames, int row_numb
  * Recognizes input/output redirection symbols ('<', '>', '>>') and associates them
  * with the appropriate filenames.
  *
- * Constructs an array of commands (each with argument vectors) and dispatches the execution.
+ * Parsing is done by parser.c into an arena, so there are no per-token allocations and no
+ * fixed limits on stages, arguments or argument length. The parsed line (a plan, with the
+ * executables already resolved) is kept in the LRU plan cache (plan_cache.c), so a repeated
+ * line is neither tokenized nor searched in PATH again. Syntax errors are reported to the
+ * client with exit status 2.
  * ==============================================================================================
  */
 
 
-void handle_command(int client_fd, char *command) {
-    int num_commands = 10;
-    int num_args_per_command = 5;
-    int max_arg_length = 20;
-
-    // Allocate memory for input and output redirection flags
-    int *input_file_flags = (int *)calloc(num_commands, sizeof(int));
-    int *output_file_flags = (int *)calloc(num_commands, sizeof(int));
-
-    // Allocate memory for storing command arguments
-    char ***args = (char ***)calloc(num_commands, sizeof(char **));
-    if (!args) {
-        perror("[ERROR] Memory allocation failed");
-        exit(1);
-    }
+void format_plan_stats(char *buf, size_t size) {
+    plan_cache_stats_t stats;
+    plan_cache_stats(&stats);
+    snprintf(buf, size, "Plan cache: %lu hits, %lu misses, %zu/%d entries\n",
+             stats.hits, stats.misses, stats.entries, PLAN_CACHE_SIZE);
+}
 
-    // Allocate memory for each command and its arguments
-    for (int i = 0; i < num_commands; i++) {
-        args[i] = (char **)calloc(num_args_per_command, sizeof(char *));
-        if (!args[i]) {
-            perror("[ERROR] Memory allocation failed");
-            exit(1);
+// `stat -v` adds the metrics of all sessions (metrics.c)
+int stat_verbose(const char *command) {
+    return strstr(command + 4, "-v") != NULL;
+}
+
+void send_metrics(int client_fd) {
+    size_t len;
+    char *text = metrics_format_verbose(&len);
+    proto_send_data(client_fd, text, len);
+    free(text);
+}
+
+void run_plan(int client_fd, const plan_t *plan) {
+    int status = 0;
+
+    sockopt_cork(client_fd, 1);     // -o cork: the response leaves in full segments
+    if (client_fd > 0) recorder_begin(plan->key, strlen(plan->key));
+    for (size_t i = 0; i < plan->count; i++) {
+        const plan_step_t *step = &plan->steps[i];
+
+        if (step->result == PARSE_ERROR) {
+            char message[128];
+            snprintf(message, sizeof(message), "[ERROR] Syntax error: %s\n", step->error);
+            recorder_output(message, strlen(message));
+            status = 2;
+            if (client_fd > 0) {
+                proto_send_reply(client_fd, message, strlen(message), 1, 2);
+            } else printf("%s", message);
+            break;
         }
 
-        for (int j = 0; j < num_args_per_command; j++) {
-            args[i][j] = (char *)calloc(max_arg_length, sizeof(char));
-            if (!args[i][j]) {
-                perror("[ERROR] Memory allocation failed");
-                exit(1);
-            }
+        if (step->pipeline.count > 0) {
+            // Only the last pipeline of the line terminates the response with [END]
+            status = execute_command(client_fd, &step->pipeline, step->result == PARSE_SEQUENCE);
+        } else if (step->result == PARSE_LAST && client_fd > 0) {
+            // Still terminate the response, e.g. for a trailing ';' or a blank line
+            proto_send_end(client_fd, 0);
         }
     }
+    heredoc_discard();  // a heredoc body no stage of the line took
+    recorder_end(status);
+    sockopt_cork(client_fd, 0);
+}
 
-    int i = 0;
-    int j = 0;
-    int l = 0;
-    char *cur_char = command;
-    char **filenames = (char **)calloc(max_arg_length, sizeof(char *));
+void handle_command(int client_fd, char *command) {
+    run_plan(client_fd, plan_lookup(command));
+}
 
-    // Loop through the command string to parse arguments
-    while (*cur_char != '\n') {
-        if (*cur_char == ' ') {
-            if (l > 0) {
-                args[i][j][l] = '\0';
-                j++;
-                l = 0;
-            }
-            cur_char++;
-            continue;
-        }
 
-        if (*cur_char == '<' && *(cur_char + 1) == '<' && *(cur_char + 2) == '<') {
-            cur_char += 3;
-            continue;
-        }
+/* ==============================================================================================
+ * Session Registry
+ * ==============================================================================================
+ * The accepting process keeps its sessions in the registry (registry.c), indexed by ID, PID
+ * and control channel. Includes:
+ *   - add_connection()  — registers a new client session
+ *   - abort_session()   — forcefully terminates a session on behalf of another client
+ *   - end_session()     — drops a session whose child has exited
+ * ==============================================================================================
+ */
 
-        if (*cur_char == '>' && *(cur_char + 1) == '>') {
-            cur_char += 2;
-            filenames[i] = read_filename(&cur_char);
-            output_file_flags[i] = 2;
-            continue;
-        }
 
-        if (*cur_char == '>') {  // Handle output redirection
-            cur_char++;
-            filenames[i] = read_filename(&cur_char);
-            output_file_flags[i] = 1;
-            continue;
-        }
-        if (*cur_char == '<') {  // Handle input redirection
-            cur_char++;
-            filenames[i] = read_filename(&cur_char);
-            input_file_flags[i] = 1;
-            continue;
+static int loop_poller = -1;        // poller of the accept loop, watches the control channels
+
+static void grant_waiting(void);
+static void cache_forget(session_t *session);
+static void cache_give_up(session_t *filler);
+
+// "<ip>:<port>" of a TCP client for `stat`; UNIX socket clients have no address of their own
+void format_peer(const struct sockaddr *addr, char *buf, size_t size) {
+    char ip[INET_ADDRSTRLEN];
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        snprintf(buf, size, "%s:%d", inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip)) ? ip : "?",
+                 ntohs(in->sin_port));
+    } else {
+        snprintf(buf, size, "local");
+    }
+}
+
+void add_connection(int id, const char *peer, int channel_fd, pid_t pid, int metrics_slot) {
+    session_t *session = registry_add(id, peer, channel_fd, pid);
+    session->metrics_slot = metrics_slot;
+    scheduler_entry_init(&session->sched, session);
+    session->cache_entry = NULL;
+    session->cache_filling = 0;
+    metrics_session_label(metrics_slot, session->id, pid);
+    poller_add(loop_poller, channel_fd, POLLER_READ);
+    printf("[INFO] Added connection ID %d (PID %d)\n", session->id, pid);
+}
+
+// Collects the child and releases its channel and pipeline slots
+void end_session(session_t *session) {
+    waitpid(session->pid, NULL, 0);
+    poller_del(loop_poller, session->channel_fd);
+    close(session->channel_fd);
+    metrics_session_close(session->metrics_slot);
+    scheduler_forget(&session->sched);
+    cache_forget(session);
+    cgroup_forget_session(session->pid);
+    registry_remove(session);
+    grant_waiting();
+}
+
+// SIGUSR2 makes the session tell its client about the abort and exit (see session_aborted())
+void abort_session(session_t *session) {
+    kill(session->pid, SIGUSR2);
+    printf("[INFO] Aborted connection ID %d (PID %d)\n", session->id, session->pid);
+    end_session(session);
+}
+
+
+/* ==============================================================================================
+ * Control Channel (Session Child <-> Parent)
+ * ==============================================================================================
+ * Every session child gets its own SOCK_SEQPACKET socketpair to the parent. Messages are a
+ * fixed binary header (control_msg_t) optionally followed by a payload; the socket keeps the
+ * boundaries, so messages from many sessions can neither merge nor split, and the parent
+ * knows the sender from the channel it arrived on. Requests from the session:
+ *   CONTROL_STAT                 - list the connections
+ *   CONTROL_ABORT  (arg = ID)    - disconnect connection <id>
+ *   CONTROL_QUIT                 - disconnect the sender
+ *   CONTROL_ACQUIRE (arg = class) - ask for a pipeline slot (-L, scheduler.c); the parent
+ *                                   answers with CONTROL_GRANT once one is free
+ *   CONTROL_RELEASE              - a pipeline of the session has ended, no answer
+ *   CONTROL_CACHE_LOOKUP (arg = TTL, payload = key) - ask the result cache (-R); answered with
+ *                                   the cached output (DATA + END, also for coalesced
+ *                                   requests; an output larger than one message comes as
+ *                                   CONTROL_CACHE_HIT with a sealed memfd instead, so the
+ *                                   parent never writes more than a message per answer and
+ *                                   cannot stall on a slow session) or
+ *                                   CONTROL_CACHE_MISS: run the pipeline, and
+ *                                   if arg is 1 send its output with CONTROL_CACHE_STORE
+ *                                   messages and its exit status with CONTROL_CACHE_DONE
+ * The parent answers on the same channel with CONTROL_DATA messages (reply text) and one
+ * closing message: CONTROL_END (status = exit status), CONTROL_ABORT when the sender
+ * aborted itself, or CONTROL_QUIT. The session forwards all of it to its client, tagged with
+ * the stream ID the request carried, and only continues once the reply is complete, so a
+ * reply cannot interleave with the output of a pipelined client's next request. The parent
+ * never writes to client sockets itself.
+ *
+ * A session whose connection is aborted by another client is stopped with SIGUSR2.
+ * ==============================================================================================
+ */
+
+
+enum {
+    CONTROL_STAT = 1,
+    CONTROL_ABORT = 2,
+    CONTROL_QUIT = 3,
+    CONTROL_DATA = 4,
+    CONTROL_END = 5,
+    CONTROL_ACQUIRE = 6,
+    CONTROL_GRANT = 7,
+    CONTROL_RELEASE = 8,
+    CONTROL_CACHE_LOOKUP = 9,
+    CONTROL_CACHE_MISS = 10,
+    CONTROL_CACHE_STORE = 11,
+    CONTROL_CACHE_DONE = 12,    // arg = 1: the output got too large, it is not stored
+    CONTROL_CACHE_HIT = 13      // closes a lookup like END; the output is in the passed fd
+};
+
+typedef struct {
+    uint32_t type;                  // CONTROL_*
+    uint32_t stream_id;             // request the message belongs to
+    int32_t arg;                    // request argument (abort: connection ID)
+    int32_t status;                 // CONTROL_END: exit status of the reply
+    uint32_t length;                // payload bytes following the header
+} control_msg_t;
+
+static int control_send(int channel_fd, uint32_t type, uint32_t stream_id, int32_t arg, int32_t status,
+                        const void *payload, size_t len) {
+    control_msg_t msg = { type, stream_id, arg, status, (uint32_t)len };
+    struct iovec iov[2] = {
+        { &msg, sizeof(msg) },
+        { (void *)payload, len }
+    };
+    struct msghdr hdr = {0};
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = len > 0 ? 2 : 1;
+
+    ssize_t sent;
+    do sent = sendmsg(channel_fd, &hdr, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    return sent < 0 ? -1 : 0;
+}
+
+// Parent side: a message without payload, with one descriptor passed along (SCM_RIGHTS)
+static int control_send_fd(int channel_fd, uint32_t type, uint32_t stream_id, int32_t status, int fd) {
+    control_msg_t msg = { type, stream_id, 0, status, 0 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { &msg, sizeof(msg) };
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    memset(&control, 0, sizeof(control));
+    hdr.msg_control = control.space;
+    hdr.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t sent;
+    do sent = sendmsg(channel_fd, &hdr, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    return sent < 0 ? -1 : 0;
+}
+
+// Session side: receives one message into packet; *fd is the descriptor sent along, or -1
+static ssize_t control_recv(int channel_fd, char *packet, size_t size, int *fd) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { packet, size };
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.space;
+    hdr.msg_controllen = sizeof(control.space);
+
+    int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    *fd = -1;
+    ssize_t bytes = recvmsg(channel_fd, &hdr, flags);
+    if (bytes < 0) return bytes;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return bytes;
+}
+
+// Session side: sends a request and relays the parent's reply to the client. Returns -1 when
+// the reply closed the session (quit, or abort of the own connection).
+static int control_request(int channel_fd, int client_fd, uint32_t type, int32_t arg) {
+    uint32_t stream_id = proto_get_stream(client_fd);
+    char packet[sizeof(control_msg_t) + CONTROL_MAX_PAYLOAD];
+
+    if (control_send(channel_fd, type, stream_id, arg, 0, NULL, 0) < 0) return 0;
+
+    while (1) {
+        ssize_t bytes = recv(channel_fd, packet, sizeof(packet), 0);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < (ssize_t)sizeof(control_msg_t)) return 0;   // parent gone
+
+        control_msg_t msg;
+        memcpy(&msg, packet, sizeof(msg));
+        switch (msg.type) {
+            case CONTROL_DATA:
+                proto_send_data(client_fd, packet + sizeof(msg), bytes - sizeof(msg));
+                break;
+            case CONTROL_END:
+                proto_send_end(client_fd, msg.status);
+                return 0;
+            case CONTROL_ABORT:
+            case CONTROL_QUIT:
+                proto_send_control(client_fd, msg.type == CONTROL_ABORT ? FRAME_ABORT : FRAME_QUIT);
+                proto_send_end(client_fd, 0);
+                return -1;
         }
-        if (*cur_char == ';') {  // Handle command separator (;)
-            if (l > 0) {
-                args[i][j][l] = '\0';
-                j++;
-            }
-            args[i][j] = NULL;
+    }
+}
 
-            execute_command(client_fd, args, filenames, i, input_file_flags, output_file_flags, 1);
+// Session side of the scheduler (-L). Blocks until the parent grants a pipeline slot; returns 1
+// if one is held now and release_pipeline_slot() has to give it back.
+static int session_channel_fd = -1;
 
-            // Reset argument storage for next command
-            for (int row = 0; row <= i; row++) {
-                for (int coll = 0; coll <= j; coll++) {
-                    free(args[row][coll]);
-                    args[row][coll] = (char *)calloc(20, sizeof(char));
-                }
-            }
-            i = 0;
-            j = 0;
-            l = 0;
-            free(input_file_flags);
-            input_file_flags = (int *)calloc(20, sizeof(int));
-            free(output_file_flags);
-            output_file_flags = (int *)calloc(20, sizeof(int));
-
-            for (int row = 0; row <= i; row++) {
-                free(filenames[i]);
-            }
-            free(filenames);
-            filenames = (char **)calloc(max_arg_length, sizeof(char *));
-            cur_char++;
-            continue;
+int acquire_pipeline_slot(void) {
+    if (!scheduler_enabled() || session_channel_fd < 0) return 0;
+    if (control_send(session_channel_fd, CONTROL_ACQUIRE, 0, session_priority, 0, NULL, 0) < 0) return 0;
+
+    control_msg_t msg;
+    while (1) {
+        ssize_t bytes = recv(session_channel_fd, &msg, sizeof(msg), 0);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < (ssize_t)sizeof(msg)) return 0;    // parent gone, run unscheduled
+        if (msg.type == CONTROL_GRANT) return 1;
+    }
+}
+
+// Async-signal-safe: background jobs give their slot back from the SIGCHLD handler (jobs.c)
+void release_pipeline_slot(void) {
+    control_send(session_channel_fd, CONTROL_RELEASE, 0, 0, 0, NULL, 0);
+}
+
+void set_session_priority(int priority) {
+    session_priority = priority;
+}
+
+// Session side of the result cache (-R): cached output on its way to the client
+static void relay_cached(int client_fd, const char *data, size_t len) {
+    if (!server_options.quiet) fwrite(data, 1, len, stdout);
+    metrics_output(len);
+    recorder_output(data, len);
+    proto_send_data(client_fd, data, len);
+}
+
+// Copies the output passed in a CONTROL_CACHE_HIT to the client; -1 if it cannot be read
+static int relay_cached_fd(int client_fd, int fd) {
+    static char buf[65536];
+    ssize_t bytes;
+    while ((bytes = read(fd, buf, sizeof(buf))) != 0) {
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) return -1;
+        relay_cached(client_fd, buf, bytes);
+    }
+    return 0;
+}
+
+// Asks the parent for the pipeline's output; returns the
+// exit status if the reply came from the cache, or -1 if the pipeline has to run, with *store
+// set when its output is to be sent to the parent.
+static int cache_request(int client_fd, const pipeline_t *pipeline, int not_all_flag, int *store) {
+    unsigned ttl_ms = result_cache_ttl(pipeline);
+    char cwd[PATH_MAX];
+    char key[CONTROL_MAX_PAYLOAD];
+    size_t key_len;
+
+    *store = 0;
+    if (ttl_ms == 0 || session_channel_fd < 0 || client_fd <= 0 || !getcwd(cwd, sizeof(cwd))) return -1;
+    if ((key_len = result_cache_key(pipeline, cwd, key, sizeof(key))) == 0) return -1;
+    if (control_send(session_channel_fd, CONTROL_CACHE_LOOKUP, proto_get_stream(client_fd), ttl_ms, 0, key, key_len) < 0)
+        return -1;
+
+    char packet[sizeof(control_msg_t) + CONTROL_MAX_PAYLOAD];
+    while (1) {
+        int output_fd;
+        ssize_t bytes = control_recv(session_channel_fd, packet, sizeof(packet), &output_fd);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < (ssize_t)sizeof(control_msg_t)) {
+            if (output_fd >= 0) close(output_fd);
+            return -1;                                          // parent gone, run uncached
         }
-        if (*cur_char == '|') {  // Handle piping (|) between commands
-            if (l > 0) {
-                args[i][j][l] = '\0';
-                j++;
-            }
-            args[i][j] = NULL;
-            i++;
-            j = 0;
-            l = 0;
-            cur_char++;
-            continue;
+
+        control_msg_t msg;
+        memcpy(&msg, packet, sizeof(msg));
+        switch (msg.type) {
+            case CONTROL_DATA:
+                relay_cached(client_fd, packet + sizeof(msg), bytes - sizeof(msg));
+                break;
+            case CONTROL_CACHE_HIT:
+                if (output_fd < 0) return -1;                   // descriptor lost, run uncached
+                if (relay_cached_fd(client_fd, output_fd) < 0)
+                    perror("[ERROR] Cannot read cached output");
+                close(output_fd);
+                // fall through
+            case CONTROL_END:
+                if (!not_all_flag) proto_send_end(client_fd, msg.status);
+                return msg.status;
+            case CONTROL_CACHE_MISS:
+                *store = msg.arg;
+                return -1;
         }
-        // Store the command argument character by character
-        args[i][j][l++] = *(cur_char++);
     }
+}
+
+// With -E the event loop owns the cache; its job process captures into this file instead,
+// behind the exit status (-1 while running, -2 too large)
+static int capture_fd = -1;
+static size_t capture_len = 0;
 
-    if (l > 0) {
-        args[i][j][l] = '\0';
-        j++;
+void set_cache_capture(int fd) {
+    capture_fd = fd;
+}
+
+static void capture_status(int status) {
+    pwrite(capture_fd, &status, sizeof(status), 0);
+}
+
+static void capture_begin(int store, const pipeline_t *pipeline) {
+    capturing = store || (capture_fd >= 0 && result_cache_ttl(pipeline) > 0);
+    capture_len = 0;
+    if (capturing && capture_fd >= 0) {
+        capture_status(-1);
+        lseek(capture_fd, sizeof(int), SEEK_SET);
     }
-    args[i][j] = NULL;
+}
 
-    // If no valid command, free memory and return
-    if (j == 0 || args[0][0] == NULL) {
-        free_args(&args, num_commands, num_args_per_command);
+static void capture_chunk(const char *data, size_t len) {
+    if (!capturing) return;
+    if (capture_len + len > result_cache_max_entry()) {
+        // Too large for the cache: the entry is given up, the rest is only forwarded
+        if (capture_fd >= 0) capture_status(-2);
+        else control_send(session_channel_fd, CONTROL_CACHE_DONE, 0, 1, 0, NULL, 0);
+        capturing = 0;
+        return;
+    }
+    capture_len += len;
+    if (capture_fd >= 0) {
+        if (proto_write_all(capture_fd, data, len) < 0) capturing = 0;
         return;
     }
+    for (size_t offset = 0; offset < len; offset += CONTROL_MAX_PAYLOAD) {
+        size_t chunk = len - offset < CONTROL_MAX_PAYLOAD ? len - offset : CONTROL_MAX_PAYLOAD;
+        control_send(session_channel_fd, CONTROL_CACHE_STORE, 0, 0, 0, data + offset, chunk);
+    }
+}
+
+// Output of a pipeline that the result cache or the recorder (-r) wants as well
+static void output_tap(const char *data, size_t len) {
+    capture_chunk(data, len);
+    recorder_output(data, len);
+}
 
-//    for (int row = 0; row <= i; row++) {
-//        for (int coll = 0; coll < num_args_per_command; coll++) {
-//            printf("%s ", args[row][coll]);
-//            if (args[row][coll] == NULL) break;
-//        }
-//        printf("\n");
-//    }
+static void capture_end(int status) {
+    if (!capturing) return;
+    capturing = 0;
+    if (capture_fd >= 0) capture_status(status);
+    else control_send(session_channel_fd, CONTROL_CACHE_DONE, 0, 0, status, NULL, 0);
+}
 
-    // Execute the parsed pipeline
-    execute_command(client_fd, args, filenames, i, input_file_flags, output_file_flags, 0);
+// Parent side: streams one line per session in CONTROL_DATA messages of up to
+// CONTROL_MAX_PAYLOAD bytes, so the list is never truncated however many sessions there are
+static void send_connections(session_t *sender, uint32_t stream_id) {
+    char chunk[CONTROL_MAX_PAYLOAD];
+    size_t len = 0;
 
-    // Free allocated memory
-    free_args(&args, num_commands, num_args_per_command);
-    free(input_file_flags);
-    free(output_file_flags);
+    for (session_t *curr = registry_newest(); curr; curr = curr->older) {
+        char line[128];
+        int line_len = snprintf(line, sizeof(line), "ID: %d | PID: %d | Peer: %s\n", curr->id, curr->pid, curr->peer);
+        if (len + line_len > sizeof(chunk)) {
+            control_send(sender->channel_fd, CONTROL_DATA, stream_id, 0, 0, chunk, len);
+            len = 0;
+        }
+        memcpy(chunk + len, line, line_len);
+        len += line_len;
+    }
+    if (len > 0) control_send(sender->channel_fd, CONTROL_DATA, stream_id, 0, 0, chunk, len);
+
+    char line[256];
+    scheduler_format_stats(line, sizeof(line));
+    control_send(sender->channel_fd, CONTROL_DATA, stream_id, 0, 0, line, strlen(line));
+    result_cache_format_stats(line, sizeof(line));
+    control_send(sender->channel_fd, CONTROL_DATA, stream_id, 0, 0, line, strlen(line));
+    control_send(sender->channel_fd, CONTROL_END, stream_id, 0, 0, NULL, 0);
 }
 
+// Hands freed pipeline slots to the sessions waiting for them
+static void grant_waiting(void) {
+    sched_entry_t *entry;
+    while ((entry = scheduler_next()) != NULL) {
+        session_t *session = entry->owner;
+        control_send(session->channel_fd, CONTROL_GRANT, 0, 0, 0, NULL, 0);
+    }
+}
 
-/* ==============================================================================================
- * Connection List Management
- * ==============================================================================================
- * This block defines and manipulates a linked list of currently active client connections.
- * Each node contains:
- *   - connection ID
- *   - socket file descriptor
- *   - PID of the child handling that connection
- *
- * Includes:
- *   - print_connections() — prints active connections for 'stat' command
- *   - find_fd()           — finds a file descriptor given a PID or ID
- *   - add_connection()    — adds a new client connection node
- *   - abort_connection()  — forcefully kills and cleans up a connection by PID or ID
- * ==============================================================================================
- */
+// Result cache (-R): answers a request with the output of an entry. More than fits in one
+// message is handed over in a sealed copy, which the session reads at its own pace.
+static void send_cached(session_t *session, uint32_t stream_id, const cache_entry_t *entry, int status) {
+    int output_fd = entry->len > CONTROL_MAX_PAYLOAD ? result_cache_export(entry) : -1;
+    if (output_fd >= 0) {
+        control_send_fd(session->channel_fd, CONTROL_CACHE_HIT, stream_id, status, output_fd);
+        close(output_fd);
+        return;
+    }
+    for (size_t offset = 0; offset < entry->len; offset += CONTROL_MAX_PAYLOAD) {
+        size_t chunk = entry->len - offset < CONTROL_MAX_PAYLOAD ? entry->len - offset : CONTROL_MAX_PAYLOAD;
+        control_send(session->channel_fd, CONTROL_DATA, stream_id, 0, 0, entry->data + offset, chunk);
+    }
+    control_send(session->channel_fd, CONTROL_END, stream_id, 0, status, NULL, 0);
+}
 
+static void cache_lookup(session_t *sender, const control_msg_t *msg, const char *key, size_t len) {
+    cache_entry_t *entry = result_cache_lookup(key, len);
+    if (entry && entry->ready) {
+        send_cached(sender, msg->stream_id, entry, 0);
+    } else if (entry) {
+        // Same command already running for another session: wait for its output
+        result_cache_wait(entry, sender, msg->stream_id);
+        sender->cache_entry = entry;
+        sender->cache_filling = 0;
+    } else {
+        sender->cache_entry = result_cache_begin(key, len, msg->arg);
+        sender->cache_filling = 1;
+        control_send(sender->channel_fd, CONTROL_CACHE_MISS, msg->stream_id, 1, 0, NULL, 0);
+    }
+}
 
-typedef struct connection_node {
-    int id;
-    int fd;
-    pid_t pid;
-    struct connection_node *next;
-} connection_node_t;
+// The output is too large to be cached: the waiters run the command themselves
+static void cache_give_up(session_t *filler) {
+    cache_waiter_t *waiters = result_cache_abandon(filler->cache_entry, 1);
+    for (cache_waiter_t *waiter = waiters; waiter; waiter = waiter->next) {
+        session_t *session = waiter->owner;
+        session->cache_entry = NULL;
+        control_send(session->channel_fd, CONTROL_CACHE_MISS, waiter->stream_id, 0, 0, NULL, 0);
+    }
+    result_cache_free_waiters(waiters);
+    filler->cache_entry = NULL;
+    filler->cache_filling = 0;
+}
 
-void print_connections(connection_node_t *list, char *out, size_t max_size) {
-    connection_node_t *curr = list;
-    out[0] = '\0';
+static void cache_done(session_t *filler, int status) {
+    cache_entry_t *entry = filler->cache_entry;
+    cache_waiter_t *waiters = result_cache_finish(entry, status);
+    for (cache_waiter_t *waiter = waiters; waiter; waiter = waiter->next) {
+        session_t *session = waiter->owner;
+        session->cache_entry = NULL;
+        send_cached(session, waiter->stream_id, entry, status);
+    }
+    result_cache_free_waiters(waiters);
+    result_cache_settle(entry);
+    filler->cache_entry = NULL;
+    filler->cache_filling = 0;
+}
 
-    while (curr) {
-        char line[128];
-        snprintf(line, sizeof(line), "ID: %d | PID: %d | FD: %d\n", curr->id, curr->pid, curr->fd);
-        strncat(out, line, max_size - strlen(out) - 1);
-        curr = curr->next;
+// A session that ends leaves the entry it waits for; the one it fills goes to the next waiter
+static void cache_forget(session_t *session) {
+    cache_entry_t *entry = session->cache_entry;
+    if (!entry) return;
+    session->cache_entry = NULL;
+    if (!session->cache_filling) {
+        result_cache_unwait(entry, session);
+        return;
     }
+
+    cache_waiter_t *next_filler = result_cache_handover(entry);
+    if (!next_filler) return;
+    session_t *successor = next_filler->owner;
+    successor->cache_filling = 1;
+    control_send(successor->channel_fd, CONTROL_CACHE_MISS, next_filler->stream_id, 1, 0, NULL, 0);
+    free(next_filler);
 }
 
-int find_fd(connection_node_t *connection_list, int sender_pid, int abort_id) {
-    connection_node_t *curr = connection_list;
-    while (curr) {
-        if (sender_pid && curr->pid == sender_pid) {
-            return curr->fd;
+void handle_control_message(session_t *sender, const control_msg_t *msg, const char *payload, size_t len) {
+    if (msg->type == CONTROL_ABORT) {
+        // Handle 'abort' command
+        session_t *target = registry_by_id(msg->arg);
+        if (!target) {
+            char info_message[256];
+            snprintf(info_message, sizeof(info_message), "[WARN] No connection found with ID %d\n", msg->arg);
+            printf("%s", info_message);
+            control_send(sender->channel_fd, CONTROL_DATA, msg->stream_id, 0, 0, info_message, strlen(info_message));
+            control_send(sender->channel_fd, CONTROL_END, msg->stream_id, 0, 1, NULL, 0);
+        } else if (target == sender) {
+            // The session closes itself after passing the abort on to its client
+            printf("[INFO] Aborted connection ID %d (PID %d)\n", sender->id, sender->pid);
+            control_send(sender->channel_fd, CONTROL_ABORT, msg->stream_id, 0, 0, NULL, 0);
+        } else {
+            char info_message[256];
+            snprintf(info_message, sizeof(info_message), "[INFO] Aborted connection for ID %d\n", msg->arg);
+            abort_session(target);
+            control_send(sender->channel_fd, CONTROL_DATA, msg->stream_id, 0, 0, info_message, strlen(info_message));
+            control_send(sender->channel_fd, CONTROL_END, msg->stream_id, 0, 0, NULL, 0);
         }
-        if (abort_id && curr->id == abort_id) {
-            return curr->fd;
+
+    } else if (msg->type == CONTROL_STAT) {
+        // Handle 'stat' command
+        send_connections(sender, msg->stream_id);
+
+    } else if (msg->type == CONTROL_QUIT) {
+        // Handle 'quit' command: the session exits once its client has the reply
+        control_send(sender->channel_fd, CONTROL_QUIT, msg->stream_id, 0, 0, NULL, 0);
+
+    } else if (msg->type == CONTROL_ACQUIRE) {
+        if (scheduler_acquire(&sender->sched, msg->arg))
+            control_send(sender->channel_fd, CONTROL_GRANT, msg->stream_id, 0, 0, NULL, 0);
+
+    } else if (msg->type == CONTROL_RELEASE) {
+        scheduler_release(&sender->sched);
+        grant_waiting();
+
+    } else if (msg->type == CONTROL_CACHE_LOOKUP) {
+        cache_lookup(sender, msg, payload, len);
+
+    } else if (msg->type == CONTROL_CACHE_STORE) {
+        // Chunks arriving after the entry was given up are dropped
+        if (sender->cache_filling && result_cache_append(sender->cache_entry, payload, len) < 0)
+            cache_give_up(sender);
+
+    } else if (msg->type == CONTROL_CACHE_DONE) {
+        if (sender->cache_filling && msg->arg) cache_give_up(sender);
+        else if (sender->cache_filling) cache_done(sender, msg->status);
+    }
+}
+
+// Handles everything queued on a session's channel; drops the session when its child is gone
+static void drain_channel(session_t *session) {
+    char packet[sizeof(control_msg_t) + CONTROL_MAX_PAYLOAD];
+
+    while (1) {
+        ssize_t bytes = recv(session->channel_fd, packet, sizeof(packet), MSG_DONTWAIT);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (bytes <= 0) {
+            end_session(session);
+            return;
         }
-        curr = curr->next;
+        if ((size_t)bytes < sizeof(control_msg_t)) continue;
 
+        control_msg_t msg;
+        memcpy(&msg, packet, sizeof(msg));
+        handle_control_message(session, &msg, packet + sizeof(msg), bytes - sizeof(msg));
     }
-    return -1;
 }
 
-void add_connection(connection_node_t **connection_list, int *next_connection_id, int fd, pid_t pid) {
-    connection_node_t *node = malloc(sizeof(connection_node_t));
-    node->id = (*next_connection_id)++;
-    node->fd = fd;
-    node->pid = pid;
-    node->next = *connection_list;
-    *connection_list = node;
-    printf("[INFO] Added connection ID %d (PID %d)\n", node->id, pid);
+
+/* ==============================================================================================
+ * Session Input
+ * ==============================================================================================
+ * Reads the next command of a session into buffer (NUL-terminated, without trailing newline).
+ * The first message of a connection decides the protocol: a FRAME_HELLO switches the session
+ * to framed mode, anything else is treated as a legacy text command. Returns the command
+ * length, or a value <= 0 when the client disconnected.
+ * ==============================================================================================
+ */
+
+
+// Switches the connection to framed mode and answers the hello. The -Z codec is used if the
+// client offered it; the reply announces the chosen codec and whether raw streams may come.
+void accept_session_hello(int client_fd, const char *hello) {
+    proto_accept_hello(client_fd, hello);
+
+    int codec = server_options.compression;
+    if (!(proto_get_caps(client_fd) & compress_cap(codec))) codec = COMPRESS_NONE;
+    proto_set_codec(client_fd, codec);
+
+    uint32_t caps = compress_cap(codec);
+    if (server_options.direct_output && codec == COMPRESS_NONE) caps |= PROTO_CAP_RAW;
+    caps |= PROTO_CAP_STDIN;
+    proto_send_hello(client_fd, caps);
 }
 
-void abort_connection(connection_node_t **connection_list, int id, int pid) {
-    connection_node_t *prev = NULL, *curr = *connection_list;
+int read_session_command(int client_fd, proto_reader_t *reader, int *negotiated, char *buffer, size_t size) {
+    while (1) {
+        if (proto_get_mode(client_fd) == PROTO_FRAMED) {
+            frame_header_t header;
+            char *payload;
+            int result = proto_read_frame(reader, client_fd, &header, &payload);
+            if (result <= 0) return result;
+            if (header.type == FRAME_STDIN) heredoc_receive(payload, header.length);
+            if (header.type != FRAME_COMMAND) continue;
+
+            size_t len = header.length < size - 2 ? header.length : size - 2;
+            memcpy(buffer, payload, len);
+            buffer[len] = '\0';
+            buffer[strcspn(buffer, "\n")] = '\0';
+            proto_set_stream(client_fd, header.stream_id);
+            return len > 0 ? (int)len : 1;
+        }
 
-    while (curr) {
-        if (curr->id == id || curr->pid == pid) {
-            kill(curr->pid, SIGTERM);
-            waitpid(curr->pid, NULL, 0);
-            close(curr->fd);
-            printf("[INFO] Aborted connection ID %d (PID %d)\n", curr->id, curr->pid);
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                *connection_list = curr->next;
+        int bytes_read = read(client_fd, buffer, size - 2);
+        if (bytes_read <= 0) return bytes_read;
+
+        if (!*negotiated) {
+            *negotiated = 1;
+            if (proto_is_hello(buffer, bytes_read)) {
+                accept_session_hello(client_fd, buffer);
+
+                // Anything sent after the hello belongs to the first frames
+                proto_reader_feed(reader, buffer + PROTO_HEADER_SIZE, bytes_read - PROTO_HEADER_SIZE);
+                continue;
             }
-            free(curr);
-            return;
-        } else {
-            prev = curr;
-            curr = curr->next;
         }
+
+        buffer[bytes_read] = '\0';
+        buffer[strcspn(buffer, "\n")] = '\0';
+        return bytes_read;
     }
-    printf("[WARN] No connection found with ID %d\n", id);
 }
 
 
 /* ==============================================================================================
- * Main Server Loop (Select-Based Event Loop)
+ * Main Server Loop (Poller-Based Event Loop)
  * ==============================================================================================
- * Central event loop for the server. Uses select() to monitor:
+ * Central event loop for the server. Uses the poller (epoll/kqueue, poller.c) to monitor:
  *   - the main server socket (for new incoming connections)
- *   - the control pipe (for inter-process messages)
+ *   - the control channel of every session (for inter-process messages)
  *
- * Upon new connection: forks a child process and creates an entry in the connection list.
- * Child process handles communication with the client, including:
- *   - forwarding control messages (stat, abort, quit)
+ * Upon new connection: creates the session's control channel, forks a child process and
+ * registers the session. Child process handles communication with the client, including:
+ *   - sending control requests (stat, abort, quit) and relaying the replies
  *   - invoking the shell command handler
- * Parent listens for messages and handles them accordingly, ensuring client status is updated.
+ * Parent drains the channels in batches and answers each request on its own channel; a
+ * channel at EOF means the session ended, so the child is collected and the entry dropped.
+ *
+ * With the -E switch the fork-per-client model is replaced by the event-driven engine of
+ * event_server.c, which serves every session from this single process.
  * ==============================================================================================
  */
 
 
-void main_server_loop(int server_fd) {
-    // File descriptor for client connection
-    int client_fd;
-    // Client address information
+#define SERVER_MAX_EVENTS 64
+
+static char handoff_socket[PATH_MAX];
+static int handoff_fd = -1;         // listener for the next hot restart (-U)
+static void serve_handoff(int server_fd);
+
+static int session_client_fd = -1;
+static volatile sig_atomic_t session_idle = 0;
+static volatile sig_atomic_t session_abort = 0;    // SESSION_ABORT_* set by session_aborted()
+
+enum {
+    SESSION_ABORT_NOTIFY = 1,       // waiting for input: the client gets ABORT + END
+    SESSION_ABORT_CLOSE = 2         // in the middle of a command: the connection is just closed
+};
+
+// SIGUSR2 handler of a session child (abort by another client). It only shuts the client
+// socket down, which ends the session loop's read; the loop sends the frames. The client is
+// only told when the session waits for input: in the middle of a command the abort frame
+// could land inside a DATA frame, so there the output side is shut down as well (and the
+// command ends once it writes again).
+static void session_aborted(int sig) {
+    (void)sig;
+    session_abort = session_idle ? SESSION_ABORT_NOTIFY : SESSION_ABORT_CLOSE;
+    shutdown(session_client_fd, session_abort == SESSION_ABORT_NOTIFY ? SHUT_RD : SHUT_RDWR);
+}
+
+static void run_session(int client_fd, int channel_fd, int metrics_slot) {
+    char buffer[PROTO_MAX_COMMAND + 2];
+    proto_reader_t reader = {0};
+    int negotiated = 0;
+
+    session_client_fd = client_fd;
+    session_channel_fd = channel_fd;
+    signal(SIGUSR2, session_aborted);
+    metrics_attach(metrics_slot);
+    sockopt_session(client_fd);
+
+    // A hello sent as TLS early data was read by the handshake already (kTLS connections)
+    char early[PROTO_HEADER_SIZE];
+    if (tls_take_early(early, sizeof(early)) > 0) {
+        accept_session_hello(client_fd, early);
+        negotiated = 1;
+    }
+
+    while (1) {
+        session_idle = 1;
+        int bytes_read = read_session_command(client_fd, &reader, &negotiated, buffer, sizeof(buffer));
+        session_idle = 0;
+        if (bytes_read < 0 && sockopt_idle_timeout() && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            printf("[INFO] Client idle for %d seconds, closing (PID %d).\n", sockopt_idle_timeout(), getpid());
+            break;
+        }
+        if (session_abort) {
+            if (session_abort == SESSION_ABORT_NOTIFY) {
+                proto_send_control(client_fd, FRAME_ABORT);
+                proto_send_end(client_fd, 0);
+            }
+            break;
+        }
+        if (bytes_read <= 0) {
+            printf("[INFO] Client disconnected (PID %d).\n", getpid());
+            break;
+        }
+
+        printf("[INFO] (PID %d) Command from client: %s\n", getpid(), buffer);
+        metrics_input(metrics_slot, bytes_read);
+
+        // Pass special commands to the parent, which answers on the control channel
+        if (strncmp(buffer, "stat", 4) == 0) {
+            // The plan cache belongs to this session; the master adds the connections
+            char msg[256];
+            format_plan_stats(msg, sizeof(msg));
+            proto_send_data(client_fd, msg, strlen(msg));
+            format_compress_stats(msg, sizeof(msg), proto_get_codec(client_fd));
+            proto_send_data(client_fd, msg, strlen(msg));
+            if (stat_verbose(buffer)) send_metrics(client_fd);
+            control_request(channel_fd, client_fd, CONTROL_STAT, 0);
+        } else if (strncmp(buffer, "abort ", 6) == 0) {
+            if (control_request(channel_fd, client_fd, CONTROL_ABORT, atoi(buffer + 6)) < 0) break;
+        } else if (strncmp(buffer, "quit", 4) == 0) {
+            if (control_request(channel_fd, client_fd, CONTROL_QUIT, 0) < 0) break;
+        } else {
+            strcat(buffer, "\n");
+            handle_command(client_fd, buffer);
+        }
+    }
+
+    jobs_hangup();
+    close(client_fd);
+    exit(0);
+}
+
+static void accept_session(int server_fd) {
     struct sockaddr_storage client_addr;
-    // Size of client address structure
     socklen_t client_len = sizeof(client_addr);
+    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+    if (client_fd < 0) {
+        // Workers sharing a listener all wake up for a connection, only one of them gets it
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("[ERROR] Accept failed");
+        return;
+    }
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);    // BSD inherits it
 
-    connection_node_t *connection_list = NULL;
-    int next_connection_id = 1;
+    printf("[INFO] Client connected.\n");
 
-    // Pipe for parent-child communication [0]-read, [1]-write
-    int control_pipe[2];
-    if (pipe(control_pipe) < 0) {
-        perror("[ERROR] Failed to create control pipe");
-        exit(1);
+    // Control channel between the session and this process [0]-parent, [1]-child
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) < 0) {
+        perror("[ERROR] Failed to create control channel");
+        close(client_fd);
+        return;
+    }
+    fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+    fcntl(channel[1], F_SETFD, FD_CLOEXEC);
+
+    // Create child process for new client; the ID is known to it for the recorder (-r)
+    int id = allocate_connection_id();
+    int metrics_slot = metrics_session_open();
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("[ERROR] Fork failed");
+        metrics_session_close(metrics_slot);
+        close(channel[0]);
+        close(channel[1]);
+        close(client_fd);
+        return;
     }
 
-    // Set non-blocking mode for pipe read end
-    fcntl(control_pipe[0], F_SETFL, O_NONBLOCK);
+    if (pid == 0) {
+        // Child process code: keep only the client socket and its own end of the channel
+        close(server_fd);
+        close(loop_poller);
+        if (handoff_fd >= 0) close(handoff_fd);
+        close(channel[0]);
+        for (session_t *curr = registry_newest(); curr; curr = curr->older) close(curr->channel_fd);
+        recorder_set_session(id);
+
+        // TLS (-T) is negotiated here, so a slow handshake never holds up the accept loop
+        sockopt_accepted(client_fd);
+        if (tls_enabled() && (client_fd = tls_accept(client_fd)) < 0) {
+            printf("[INFO] TLS handshake failed (PID %d).\n", getpid());
+            exit(0);
+        }
+        run_session(client_fd, channel[1], metrics_slot);
+    }
 
-    while (1) {
-        // Prepare file descriptor set for select()
-        fd_set read_fds; // Set of file descriptors to monitor
-        FD_ZERO(&read_fds); // Clear the set
-        FD_SET(server_fd, &read_fds); // Add server socket
-        FD_SET(control_pipe[0], &read_fds); // Add pipe read end
+    // Parent process - the socket belongs to the session from now on
+    close(channel[1]);
+    close(client_fd);
+    char peer[REGISTRY_PEER_SIZE];
+    format_peer((struct sockaddr *)&client_addr, peer, sizeof(peer));
+    add_connection(id, peer, channel[0], pid, metrics_slot);
+}
+
+void main_server_loop(int server_fd) {
+    if (server_options.event_mode) {
+        event_server_loop(server_fd);
+        return;
+    }
+
+    loop_poller = poller_create();
+    if (loop_poller < 0) {
+        perror("[ERROR] Failed to create poller");
+        exit(1);
+    }
+    fcntl(loop_poller, F_SETFD, FD_CLOEXEC);
+    poller_add(loop_poller, server_fd, POLLER_READ);
+    if (metrics_admin_fd() >= 0) poller_add(loop_poller, metrics_admin_fd(), POLLER_READ);
 
-        // Find maximum file descriptor number
-        int max_fd = (server_fd > control_pipe[0]) ? server_fd : control_pipe[0];
+    // Sessions taken over from the previous server (-U), and the socket for the next restart
+    for (session_t *curr = registry_newest(); curr; curr = curr->older)
+        poller_add(loop_poller, curr->channel_fd, POLLER_READ);
+    grant_waiting();
+    if (handoff_socket[0] && server_options.workers <= 1 && (handoff_fd = handoff_listen(handoff_socket)) >= 0)
+        poller_add(loop_poller, handoff_fd, POLLER_READ);
 
-        // Wait for events
-        int ready = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+    while (1) {
+        poller_event_t events[SERVER_MAX_EVENTS];
+        int ready = poller_wait(loop_poller, events, SERVER_MAX_EVENTS, -1);
         if (ready < 0) {
-            perror("[ERROR] select failed");
+            if (errno != EINTR) perror("[ERROR] Poller wait failed");
             continue;
         }
 
-        // Handle commands from child process
-        if (FD_ISSET(control_pipe[0], &read_fds)) {
-            char parent_buffer[256];
-            ssize_t bytes = read(control_pipe[0], parent_buffer, sizeof(parent_buffer) - 1);
-            if (bytes > 0) {
-                parent_buffer[bytes] = '\0';
-                if (strncmp(parent_buffer, "abort ", 5) == 0) {
-                    // Handle 'abort' command
-                    strtok(parent_buffer, " ");
-                    int arg_id = atoi(strtok(NULL, " "));
-                    int sender_pid = atoi(strtok(NULL, " "));
-
-                    // Prepare info message for sender
-                    char info_message[256] = "", buffer[512] = "";
-                    int total = 0;
-                    snprintf(info_message, sizeof(info_message), "[INFO] Aborted connection for ID %d\n", arg_id);
-                    if (info_message[0] != '\0') {
-                        strncat(buffer, info_message, sizeof(buffer) - strlen(buffer) - 1);
-                        total = strlen(buffer);
-                    }
-                    buffer[total] = '\0';
-
-                    // Find file descriptors: one for the sender client and one for the client that should be disconnected
-                    int sender_fd = find_fd(connection_list, sender_pid, -1);
-                    int arg_fd = find_fd(connection_list, -1, arg_id);
-                    if (sender_fd == arg_fd) {
-                        write(arg_fd, "[ABORT]", 7);
-                        write(arg_fd, "[END]", 5);
-                    } else {
-                        if (sender_fd >= 0) {
-                            write(sender_fd, buffer, total);
-                            write(sender_fd, "[END]", 5);
-                        }
-                        if (arg_fd >= 0) {
-                            write(arg_fd, "[ABORT]", 7);
-                            write(arg_fd, "[END]", 5);
-                        }
-                    }
-                    // Abort connection for chosen id
-                    abort_connection(&connection_list, arg_id, -1);
-
-                } else if (strncmp(parent_buffer, "stat", 4) == 0) {
-                    // Handle 'stat' command
-                    int sender_pid = atoi(parent_buffer + 5);
-                    char stat_buf[1024] = "";
-
-                    // Write list of connections in buffer
-                    print_connections(connection_list, stat_buf, sizeof(stat_buf));
-
-                    // Find file descriptor for the sender client
-                    int found_fd = find_fd(connection_list, sender_pid, -1);
-                    if (found_fd >= 0) {
-                        write(found_fd, stat_buf, strlen(stat_buf));
-                        write(found_fd, "[END]", 5);
-                    } else {
-                        fprintf(stderr, "[WARN] No connection found for PID %d\n", sender_pid);
-                    }
-
-                } else if (strncmp(parent_buffer, "quit", 4) == 0) {
-                    // Handle 'quit' command
-                    int sender_pid = atoi(parent_buffer + 5);
-
-                    // Find file descriptor for the sender client
-                    int found_fd = find_fd(connection_list, sender_pid, -1);
-                    if (client_fd > 0) {
-                        write(found_fd,  "[QUIT]", 6);
-                        write(found_fd, "[END]", 5);
-                    }
-
-                    // Abort connection for sender client
-                    abort_connection(&connection_list, -1, sender_pid);
-                }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].fd == server_fd) {
+                accept_session(server_fd);
+                continue;
             }
-        }
-
-        // Handle new connection
-        if (FD_ISSET(server_fd, &read_fds)) {
-            client_len = sizeof(client_addr);
-            client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-            if (client_fd < 0) {
-                perror("[ERROR] Accept failed");
+            if (events[i].fd == metrics_admin_fd()) {
+                metrics_admin_serve();
+                continue;
+            }
+            if (events[i].fd == handoff_fd) {
+                serve_handoff(server_fd);
                 continue;
             }
+            // A session aborted earlier in this batch is no longer registered
+            session_t *session = registry_by_channel(events[i].fd);
+            if (session) drain_channel(session);
+        }
+    }
+}
 
-            printf("[INFO] Client connected.\n");
 
-            // Create child process for new client
-            pid_t pid = fork();
+/* ==============================================================================================
+ * Pre-forked Worker Pool
+ * ==============================================================================================
+ * With -w <N> the server starts N worker processes, each running its own main_server_loop().
+ * For TCP every worker gets a dedicated listener bound with SO_REUSEPORT, so the kernel spreads
+ * incoming connections across workers (and cores) instead of funnelling them through a single
+ * accept loop. UNIX sockets have no equivalent, so there the workers share one listener.
+ *
+ * The listeners are created by the supervising parent before forking: bind errors are reported
+ * once, and a crashed worker can be restarted on the same socket without losing its backlog.
+ * Connection IDs are interleaved between workers to stay unique; `stat` and `abort` operate on
+ * the sessions of the worker serving the requesting client.
+ * ==============================================================================================
+ */
 
-            if (pid < 0) {
-                perror("[ERROR] Fork failed");
-                close(client_fd);
-                continue;
+
+static int worker_index = 0;
+static int worker_count = 1;
+static int connection_ids = 0;      // handed out by this process (a hot restart passes it on)
+
+int allocate_connection_id(void) {
+    return worker_index + 1 + worker_count * connection_ids++;
+}
+
+static int listen_backlog(void) {
+    return server_options.backlog > 0 ? server_options.backlog : SOMAXCONN;
+}
+
+static pid_t spawn_worker(const int *listener_fds, int count, int shared, int index) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("[ERROR] Fork of worker failed");
+        return -1;
+    }
+    if (pid == 0) {
+        worker_index = index;
+        if (!shared) {
+            for (int i = 0; i < count; i++) {
+                if (i != index) close(listener_fds[i]);
             }
+        }
+        printf("[INFO] Worker %d started (PID %d)\n", index, getpid());
+        main_server_loop(listener_fds[index]);
+        exit(0);
+    }
+    return pid;
+}
 
-            if (pid == 0) {
-                // Child process code
-                close(server_fd);
-                close(control_pipe[0]); // Close unused pipe
-
-                char buffer[4096];
-
-                while (1) {
-                    int bytes_read = read(client_fd, buffer, sizeof(buffer) - 1);
-                    if (bytes_read <= 0) {
-                        printf("[INFO] Client disconnected (PID %d).\n", getpid());
-                        break;
-                    }
-
-                    printf("[INFO] (PID %d) Command from client: %s\n", getpid(), buffer);
-
-                    // Forward special commands to parent
-                    if (strncmp(buffer, "stat", 4) == 0) {
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "stat %d\n", getpid());
-                        write(control_pipe[1], msg, strlen(msg));
-                    } else if (strncmp(buffer, "abort ", 6) == 0) {
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "%s %d\n", buffer, getpid());
-                        write(control_pipe[1], msg, strlen(msg));
-                    } else if (strncmp(buffer, "quit", 4) == 0) {
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "%s %d\n", buffer, getpid());
-                        write(control_pipe[1], msg, strlen(msg));
-                    } else {
-                        buffer[strlen(buffer)] = '\n';
-                        handle_command(client_fd, buffer);
-                    }
-                }
+static pid_t *pool_pids = NULL;
+static int pool_size = 0;
 
-                close(client_fd);
-                exit(0);
-            } else {
-                // Parent process - add to connection list
-                add_connection(&connection_list, &next_connection_id, client_fd, pid);
+// Terminating the supervisor takes the whole pool down with it
+static void stop_workers(int sig) {
+    for (int i = 0; i < pool_size; i++) {
+        if (pool_pids[i] > 0) kill(pool_pids[i], SIGTERM);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void run_workers(const int *listener_fds, int count, int shared) {
+    pid_t pids[count];
+    int alive = 0;
+
+    worker_count = count;
+    pool_pids = pids;
+    pool_size = count;
+    for (int i = 0; i < count; i++) {
+        pids[i] = spawn_worker(listener_fds, count, shared, i);
+        if (pids[i] > 0) alive++;
+    }
+    signal(SIGTERM, stop_workers);
+    signal(SIGINT, stop_workers);
+
+    // Supervise the pool: restart workers that crashed, stop once all have exited normally
+    while (alive > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (pids[i] != pid) continue;
+
+            if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM && WTERMSIG(status) != SIGKILL) {
+                fprintf(stderr, "[WARN] Worker %d (PID %d) died with signal %d, restarting\n",
+                        i, pid, WTERMSIG(status));
+                pids[i] = spawn_worker(listener_fds, count, shared, i);
+                if (pids[i] > 0) break;
             }
+            pids[i] = 0;
+            alive--;
+            break;
+        }
+    }
+}
+
+
+/* ==============================================================================================
+ * Hot Restart (-U)
+ * ==============================================================================================
+ * The forking server hands its listener, shared regions and registry to a new binary started
+ * with -U and exits; see handoff.c for the exchange. Both ends run here, in the accept loop of
+ * the old server and in place of the socket setup of the new one.
+ * ==============================================================================================
+ */
+
+
+// Old server: passes everything to the successor and exits, or keeps serving if it fails
+static void serve_handoff(int server_fd) {
+    int fd = accept(handoff_fd, NULL, NULL);
+    if (fd < 0) return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    handoff_msg_t msg;
+    int fds[HANDOFF_FDS];
+    if (handoff_recv(fd, &msg, fds) < 0 || msg.type != HANDOFF_HELLO || msg.version != HANDOFF_VERSION) {
+        fprintf(stderr, "[WARN] Refused a hot restart: not a handoff request of version %d\n", HANDOFF_VERSION);
+        close(fd);
+        return;
+    }
+    pid_t successor = msg.pid;
+    printf("[INFO] Handing over to PID %d\n", successor);
+
+    // The result cache stays behind: fills in progress are given up, their waiters run the command
+    for (session_t *curr = registry_newest(); curr; curr = curr->older) {
+        if (curr->cache_filling) cache_give_up(curr);
+    }
+
+    handoff_msg_t state = { .type = HANDOFF_STATE, .pid = getpid(), .pgid = getpgrp(),
+                            .count = (int32_t)registry_count(), .next_id = connection_ids };
+    int state_fds[HANDOFF_FDS];
+    state_fds[HANDOFF_FD_LISTENER] = server_fd;
+    state_fds[HANDOFF_FD_ADMIN] = metrics_admin_fd();
+    state_fds[HANDOFF_FD_METRICS] = metrics_region_fd();
+    state_fds[HANDOFF_FD_RING] = recorder_ring_fd();
+    int ok = handoff_send(fd, &state, state_fds) == 0;
+
+    // Oldest first, so the new registry lists them in the same order
+    session_t *oldest = registry_newest();
+    while (oldest && oldest->older) oldest = oldest->older;
+    for (session_t *curr = oldest; curr && ok; curr = curr->newer) {
+        handoff_msg_t record = { .type = HANDOFF_SESSION, .pid = curr->pid, .id = curr->id,
+                                 .metrics_slot = curr->metrics_slot, .priority = curr->sched.priority,
+                                 .running = curr->sched.running, .queued = curr->sched.queued };
+        snprintf(record.peer, sizeof(record.peer), "%s", curr->peer);
+        int channel[HANDOFF_FDS] = { -1, -1, -1, -1 };
+        channel[HANDOFF_FD_CHANNEL] = curr->channel_fd;
+        ok = handoff_send(fd, &record, channel) == 0;
+    }
+    if (ok) ok = handoff_recv(fd, &msg, fds) == 0 && msg.type == HANDOFF_READY;
+    if (!ok) {
+        fprintf(stderr, "[WARN] Hot restart by PID %d failed, still serving\n", successor);
+        close(fd);
+        return;
+    }
+
+    // One writer drains the ring at a time: ours finishes before the successor starts its own
+    recorder_stop();
+    msg = (handoff_msg_t){ .type = HANDOFF_GO };
+    handoff_send(fd, &msg, NULL);
+    printf("[INFO] Handed the listener and %zu sessions over to PID %d, exiting\n", registry_count(), successor);
+    exit(0);
+}
+
+static void adopt_session(const handoff_msg_t *msg, int channel_fd, int metrics_shared) {
+    session_t *session = registry_add(msg->id, msg->peer, channel_fd, msg->pid);
+    session->metrics_slot = metrics_shared ? msg->metrics_slot : -1;
+    scheduler_entry_init(&session->sched, session);
+    scheduler_adopt(&session->sched, msg->priority, msg->running, msg->queued);
+    session->cache_entry = NULL;
+    session->cache_filling = 0;
+    printf("[INFO] Took over connection ID %d (PID %d)\n", session->id, session->pid);
+}
+
+// New server: stands in for the socket setup and start_metrics(). What does not depend on the
+// old server is done before connecting to it, so it stops accepting only for the exchange;
+// the listener is adopted as it is, still holding the connections that arrived meanwhile.
+static int take_over(void) {
+    if (server_options.event_mode || server_options.workers > 1) {
+        fprintf(stderr, "[ERROR] -U takes over a forking server, it cannot be combined with -E or -w\n");
+        exit(1);
+    }
+    scheduler_configure(server_options.max_running, server_options.max_per_session);
+    cgroup_init();
+
+    int fd = handoff_connect(handoff_socket);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] No server to take over at %s: %s\n", handoff_socket, strerror(errno));
+        exit(1);
+    }
+
+    handoff_msg_t msg = { .type = HANDOFF_HELLO, .version = HANDOFF_VERSION, .pid = getpid() };
+    int fds[HANDOFF_FDS];
+    if (handoff_send(fd, &msg, NULL) < 0 || handoff_recv(fd, &msg, fds) < 0 || msg.type != HANDOFF_STATE
+        || fds[HANDOFF_FD_LISTENER] < 0) {
+        fprintf(stderr, "[ERROR] The server at %s refused the hot restart\n", handoff_socket);
+        exit(1);
+    }
+    pid_t predecessor = msg.pid;
+    int server_fd = fds[HANDOFF_FD_LISTENER];
+    int ring_fd = fds[HANDOFF_FD_RING];
+    int metrics_shared = fds[HANDOFF_FD_METRICS] >= 0 && metrics_adopt(fds[HANDOFF_FD_METRICS]) == 0;
+    if (!metrics_shared) metrics_init();
+    if (fds[HANDOFF_FD_ADMIN] >= 0) metrics_admin_adopt(fds[HANDOFF_FD_ADMIN]);
+    else if (server_options.admin_socket) metrics_admin_open(server_options.admin_socket);
+    connection_ids = msg.next_id;
+
+    // `halt` terminates the process group of the session running it: join the group of the old one
+    if (msg.pgid > 0 && msg.pgid != getpgrp() && setpgid(0, msg.pgid) < 0)
+        fprintf(stderr, "[WARN] Cannot join process group %d of the sessions taken over (%s): "
+                "`halt` stops either them or the new ones\n", msg.pgid, strerror(errno));
+
+    int sessions = msg.count;
+    for (int i = 0; i < sessions; i++) {
+        if (handoff_recv(fd, &msg, fds) < 0 || msg.type != HANDOFF_SESSION) {
+            fprintf(stderr, "[ERROR] Hot restart from PID %d broke off after %d of %d sessions\n",
+                    predecessor, i, sessions);
+            exit(1);
         }
+        if (fds[HANDOFF_FD_CHANNEL] >= 0) adopt_session(&msg, fds[HANDOFF_FD_CHANNEL], metrics_shared);
+    }
+
+    msg = (handoff_msg_t){ .type = HANDOFF_READY };
+    if (handoff_send(fd, &msg, NULL) < 0 || handoff_recv(fd, &msg, fds) < 0 || msg.type != HANDOFF_GO) {
+        fprintf(stderr, "[ERROR] Hot restart cancelled by PID %d\n", predecessor);
+        exit(1);
     }
+    close(fd);
+
+    if (ring_fd >= 0) recorder_adopt(ring_fd);
+    else recorder_start();
+    printf("[INFO] Took over %d sessions from PID %d\n", sessions, predecessor);
+    return server_fd;
 }
 
 
@@ -745,10 +1772,30 @@ void main_server_loop(int server_fd) {
  */
 
 
+// Maps the metrics region and opens the -A admin socket, before anything is forked; the same goes
+// for the ring of the session recorder (-r) and its writer process
+static void start_metrics(void) {
+    metrics_init();
+    if (server_options.admin_socket) metrics_admin_open(server_options.admin_socket);
+    scheduler_configure(server_options.max_running, server_options.max_per_session);
+    cgroup_init();
+    recorder_start();
+}
+
 void run_unix_server(char *socket_path) {
     int server_fd;
     struct sockaddr_un server_addr;
 
+    handoff_path(handoff_socket, sizeof(handoff_socket), socket_path, NULL, 0);
+    if (server_options.takeover) {
+        // Hot restart: the socket stays bound and listening, nothing to set up again
+        server_fd = take_over();
+        printf("[UNIX SERVER] Took over unix socket: %s\n", socket_path);
+        main_server_loop(server_fd);
+        close(server_fd);
+        return;
+    }
+
     // Remove any existing socket file
     unlink(socket_path);
 
@@ -771,14 +1818,24 @@ void run_unix_server(char *socket_path) {
     }
 
     // Listen for incoming connections
-    if (listen(server_fd, 5) < 0) {
+    if (listen(server_fd, listen_backlog()) < 0) {
         perror("Unix listen failed");
         exit(1);
     }
 
     printf("[UNIX SERVER] Server is listening on unix socket: %s\n", socket_path);
-
-    main_server_loop(server_fd);
+    start_metrics();
+
+    if (server_options.workers > 1) {
+        // All workers accept from the same UNIX listener; it is non-blocking, so a worker that
+        // loses the race for a connection goes back to its channels instead of waiting in accept()
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+        int listener_fds[server_options.workers];
+        for (int i = 0; i < server_options.workers; i++) listener_fds[i] = server_fd;
+        run_workers(listener_fds, server_options.workers, 1);
+    } else {
+        main_server_loop(server_fd);
+    }
 
     // Cleanup
     close(server_fd);
@@ -792,16 +1849,14 @@ void run_unix_server(char *socket_path) {
  * Initializes and starts a server using TCP/IP sockets.
  * Binds the socket to a specified IP address and port, enabling remote client access.
  * Configures options like SO_REUSEADDR and prepares the socket to listen.
- * Enters the main server loop once setup is complete.
+ * Enters the main server loop once setup is complete, or hands one SO_REUSEPORT listener
+ * to each worker of the pre-forked pool (-w).
  * ==============================================================================================
  */
 
 
-void run_tcp_server(const char *host, int port) {
-    int server_fd;
-    struct sockaddr_in server_addr;
-
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+static int open_tcp_listener(const struct sockaddr_in *server_addr, int reuse_port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         perror("TCP socket creation failed");
         exit(1);
@@ -809,6 +1864,34 @@ void run_tcp_server(const char *host, int port) {
 
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockopt_listener(server_fd);    // -o buffer sizes, before listen() so the window scale fits
+
+    if (reuse_port) {
+        // Let several listeners share the port; the kernel load-balances between them
+#if defined(SO_REUSEPORT_LB)
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT_LB, &opt, sizeof(opt)) < 0) {
+#else
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+#endif
+            perror("TCP SO_REUSEPORT failed");
+            exit(1);
+        }
+    }
+
+    if (bind(server_fd, (const struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
+        perror("TCP bind failed");
+        exit(1);
+    }
+
+    if (listen(server_fd, listen_backlog()) < 0) {
+        perror("TCP listen failed");
+        exit(1);
+    }
+    return server_fd;
+}
+
+void run_tcp_server(const char *host, int port) {
+    struct sockaddr_in server_addr;
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -819,25 +1902,46 @@ void run_tcp_server(const char *host, int port) {
     } else {
         if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
             perror("[SERVER] Invalid IP address");
-            close(server_fd);
             exit(1);
         }
     }
 
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("TCP bind failed");
-        exit(1);
+    handoff_path(handoff_socket, sizeof(handoff_socket), NULL, host, port);
+    if (server_options.takeover) {
+        // Certificates are loaded before the running server stops accepting
+        if (tls_configured() && tls_server_init() < 0) exit(1);
+        int server_fd = take_over();
+        sockopt_listener(server_fd);
+        printf("[TCP SERVER] Took over %s:%d...\n", host, port);
+        main_server_loop(server_fd);
+        close(server_fd);
+        return;
     }
 
-    if (listen(server_fd, 5) < 0) {
-        perror("TCP listen failed");
-        exit(1);
+    start_metrics();
+
+    // Certificates and ticket keys are loaded once, every worker and session inherits them
+    if (tls_configured() && tls_server_init() < 0) exit(1);
+
+    if (server_options.workers > 1) {
+        // One SO_REUSEPORT listener per worker
+        int listener_fds[server_options.workers];
+        for (int i = 0; i < server_options.workers; i++)
+            listener_fds[i] = open_tcp_listener(&server_addr, 1);
+
+        printf("[TCP SERVER] Listening on %s:%d with %d workers...\n", host, port, server_options.workers);
+        run_workers(listener_fds, server_options.workers, 0);
+
+        for (int i = 0; i < server_options.workers; i++) close(listener_fds[i]);
+        return;
     }
 
+    int server_fd = open_tcp_listener(&server_addr, 0);
+
     printf("[TCP SERVER] Listening on %s:%d...\n", host, port);
 
     main_server_loop(server_fd);
 
 
     close(server_fd);
-}
\ No newline at end of file
+}
@@ -1,8 +1,40 @@
 #ifndef MYSHELL_SERVER_H
 #define MYSHELL_SERVER_H
 
+#include <stddef.h>
+#include <sys/socket.h>
+#include "plan_cache.h"
 
+typedef struct {
+    int event_mode;     // -E: serve all clients from one epoll/kqueue process
+    int workers;        // -w: number of pre-forked worker processes (0/1 = no pool)
+    int backlog;        // -b: listen() backlog, 0 = SOMAXCONN
+    int quiet;          // -q: do not mirror command output on the server's stdout
+    int direct_output;  // -D: last pipeline stage writes straight into the client socket
+    int fork_launcher;  // -F: start pipeline stages with fork() instead of posix_spawn()
+    int script_jobs;    // -j: parallel workers for script mode (0/1 = line by line)
+    int compression;    // -Z: COMPRESS_* codec offered to clients (0 = none)
+    const char *admin_socket;   // -A: metrics admin socket (UNIX path or TCP port), NULL = none
+    int max_running;    // -L: pipelines running at the same time, 0 = unlimited
+    int max_per_session;        // -L n,m: of which one session may run at most m, 0 = n
+    int takeover;       // -U: take over listener and sessions of the running server (hot restart)
+} server_options_t;
+
+extern server_options_t server_options;
+
+int allocate_connection_id(void);
+void format_peer(const struct sockaddr *addr, char *buf, size_t size);
 void handle_command(int client_fd, char *command);
+void run_plan(int client_fd, const plan_t *plan);
+void format_plan_stats(char *buf, size_t size);
+void accept_session_hello(int client_fd, const char *hello);
+int stat_verbose(const char *command);
+void send_metrics(int client_fd);
+int hash_builtin(char **argv, char *buf, size_t size);
+int acquire_pipeline_slot(void);
+void release_pipeline_slot(void);
+void set_session_priority(int priority);
+void set_cache_capture(int fd);
 void run_unix_server(char *socket_path);
 void run_tcp_server(const char *host, int port);
 
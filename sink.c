@@ -0,0 +1,432 @@
+/* ==============================================================================================
+ * Redirection Sink
+ * ==============================================================================================
+ *
+ * Without -O a `> file` stage writes the file itself, in whatever small writes the command
+ * does, and every page it writes stays in the page cache. For long-running captures (`tail -f
+ * app.log | grep ERROR >> errors.log`) the server can take over the file instead:
+ *
+ *   -O batch=1M,depth=4,prealloc=64M,readahead=8M,nocache
+ *
+ *   batch=<size>      size of one write; output is collected in page-aligned buffers of this
+ *                     size and written once a buffer is full, at the latest SINK_FLUSH_MS
+ *                     after its first byte (default SINK_BATCH)
+ *   depth=<n>         buffers being written while the next one fills (default SINK_DEPTH)
+ *   prealloc=<size>   reserve disk space in steps of this size ahead of the writes (Linux
+ *                     fallocate, the file size is not changed)
+ *   readahead=<size>  read ahead this much of a `<` file before the stage starts
+ *                     (default SINK_READAHEAD)
+ *   nocache           start writeback right away and drop written pages from the page cache
+ *
+ * With -O the last stage of a pipeline writes its `>` or `>>` output into the result pipe as
+ * if there were no redirection, and the server moves it to the file here. On Linux the writes
+ * are queued on an io_uring at explicit offsets, so up to depth of them are in flight while
+ * the pipe is read; where io_uring is not available (older kernels, seccomp, FreeBSD) each
+ * batch is written with pwrite(). A file opened for `>>` is written from its end.
+ *
+ * Input files (`<`) are opened by the server as well: it declares them sequential and asks
+ * the kernel to read ahead, then hands the descriptor to the stage.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include "sink.h"
+
+#if defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+static int enabled = 0;
+static size_t batch_size = SINK_BATCH;
+static int depth = SINK_DEPTH;
+static off_t prealloc_step = 0;
+static off_t readahead_bytes = SINK_READAHEAD;
+static int nocache = 0;
+
+static char **buffers = NULL;       // depth page-aligned buffers of batch_size bytes
+
+
+/* ==============================================================================================
+ * Configuration
+ * ==============================================================================================
+ */
+
+
+static int parse_size(const char *text, long long *bytes) {
+    char *end;
+    *bytes = strtoll(text, &end, 10);
+    if (*end == 'K' || *end == 'k') *bytes <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') *bytes <<= 20, end++;
+    else if (*end == 'G' || *end == 'g') *bytes <<= 30, end++;
+    return (*end != '\0' || *bytes < 1) ? -1 : 0;
+}
+
+int sink_parse(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        long long value = 0;
+        char *equals = strchr(item, '=');
+        if (equals) *equals++ = '\0';
+
+        if (strcmp(item, "nocache") == 0 && !equals) {
+            nocache = 1;
+        } else if (!equals || parse_size(equals, &value) < 0) {
+            result = -1;
+        } else if (strcmp(item, "batch") == 0) {
+            // Whole pages, so every buffer starts and ends page-aligned
+            batch_size = (value + 4095) & ~4095LL;
+        } else if (strcmp(item, "depth") == 0 && value <= 64) {
+            depth = value;
+        } else if (strcmp(item, "prealloc") == 0) {
+            prealloc_step = value;
+        } else if (strcmp(item, "readahead") == 0) {
+            readahead_bytes = value;
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    if (result == 0) enabled = 1;
+    return result;
+}
+
+int sink_enabled(void) {
+    return enabled;
+}
+
+
+/* ==============================================================================================
+ * Opening Redirected Files
+ * ==============================================================================================
+ */
+
+
+// Opens the `>`/`>>` file of the stage for the server; -1 leaves the redirection to the stage,
+// which then reports the error itself
+int sink_open_output(const command_t *stage) {
+    // No O_APPEND: writes go to explicit offsets from the end of the file
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->output_mode == REDIRECT_TRUNCATE ? O_TRUNC : 0);
+    return open(stage->output_file, flags, 0644);
+}
+
+// Opens a `<` file with readahead hints; -1 leaves it to the stage
+int sink_open_input(const char *filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, readahead_bytes, POSIX_FADV_WILLNEED);
+    return fd;
+}
+
+
+/* ==============================================================================================
+ * Submission Ring (Linux io_uring)
+ * ==============================================================================================
+ * A minimal ring driven by the raw system calls: one submission per batch, completions carry
+ * the buffer index. The ring belongs to the process that set it up; a forked job sets up its
+ * own.
+ * ==============================================================================================
+ */
+
+
+#if defined(HAVE_IO_URING)
+
+typedef struct {
+    int fd;
+    pid_t owner;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} sink_ring_t;
+
+static sink_ring_t ring = { -1, 0 };
+static int ring_failed = 0;         // io_uring refused once, pwrite() from now on
+
+static int ring_setup(void) {
+    if (ring.fd >= 0 && ring.owner == getpid()) return 0;
+    if (ring_failed) return -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        ring_failed = 1;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq_ptr = single_mmap ? sq_ptr
+                               : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        ring_failed = 1;
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.owner = getpid();
+    ring.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring.sqes = sqes;
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+static int ring_submit_write(int fd, const char *buf, size_t len, off_t offset, int index) {
+    unsigned tail = *ring.sq_tail;
+    unsigned slot = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = index;
+    ring.sq_array[slot] = slot;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+// Waits for the next completion; returns its buffer index and the write's result in *res
+static int ring_complete(int *res) {
+    while (1) {
+        unsigned head = *ring.cq_head;
+        if (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            return index;
+        }
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+#endif
+
+
+/* ==============================================================================================
+ * Draining the Result Pipe
+ * ==============================================================================================
+ */
+
+
+static void allocate_buffers(void) {
+    if (buffers) return;
+    buffers = calloc(depth, sizeof(char *));
+    if (!buffers) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    for (int i = 0; i < depth; i++) {
+        if (posix_memalign((void **)&buffers[i], 4096, batch_size) != 0) {
+            perror("[ERROR] Memory allocation failed");
+            exit(1);
+        }
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Fills buf from the (non-blocking) pipe until it is full, EOF, or SINK_FLUSH_MS after its
+// first byte. While the pipe is empty the loop naps instead of waiting for the next write, so
+// a command writing small pieces fills the pipe in between rather than waking the server for
+// every one of them. *eof is set once the writers are gone.
+static size_t fill_batch(int src_fd, char *buf, int *eof) {
+    size_t len = 0;
+    uint64_t first = 0;
+
+    while (len < batch_size) {
+        ssize_t bytes = read(src_fd, buf + len, batch_size - len);
+        if (bytes > 0) {
+            if (len == 0) first = now_ms();
+            len += bytes;
+            continue;
+        }
+        if (bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+            *eof = 1;
+            break;
+        }
+        if (len == 0) {
+            struct pollfd pfd = { src_fd, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+        } else if (now_ms() - first >= SINK_FLUSH_MS) {
+            break;
+        } else {
+            poll(NULL, 0, 1);
+        }
+    }
+    return len;
+}
+
+static int write_all_at(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// Reserves disk space ahead of a write that reaches end
+static void preallocate(int fd, off_t end, off_t *allocated) {
+#if defined(__linux__)
+    if (prealloc_step == 0 || end <= *allocated) return;
+    off_t start = *allocated > end - (off_t)batch_size ? *allocated : end - (off_t)batch_size;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, end - start + prealloc_step) == 0)
+        *allocated = end + prealloc_step;
+    else
+        prealloc_step = 0;              // not supported by the file system
+#else
+    (void)fd; (void)end; (void)allocated;
+#endif
+}
+
+// nocache: starts writeback of a written range and drops what lies a batch or more behind it
+static void release_pages(int fd, off_t offset, size_t len, off_t *dropped) {
+#if defined(__linux__)
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+#endif
+    off_t behind = offset - (off_t)batch_size;
+    if (behind > *dropped) {
+        posix_fadvise(fd, *dropped, behind - *dropped, POSIX_FADV_DONTNEED);
+        *dropped = behind;
+    }
+}
+
+// Moves everything the pipe delivers until EOF into file_fd. Returns the number of bytes
+// written, or -1 with errno set if writing failed (the pipe is still drained to EOF).
+ssize_t sink_drain(int src_fd, int file_fd) {
+    off_t offset = lseek(file_fd, 0, SEEK_END);
+    if (offset < 0) offset = 0;
+    off_t allocated = offset, dropped = offset;
+    size_t lengths[64];
+    off_t offsets[64];
+    int free_list[64], free_count = 0, in_flight = 0;
+    int eof = 0, error = 0;
+    ssize_t total = 0;
+
+    allocate_buffers();
+    for (int i = depth - 1; i >= 0; i--) free_list[free_count++] = i;
+#if defined(__linux__)
+    fcntl(src_fd, F_SETPIPE_SZ, (int)batch_size);   // best effort, may exceed the limit
+#endif
+    fcntl(src_fd, F_SETFL, fcntl(src_fd, F_GETFL) | O_NONBLOCK);
+#if defined(HAVE_IO_URING)
+    int async = (ring_setup() == 0);
+#endif
+
+    while (!eof || in_flight > 0) {
+        int index;
+        int res = 0;
+
+        if (!eof && free_count > 0) {
+            index = free_list[--free_count];
+            lengths[index] = fill_batch(src_fd, buffers[index], &eof);
+            offsets[index] = offset;
+            if (lengths[index] == 0 || error) {
+                free_list[free_count++] = index;
+                continue;
+            }
+            offset += lengths[index];
+            preallocate(file_fd, offset, &allocated);
+#if defined(HAVE_IO_URING)
+            if (async && ring_submit_write(file_fd, buffers[index], lengths[index], offsets[index], index) == 0) {
+                in_flight++;
+                continue;
+            }
+#endif
+            res = write_all_at(file_fd, buffers[index], lengths[index], offsets[index]) < 0 ? -errno : (int)lengths[index];
+        } else {
+#if defined(HAVE_IO_URING)
+            index = ring_complete(&res);
+            if (index < 0) break;
+            in_flight--;
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // IORING_OP_WRITE needs Linux 5.6: write this batch and the rest synchronously
+                ring_failed = 1;
+                async = 0;
+                res = 0;
+            }
+            if (res >= 0 && (size_t)res < lengths[index]) {
+                // Short write (rare for files): finish the buffer synchronously
+                if (write_all_at(file_fd, buffers[index] + res, lengths[index] - res, offsets[index] + res) < 0) res = -errno;
+                else res = lengths[index];
+            }
+#else
+            break;
+#endif
+        }
+
+        if (res < 0 && !error) error = -res;
+        if (res > 0) {
+            total += res;
+            if (nocache) release_pages(file_fd, offsets[index], res, &dropped);
+        }
+        free_list[free_count++] = index;
+    }
+
+    if (nocache && !error) {
+#if defined(__linux__)
+        sync_file_range(file_fd, dropped, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+        posix_fadvise(file_fd, dropped, 0, POSIX_FADV_DONTNEED);
+    }
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return total;
+}
@@ -0,0 +1,20 @@
+#ifndef MYSHELL_SINK_H
+#define MYSHELL_SINK_H
+
+#include <sys/types.h>
+#include "parser.h"
+
+#define SINK_BATCH (1 << 20)        // default size of one write
+#define SINK_DEPTH 4                // default writes in flight
+#define SINK_READAHEAD (8 << 20)    // default readahead for `<` files
+#define SINK_FLUSH_MS 100           // a batch is written this long after its first byte at the latest
+
+// Parses -O "batch=<size>,depth=<n>,prealloc=<size>,readahead=<size>,nocache"; -1 if malformed
+int sink_parse(const char *spec);
+
+int sink_enabled(void);
+int sink_open_output(const command_t *stage);
+int sink_open_input(const char *filename);
+ssize_t sink_drain(int src_fd, int file_fd);
+
+#endif //MYSHELL_SINK_H
@@ -0,0 +1,194 @@
+/* ==============================================================================================
+ * TCP Socket Tuning
+ * ==============================================================================================
+ *
+ * A response is the output of a command followed by its END frame ("[END]" for legacy
+ * clients), often only a few bytes. With Nagle's algorithm a small write that follows
+ * unacknowledged data waits for the ACK, which the client delays in turn, so an interactive
+ * command could take tens of milliseconds longer than it runs. TCP connections therefore set
+ * TCP_NODELAY, and the protocol module writes header, payload and trailer of a short response
+ * in one writev() (proto_send_reply), so turning Nagle off does not mean more tiny segments.
+ * The rest is tunable with -o, on the server and the client:
+ *
+ *   -o cork,sndbuf=1M,rcvbuf=1M,keepalive=60/10/5,idle=600
+ *
+ *   nagle             keep Nagle's algorithm (no TCP_NODELAY)
+ *   cork              server: hold each response in TCP_CORK until its END, so output that a
+ *                     pipeline writes in small pieces goes out in full segments. A partial
+ *                     segment of a long-running command waits up to 200 ms then (Linux).
+ *   sndbuf=<size>     SO_SNDBUF / SO_RCVBUF; set on the listener and before connect(), so
+ *   rcvbuf=<size>     the window scale is chosen for them (the kernel doubles the value)
+ *   keepalive=<idle>[/<interval>[/<count>]]
+ *                     probe a silent peer after idle seconds, every interval seconds, and
+ *                     drop the connection after count unanswered probes
+ *   idle=<seconds>    server: close sessions that sent no command for this long (a running
+ *                     command does not count as idle)
+ *
+ * The options apply to TCP only: the listener of run_tcp_server() and the sockets it accepts,
+ * and the connections of clients, the multiplexer (-M) and fanout (-H). UNIX sockets have no
+ * Nagle delay and are left alone.
+ *
+ * ==============================================================================================
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sockopt.h"
+
+static int nagle = 0;
+static int cork = 0;
+static int send_buffer = 0;
+static int receive_buffer = 0;
+static int keepalive_idle = 0;      // seconds, 0 = no keepalive
+static int keepalive_interval = 0;  // 0 = system default
+static int keepalive_count = 0;
+static int idle_timeout = 0;        // seconds, 0 = sessions never time out
+static int tcp_server = 0;          // the server listens on TCP (sockopt_listener)
+
+
+/* ==============================================================================================
+ * Configuration
+ * ==============================================================================================
+ */
+
+
+static int parse_size(const char *text, long long *bytes) {
+    char *end;
+    *bytes = strtoll(text, &end, 10);
+    if (*end == 'K' || *end == 'k') *bytes <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') *bytes <<= 20, end++;
+    return (*end != '\0' || *bytes < 1 || *bytes > (1 << 30)) ? -1 : 0;
+}
+
+static int parse_seconds(const char *text, int *seconds) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 1 || value > 86400 * 7) return -1;
+    *seconds = value;
+    return *end == '\0' ? 0 : (*end == '/' ? (int)(end - text) + 1 : -1);
+}
+
+// "<idle>[/<interval>[/<count>]]"
+static int parse_keepalive(const char *text) {
+    int *fields[] = { &keepalive_idle, &keepalive_interval, &keepalive_count };
+    for (int i = 0; i < 3; i++) {
+        int next = parse_seconds(text, fields[i]);
+        if (next <= 0) return next;
+        text += next;
+    }
+    return -1;
+}
+
+int sockopt_parse(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        long long size = 0;
+        char *equals = strchr(item, '=');
+        if (equals) *equals++ = '\0';
+
+        if (strcmp(item, "nagle") == 0 && !equals) {
+            nagle = 1;
+        } else if (strcmp(item, "cork") == 0 && !equals) {
+            cork = 1;
+        } else if (!equals) {
+            result = -1;
+        } else if (strcmp(item, "sndbuf") == 0 && parse_size(equals, &size) == 0) {
+            send_buffer = size;
+        } else if (strcmp(item, "rcvbuf") == 0 && parse_size(equals, &size) == 0) {
+            receive_buffer = size;
+        } else if (strcmp(item, "keepalive") == 0) {
+            result = parse_keepalive(equals);
+        } else if (strcmp(item, "idle") == 0) {
+            result = parse_seconds(equals, &idle_timeout);
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+int sockopt_idle_timeout(void) {
+    return tcp_server ? idle_timeout : 0;
+}
+
+
+/* ==============================================================================================
+ * Applying the Options
+ * ==============================================================================================
+ * Failures are ignored: every option only tunes a connection that works without it.
+ * ==============================================================================================
+ */
+
+
+static void set_buffers(int fd) {
+    if (send_buffer) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+    if (receive_buffer) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+}
+
+// The listening socket of run_tcp_server(); buffer sizes are inherited by accepted sockets
+void sockopt_listener(int fd) {
+    tcp_server = 1;
+    set_buffers(fd);
+}
+
+// A TCP socket before connect() (clients) or right after accept() (server)
+void sockopt_connection(int fd) {
+    int on = 1;
+    if (!nagle) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    set_buffers(fd);
+
+    if (keepalive_idle) {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#if defined(TCP_KEEPIDLE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle, sizeof(keepalive_idle));
+#elif defined(TCP_KEEPALIVE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &keepalive_idle, sizeof(keepalive_idle));
+#endif
+#if defined(TCP_KEEPINTVL)
+        if (keepalive_interval)
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_interval, sizeof(keepalive_interval));
+#endif
+#if defined(TCP_KEEPCNT)
+        if (keepalive_count)
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_count, sizeof(keepalive_count));
+#endif
+    }
+}
+
+// A connection accepted by the server; nothing to do for UNIX sockets
+void sockopt_accepted(int fd) {
+    if (tcp_server) sockopt_connection(fd);
+}
+
+// The descriptor a forked session reads its commands from (a TLS relay pair with -T): a read
+// that waits longer than the idle timeout fails with EAGAIN and ends the session
+void sockopt_session(int fd) {
+    if (!sockopt_idle_timeout()) return;
+    struct timeval timeout = { idle_timeout, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Brackets a response with -o cork; uncorking sends what is left right away
+void sockopt_cork(int fd, int on) {
+    if (!cork || !tcp_server || fd < 0) return;
+#if defined(TCP_CORK)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#else
+    (void)on;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef MYSHELL_SOCKOPT_H
+#define MYSHELL_SOCKOPT_H
+
+// Parses -o "nagle,cork,sndbuf=<size>,rcvbuf=<size>,keepalive=<idle>[/<interval>[/<count>]],idle=<seconds>";
+// -1 if malformed
+int sockopt_parse(const char *spec);
+
+void sockopt_listener(int fd);
+void sockopt_connection(int fd);
+void sockopt_accepted(int fd);
+void sockopt_session(int fd);
+int sockopt_idle_timeout(void);
+void sockopt_cork(int fd, int on);
+
+#endif //MYSHELL_SOCKOPT_H
@@ -0,0 +1,85 @@
+/* ==============================================================================================
+ * Pipeline Launcher (posix_spawn)
+ * ==============================================================================================
+ *
+ * Starts pipeline stages with posix_spawn() instead of fork() + dup2() + exec(). The C library
+ * implements it with vfork() / clone(CLONE_VM | CLONE_VFORK), so the address space of the
+ * (possibly large) server process is never copied and no page tables are duplicated, which
+ * makes short commands noticeably cheaper. bench/spawn_bench.c compares both paths.
+ *
+ * The stdin / stdout wiring and the redirections of redirections.c are expressed as file
+ * actions. Pipes are created close-on-exec by spawn_pipe(), so a stage only keeps the ends
+ * that were dup2'ed onto its standard descriptors and no close loop is needed.
+ *
+ * The old fork path stays available in execute_command() with the -F switch.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include "redirections.h"
+#include "spawn.h"
+
+extern char **environ;
+
+int spawn_pipe(int fds[2]) {
+    return pipe2(fds, O_CLOEXEC);
+}
+
+// Starts one stage reading from in_fd (-1 = inherit stdin) and writing stdout and stderr to
+// out_fd, unless the stage redirects them to files. Returns the PID, or -1 with *error set.
+pid_t spawn_stage(const command_t *command, int in_fd, int out_fd, int *error) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid = -1;
+    int rc;
+
+    if ((rc = posix_spawn_file_actions_init(&actions)) != 0) {
+        *error = rc;
+        return -1;
+    }
+
+    // Handle input redirection or pipe from previous command
+    if (command->input_file) {
+        rc = spawn_input_redirection(&actions, command->input_file);
+    } else if (in_fd >= 0) {
+        rc = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+
+    // Handle output redirection or pipe to next command / result pipe / client
+    if (rc == 0) {
+        if (command->output_mode == REDIRECT_TRUNCATE) {
+            rc = spawn_output_redirection(&actions, command->output_file);
+        } else if (command->output_mode == REDIRECT_APPEND) {
+            rc = spawn_output_redirection_append(&actions, command->output_file);
+        } else {
+            rc = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        }
+    }
+
+    // Redirect STDERR to STDOUT for error capturing
+    if (rc == 0) rc = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    if (rc == 0) {
+        if (command->path)
+            rc = posix_spawn(&pid, command->path, &actions, NULL, command->argv, environ);
+        // Not resolved, or the resolved file has gone since
+        if (!command->path || rc == ENOENT)
+            rc = posix_spawnp(&pid, command->argv[0], &actions, NULL, command->argv, environ);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        *error = rc;
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,10 @@
+#ifndef MYSHELL_SPAWN_H
+#define MYSHELL_SPAWN_H
+
+#include <sys/types.h>
+#include "parser.h"
+
+int spawn_pipe(int fds[2]);
+pid_t spawn_stage(const command_t *command, int in_fd, int out_fd, int *error);
+
+#endif //MYSHELL_SPAWN_H
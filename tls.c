@@ -0,0 +1,583 @@
+/* ==============================================================================================
+ * TLS Transport (-T)
+ * ==============================================================================================
+ *
+ * TCP connections can be encrypted natively instead of being tunnelled through ssh:
+ *
+ *   server: -T cert=server.pem,key=server.key[,noearly]
+ *   client: -T ca=ca.pem[,session=<file>][,noearly]   (or -T on: system CAs, or -T insecure)
+ *
+ *   cert=/key=        certificate chain and private key of the server (PEM)
+ *   ca=<file>         CA certificates the client trusts, default the system store; the
+ *                     server name given by -i is verified against the certificate
+ *   insecure          client: do not verify the server certificate
+ *   session=<file>    client: where the session ticket is kept, default
+ *                     $HOME/.myshell_tls_<host>_<port>
+ *   noearly           no 0-RTT data
+ *
+ * TLS 1.3 (1.2 at least) is negotiated with OpenSSL. The server hands out stateless session
+ * tickets; its keys are made before the server forks, so every session process and -w worker
+ * honours any ticket. The client stores the newest ticket in its session file, so repeated
+ * one-shot `-c` clients resume with a short handshake. The protocol hello (FRAME_HELLO, see
+ * protocol.c) then travels as 0-RTT early data with the ClientHello, saving the round trip
+ * of the hello exchange. Early data can be replayed by an attacker, which is why the server
+ * takes nothing but a single hello there - replaying a hello changes nothing - and closes
+ * connections that send anything else early. Commands always wait for the full handshake.
+ *
+ * After the handshake the connection is handed to the rest of the server, which only knows
+ * plain descriptors (read(), splice(), sendfile(), the -D stages writing into the socket):
+ *
+ *   kTLS      where the kernel and OpenSSL offload both directions of the connection, the
+ *             socket itself is used from then on: the kernel encrypts and decrypts, and the
+ *             zero-copy output paths work as before. Session servers only; a client has to
+ *             read the tickets the server sends after the handshake, which a plain read() on
+ *             a kTLS socket cannot take.
+ *   relay     otherwise a relay process encrypts and decrypts between the TLS connection and
+ *             a socketpair, whose other end takes the place of the socket. The relay is
+ *             orphaned right away (no waitpid() of the caller ever sees it) and ends when
+ *             either side closes.
+ *
+ * The handshake runs in the process of the session (forked servers and -w workers) or of the
+ * client. The event loop (-E) and the fan-out client must not block in handshakes, so there the
+ * relay makes the handshake itself (tls_accept_detached, tls_connect_detached); these
+ * connections always use the relay, and detached clients send no early data.
+ *
+ * UNIX sockets are local and never use TLS.
+ *
+ * ==============================================================================================
+ */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "tls.h"
+
+#if defined(HAVE_OPENSSL)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+static int configured = 0;
+
+#if defined(HAVE_OPENSSL)
+
+static char *cert_file = NULL;
+static char *key_file = NULL;
+static char *ca_file = NULL;
+static char *session_file = NULL;
+static int verify_peer = 1;
+static int early_data = 1;
+
+static char early_hello[PROTO_HEADER_SIZE];     // hello received as 0-RTT data (server)
+static size_t early_hello_len = 0;
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+
+
+static char *copy_value(const char *value) {
+    char *copy = strdup(value);
+    if (!copy) {
+        perror("[ERROR] Memory allocation failed");
+        exit(1);
+    }
+    return copy;
+}
+
+int tls_parse(const char *spec) {
+    char *copy = copy_value(spec);
+    int result = 0;
+    for (char *item = strtok(copy, ","); item && result == 0; item = strtok(NULL, ",")) {
+        char *equals = strchr(item, '=');
+        if (equals) *equals++ = '\0';
+
+        if (!equals && strcmp(item, "on") == 0) {
+            // defaults only
+        } else if (!equals && strcmp(item, "insecure") == 0) {
+            verify_peer = 0;
+        } else if (!equals && strcmp(item, "noearly") == 0) {
+            early_data = 0;
+        } else if (!equals || *equals == '\0') {
+            result = -1;
+        } else if (strcmp(item, "cert") == 0) {
+            cert_file = copy_value(equals);
+        } else if (strcmp(item, "key") == 0) {
+            key_file = copy_value(equals);
+        } else if (strcmp(item, "ca") == 0) {
+            ca_file = copy_value(equals);
+        } else if (strcmp(item, "session") == 0) {
+            session_file = copy_value(equals);
+        } else {
+            result = -1;
+        }
+    }
+    free(copy);
+    if (result == 0) configured = 1;
+    return result;
+}
+
+
+/* ==============================================================================================
+ * Relay
+ * ==============================================================================================
+ * Moves data between the TLS connection (net_fd) and the local end of a socketpair. Each
+ * direction has one buffer: a side is read again once the data read from it before has been
+ * passed on, so a slow reader on one side never stops the other direction.
+ * ==============================================================================================
+ */
+
+
+// The relay keeps nothing of its parent's descriptors but its own two
+static void close_other_fds(int keep_a, int keep_b) {
+    int low = keep_a < keep_b ? keep_a : keep_b;
+    int high = keep_a < keep_b ? keep_b : keep_a;
+#if defined(SYS_close_range)
+    if (low > 3) syscall(SYS_close_range, 3, low - 1, 0);
+    if (high > low + 1) syscall(SYS_close_range, low + 1, high - 1, 0);
+    if (syscall(SYS_close_range, high + 1, ~0U, 0) == 0) return;
+#endif
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+    for (int fd = 3; fd < max_fd; fd++) {
+        if (fd != keep_a && fd != keep_b) close(fd);
+    }
+}
+
+static void relay(SSL *ssl, int net_fd, int local_fd) {
+    static char to_local[TLS_RELAY_BUFFER], to_net[TLS_RELAY_BUFFER];
+    size_t local_len = 0, local_off = 0, net_len = 0;
+    int net_wants_write = 0;                // SSL_write() waits for the socket, same arguments
+    int net_open = 1, local_open = 1;
+
+    fcntl(net_fd, F_SETFL, fcntl(net_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(local_fd, F_SETFL, fcntl(local_fd, F_GETFL) | O_NONBLOCK);
+
+    while ((net_open || local_len > 0) && (local_open || net_len > 0)) {
+        struct pollfd fds[2] = {
+            { net_fd, 0, 0 },
+            { local_fd, 0, 0 }
+        };
+        if (net_open && local_len == 0) fds[0].events |= POLLIN;
+        if (net_len > 0 && net_wants_write) fds[0].events |= POLLOUT;
+        if (local_open && net_len == 0) fds[1].events |= POLLIN;
+        if (local_len > 0) fds[1].events |= POLLOUT;
+        for (int i = 0; i < 2; i++) {
+            if (!fds[i].events) fds[i].fd = -1;     // no POLLHUP storms from a side done with
+        }
+
+        // Records OpenSSL has decrypted already do not show up on the socket
+        int buffered = net_open && local_len == 0 && SSL_pending(ssl) > 0;
+        if (poll(fds, 2, buffered ? 0 : -1) < 0 && errno != EINTR) break;
+
+        if (buffered || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int bytes = SSL_read(ssl, to_local, sizeof(to_local));
+            if (bytes > 0) {
+                local_len = bytes;
+                local_off = 0;
+            } else {
+                int error = SSL_get_error(ssl, bytes);
+                if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) net_open = 0;
+            }
+        }
+
+        if (local_len > 0) {
+            ssize_t written = write(local_fd, to_local + local_off, local_len);
+            if (written > 0) {
+                local_off += written;
+                local_len -= written;
+            } else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+        }
+
+        if (local_open && net_len == 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t bytes = read(local_fd, to_net, sizeof(to_net));
+            if (bytes > 0) net_len = bytes;
+            else if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) local_open = 0;
+        }
+
+        if (net_len > 0) {
+            int written = SSL_write(ssl, to_net, net_len);
+            net_wants_write = 0;
+            if (written > 0) {
+                net_len = 0;
+            } else {
+                int error = SSL_get_error(ssl, written);
+                if (error == SSL_ERROR_WANT_WRITE) net_wants_write = 1;
+                else if (error != SSL_ERROR_WANT_READ) break;
+            }
+        }
+    }
+
+    // Tell the peer the stream is complete, unless it is the one that went away
+    if (net_open) SSL_shutdown(ssl);
+    _exit(0);
+}
+
+// Runs the relay for ssl in an orphaned process; handshake (NULL = already done) is made there
+// first. Returns the end of the socketpair that replaces net_fd, which the caller closes.
+static int spawn_relay(SSL *ssl, int net_fd, int (*handshake)(SSL *ssl, int fd)) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) return -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (fork() != 0) _exit(0);
+
+        // Out of the caller's session and process group: no terminal signals, no killpg()
+        setsid();
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGUSR2, SIG_DFL);
+        close(pair[0]);
+        close_other_fds(net_fd, pair[1]);
+        fcntl(net_fd, F_SETFL, fcntl(net_fd, F_GETFL) & ~O_NONBLOCK);   // the handshake blocks
+
+        if (handshake && handshake(ssl, net_fd) < 0) _exit(1);
+        fflush(stdout);     // the relay ends with _exit()
+        if (early_hello_len > 0 && proto_write_all(pair[1], early_hello, early_hello_len) < 0) _exit(1);
+        relay(ssl, net_fd, pair[1]);
+    }
+
+    waitpid(pid, NULL, 0);
+    close(pair[1]);
+    early_hello_len = 0;    // delivered by the relay
+    fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+    return pair[0];
+}
+
+static void set_timeout(int fd, int seconds) {
+    struct timeval timeout = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static void report_errors(const char *what) {
+    unsigned long error = ERR_get_error();
+    char text[256] = "connection closed";
+    if (error) ERR_error_string_n(error, text, sizeof(text));
+    fprintf(stderr, "[WARN] %s: %s\n", what, text);
+    ERR_clear_error();
+}
+
+
+/* ==============================================================================================
+ * Server
+ * ==============================================================================================
+ */
+
+
+int tls_server_init(void) {
+    if (!cert_file || !key_file) {
+        fprintf(stderr, "[ERROR] TLS server needs cert=<file> and key=<file> (-T)\n");
+        return -1;
+    }
+
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    if (!server_ctx) {
+        report_errors("TLS setup failed");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(server_ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(server_ctx) != 1) {
+        report_errors("TLS certificate or key not usable");
+        SSL_CTX_free(server_ctx);
+        server_ctx = NULL;
+        return -1;
+    }
+#if defined(SSL_OP_ENABLE_KTLS)
+    SSL_CTX_set_options(server_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    // Stateless tickets: any session process can resume any session. Replay protection would
+    // need a ticket store shared by all of them; the early data is limited to the hello instead.
+    SSL_CTX_set_session_id_context(server_ctx, (const unsigned char *)"myshell", 7);
+    SSL_CTX_set_num_tickets(server_ctx, 1);
+    if (early_data) {
+        SSL_CTX_set_max_early_data(server_ctx, PROTO_HEADER_SIZE);
+        SSL_CTX_set_options(server_ctx, SSL_OP_NO_ANTI_REPLAY);
+    }
+    return 0;
+}
+
+int tls_enabled(void) {
+    return server_ctx != NULL;
+}
+
+// Completes the server handshake, taking a hello sent as early data into early_hello
+static int server_handshake(SSL *ssl, int fd) {
+    set_timeout(fd, TLS_HANDSHAKE_TIMEOUT);
+    early_hello_len = 0;
+
+    if (early_data) {
+        while (1) {
+            size_t got = 0;
+            int result = SSL_read_early_data(ssl, early_hello + early_hello_len,
+                                             sizeof(early_hello) - early_hello_len, &got);
+            if (result == SSL_READ_EARLY_DATA_ERROR) {
+                report_errors("TLS handshake failed");
+                return -1;
+            }
+            early_hello_len += got;
+            if (result == SSL_READ_EARLY_DATA_FINISH) break;
+        }
+        if (early_hello_len > 0
+            && (early_hello_len != PROTO_HEADER_SIZE || !proto_is_hello(early_hello, early_hello_len))) {
+            fprintf(stderr, "[WARN] TLS early data is not a protocol hello, connection closed\n");
+            return -1;
+        }
+    }
+    if (SSL_accept(ssl) != 1) {
+        report_errors("TLS handshake failed");
+        return -1;
+    }
+
+    set_timeout(fd, 0);
+    printf("[INFO] TLS %s%s%s\n", SSL_get_version(ssl), SSL_session_reused(ssl) ? ", resumed" : "",
+           early_hello_len > 0 ? ", 0-RTT hello" : "");
+    return 0;
+}
+
+// Whether the kernel took over both directions of the connection
+static int ktls_active(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    (void)ssl;
+    return 0;
+#endif
+}
+
+// Session process: returns the descriptor to serve the client on (fd itself with kTLS), -1 if
+// the handshake failed. fd belongs to the connection either way.
+int tls_accept(int fd) {
+    SSL *ssl = SSL_new(server_ctx);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1 || server_handshake(ssl, fd) < 0) {
+        if (ssl) SSL_free(ssl);
+        return -1;
+    }
+
+    // The SSL object stays alive: with kTLS it holds the keys of records yet to come
+    if (ktls_active(ssl)) {
+        printf("[INFO] TLS offloaded to the kernel (kTLS)\n");
+        return fd;
+    }
+
+    int local_fd = spawn_relay(ssl, fd, NULL);
+    SSL_free(ssl);
+    close(fd);
+    return local_fd;
+}
+
+// Event loop: the relay makes the handshake; returns its end at once (fd is closed)
+int tls_accept_detached(int fd) {
+    SSL *ssl = SSL_new(server_ctx);
+    int local_fd = (ssl && SSL_set_fd(ssl, fd) == 1) ? spawn_relay(ssl, fd, server_handshake) : -1;
+    if (ssl) SSL_free(ssl);
+    close(fd);
+    return local_fd;
+}
+
+// The hello a kTLS connection received as early data, for the session to answer
+size_t tls_take_early(char *buf, size_t size) {
+    size_t len = early_hello_len <= size ? early_hello_len : 0;
+    memcpy(buf, early_hello, len);
+    early_hello_len = 0;
+    return len;
+}
+
+
+/* ==============================================================================================
+ * Client
+ * ==============================================================================================
+ */
+
+
+static char session_path[4096];
+
+// Keeps the newest ticket the server sent for the next connection (mode 0600: it is a secret)
+static int save_session(SSL *ssl, SSL_SESSION *session) {
+    (void)ssl;
+    char tmp_path[sizeof(session_path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", session_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return 0;
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        return 0;
+    }
+    int written = PEM_write_SSL_SESSION(file, session);
+    if (fclose(file) == 0 && written) rename(tmp_path, session_path);
+    else unlink(tmp_path);
+    return 0;   // the session is not kept in memory
+}
+
+static SSL_SESSION *load_session(void) {
+    FILE *file = fopen(session_path, "r");
+    if (!file) return NULL;
+    SSL_SESSION *session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+    fclose(file);
+    if (session && !SSL_SESSION_is_resumable(session)) {
+        SSL_SESSION_free(session);
+        session = NULL;
+    }
+    return session;
+}
+
+static int client_init(void) {
+    if (client_ctx) return 0;
+
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (!client_ctx) {
+        report_errors("TLS setup failed");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    if (verify_peer) {
+        int loaded = ca_file ? SSL_CTX_load_verify_locations(client_ctx, ca_file, NULL)
+                             : SSL_CTX_set_default_verify_paths(client_ctx);
+        if (loaded != 1) {
+            report_errors("TLS CA certificates not usable");
+            return -1;
+        }
+        SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+    }
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client_ctx, save_session);
+    return 0;
+}
+
+// A connection to host: SNI, the name or address to verify, and the saved session
+static SSL *client_session(int fd, const char *host, int port) {
+    if (client_init() < 0) return NULL;
+
+    if (session_file) {
+        snprintf(session_path, sizeof(session_path), "%s", session_file);
+    } else {
+        const char *home = getenv("HOME");
+        snprintf(session_path, sizeof(session_path), "%s/.myshell_tls_%s_%d", home ? home : "/tmp", host, port);
+    }
+
+    SSL *ssl = SSL_new(client_ctx);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        if (ssl) SSL_free(ssl);
+        return NULL;
+    }
+
+    unsigned char address[sizeof(struct in6_addr)];
+    int is_address = inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+    if (!is_address) SSL_set_tlsext_host_name(ssl, host);
+    if (verify_peer) {
+        if (is_address) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+        else SSL_set1_host(ssl, host);
+    }
+
+    SSL_SESSION *session = load_session();
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    return ssl;
+}
+
+static int client_handshake(SSL *ssl, int fd) {
+    set_timeout(fd, TLS_HANDSHAKE_TIMEOUT);
+    if (SSL_connect(ssl) != 1) {
+        report_errors("TLS handshake failed");
+        return -1;
+    }
+    set_timeout(fd, 0);
+    return 0;
+}
+
+// Client: the handshake, with early (the protocol hello) as 0-RTT data when the saved session
+// allows it and sent normally otherwise. Takes fd; returns the relay's end, or -1.
+int tls_connect(int fd, const char *host, int port, const void *early, size_t early_len) {
+    SSL *ssl = client_session(fd, host, port);
+    int sent_early = 0;
+    int result = -1;
+
+    if (ssl) {
+        SSL_SESSION *session = SSL_get0_session(ssl);
+        if (early_data && early_len > 0 && session && SSL_SESSION_get_max_early_data(session) >= early_len) {
+            size_t written = 0;
+            set_timeout(fd, TLS_HANDSHAKE_TIMEOUT);
+            sent_early = SSL_write_early_data(ssl, early, early_len, &written) == 1 && written == early_len;
+            ERR_clear_error();
+        }
+        result = client_handshake(ssl, fd);
+    }
+
+    if (result == 0 && early_len > 0
+        && (!sent_early || SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_ACCEPTED)
+        && SSL_write(ssl, early, early_len) != (int)early_len) {
+        report_errors("TLS write failed");
+        result = -1;
+    }
+
+    int local_fd = result == 0 ? spawn_relay(ssl, fd, NULL) : -1;
+    if (ssl) SSL_free(ssl);
+    close(fd);
+    return local_fd;
+}
+
+// Fan-out client: the relay makes the handshake; returns its end at once (fd is closed)
+int tls_connect_detached(int fd, const char *host, int port) {
+    SSL *ssl = client_session(fd, host, port);
+    int local_fd = ssl ? spawn_relay(ssl, fd, client_handshake) : -1;
+    if (ssl) SSL_free(ssl);
+    close(fd);
+    return local_fd;
+}
+
+#else   // !HAVE_OPENSSL: -T is rejected, none of the connection functions is reached
+
+int tls_parse(const char *spec) { (void)spec; return -1; }
+int tls_server_init(void) { return -1; }
+int tls_enabled(void) { return 0; }
+int tls_accept(int fd) { return fd; }
+int tls_accept_detached(int fd) { return fd; }
+size_t tls_take_early(char *buf, size_t size) { (void)buf; (void)size; return 0; }
+int tls_connect(int fd, const char *host, int port, const void *early, size_t early_len) {
+    (void)host; (void)port;
+    return proto_write_all(fd, early, early_len) < 0 ? -1 : fd;
+}
+int tls_connect_detached(int fd, const char *host, int port) { (void)host; (void)port; return fd; }
+
+#endif
+
+int tls_configured(void) {
+    return configured;
+}
@@ -0,0 +1,24 @@
+#ifndef MYSHELL_TLS_H
+#define MYSHELL_TLS_H
+
+#include <stddef.h>
+
+#define TLS_HANDSHAKE_TIMEOUT 10    // seconds for a handshake before the connection is dropped
+#define TLS_RELAY_BUFFER 16384      // one TLS record
+
+// Parses -T "cert=<file>,key=<file>,ca=<file>,session=<file>,insecure,noearly" (or "on"); -1 if
+// malformed or TLS is not built in
+int tls_parse(const char *spec);
+
+int tls_configured(void);
+int tls_server_init(void);
+int tls_enabled(void);
+
+int tls_accept(int fd);
+int tls_accept_detached(int fd);
+size_t tls_take_early(char *buf, size_t size);
+
+int tls_connect(int fd, const char *host, int port, const void *early, size_t early_len);
+int tls_connect_detached(int fd, const char *host, int port);
+
+#endif //MYSHELL_TLS_H